@@ -0,0 +1,25 @@
+#ifdef ARDUINO_ARCH_AVR
+
+#include "stepper.h"
+#include "stepper_fast_io.h"
+
+// Fake register for NO_PIN: writes with zero mask do nothing, reads return 0
+static volatile uint8_t _fast_io_dummy_reg = 0;
+
+/**
+ * Resolve Arduino pin number to PORTx/PINx registers and bit mask.
+ */
+void fast_io_resolve_pin(int pin, fast_io_pin_t* io) {
+    uint8_t port = pin != NO_PIN ? digitalPinToPort(pin) : NOT_A_PIN;
+    if(port == NOT_A_PIN) {
+        io->port = &_fast_io_dummy_reg;
+        io->in = &_fast_io_dummy_reg;
+        io->mask = 0;
+    } else {
+        io->port = portOutputRegister(port);
+        io->in = portInputRegister(port);
+        io->mask = digitalPinToBitMask(pin);
+    }
+}
+
+#endif // ARDUINO_ARCH_AVR
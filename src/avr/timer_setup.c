@@ -352,6 +352,44 @@ void _timer_init_ISR(int timer, int prescaler, unsigned int adjustment) {
 #endif
 }
 
+/**
+ * Update compare match value for already started timer: next interrupt
+ * would be fired after adjustment+1 timer clocks.
+ * 
+ * In CTC mode timer counter is cleared on compare match, so when called
+ * from ISR new value takes effect for the next timer period.
+ * 
+ * @param timer
+ *   system timer id for started ISR
+ * @param adjustment
+ *   adjustment divider after timer prescaled - timer compare match value
+ */
+void _timer_update_ISR(int timer, unsigned int adjustment) {
+#if defined (_useTimer1)
+    if(timer == _timer1) {
+        OCR1A = adjustment;     // compare match register
+    }
+#endif
+
+#if defined (_useTimer3)
+    if(timer == _timer3) {
+        OCR3A = adjustment;     // compare match register
+    }
+#endif
+
+#if defined (_useTimer4)
+    if(timer == _timer4) {
+        OCR4A = adjustment;     // compare match register
+    }
+#endif
+
+#if defined (_useTimer5)
+    if(timer == _timer5) {
+        OCR5A = adjustment;     // compare match register
+    }
+#endif
+}
+
 /**
  * Stop ISR (Interrupt service routine) for the timer.
  * 
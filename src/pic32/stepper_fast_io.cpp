@@ -0,0 +1,25 @@
+#ifdef __PIC32__
+
+#include "stepper.h"
+#include "stepper_fast_io.h"
+
+// Fake port registers for NO_PIN: writes with zero mask do nothing, reads return 0
+static uint32_t _fast_io_dummy_regs[sizeof(p32_ioport) / sizeof(uint32_t)];
+
+/**
+ * Resolve Arduino pin number to port registers (TRISx/PORTx/LATx) and bit mask.
+ */
+void fast_io_resolve_pin(int pin, fast_io_pin_t* io) {
+    uint8_t port = pin != NO_PIN ? digitalPinToPort(pin) : NOT_A_PIN;
+    if(port == NOT_A_PIN) {
+        io->port = (p32_ioport*)_fast_io_dummy_regs;
+        io->in = (p32_ioport*)_fast_io_dummy_regs;
+        io->mask = 0;
+    } else {
+        io->port = (p32_ioport*)portRegisters(port);
+        io->in = io->port;
+        io->mask = digitalPinToBitMask(pin);
+    }
+}
+
+#endif // __PIC32__
@@ -332,6 +332,32 @@ void _timer_init_ISR(int timer, int prescaler, unsigned int adjustment) {
     }
 }
 
+/**
+ * Update compare match value for already started timer: next interrupt
+ * would be fired after adjustment+1 timer clocks.
+ * 
+ * Timer register is cleared on period match, so when called from ISR
+ * new value takes effect for the next timer period.
+ * 
+ * @param timer
+ *   system timer id for started ISR
+ * @param adjustment
+ *   adjustment divider after timer prescaled - timer compare match value
+ */
+void _timer_update_ISR(int timer, unsigned int adjustment) {
+    if(timer == _TIMER1) {
+        PR1 = adjustment; // period register
+    } else if(timer == _TIMER2 || timer == _TIMER2_32BIT) {
+        PR2 = adjustment; // period register (32-bit value for Timer2+3)
+    } else if(timer == _TIMER3) {
+        PR3 = adjustment; // period register
+    } else if(timer == _TIMER4 || timer == _TIMER4_32BIT) {
+        PR4 = adjustment; // period register (32-bit value for Timer4+5)
+    } else if(timer == _TIMER5) {
+        PR5 = adjustment; // period register
+    }
+}
+
 /**
  * Stop ISR (Interrupt service routine) for the timer.
  * 
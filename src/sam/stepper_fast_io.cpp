@@ -0,0 +1,26 @@
+#ifdef ARDUINO_ARCH_SAM
+
+#include "stepper.h"
+#include "stepper_fast_io.h"
+
+// Fake PIO controller for NO_PIN: writes with zero mask do nothing, reads return 0
+// (plain memory of the Pio size - Pio has read-only members and can't be
+// declared directly)
+static uint32_t _fast_io_dummy_regs[sizeof(Pio) / sizeof(uint32_t)];
+
+/**
+ * Resolve Arduino pin number to PIO controller and bit mask.
+ */
+void fast_io_resolve_pin(int pin, fast_io_pin_t* io) {
+    if(pin == NO_PIN || pin < 0 || pin >= PINS_COUNT || g_APinDescription[pin].pPort == NULL) {
+        io->port = (Pio*)_fast_io_dummy_regs;
+        io->in = (Pio*)_fast_io_dummy_regs;
+        io->mask = 0;
+    } else {
+        io->port = g_APinDescription[pin].pPort;
+        io->in = g_APinDescription[pin].pPort;
+        io->mask = g_APinDescription[pin].ulPin;
+    }
+}
+
+#endif // ARDUINO_ARCH_SAM
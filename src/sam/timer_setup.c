@@ -324,6 +324,58 @@ void _timer_init_ISR(int timer, int prescaler, unsigned int adjustment) {
 }
 
 
+/**
+ * Update compare match value for already started timer: next interrupt
+ * would be fired after adjustment+1 timer clocks.
+ * 
+ * Timer counter is reset by software trigger in the interrupt handler
+ * before _timer_handle_interrupts call, so new value takes effect
+ * for the next timer period.
+ * 
+ * @param timer
+ *   system timer id for started ISR
+ * @param adjustment
+ *   adjustment divider after timer prescaled - timer compare match value
+ */
+void _timer_update_ISR(int timer, unsigned int adjustment) {
+#if defined (_useTimer1)
+    if (timer == _TIMER1)
+        TC_SetRA(TC_FOR_TIMER1, CHANNEL_FOR_TIMER1, adjustment);
+#endif
+#if defined (_useTimer2)
+    if (timer == _TIMER2)
+        TC_SetRA(TC_FOR_TIMER2, CHANNEL_FOR_TIMER2, adjustment);
+#endif
+#if defined (_useTimer3)
+    if (timer == _TIMER3)
+        TC_SetRA(TC_FOR_TIMER3, CHANNEL_FOR_TIMER3, adjustment);
+#endif
+#if defined (_useTimer4)
+    if (timer == _TIMER4)
+        TC_SetRA(TC_FOR_TIMER4, CHANNEL_FOR_TIMER4, adjustment);
+#endif
+#if defined (_useTimer5)
+    if (timer == _TIMER5)
+        TC_SetRA(TC_FOR_TIMER5, CHANNEL_FOR_TIMER5, adjustment);
+#endif
+#if defined (_useTimer6)
+    if (timer == _TIMER6)
+        TC_SetRA(TC_FOR_TIMER6, CHANNEL_FOR_TIMER6, adjustment);
+#endif
+#if defined (_useTimer7)
+    if (timer == _TIMER7)
+        TC_SetRA(TC_FOR_TIMER7, CHANNEL_FOR_TIMER7, adjustment);
+#endif
+#if defined (_useTimer8)
+    if (timer == _TIMER8)
+        TC_SetRA(TC_FOR_TIMER8, CHANNEL_FOR_TIMER8, adjustment);
+#endif
+#if defined (_useTimer9)
+    if (timer == _TIMER9)
+        TC_SetRA(TC_FOR_TIMER9, CHANNEL_FOR_TIMER9, adjustment);
+#endif
+}
+
 /**
  * Stop ISR (Interrupt service routine) for the timer.
  * 
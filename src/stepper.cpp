@@ -59,6 +59,10 @@ void init_stepper(stepper* smotor, char name,
     
     smotor->distance_per_step = distance_per_step;
     
+    // по умолчанию без разгона
+    smotor->max_accel = 0;
+    smotor->max_jerk = 0;
+    
     // Значения по умолчанию
     // обнулить текущую позицию
     smotor->current_pos = 0;
@@ -73,12 +77,31 @@ void init_stepper(stepper* smotor, char name,
     smotor->min_pos = 0;
     smotor->max_pos = 0;
     
+    smotor->end_flags = 0;
+    smotor->end_filter = 0;
+    smotor->end_min_samples = 0;
+    smotor->end_max_samples = 0;
+    smotor->end_state = 0;
+    
+#if STEPPER_ISR_PROFILE
+    smotor->profile.steps = 0;
+    smotor->profile.work_time = 0;
+    smotor->profile.work_max_time = 0;
+    smotor->profile.reset = false;
+#endif
+    
     
     // задать настройки пинов
     pinMode(pin_step, OUTPUT);
     pinMode(pin_dir, OUTPUT);
     pinMode(pin_en, OUTPUT);
     
+    // регистры портов для быстрого доступа из обработчика прерывания
+    fast_io_resolve_pin(pin_step, &smotor->pin_step_io);
+    fast_io_resolve_pin(pin_dir, &smotor->pin_dir_io);
+    fast_io_resolve_pin(NO_PIN, &smotor->pin_min_io);
+    fast_io_resolve_pin(NO_PIN, &smotor->pin_max_io);
+    
     // пока выключить мотор
     digitalWrite(pin_en, HIGH);
 }
@@ -122,7 +145,7 @@ void init_stepper(stepper* smotor, char name,
 void init_stepper_ends(stepper* smotor,
         int pin_min, int pin_max,
         end_strategy_t min_end_strategy, end_strategy_t max_end_strategy,
-        long long min_pos, long long max_pos) {
+        stepper_pos_t min_pos, stepper_pos_t max_pos) {
     
     smotor->pin_min = pin_min;
     smotor->pin_max = pin_max;
@@ -140,5 +163,62 @@ void init_stepper_ends(stepper* smotor,
     if(pin_max != NO_PIN) {
         pinMode(pin_max, INPUT);
     }
+    
+    // регистры портов для быстрого доступа из обработчика прерывания
+    fast_io_resolve_pin(pin_min, &smotor->pin_min_io);
+    fast_io_resolve_pin(pin_max, &smotor->pin_max_io);
+    
+    // начальное состояние датчиков (дальше - из прерываний по изменению пинов)
+    stepper_end_changed(smotor);
+}
+
+/**
+ * Обновить состояние концевых датчиков мотора (end_flags) по значениям
+ * пинов pin_min и pin_max; вызывать из прерывания по изменению пина.
+ * 
+ * @param smotor
+ */
+void stepper_end_changed(stepper* smotor) {
+    // одна запись байта - обработчик таймера всегда видит
+    // согласованное значение
+    smotor->end_flags =
+        (fast_io_read(&smotor->pin_min_io) ? STEPPER_END_MIN : 0) |
+        (fast_io_read(&smotor->pin_max_io) ? STEPPER_END_MAX : 0);
+}
+
+/**
+ * Задать фильтр помех для концевых датчиков мотора.
+ * 
+ * @param smotor
+ * @param samples - количество выборок подряд, 1..8, 0 - без фильтра
+ */
+void init_stepper_end_filter(stepper* smotor, unsigned char samples) {
+    // регистр выборок - 8 бит
+    smotor->end_filter = samples > 8 ? 8 : samples;
+}
+
+/**
+ * Задать максимальное ускорение для шагового мотора: с этим ускорением
+ * мотор разгоняется и тормозит в сериях шагов prepare_accel_steps
+ * и prepare_scurve_steps.
+ * 
+ * Пример: мотор с минимальной задержкой между шагами 200 микросекунд
+ * (5000 шагов в секунду) разгоняется до максимальной скорости за 50 шагов
+ * (10мс) с ускорением 250000 шагов/с^2:
+ *   init_stepper_accel(&sm_x, 250000);
+ * то же самое, но ускорение набирается не сразу, а за 1мс (рывок
+ * 250000000 шагов/с^3):
+ *   init_stepper_accel(&sm_x, 250000, 250000000);
+ * 
+ * @param smotor
+ * @param max_accel - максимальное ускорение, шагов в секунду за секунду
+ *     (0 - не разгоняться, сразу стартовать на заданной скорости)
+ * @param max_jerk - максимальный рывок (скорость изменения ускорения)
+ *     для prepare_scurve_steps, шагов в секунду за секунду за секунду
+ *     (0 - без ограничения, профиль скорости - трапеция)
+ */
+void init_stepper_accel(stepper* smotor, unsigned long max_accel, unsigned long max_jerk) {
+    smotor->max_accel = max_accel;
+    smotor->max_jerk = max_jerk;
 }
 
@@ -17,6 +17,117 @@
 
 #include "stddef.h"
 
+#include "stepper_fast_io.h"
+#include "stepper_lib_config.h"
+
+/**
+ * Координата мотора (current_pos, min_pos, max_pos): 64-битная,
+ * при STEPPER_POS_64=0 - 32-битная (см. stepper.current_pos).
+ */
+#if STEPPER_POS_64
+typedef long long stepper_pos_t;
+#else
+typedef long stepper_pos_t;
+#endif
+
+#if STEPPER_ISR_PROFILE
+/**
+ * Количество корзин гистограммы времени обработчика прерывания
+ * (stepper_profile_t.time_buckets)
+ */
+#define STEPPER_PROFILE_BUCKETS 12
+
+/**
+ * Фаза тика таймера - самая тяжелая работа, которую обработчик прерывания
+ * сделал на этом тике хотя бы для одного мотора
+ */
+typedef enum {
+    /** Моторы только отсчитывают время до шага (или цикла нет) */
+    STEPPER_PHASE_IDLE,
+    
+    /** Проверка границ и концевых датчиков перед шагом */
+    STEPPER_PHASE_CHECK,
+    
+    /** Ножка step взводится перед шагом */
+    STEPPER_PHASE_PULSE,
+    
+    /** Шаг и вычисление задержки перед следующим шагом */
+    STEPPER_PHASE_STEP,
+    
+    STEPPER_PHASE_COUNT
+} stepper_phase_t;
+
+/**
+ * Профиль обработчика прерывания таймера (stepper_profile)
+ */
+typedef struct {
+    /** Вызовов обработчика */
+    unsigned long ticks;
+    
+    /**
+     * Гистограмма времени обработчика: time_buckets[0] - меньше 1 мкс,
+     * time_buckets[k] - от 2^(k-1) до 2^k мкс, последняя корзина - все,
+     * что дольше
+     */
+    unsigned long time_buckets[STEPPER_PROFILE_BUCKETS];
+    
+    /** Вызовов обработчика по фазам тика (stepper_phase_t) */
+    unsigned long phase_ticks[STEPPER_PHASE_COUNT];
+    
+    /** Наибольшее время обработчика, микросекунды */
+    unsigned long max_time;
+    
+    /** Фаза тика с наибольшим временем обработчика (stepper_phase_t) */
+    unsigned char max_time_phase;
+} stepper_profile_t;
+
+/**
+ * Профиль мотора в обработчике прерывания (stepper_profile_motor)
+ */
+typedef struct {
+    /** Шагов мотора */
+    unsigned long steps;
+    
+    /**
+     * Время работы на шагах мотора (положение, следующая задержка, ведомые
+     * моторы и т.п.), всего и наибольшее на одном шаге, микросекунды
+     */
+    unsigned long work_time;
+    unsigned long work_max_time;
+    
+    /** Запрошен сброс: обработчик обнулит профиль на следующем шаге */
+    volatile bool reset;
+} stepper_motor_profile_t;
+#endif // STEPPER_ISR_PROFILE
+
+#if STEPPER_TRACE
+/** Флаги события трассы: мотор шагал в сторону увеличения координаты */
+#define STEPPER_TRACE_DIR 0x80
+
+/** Флаги события трассы: мотор остановлен (или цикл завершен) с ошибкой, шага не было */
+#define STEPPER_TRACE_STOP 0x40
+
+/** Флаги события трассы: флаги ошибок мотора (stepper_error_flags) */
+#define STEPPER_TRACE_ERROR_MASK 0x3F
+
+/** Размер события трассы в потоке байт (stepper_trace_encode) */
+#define STEPPER_TRACE_EVENT_BYTES 6
+
+/**
+ * Событие трассы шагов (stepper_trace_read)
+ */
+typedef struct {
+    /** Номер тика таймера (периода _timer_period_us), на котором был шаг */
+    unsigned long tick;
+    
+    /** Имя мотора (init_stepper) */
+    char motor;
+    
+    /** STEPPER_TRACE_DIR, STEPPER_TRACE_STOP и флаги ошибок мотора */
+    unsigned char flags;
+} stepper_trace_event_t;
+#endif // STEPPER_TRACE
+
 /**
  * Стратегия определения границы движения координаты в одном из направлений:
  * - CONST: значение координаты задается константой в настройках мотора (min/max _pos)
@@ -74,7 +185,13 @@ typedef enum {
     STEPPER_ERROR_HARD_END_MAX = 0x8,
     
     /** Слишком маленькая задержка между двумя импульсами для шага */
-    STEPPER_ERROR_STEP_DELAY_SMALL = 0x10
+    STEPPER_ERROR_STEP_DELAY_SMALL = 0x10,
+    
+    /**
+     * Завершил вращение из-за опустошения потокового буфера:
+     * следующая подсерия не успела попасть в буфер (prepare_stream_steps)
+     */
+    STEPPER_ERROR_BUFFER_UNDERRUN = 0x20
 } stepper_error_flags;
 
 /**
@@ -130,6 +247,49 @@ typedef struct {
      */
     int pin_max;
     
+    /*************************************************************/
+    /* Прямой доступ к портам пинов для обработчика прерывания */
+    /* (вычисляется в init_stepper и init_stepper_ends) */
+    /*************************************************************/
+    
+    /** Регистр порта и маска для pin_step */
+    fast_io_pin_t pin_step_io;
+    
+    /** Регистр порта и маска для pin_dir */
+    fast_io_pin_t pin_dir_io;
+    
+    /** Регистр порта и маска для pin_min */
+    fast_io_pin_t pin_min_io;
+    
+    /** Регистр порта и маска для pin_max */
+    fast_io_pin_t pin_max_io;
+    
+    /**
+     * Состояние концевых датчиков: биты STEPPER_END_MIN, STEPPER_END_MAX
+     * (обновляет stepper_end_changed; при STEPPER_END_INTERRUPTS=1
+     * обработчик таймера проверяет эти биты вместо чтения пинов).
+     */
+    volatile unsigned char end_flags;
+    
+    /**
+     * Фильтр помех концевых датчиков: сколько выборок подряд (по одной
+     * на тик таймера) датчик должен быть нажат или отпущен, чтобы его
+     * состояние поменялось, 0 - без фильтра (init_stepper_end_filter).
+     */
+    unsigned char end_filter;
+    
+    /** Выборки pin_min и pin_max, последняя - младший бит (обработчик таймера) */
+    unsigned char end_min_samples;
+    unsigned char end_max_samples;
+    
+    /** Состояние датчиков после фильтра: биты STEPPER_END_MIN, STEPPER_END_MAX */
+    unsigned char end_state;
+    
+#if STEPPER_ISR_PROFILE
+    /** Профиль мотора в обработчике прерывания (stepper_profile_motor) */
+    stepper_motor_profile_t profile;
+#endif
+    
     /*************************************************************/
     /* Настройки подключения - характеристики мотора, драйвера и привода */
     /*************************************************************/
@@ -197,6 +357,20 @@ typedef struct {
      */
     unsigned long distance_per_step;
     
+    /**
+     * Максимальное ускорение мотора, шагов в секунду за секунду
+     * (для prepare_accel_steps). 0 - ускорение не задано, мотор
+     * стартует и останавливается сразу на заданной скорости.
+     */
+    unsigned long max_accel;
+    
+    /**
+     * Максимальный рывок мотора (скорость изменения ускорения), шагов
+     * в секунду за секунду за секунду (для prepare_scurve_steps).
+     * 0 - рывок не ограничен, ускорение включается сразу.
+     */
+    unsigned long max_jerk;
+    
     /*************************************************************/
     /* Характеристики рабочей области */
     /*************************************************************/
@@ -216,12 +390,12 @@ typedef struct {
     /**
      * Минимальное значение положения координаты, базовая единица измерения мотора
      */
-    long long min_pos;
+    stepper_pos_t min_pos;
     
     /**
      * Максимальное значение положения координаты, базовая единица измерения мотора
      */
-    long long max_pos;
+    stepper_pos_t max_pos;
     
     /*************************************************************/
     /* Информация о движении координаты, подключенной к мотору;  */
@@ -239,8 +413,8 @@ typedef struct {
      * Единица измерения выбирается в зависимости от задачи и свойств
      * передаточного механизма (проще всего считать за нанометры).
      * 
-     * Тип данных curren_pos, min_pos и max_pos - long long (int64_t),
-     * 64-битное знаковое целое.
+     * Тип данных curren_pos, min_pos и max_pos - stepper_pos_t: long long (int64_t),
+     * 64-битное знаковое целое (при STEPPER_POS_64=0 - long, 32 бит).
      * 
      * Для 64-битного значения current_pos размеры рабочей области
      * с базовой единицей нанометры:
@@ -259,6 +433,10 @@ typedef struct {
      * При этом использование 64-битных значений фактически позволяет
      * не задумываться о максимальных границах рабочей области.
      * 
+     * На AVR сложение и сравнение 64-битных значений в обработчике
+     * прерывания заметно дороже, там, где хватает 32-битной рабочей
+     * области (см. ниже), можно собрать библиотеку с STEPPER_POS_64=0.
+     * 
      * Для 32хбитного значения current_pos размеры рабочей области были бы:
      * 
      * - Если брать базовую единицу измерения за нанометры (1/1000 микрометра),
@@ -275,7 +453,7 @@ typedef struct {
      * микрон (6.15мкм, 7.5мкм и т.п.), поэтому в качестве целевой единицы измерения
      * рекомендуется ориентироваться на целочисленные нанометры.
      */
-    long long current_pos;
+    stepper_pos_t current_pos;
     
     /** Информация о цикле вращения шагового двигателя. */
     
@@ -423,7 +601,83 @@ void init_stepper(stepper* smotor, char name,
 void init_stepper_ends(stepper* smotor,
         int pin_min, int pin_max,
         end_strategy_t min_end_strategy, end_strategy_t max_end_strategy,
-        long long min_pos, long long max_pos);
+        stepper_pos_t min_pos, stepper_pos_t max_pos);
+
+/** Бит сработавшего концевого датчика pin_min в end_flags */
+#define STEPPER_END_MIN 0x01
+/** Бит сработавшего концевого датчика pin_max в end_flags */
+#define STEPPER_END_MAX 0x02
+
+/**
+ * Обновить состояние концевых датчиков мотора (end_flags) по значениям
+ * пинов pin_min и pin_max.
+ * 
+ * При сборке с STEPPER_END_INTERRUPTS=1 (stepper_lib_config.h) обработчик
+ * таймера не читает пины концевых датчиков перед каждым шагом, а проверяет
+ * биты end_flags, поэтому stepper_end_changed нужно вызывать из прерывания
+ * по изменению пина (внешнего или pin change) на каждое нажатие
+ * и отпускание датчика. Реакция на сработавший датчик прежняя:
+ * STEPPER_ERROR_HARD_END_MIN/MAX и стратегия hard_end_handle
+ * (stepper_set_error_handle_strategy). Без STEPPER_END_INTERRUPTS
+ * вызывать не обязательно.
+ * 
+ * Пример:
+ *   void x_end_changed() {
+ *       stepper_end_changed(&sm_x);
+ *   }
+ *   
+ *   init_stepper_ends(&sm_x, X_MIN_PIN, X_MAX_PIN, CONST, CONST, 0, 300000000);
+ *   attachInterrupt(digitalPinToInterrupt(X_MIN_PIN), x_end_changed, CHANGE);
+ *   attachInterrupt(digitalPinToInterrupt(X_MAX_PIN), x_end_changed, CHANGE);
+ * 
+ * @param smotor
+ */
+void stepper_end_changed(stepper* smotor);
+
+/**
+ * Задать фильтр помех для концевых датчиков мотора (например, наводки
+ * от шпинделя, из-за которых цикл отменяется по
+ * STEPPER_ERROR_HARD_END_MIN/MAX).
+ * 
+ * Обработчик таймера на каждом тике сдвигает значение датчика в регистр
+ * выборок; датчик считается нажатым, когда последние samples выборок -
+ * нажат, и отпущенным, когда последние samples выборок - отпущен,
+ * иначе состояние не меняется. Импульс помехи короче samples периодов
+ * таймера отбрасывается, настоящее нажатие замечается с задержкой
+ * samples-1 периодов (при периоде 20мкс и samples=4 - помехи до 60мкс,
+ * задержка 60мкс). Датчик, нажатый на старте цикла, считается нажатым
+ * сразу.
+ * 
+ * Работает при STEPPER_END_FILTER=1 (stepper_lib_config.h), в том числе
+ * вместе с STEPPER_END_INTERRUPTS (выборки - биты end_flags).
+ * 
+ * @param smotor
+ * @param samples - количество выборок подряд, 1..8 (больше 8 - 8),
+ *     0 - без фильтра (датчик проверяется только перед шагом)
+ */
+void init_stepper_end_filter(stepper* smotor, unsigned char samples);
+
+/**
+ * Задать максимальное ускорение для шагового мотора: с этим ускорением
+ * мотор разгоняется и тормозит в сериях шагов prepare_accel_steps
+ * и prepare_scurve_steps.
+ * 
+ * Пример: мотор с минимальной задержкой между шагами 200 микросекунд
+ * (5000 шагов в секунду) разгоняется до максимальной скорости за 50 шагов
+ * (10мс) с ускорением 250000 шагов/с^2:
+ *   init_stepper_accel(&sm_x, 250000);
+ * то же самое, но ускорение набирается не сразу, а за 1мс (рывок
+ * 250000000 шагов/с^3):
+ *   init_stepper_accel(&sm_x, 250000, 250000000);
+ * 
+ * @param smotor
+ * @param max_accel - максимальное ускорение, шагов в секунду за секунду
+ *     (0 - не разгоняться, сразу стартовать на заданной скорости)
+ * @param max_jerk - максимальный рывок (скорость изменения ускорения)
+ *     для prepare_scurve_steps, шагов в секунду за секунду за секунду
+ *     (0 - без ограничения, профиль скорости - трапеция)
+ */
+void init_stepper_accel(stepper* smotor, unsigned long max_accel, unsigned long max_jerk=0);
 
 /**
  * Подготовить мотор к запуску ограниченной серии шагов - задать нужное количество
@@ -436,9 +690,56 @@ void init_stepper_ends(stepper* smotor,
  *           рабочей области [min_pos, max_pos] (аппаратные проверяются ВСЕГДА);
  *     CALIBRATE_START_MIN_POS: установка начальной позиции (сбрасывать current_pos в min_pos при каждом шаге);
  *     CALIBRATE_BOUNDS_MAX_POS: установка размеров рабочей области (сбрасывать max_pos в current_pos при каждом шаге)
+ *     (со STEPPER_CALIBRATE=0 режимы калибровки не поддерживаются - всегда NONE)
  */
 void prepare_steps(stepper *smotor, long step_count, unsigned long step_delay, calibrate_mode_t calibrate_mode=NONE);
 
+/**
+ * Подготовить мотор к запуску ограниченной серии шагов с плавным разгоном
+ * и торможением: мотор разгоняется с места с постоянным ускорением
+ * max_accel (init_stepper_accel) до скорости step_delay, идет с этой
+ * скоростью и тормозит до полной остановки к последнему шагу
+ * (трапецеидальный профиль скорости). Если шагов не хватает на разгон
+ * до заданной скорости, начинает тормозить с середины пути (треугольник).
+ * 
+ * Задержки перед шагами вычисляются в обработчике прерывания по ходу
+ * движения, без деления, квадратного корня и 64-битной арифметики
+ * на каждом шаге (умножения 32 бит с фиксированной точкой).
+ * 
+ * Если для мотора не задано ускорение (max_accel=0), мотор движется
+ * с постоянной скоростью, как с prepare_steps.
+ * 
+ * @param step_count - количество шагов, знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами на крейсерской скорости,
+ *     микросекунды (0 для максимальной скорости)
+ * @param calibrate_mode - режим калибровки (см. prepare_steps)
+ */
+void prepare_accel_steps(stepper *smotor, long step_count, unsigned long step_delay, calibrate_mode_t calibrate_mode=NONE);
+
+/**
+ * Подготовить мотор к запуску ограниченной серии шагов с плавным разгоном
+ * и торможением по S-кривой: как prepare_accel_steps, но ускорение
+ * нарастает и спадает постепенно с рывком max_jerk (init_stepper_accel),
+ * а не включается сразу. Профиль скорости из 7 участков: рост ускорения,
+ * постоянное ускорение, спад ускорения, крейсерская скорость и зеркально
+ * для торможения. Резкие скачки ускорения на границах трапеции раскачивают
+ * механику (резонанс ремней), с ограничением рывка можно оставить
+ * ускорение больше при той же вибрации.
+ * 
+ * Задержки перед шагами вычисляются в обработчике прерывания по ходу
+ * движения в фиксированной точке, без деления, квадратного корня
+ * и 64-битной арифметики (умножения 32 бит).
+ * 
+ * Если для мотора не задан рывок (max_jerk=0), профиль - трапеция
+ * (prepare_accel_steps), если не задано ускорение - постоянная скорость.
+ * 
+ * @param step_count - количество шагов, знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами на крейсерской скорости,
+ *     микросекунды (0 для максимальной скорости)
+ * @param calibrate_mode - режим калибровки (см. prepare_steps)
+ */
+void prepare_scurve_steps(stepper *smotor, long step_count, unsigned long step_delay, calibrate_mode_t calibrate_mode=NONE);
+
 /**
  * Подготовить мотор к запуску на беспрерывное вращение - задать направление и задержку между
  * шагами для регулирования скорости (0 для максимальной скорости).
@@ -455,6 +756,7 @@ void prepare_steps(stepper *smotor, long step_count, unsigned long step_delay, c
  */
 void prepare_whirl(stepper *smotor, int dir, unsigned long step_delay, calibrate_mode_t calibrate_mode=NONE);
 
+#if STEPPER_BUFFERED_STEPS
 /**
  * Подготовить мотор к запуску ограниченной серии шагов с переменной скоростью - задержки на каждом
  * шаге вычисляются заранее, передаются в буфере delay_buffer.
@@ -535,7 +837,134 @@ void prepare_simple_buffered_steps(stepper *smotor, int buf_size, unsigned long*
  *     Должен содержать ровно столько же элементов, сколько delay_buffer
  */
 void prepare_buffered_steps(stepper *smotor, int buf_size, unsigned long* delay_buffer, long* step_buffer);
+#endif // STEPPER_BUFFERED_STEPS
 
+/**
+ * Потоковый буфер подсерий шагов для prepare_stream_steps: кольцевой
+ * буфер с одним писателем (главный цикл или функция refill) и одним
+ * читателем (обработчик прерывания). Поля заполняет stepper_stream_init,
+ * напрямую не менять.
+ */
+typedef struct stepper_stream_t {
+    /** Задержки между шагами для каждой подсерии, микросекунды */
+    unsigned long* delay_buffer;
+    
+    /** Количество шагов для каждой подсерии, знак задает направление */
+    long* step_buffer;
+    
+    /** Количество элементов в массивах delay_buffer и step_buffer */
+    unsigned char size;
+    
+    /** Следующий элемент на запись (меняет только писатель) */
+    volatile unsigned char head;
+    
+    /** Следующий элемент на чтение (меняет только обработчик прерывания) */
+    volatile unsigned char tail;
+    
+    /** Больше подсерий не будет: опустошение буфера - завершение серии */
+    volatile bool ended;
+    
+    /**
+     * Порог заполнения: если после загрузки подсерии в буфере осталось
+     * не больше low_watermark подсерий, вызывается refill
+     */
+    unsigned char low_watermark;
+    
+    /**
+     * Функция пополнения буфера (stepper_stream_put) - вызывается из
+     * обработчика прерывания, должна быть быстрой; NULL - буфер пополняет
+     * главный цикл (по stepper_stream_low)
+     */
+    void (*refill)(struct stepper_stream_t* stream, void* context);
+    
+    /** Контекст для функции refill */
+    void* context;
+} stepper_stream_t;
+
+/**
+ * Подготовить потоковый буфер подсерий шагов. Буфер вмещает
+ * buf_size-1 подсерий (одна ячейка всегда пустая), buf_size - не больше 255.
+ * 
+ * Массивы delay_buffer и step_buffer должны существовать до завершения
+ * цикла вращения, но, в отличие от prepare_buffered_steps, их размер
+ * не ограничивает длину серии: обработчик прерывания освобождает ячейки
+ * по мере выполнения подсерий, главный цикл (или функция refill)
+ * заполняет их снова - из последовательного порта, файла, генератора и т.п.
+ * 
+ *   static unsigned long delay_buffer[16];
+ *   static long step_buffer[16];
+ *   static stepper_stream_t stream;
+ * 
+ *   stepper_stream_init(&stream, 16, delay_buffer, step_buffer, 4);
+ *   while(!stepper_stream_full(&stream)) stepper_stream_put(&stream, next_delay(), next_steps());
+ *   prepare_stream_steps(&sm_y, &stream);
+ *   stepper_start_cycle();
+ * 
+ *   // в loop
+ *   if(stepper_stream_low(&stream)) { ... stepper_stream_put ... }
+ *   ...
+ *   stepper_stream_end(&stream);
+ * 
+ * @param buf_size - количество элементов в массивах delay_buffer и step_buffer
+ * @param delay_buffer - массив для задержек между шагами подсерий, микросекунды
+ * @param step_buffer - массив для количества шагов подсерий
+ * @param low_watermark - порог заполнения буфера для stepper_stream_low и refill
+ * @param refill - функция пополнения буфера, вызывается из обработчика
+ *     прерывания, когда в буфере остается не больше low_watermark подсерий
+ *     (NULL - буфер пополняет главный цикл)
+ * @param context - контекст для функции refill
+ */
+void stepper_stream_init(stepper_stream_t* stream, int buf_size, unsigned long* delay_buffer, long* step_buffer,
+        int low_watermark=0, void (*refill)(stepper_stream_t* stream, void* context)=NULL, void* context=NULL);
+
+/**
+ * Добавить подсерию шагов в конец потокового буфера.
+ * 
+ * @param step_delay - задержка между шагами подсерии, микросекунды (0 для максимальной скорости)
+ * @param step_count - количество шагов подсерии, знак задает направление вращения
+ * @return
+ *     true - подсерия добавлена (подсерия без шагов пропускается)
+ *     false - буфер заполнен или уже завершен (stepper_stream_end)
+ */
+bool stepper_stream_put(stepper_stream_t* stream, unsigned long step_delay, long step_count);
+
+/**
+ * Больше подсерий не будет: мотор завершит серию, когда выполнит
+ * подсерии, оставшиеся в буфере.
+ */
+void stepper_stream_end(stepper_stream_t* stream);
+
+/**
+ * Количество подсерий в потоковом буфере, ожидающих выполнения.
+ */
+int stepper_stream_count(stepper_stream_t* stream);
+
+/**
+ * Потоковый буфер заполнен.
+ */
+bool stepper_stream_full(stepper_stream_t* stream);
+
+/**
+ * В потоковом буфере осталось не больше low_watermark подсерий,
+ * пора пополнять.
+ */
+bool stepper_stream_low(stepper_stream_t* stream);
+
+/**
+ * Подготовить серию шагов с переменной скоростью из потокового буфера
+ * (stepper_stream_init): подсерии - как у prepare_buffered_steps, но
+ * загружаются из буфера по ходу движения, длина серии не ограничена
+ * размером буфера.
+ * 
+ * Если к концу подсерии следующая не попала в буфер, а серия не завершена
+ * (stepper_stream_end), мотор останавливается с ошибкой
+ * STEPPER_ERROR_BUFFER_UNDERRUN (остальные моторы цикла продолжают вращение).
+ * 
+ * @param stream - потоковый буфер с первой подсерией
+ */
+void prepare_stream_steps(stepper *smotor, stepper_stream_t* stream);
+
+#if STEPPER_DYNAMIC_STEPS
 /**
  * Подготовить мотор к запуску ограниченной серии шагов с переменной скоростью - задать нужное количество
  * шагов и указатель на функцию, вычисляющую задержку перед каждым шагом для регулирования скорости.
@@ -560,6 +989,261 @@ void prepare_dynamic_steps(stepper *smotor, long step_count,
 void prepare_dynamic_whirl(stepper *smotor, int dir,
         void* curve_context, unsigned long (*next_step_delay)(unsigned long curr_step, void* curve_context));
 
+/**
+ * Буфер опережающего вычисления задержек для prepare_dynamic_steps
+ * и prepare_dynamic_whirl: кольцевой буфер с одним писателем (главный
+ * цикл, stepper_prefetch_fill) и одним читателем (обработчик прерывания).
+ * Поля заполняют stepper_prefetch_init и prepare_dynamic_xxx, напрямую
+ * не менять.
+ */
+typedef struct {
+    /** Вычисленные задержки перед следующими шагами, микросекунды */
+    unsigned long* buffer;
+    
+    /** Количество элементов в массиве buffer */
+    unsigned char size;
+    
+    /** Следующий элемент на запись (меняет только писатель) */
+    volatile unsigned char head;
+    
+    /** Следующий элемент на чтение (меняет только обработчик прерывания) */
+    volatile unsigned char tail;
+    
+    /** Контекст для функции next_step_delay */
+    void* curve_context;
+    
+    /** Функция, вычисляющая задержку перед следующим шагом */
+    unsigned long (*next_step_delay)(unsigned long curr_step, void* curve_context);
+    
+    /** Номер шага для следующего вычисления (меняет только писатель) */
+    unsigned long next_step;
+    
+    /** Количество шагов серии, 0 - вращение без остановки */
+    unsigned long step_count;
+    
+    /** Последняя задержка, взятая из буфера (обработчик прерывания) */
+    unsigned long last_delay;
+    
+    /** Сколько раз к шагу в буфере не оказалось задержки (обработчик прерывания) */
+    volatile unsigned int underruns;
+} stepper_prefetch_t;
+
+/**
+ * Подготовить буфер опережающего вычисления задержек: функция
+ * next_step_delay вызывается не в обработчике прерывания после каждого
+ * шага, а в главном цикле (или низкоприоритетном прерывании) на несколько
+ * шагов вперед, обработчик прерывания только забирает готовое значение.
+ * Время обработчика не зависит от сложности функции, период таймера
+ * не нужно увеличивать под самый долгий ее вызов.
+ * 
+ * Буфер вмещает buf_size-1 задержек (одна ячейка всегда пустая),
+ * массив buffer должен существовать до завершения цикла вращения.
+ * 
+ *   static unsigned long prefetch_buffer[16];
+ *   static stepper_prefetch_t prefetch;
+ * 
+ *   stepper_prefetch_init(&prefetch, 16, prefetch_buffer, &curve, curve_next_step_delay);
+ *   prepare_dynamic_steps(&sm_x, 10000, &prefetch);
+ *   stepper_start_cycle();
+ * 
+ *   // в loop
+ *   stepper_prefetch_fill(&prefetch);
+ * 
+ * Если к шагу мотора главный цикл не успел вычислить задержку, повторяется
+ * предыдущая задержка и увеличивается счетчик stepper_prefetch_underruns
+ * (последующие задержки сдвигаются на шаг, количество шагов не меняется).
+ * 
+ * @param buf_size - количество элементов в массиве buffer (не больше 255)
+ * @param buffer - массив для вычисленных задержек, микросекунды
+ * @param curve_context - контекст для функции next_step_delay
+ * @param next_step_delay - функция, вычисляющая задержку перед следующим шагом,
+ *     микросекунды (как у prepare_dynamic_steps); вызывается с номерами
+ *     шагов по порядку, для prepare_dynamic_whirl - с номером 0
+ */
+void stepper_prefetch_init(stepper_prefetch_t* prefetch, int buf_size, unsigned long* buffer,
+        void* curve_context, unsigned long (*next_step_delay)(unsigned long curr_step, void* curve_context));
+
+/**
+ * Вычислить задержки для следующих шагов, пока в буфере есть место.
+ * Вызывать в главном цикле loop как можно чаще (или из низкоприоритетного
+ * прерывания, но не одновременно из двух мест).
+ * 
+ * @return количество вычисленных задержек
+ */
+int stepper_prefetch_fill(stepper_prefetch_t* prefetch);
+
+/**
+ * Сколько раз к шагу мотора в буфере не оказалось вычисленной задержки
+ * (с начала серии prepare_dynamic_xxx).
+ */
+unsigned int stepper_prefetch_underruns(stepper_prefetch_t* prefetch);
+
+/**
+ * Подготовить серию шагов с переменной скоростью, как prepare_dynamic_steps,
+ * но задержки вычисляются заранее вне обработчика прерывания: буфер
+ * заполняется здесь, дальше - stepper_prefetch_fill.
+ * 
+ * @param step_count - количество шагов, знак задает направление вращения
+ * @param prefetch - буфер задержек (stepper_prefetch_init)
+ */
+void prepare_dynamic_steps(stepper *smotor, long step_count, stepper_prefetch_t* prefetch);
+
+/**
+ * Подготовить беспрерывное вращение с переменной скоростью, как
+ * prepare_dynamic_whirl, но задержки вычисляются заранее вне обработчика
+ * прерывания (stepper_prefetch_fill).
+ * 
+ * @param dir - направление вращения: 1 - вращать вперед, -1 - назад.
+ * @param prefetch - буфер задержек (stepper_prefetch_init)
+ */
+void prepare_dynamic_whirl(stepper *smotor, int dir, stepper_prefetch_t* prefetch);
+#endif // STEPPER_DYNAMIC_STEPS
+
+/**
+ * Подготовить группу моторов к движению по прямой линии: все моторы группы
+ * одновременно начинают и одновременно заканчивают движение.
+ * 
+ * Ведущий мотор группы (с максимальным количеством шагов) задает тайминг,
+ * остальные моторы шагают синхронно с ним по алгоритму Брезенхэма (DDA) -
+ * делают шаг на тех шагах ведущего мотора, на которых переполняется
+ * накопленная ошибка. Задержка между шагами одна для всех моторов группы,
+ * поэтому координаты не расходятся из-за округления отдельных задержек
+ * на длинных отрезках.
+ * 
+ *   static stepper* line_motors[] = {&sm_x, &sm_y, &sm_z};
+ *   long line_steps[] = {20000, 6666, 2666};
+ *   prepare_line(3, line_motors, line_steps, 1000);
+ * 
+ * @param motor_count - количество моторов в группе
+ * @param smotors - моторы группы
+ * @param step_counts - количество шагов для каждого мотора, знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами ведущего мотора, микросекунды
+ *     (0 для максимальной скорости - минимальная задержка, допустимая для всех моторов группы)
+ */
+void prepare_line(int motor_count, stepper** smotors, long* step_counts, unsigned long step_delay=0);
+
+/**
+ * Подготовить группу моторов к движению по прямой линии с плавным разгоном
+ * и торможением: как prepare_line, но ведущий мотор разгоняется и тормозит
+ * по трапеции (как в prepare_accel_steps), ведомые моторы шагают
+ * с его задержками.
+ * 
+ * Ускорение ведущего мотора выбирается так, чтобы ни один мотор группы
+ * не превысил свое максимальное ускорение max_accel (init_stepper_accel);
+ * если ускорение не задано ни для одного мотора, группа движется
+ * с постоянной скоростью, как с prepare_line.
+ * 
+ * Начальная и конечная скорость не обязательно нулевые: так отрезки
+ * ломаной линии можно проходить без остановки в промежуточных точках
+ * (см. stepper_planner.h).
+ * 
+ * @param motor_count - количество моторов в группе
+ * @param smotors - моторы группы
+ * @param step_counts - количество шагов для каждого мотора, знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами ведущего мотора на крейсерской
+ *     скорости, микросекунды (0 для максимальной скорости - минимальная задержка,
+ *     допустимая для всех моторов группы)
+ * @param entry_delay - задержка между шагами ведущего мотора на старте,
+ *     микросекунды (0 - старт с места)
+ * @param exit_delay - задержка между шагами ведущего мотора в конце отрезка,
+ *     микросекунды (0 - торможение до полной остановки)
+ */
+void prepare_accel_line(int motor_count, stepper** smotors, long* step_counts,
+        unsigned long step_delay=0, unsigned long entry_delay=0, unsigned long exit_delay=0);
+
+/**
+ * Подготовить пару моторов к движению по дуге окружности (как G2/G3):
+ * шаги по осям выбирает целочисленный алгоритм средней точки - в обработчике
+ * прерывания только сложения и сравнения, без тригонометрии, поэтому дуга
+ * идет на той же частоте таймера, что и прямая линия (в том числе на AVR).
+ * 
+ * Моторы шагают синхронно, как группа prepare_line, средняя скорость
+ * вдоль дуги равна заданной (местами отклоняется до 5%). Координаты - в шагах моторов (distance_per_step у моторов
+ * предполагается одинаковым). Если конечная точка не лежит на окружности,
+ * дуга заканчивается в ближайшей к ней точке окружности; конечная точка,
+ * совпадающая с начальной, - полная окружность.
+ * 
+ * Пример: полуокружность радиусом 1000 шагов против часовой стрелки
+ *   prepare_arc(&sm_x, &sm_y, -2000, 0, -1000, 0, false, 1000);
+ * 
+ * @param sm_x - мотор оси X
+ * @param sm_y - мотор оси Y
+ * @param x_steps - конечная точка дуги относительно начальной по оси X, шаги
+ * @param y_steps - конечная точка дуги относительно начальной по оси Y, шаги
+ * @param center_x - центр окружности относительно начальной точки по оси X, шаги (I в G-коде)
+ * @param center_y - центр окружности относительно начальной точки по оси Y, шаги (J в G-коде)
+ * @param cw - true: по часовой стрелке (G2), false: против часовой стрелки (G3)
+ * @param step_delay - время на путь длиной в один шаг вдоль дуги, микросекунды
+ *     (0 для максимальной скорости - шаг по одной оси с минимальной задержкой,
+ *     допустимой для всех моторов; меньшая задержка тоже ограничивается ею)
+ */
+void prepare_arc(stepper* sm_x, stepper* sm_y, long x_steps, long y_steps,
+        long center_x, long center_y, bool cw, unsigned long step_delay=0);
+
+/**
+ * Подготовить три мотора к движению по винтовой линии (G2/G3 с Z): X и Y
+ * идут по дуге окружности, как в prepare_arc, третий мотор (Z) - линейно,
+ * синхронно с дугой (алгоритм Брезенхэма от продвижения по дуге, без
+ * отдельного таймера или prepare_dynamic_steps). Для фрезерования резьбы
+ * и врезания в карман по спирали.
+ * 
+ * Линейная ось делает не больше одного шага за шаг дуги, поэтому количество
+ * ее шагов - не больше половины суммы шагов по X и Y (для полной окружности
+ * радиусом R - подъем на виток не больше 4R).
+ * 
+ * Пример: фрезерование резьбы - виток радиусом 1000 шагов с подъемом 200 шагов
+ *   prepare_helix(&sm_x, &sm_y, &sm_z, 0, 0, 200, -1000, 0, false);
+ * 
+ * @param sm_z - мотор линейной оси
+ * @param z_steps - количество шагов линейной оси, знак задает направление вращения
+ * Остальные параметры - как у prepare_arc.
+ * @return
+ *     true - движение подготовлено
+ *     false - линейная ось не успевает за дугой (слишком много шагов),
+ *         ничего не подготовлено
+ */
+bool prepare_helix(stepper* sm_x, stepper* sm_y, stepper* sm_z, long x_steps, long y_steps, long z_steps,
+        long center_x, long center_y, bool cw, unsigned long step_delay=0);
+
+/**
+ * Подготовить группу моторов к движению по кубической кривой Безье: плавные
+ * переходы между отрезками и сплайны (кривая за кривой) одним согласованным
+ * движением всех моторов группы, как prepare_line.
+ * 
+ * Кривая обходится в целых числах прямыми конечными разностями: в обработчике
+ * прерывания на каждом шаге кривой только сложения и сравнения, без умножения,
+ * деления и плавающей точки. Шаг параметра кривой подобран по ее размеру так,
+ * что моторы делают не больше шага за шаг параметра, шаги параметра без шагов
+ * моторов проходятся без ожидания таймера. Скорость вдоль кривой примерно
+ * постоянна, моторы приходят точно в конечную точку.
+ * 
+ * Координаты - в шагах моторов относительно начальной точки (distance_per_step
+ * у моторов предполагается одинаковым).
+ * 
+ * Пример: плавный поворот на 90 градусов из (0, 0) в (1000, 1000)
+ *   static stepper* bezier_motors[] = {&sm_x, &sm_y};
+ *   long p1[] = {550, 0};
+ *   long p2[] = {1000, 450};
+ *   long p3[] = {1000, 1000};
+ *   prepare_bezier(2, bezier_motors, p1, p2, p3, 1000);
+ * 
+ * @param motor_count - количество моторов в группе
+ * @param smotors - моторы группы
+ * @param p1 - первая контрольная точка, шаги для каждого мотора
+ * @param p2 - вторая контрольная точка, шаги для каждого мотора
+ * @param p3 - конечная точка, шаги для каждого мотора
+ * @param step_delay - время на путь длиной в один шаг вдоль кривой, микросекунды
+ *     (0 для максимальной скорости - шаг по одной оси с минимальной задержкой,
+ *     допустимой для всех моторов группы; меньшая задержка тоже ограничивается ею)
+ * @return
+ *     true - движение подготовлено
+ *     false - слишком много моторов (больше 8) или слишком большая кривая
+ *         (отрезок между соседними контрольными точками по одной оси длиннее
+ *         349525 шагов), ничего не подготовлено
+ */
+bool prepare_bezier(int motor_count, stepper** smotors, long* p1, long* p2, long* p3,
+        unsigned long step_delay=0);
+
 
 //////////////////////////////////////////
 // Управление циклом
@@ -568,17 +1252,44 @@ void prepare_dynamic_whirl(stepper *smotor, int dir,
  * Запустить цикл шагов на выполнение - запускаем таймер с
  * обработчиком прерываний отрабатывать подготовленную программу.
  *
+ * Если программа не подготовлена (ни одного вызова prepare_xxx),
+ * запускается первое движение из очереди (stepper_queue_line).
+ *
+ * Следующую программу можно готовить (prepare_xxx), пока выполняется
+ * текущий цикл (при STEPPER_CYCLE_PROGRAMS=2): stepper_start_cycle
+ * во время цикла ставит ее на запуск сразу после последнего шага
+ * текущего цикла без остановки таймера.
+ *
+ * Пример: квадрат, стороны готовим на ходу
+ *   prepare_steps(&sm_x, 10000, 1000);
+ *   stepper_start_cycle();
+ *   prepare_steps(&sm_y, 10000, 1000);
+ *   stepper_start_cycle();
+ *   while(stepper_cycle_pending());
+ *   prepare_steps(&sm_x, -10000, 1000);
+ *   stepper_start_cycle();
+ *   ...
+ *
  * @return
- *     true - цикл запущен
+ *     true - цикл запущен или программа запустится после текущего цикла
  *     false - цикл не запущен, т.к. предыдущий цикл еще не завершен
+ *         (программа не подготовлена, уже ждет запуска или не прошла проверки)
  */
 bool stepper_start_cycle();
 
 /**
- * Завершить цикл шагов - остановить таймер, обнулить список моторов.
+ * Завершить цикл шагов - остановить таймер, обнулить список моторов
+ * (в том числе подготовленных для следующего цикла), очистить
+ * очередь движений.
  */
 void stepper_finish_cycle();
 
+/**
+ * Программа, подготовленная во время цикла, ждет запуска после его
+ * завершения. Пока ждет, следующую программу готовить нельзя.
+ */
+bool stepper_cycle_pending();
+
 /**
  * Поставить вращение на паузу, не прирывая всего цикла
  */
@@ -618,6 +1329,150 @@ stepper_cycle_error_t stepper_cycle_error();
  */
 unsigned long stepper_cycle_max_time();
 
+#if STEPPER_ISR_PROFILE
+/**
+ * Профиль обработчика прерывания таймера (при сборке с STEPPER_ISR_PROFILE=1):
+ * гистограмма времени вызовов, вызовы по фазам шага. В отличие от
+ * stepper_cycle_max_time не сбрасывается при запуске цикла, копится,
+ * пока его не сбросят.
+ * 
+ * Копия согласованная: если обработчик прерывания сработал во время
+ * копирования, профиль копируется заново. Прерывания не запрещаются.
+ * 
+ * Пример:
+ *   stepper_profile_t profile;
+ *   stepper_profile(&profile, true);
+ *   Serial.println(profile.phase_ticks[STEPPER_PHASE_STEP]);
+ * 
+ * @param profile - копия профиля
+ * @param reset - сбросить профиль (если цикл запущен - на следующем вызове
+ *     обработчика, этот вызов в новый профиль не попадет)
+ */
+void stepper_profile(stepper_profile_t* profile, bool reset=false);
+
+/**
+ * Профиль мотора в обработчике прерывания (при сборке с STEPPER_ISR_PROFILE=1):
+ * шаги и время работы на шагах. Копия согласованная, как у stepper_profile.
+ * 
+ * @param smotor - мотор
+ * @param profile - копия профиля
+ * @param reset - сбросить профиль (если мотор вращается - на следующем шаге)
+ */
+void stepper_profile_motor(stepper* smotor, stepper_motor_profile_t* profile, bool reset=false);
+#endif // STEPPER_ISR_PROFILE
+
+#if STEPPER_TRACE
+/**
+ * Включить трассу шагов (при сборке с STEPPER_TRACE=1): обработчик
+ * прерывания записывает в кольцевой буфер событие на каждый шаг мотора
+ * (и на остановку мотора с ошибкой), главный цикл забирает события
+ * stepper_trace_read и, например, отправляет в последовательный порт
+ * (stepper_trace_encode). Разбор на компьютере (CSV, VCD) -
+ * test/stepper_trace_decode.cpp.
+ * 
+ * Буфер с одним писателем (обработчик прерывания) и одним читателем
+ * (главный цикл), без запрета прерываний: читать можно во время движения.
+ * Если читатель не успевает, новые события отбрасываются
+ * (stepper_trace_dropped), уже записанные не портятся.
+ * 
+ *   static stepper_trace_event_t trace_buffer[64];
+ *   stepper_trace_init(64, trace_buffer);
+ * 
+ *   // в loop
+ *   stepper_trace_event_t event;
+ *   unsigned char data[STEPPER_TRACE_EVENT_BYTES];
+ *   while(stepper_trace_read(&event, 1)) {
+ *       Serial.write(data, stepper_trace_encode(&event, data));
+ *   }
+ * 
+ * Вызывать, когда цикл не запущен.
+ * 
+ * @param buf_size - размер буфера, не больше 255 (вмещает buf_size-1 событий)
+ * @param buffer - буфер событий, NULL - выключить трассу
+ */
+void stepper_trace_init(int buf_size, stepper_trace_event_t* buffer);
+
+/**
+ * Забрать события трассы шагов из буфера.
+ * 
+ * @param events - куда скопировать события
+ * @param max_count - не больше стольких событий
+ * @return количество скопированных событий
+ */
+int stepper_trace_read(stepper_trace_event_t* events, int max_count);
+
+/**
+ * Сколько событий трассы отброшено из-за переполнения буфера
+ * (с момента stepper_trace_init).
+ */
+unsigned long stepper_trace_dropped();
+
+/**
+ * Событие трассы в поток байт для отправки на компьютер:
+ * тик (4 байта, младший первым), имя мотора, флаги.
+ * 
+ * @param data - не меньше STEPPER_TRACE_EVENT_BYTES байт
+ * @return STEPPER_TRACE_EVENT_BYTES
+ */
+int stepper_trace_encode(const stepper_trace_event_t* event, unsigned char* data);
+#endif // STEPPER_TRACE
+
+/**
+ * Память под программы цикла: размер статуса цикла одного мотора, байт.
+ * Всего под статусы уходит MAX_STEPPERS*STEPPER_CYCLE_PROGRAMS таких блоков.
+ * Поля отдельных режимов лежат в объединении, флаги - в битовых полях:
+ * на AVR около 100 байт на мотор (было больше 200), на 32-битных
+ * PIC32 и SAM - около 120 (было около 260).
+ */
+unsigned int stepper_cycle_info_size();
+
+//////////////////////////////////////////
+// Очередь движений
+
+/**
+ * Добавить движение группы моторов по прямой линии в очередь. Движения
+ * из очереди запускаются одно за другим без остановки таймера: следующее
+ * движение загружается в обработчике прерывания сразу после последнего
+ * шага предыдущего, первый шаг - через entry_delay после последнего
+ * шага предыдущего движения. Добавлять движения можно, пока цикл
+ * выполняется, очередь не требует запрета прерываний.
+ *
+ * Если цикл не запущен (или успел завершиться до того, как движение
+ * попало в очередь), первое движение из очереди запускает stepper_start_cycle.
+ * Если цикл завершился с ошибкой или остановлен stepper_finish_cycle,
+ * очередь очищается.
+ *
+ * Пример: треугольник без остановки таймера в вершинах
+ *   static stepper* line_motors[] = {&sm_x, &sm_y, &sm_z};
+ *   long line1[] = {20000, 6666, 2666};
+ *   long line2[] = {-10000, 3334, 7334};
+ *   long line3[] = {-10000, -10000, -10000};
+ *   stepper_queue_line(3, line_motors, line1, 1000);
+ *   stepper_queue_line(3, line_motors, line2, 1000);
+ *   stepper_queue_line(3, line_motors, line3, 1000);
+ *   stepper_start_cycle();
+ *
+ * Параметры - как у prepare_accel_line (для моторов без ускорения -
+ * как у prepare_line).
+ *
+ * @return
+ *     true - движение добавлено в очередь
+ *     false - очередь заполнена (STEPPER_MOVE_QUEUE_SIZE) или движение
+ *         нельзя запустить с текущими настройками таймера (см. stepper_start_cycle)
+ */
+bool stepper_queue_line(int motor_count, stepper** smotors, long* step_counts,
+        unsigned long step_delay=0, unsigned long entry_delay=0, unsigned long exit_delay=0);
+
+/**
+ * Количество движений в очереди, ожидающих запуска.
+ */
+int stepper_queue_count();
+
+/**
+ * Очередь движений заполнена.
+ */
+bool stepper_queue_full();
+
 /////////////////////////////////////////
 // Системные настройки
 
@@ -695,6 +1550,54 @@ void stepper_configure_timer(unsigned long target_period_us, int timer, int pres
  */
 void stepper_set_timer_enabled(bool enabled);
 
+/**
+ * Режим таймера "по событию": вызывать обработчик прерывания не на каждом
+ * периоде таймера, а только на тех периодах, когда хотя бы одному из моторов
+ * нужно что-то сделать (проверить границы перед шагом, взвести или сбросить
+ * ножку step). На медленных шагах с коротким периодом таймера это снимает
+ * почти всю нагрузку с процессора, тайминг шагов при этом не меняется.
+ *
+ * Режим нельзя переключить во время работы цикла.
+ *
+ * @param enabled
+ *   true: режим "по событию"
+ *   false: обычный режим - обработчик вызывается каждый период таймера (по умолчанию)
+ */
+void stepper_set_timer_event_driven(bool enabled);
+
+/**
+ * Количество периодов таймера до следующего вызова обработчика прерывания:
+ * в обычном режиме всегда 1, в режиме "по событию" - до ближайшего события
+ * у моторов в цикле. Может быть полезно при тестировании с выключенным
+ * таймером (stepper_set_timer_enabled).
+ */
+unsigned int stepper_timer_event_ticks();
+
+/**
+ * Ограничить "тяжелую" работу на шаге (вычисление задержки перед следующим
+ * шагом для delay_source=BUFFER, DYNAMIC, ACCEL, SCURVE): не больше
+ * max_motors моторов на один вызов обработчика прерывания. Если шаги
+ * нескольких моторов попали на один тик, вычисление задержки у остальных
+ * откладывается на следующие тики, до тех пор, пока мотор не подойдет
+ * к проверке границ перед следующим шагом (тайминг шагов не меняется).
+ * Худшее время обработчика при этом определяется K моторами, а не всеми:
+ * одно вычисление задержки (например, вызов next_step_delay) на тики
+ * не делится, поэтому тик с ним остается дольше среднего.
+ *
+ * Ведущий мотор группы движения по линии (prepare_line, stepper_queue_line
+ * с разгоном) не откладывает задержку - ведомые берут ее на том же тике, -
+ * а вычисляет ее заранее, за шаг до нужного, тоже в пределах лимита.
+ * Ведущие моторы дуг и кривых Безье (дешевая целочисленная работа)
+ * и последний шаг серии не откладываются. Отложенная работа ждет не дольше,
+ * чем до момента за 3 периода таймера до следующего шага мотора.
+ *
+ * Лимит нельзя поменять во время работы цикла.
+ *
+ * @param max_motors - моторов с тяжелой работой на тик,
+ *     0 - без ограничения (по умолчанию)
+ */
+void stepper_set_step_work_limit(int max_motors);
+
 /**
  * Стратегия реакции на некоторые исключительные ситуации, которые
  * могут произойти во время вращения моторов.
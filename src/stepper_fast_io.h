@@ -0,0 +1,166 @@
+/**
+ * stepper_fast_io.h
+ *
+ * Прямой доступ к портам ввода-вывода для обработчика прерывания таймера:
+ * номер пина один раз (в init_stepper/init_stepper_ends) переводится
+ * в указатель на регистр порта и битовую маску, дальше ножки step
+ * и концевых датчиков переключаются и читаются одной записью
+ * (чтением) регистра без поиска по таблицам digitalWrite/digitalRead.
+ *
+ * Для каждой платформы своя реализация: src/avr, src/sam, src/pic32,
+ * для тестов на настольном компьютере - заглушка в test/Arduino.cpp.
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#ifndef STEPPER_FAST_IO_H
+#define STEPPER_FAST_IO_H
+
+#include "Arduino.h"
+
+#if defined( ARDUINO_ARCH_AVR )
+// AVR: 8-битные порты PORTx (запись) и PINx (чтение),
+// отдельных регистров set/clear нет - запись через |= и &=
+// (в обработчике прерывания атомарна, digitalWrite в главном
+// цикле на время записи сам запрещает прерывания)
+
+typedef volatile uint8_t* fast_io_port_t;
+typedef uint8_t fast_io_mask_t;
+
+typedef struct {
+    /** Регистр порта для записи (PORTx) */
+    fast_io_port_t port;
+    /** Регистр порта для чтения (PINx) */
+    fast_io_port_t in;
+    /** Бит пина в регистре порта */
+    fast_io_mask_t mask;
+} fast_io_pin_t;
+
+static inline void fast_io_set(fast_io_port_t port, fast_io_mask_t mask) {
+    *port |= mask;
+}
+
+static inline void fast_io_clear(fast_io_port_t port, fast_io_mask_t mask) {
+    *port &= ~mask;
+}
+
+static inline fast_io_mask_t fast_io_read(const fast_io_pin_t* io) {
+    return *io->in & io->mask;
+}
+
+//#endif // ARDUINO_ARCH_AVR
+#elif defined( ARDUINO_ARCH_SAM )
+// SAM: 32-битные контроллеры PIO с отдельными регистрами
+// установки (PIO_SODR), сброса (PIO_CODR) и чтения (PIO_PDSR)
+
+typedef Pio* fast_io_port_t;
+typedef uint32_t fast_io_mask_t;
+
+typedef struct {
+    /** Контроллер порта PIOx */
+    fast_io_port_t port;
+    /** Контроллер порта для чтения (тот же, что и port) */
+    fast_io_port_t in;
+    /** Бит пина в регистрах порта */
+    fast_io_mask_t mask;
+} fast_io_pin_t;
+
+static inline void fast_io_set(fast_io_port_t port, fast_io_mask_t mask) {
+    port->PIO_SODR = mask;
+}
+
+static inline void fast_io_clear(fast_io_port_t port, fast_io_mask_t mask) {
+    port->PIO_CODR = mask;
+}
+
+static inline fast_io_mask_t fast_io_read(const fast_io_pin_t* io) {
+    return io->in->PIO_PDSR & io->mask;
+}
+
+//#endif // ARDUINO_ARCH_SAM
+#elif defined( __PIC32__ )
+// PIC32: 32-битные порты с отдельными регистрами
+// установки (LATxSET), сброса (LATxCLR) и чтения (PORTx)
+
+typedef p32_ioport* fast_io_port_t;
+typedef uint32_t fast_io_mask_t;
+
+typedef struct {
+    /** Регистры порта */
+    fast_io_port_t port;
+    /** Регистры порта для чтения (те же, что и port) */
+    fast_io_port_t in;
+    /** Бит пина в регистрах порта */
+    fast_io_mask_t mask;
+} fast_io_pin_t;
+
+static inline void fast_io_set(fast_io_port_t port, fast_io_mask_t mask) {
+    port->lat.set = mask;
+}
+
+static inline void fast_io_clear(fast_io_port_t port, fast_io_mask_t mask) {
+    port->lat.clr = mask;
+}
+
+static inline fast_io_mask_t fast_io_read(const fast_io_pin_t* io) {
+    return io->in->port.reg & io->mask;
+}
+
+//#endif // __PIC32__
+#else // unknown arch (most likely in test mode)
+// test mode: emulate 8-pin ports on top of digitalWrite/digitalRead stub values
+// тестовый режим: порты по 8 пинов поверх значений заглушки digitalWrite/digitalRead
+
+typedef unsigned int fast_io_port_t;
+typedef unsigned int fast_io_mask_t;
+
+typedef struct {
+    /** Номер порта */
+    fast_io_port_t port;
+    /** Номер порта для чтения (тот же, что и port) */
+    fast_io_port_t in;
+    /** Бит пина в порту */
+    fast_io_mask_t mask;
+} fast_io_pin_t;
+
+void fast_io_write_port(fast_io_port_t port, fast_io_mask_t mask, int val);
+fast_io_mask_t fast_io_read_port(fast_io_port_t port, fast_io_mask_t mask);
+
+static inline void fast_io_set(fast_io_port_t port, fast_io_mask_t mask) {
+    fast_io_write_port(port, mask, HIGH);
+}
+
+static inline void fast_io_clear(fast_io_port_t port, fast_io_mask_t mask) {
+    fast_io_write_port(port, mask, LOW);
+}
+
+static inline fast_io_mask_t fast_io_read(const fast_io_pin_t* io) {
+    return fast_io_read_port(io->in, io->mask);
+}
+
+#endif
+
+/**
+ * Найти регистр порта и битовую маску для пина.
+ *
+ * Для NO_PIN маска будет 0, а регистр - фиктивным (запись и чтение
+ * безопасны, но ничего не делают), поэтому ножки можно не проверять
+ * на NO_PIN в обработчике прерывания.
+ *
+ * @param pin - номер пина Arduino или NO_PIN
+ * @param io - регистр порта и маска пина
+ */
+void fast_io_resolve_pin(int pin, fast_io_pin_t* io);
+
+static inline void fast_io_write_high(const fast_io_pin_t* io) {
+    fast_io_set(io->port, io->mask);
+}
+
+static inline void fast_io_write_low(const fast_io_pin_t* io) {
+    fast_io_clear(io->port, io->mask);
+}
+
+#endif // STEPPER_FAST_IO_H
+
@@ -0,0 +1,750 @@
+/**
+ * stepper_gcode.cpp
+ *
+ * Интерпретатор G-кода поверх prepare_xxx: команды читаются по одному
+ * символу по мере поступления, каждая строка сразу превращается в вызовы
+ * prepare_xxx и запуск цикла. Память выделяется только статически.
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#include "math.h"
+
+#include "Arduino.h"
+
+#include "stepper.h"
+#include "stepper_gcode.h"
+
+#include "stepper_lib_config.h"
+
+/** Оси G-кода */
+#define GCODE_AXES 6
+static const char _axis_letters[GCODE_AXES] = {'X', 'Y', 'Z', 'A', 'B', 'C'};
+
+/** Параметры строки: оси, затем I, J, F, P, S */
+#define GCODE_WORD_I 6
+#define GCODE_WORD_J 7
+#define GCODE_WORD_F 8
+#define GCODE_WORD_P 9
+#define GCODE_WORD_S 10
+#define GCODE_WORDS 11
+
+/** Числа G-кода хранятся в целых с 6 знаками после запятой */
+#define GCODE_NUMBER_SCALE 1000000LL
+
+/** Целая часть числа не больше (миллиметры - 1 километр) */
+#define GCODE_NUMBER_MAX 1000000LL
+
+/**
+ * Разобранная строка G-кода.
+ */
+typedef struct {
+    /** Команда G (0, 1, 2, 3, 4, 28, 92), -1 - нет */
+    int g;
+
+    /** Координаты: 90 - абсолютные, 91 - относительные, 0 - не менялись */
+    unsigned char distance_mode;
+
+    /** Есть ли в строке хоть одно слово */
+    bool not_empty;
+
+    /** Есть ли в строке ось без числа (допустимо только в G28 X Y) */
+    bool bare_axis;
+
+    /** Параметры, которые есть в строке (биты по индексам values) */
+    unsigned int words;
+
+    /** Значения параметров, GCODE_NUMBER_SCALE - единица */
+    long long values[GCODE_WORDS];
+
+    /** Ошибка разбора строки */
+    stepper_gcode_error_t error;
+} gcode_line_t;
+
+/** Моторы осей (NULL - оси нет) */
+static stepper* _axis_motors[GCODE_AXES];
+
+/** Единиц distance_per_step моторов в миллиметре */
+static unsigned long _distance_per_mm = 1;
+
+/** Позиция после последнего подготовленного движения, шаги */
+static long _pos[GCODE_AXES];
+
+/** Относительные координаты (G91) */
+static bool _relative = false;
+
+/** Скорость подачи F, мм/мин с GCODE_NUMBER_SCALE (0 - максимальная скорость) */
+static long long _feed = 0;
+
+/** Команда перемещения для строк без G (G0, G1, G2, G3) */
+static int _motion_mode = 0;
+
+/** Текущая строка */
+static gcode_line_t _line;
+
+/** Строка разобрана и ждет выполнения */
+static bool _line_ready = false;
+
+// Состояние разбора текущего слова (буква и число)
+static char _letter = 0;
+static long long _number = 0;
+static signed char _frac_digits = -1;
+static bool _negative = false;
+static bool _has_sign = false;
+static bool _has_digits = false;
+
+/** Пропуск символов: комментарий в скобках или до конца строки */
+#define GCODE_SKIP_NONE 0
+#define GCODE_SKIP_PAREN 1
+#define GCODE_SKIP_EOL 2
+static unsigned char _skip = GCODE_SKIP_NONE;
+
+// Многошаговые команды: пауза G4 и выход в начальную позицию G28
+static bool _dwell_started = false;
+static unsigned long _dwell_start = 0;
+static bool _home_started = false;
+static unsigned char _home_axes = 0;
+
+/** Ошибка последней выполненной строки */
+static stepper_gcode_error_t _error = GCODE_ERROR_NONE;
+
+/** Количество выполненных строк */
+static unsigned long _line_count = 0;
+
+static void _line_reset() {
+    _line.g = -1;
+    _line.distance_mode = 0;
+    _line.not_empty = false;
+    _line.bare_axis = false;
+    _line.words = 0;
+    _line.error = GCODE_ERROR_NONE;
+}
+
+static inline void _line_fail(stepper_gcode_error_t error) {
+    // первая ошибка строки
+    if(_line.error == GCODE_ERROR_NONE) {
+        _line.error = error;
+    }
+}
+
+static inline bool _has_word(int word) {
+    return (_line.words & (1 << word)) != 0;
+}
+
+/**
+ * Индекс параметра в gcode_line_t.values по букве, -1 - не параметр.
+ */
+static int _word_index(char letter) {
+    switch(letter) {
+        case 'X': return 0;
+        case 'Y': return 1;
+        case 'Z': return 2;
+        case 'A': return 3;
+        case 'B': return 4;
+        case 'C': return 5;
+        case 'I': return GCODE_WORD_I;
+        case 'J': return GCODE_WORD_J;
+        case 'F': return GCODE_WORD_F;
+        case 'P': return GCODE_WORD_P;
+        case 'S': return GCODE_WORD_S;
+        default: return -1;
+    }
+}
+
+/**
+ * Слово закончилось (новая буква, комментарий, конец строки):
+ * записать его значение в строку.
+ */
+static void _end_word() {
+    if(_letter == 0) {
+        return;
+    }
+    char letter = _letter;
+    _letter = 0;
+    _line.not_empty = true;
+
+    if(!_has_digits) {
+        int word = _word_index(letter);
+        if(word >= 0 && word < GCODE_AXES) {
+            // G28 X - проверим при выполнении
+            _line.bare_axis = true;
+            _line.words |= 1 << word;
+            _line.values[word] = 0;
+        } else {
+            _line_fail(GCODE_ERROR_SYNTAX);
+        }
+        return;
+    }
+    long long value = _number;
+    for(int i = _frac_digits > 0 ? _frac_digits : 0; i < 6; i++) {
+        value *= 10;
+    }
+    if(_negative) {
+        value = -value;
+    }
+
+    if(letter == 'G') {
+        if(value % GCODE_NUMBER_SCALE != 0 || value < 0) {
+            // G38.2 и т.п.
+            _line_fail(GCODE_ERROR_UNSUPPORTED);
+            return;
+        }
+        int code = value / GCODE_NUMBER_SCALE;
+        switch(code) {
+            case 0: case 1: case 2: case 3: case 4: case 28: case 92:
+                _line.g = code;
+                break;
+            case 90: case 91:
+                _line.distance_mode = code;
+                break;
+            case 17: case 21:
+                // плоскость XY и миллиметры - и так всегда
+                break;
+            default:
+                _line_fail(GCODE_ERROR_UNSUPPORTED);
+        }
+    } else if(letter == 'N') {
+        // номер строки
+    } else {
+        int word = _word_index(letter);
+        if(word < 0) {
+            // M, T, R, K и т.п.
+            _line_fail(GCODE_ERROR_UNSUPPORTED);
+            return;
+        }
+        _line.words |= 1 << word;
+        _line.values[word] = value;
+    }
+}
+
+/**
+ * Шаги мотора в value миллиметрах (value с GCODE_NUMBER_SCALE).
+ */
+static long _to_steps(long long value, stepper* smotor) {
+    return (long)floor((double)value / GCODE_NUMBER_SCALE * _distance_per_mm /
+        smotor->distance_per_step + 0.5);
+}
+
+/**
+ * Время на путь длиной в один шаг мотора со скоростью подачи F, микросекунды
+ * (0 - скорость не задана).
+ */
+static unsigned long _feed_step_delay(stepper* smotor) {
+    if(_feed <= 0) {
+        return 0;
+    }
+    // F - мм/мин, 60000000 мкс в минуте
+    return (unsigned long)((double)smotor->distance_per_step / _distance_per_mm *
+        60000000.0 * GCODE_NUMBER_SCALE / _feed);
+}
+
+/**
+ * Позиция осей по текущим позициям моторов (моторы стоят).
+ */
+static void _sync_position() {
+    for(int a = 0; a < GCODE_AXES; a++) {
+        if(_axis_motors[a] != NULL) {
+            _pos[a] = _axis_motors[a]->current_pos / (long long)_axis_motors[a]->distance_per_step;
+        }
+    }
+}
+
+/**
+ * Можно ли готовить следующее движение: моторы стоят или выполняется
+ * цикл, а следующая программа цикла свободна.
+ */
+static bool _motion_ready() {
+    if(!stepper_cycle_running()) {
+        // моторы могли не дойти до цели (концевой датчик, отмена цикла)
+        _sync_position();
+        return true;
+    }
+#if STEPPER_CYCLE_PROGRAMS > 1
+    return !stepper_cycle_pending();
+#else
+    return false;
+#endif
+}
+
+/**
+ * Конечная точка движения по осям строки, шаги.
+ * @return false - в строке ось без мотора
+ */
+static bool _target(long* target) {
+    for(int a = 0; a < GCODE_AXES; a++) {
+        target[a] = _pos[a];
+        if(_has_word(a)) {
+            if(_axis_motors[a] == NULL) {
+                _line_fail(GCODE_ERROR_NO_MOTOR);
+                return false;
+            }
+            long steps = _to_steps(_line.values[a], _axis_motors[a]);
+            target[a] = _relative ? _pos[a] + steps : steps;
+        }
+    }
+    return true;
+}
+
+/**
+ * G0, G1: перемещение по прямой.
+ */
+static void _exec_line(int g) {
+    long target[GCODE_AXES];
+    if(!_target(target)) {
+        return;
+    }
+
+    int motor_count = 0;
+    stepper* smotors[GCODE_AXES];
+    long step_counts[GCODE_AXES];
+    unsigned long lead_count = 0;
+    double length2 = 0;
+    for(int a = 0; a < GCODE_AXES; a++) {
+        long count = target[a] - _pos[a];
+        if(count != 0) {
+            smotors[motor_count] = _axis_motors[a];
+            step_counts[motor_count] = count;
+            motor_count++;
+
+            unsigned long abs_count = count > 0 ? count : -count;
+            if(abs_count > lead_count) {
+                lead_count = abs_count;
+            }
+            double dist = (double)abs_count * _axis_motors[a]->distance_per_step / _distance_per_mm;
+            length2 += dist * dist;
+        }
+    }
+    if(motor_count == 0) {
+        // двигаться некуда
+        return;
+    }
+
+    // задержка ведущего мотора: путь вдоль линии со скоростью F
+    unsigned long step_delay = 0;
+    if(g == 1 && _feed > 0) {
+        step_delay = (unsigned long)(sqrt(length2) * 60000000.0 * GCODE_NUMBER_SCALE / _feed / lead_count);
+        for(int i = 0; i < motor_count; i++) {
+            unsigned long count = step_counts[i] > 0 ? step_counts[i] : -step_counts[i];
+            if((double)step_delay * lead_count / count < smotors[i]->step_delay) {
+                // быстрее, чем может мотор, - максимальная скорость
+                step_delay = 0;
+            }
+        }
+    }
+
+    prepare_line(motor_count, smotors, step_counts, step_delay);
+    if(!stepper_start_cycle()) {
+        _line_fail(GCODE_ERROR_CYCLE);
+        return;
+    }
+    for(int a = 0; a < GCODE_AXES; a++) {
+        _pos[a] = target[a];
+    }
+}
+
+/**
+ * G2, G3: дуга в плоскости XY (с Z - винтовая линия).
+ */
+static void _exec_arc(int g) {
+    stepper* sm_x = _axis_motors[0];
+    stepper* sm_y = _axis_motors[1];
+    stepper* sm_z = _axis_motors[2];
+    if(sm_x == NULL || sm_y == NULL) {
+        _line_fail(GCODE_ERROR_NO_MOTOR);
+        return;
+    }
+    if(!_has_word(GCODE_WORD_I) && !_has_word(GCODE_WORD_J)) {
+        _line_fail(GCODE_ERROR_ARC);
+        return;
+    }
+
+    long target[GCODE_AXES];
+    if(!_target(target)) {
+        return;
+    }
+    for(int a = 3; a < GCODE_AXES; a++) {
+        if(target[a] != _pos[a]) {
+            // дуга только по X, Y и Z
+            _line_fail(GCODE_ERROR_UNSUPPORTED);
+            return;
+        }
+    }
+
+    // центр всегда относительно начальной точки
+    long center_x = _has_word(GCODE_WORD_I) ? _to_steps(_line.values[GCODE_WORD_I], sm_x) : 0;
+    long center_y = _has_word(GCODE_WORD_J) ? _to_steps(_line.values[GCODE_WORD_J], sm_y) : 0;
+    long z_steps = sm_z != NULL ? target[2] - _pos[2] : 0;
+
+    // не быстрее, чем могут моторы, - ограничивает сама prepare_arc/prepare_helix
+    unsigned long step_delay = _feed_step_delay(sm_x);
+
+    if(z_steps != 0) {
+        if(!prepare_helix(sm_x, sm_y, sm_z, target[0] - _pos[0], target[1] - _pos[1], z_steps,
+                center_x, center_y, g == 2, step_delay)) {
+            _line_fail(GCODE_ERROR_ARC);
+            return;
+        }
+    } else {
+        prepare_arc(sm_x, sm_y, target[0] - _pos[0], target[1] - _pos[1],
+                center_x, center_y, g == 2, step_delay);
+    }
+    if(!stepper_start_cycle()) {
+        _line_fail(GCODE_ERROR_CYCLE);
+        return;
+    }
+    for(int a = 0; a < 3; a++) {
+        _pos[a] = target[a];
+    }
+}
+
+/**
+ * G4: пауза после остановки моторов.
+ * @return false - пауза еще идет
+ */
+static bool _exec_dwell() {
+    if(stepper_cycle_running()) {
+        return false;
+    }
+    // P - миллисекунды, S - секунды
+    unsigned long dwell_us = _has_word(GCODE_WORD_P) ? _line.values[GCODE_WORD_P] / 1000 :
+        _has_word(GCODE_WORD_S) ? _line.values[GCODE_WORD_S] : 0;
+    if(!_dwell_started) {
+        _dwell_started = true;
+        _dwell_start = micros();
+    }
+    if(micros() - _dwell_start < dwell_us) {
+        return false;
+    }
+    _dwell_started = false;
+    return true;
+}
+
+/**
+ * G28: выход в начальную позицию - вращение к концевому датчику min
+ * в режиме калибровки CALIBRATE_START_MIN_POS, по одной оси за раз
+ * (концевой датчик отменяет весь цикл).
+ * @return false - моторы еще едут
+ */
+static bool _exec_home() {
+    if(!_home_started) {
+        // оси из строки или все оси с моторами
+        _home_axes = 0;
+        for(int a = 0; a < GCODE_AXES; a++) {
+            if(_has_word(a)) {
+                if(_axis_motors[a] == NULL) {
+                    _line_fail(GCODE_ERROR_NO_MOTOR);
+                    return true;
+                }
+                _home_axes |= 1 << a;
+            }
+        }
+        if(_home_axes == 0) {
+            for(int a = 0; a < GCODE_AXES; a++) {
+                if(_axis_motors[a] != NULL) {
+                    _home_axes |= 1 << a;
+                }
+            }
+        }
+        _home_started = true;
+    }
+
+    if(stepper_cycle_running()) {
+        return false;
+    }
+    if(_home_axes == 0) {
+        _sync_position();
+        _home_started = false;
+        return true;
+    }
+
+    int a = 0;
+    while((_home_axes & (1 << a)) == 0) a++;
+    _home_axes &= ~(1 << a);
+
+    unsigned long step_delay = _feed_step_delay(_axis_motors[a]);
+    if(step_delay < _axis_motors[a]->step_delay) {
+        step_delay = 0;
+    }
+    prepare_whirl(_axis_motors[a], -1, step_delay, CALIBRATE_START_MIN_POS);
+    if(!stepper_start_cycle()) {
+        _line_fail(GCODE_ERROR_CYCLE);
+        _home_axes = 0;
+        _home_started = false;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * G92: задать текущую позицию осей (без параметров - все оси в 0).
+ * @return false - моторы еще едут
+ */
+static bool _exec_set_position() {
+    if(stepper_cycle_running()) {
+        return false;
+    }
+    _sync_position();
+
+    bool any = false;
+    for(int a = 0; a < GCODE_AXES; a++) {
+        if(_has_word(a)) {
+            any = true;
+            if(_axis_motors[a] == NULL) {
+                _line_fail(GCODE_ERROR_NO_MOTOR);
+                return true;
+            }
+        }
+    }
+    for(int a = 0; a < GCODE_AXES; a++) {
+        if(_axis_motors[a] != NULL && (!any || _has_word(a))) {
+            _pos[a] = any ? _to_steps(_line.values[a], _axis_motors[a]) : 0;
+            _axis_motors[a]->current_pos = (long long)_pos[a] * _axis_motors[a]->distance_per_step;
+        }
+    }
+    return true;
+}
+
+/**
+ * Выполнить разобранную строку.
+ * @return false - строка ждет моторов, вызвать еще раз позже
+ */
+static bool _execute() {
+    // модальные параметры (повторное применение ничего не меняет)
+    if(_line.distance_mode != 0) {
+        _relative = _line.distance_mode == 91;
+    }
+    if(_has_word(GCODE_WORD_F)) {
+        _feed = _line.values[GCODE_WORD_F];
+    }
+
+    int g = _line.g;
+    if(g < 0) {
+        // X, Y... без G - в последнем режиме перемещения
+        for(int a = 0; a < GCODE_AXES; a++) {
+            if(_has_word(a)) {
+                g = _motion_mode;
+            }
+        }
+    }
+
+    if(_line.bare_axis && g != 28) {
+        // ось без числа
+        _line_fail(GCODE_ERROR_SYNTAX);
+        return true;
+    }
+
+    switch(g) {
+        case 0: case 1:
+            if(!_motion_ready()) {
+                return false;
+            }
+            _motion_mode = g;
+            _exec_line(g);
+            return true;
+        case 2: case 3:
+            if(!_motion_ready()) {
+                return false;
+            }
+            _motion_mode = g;
+            _exec_arc(g);
+            return true;
+        case 4:
+            return _exec_dwell();
+        case 28:
+            return _exec_home();
+        case 92:
+            return _exec_set_position();
+        default:
+            // только модальные параметры
+            return true;
+    }
+}
+
+/**
+ * Задать моторы интерпретатора и сбросить его состояние.
+ *
+ * @param motor_count - количество моторов
+ * @param smotors - моторы
+ * @param distance_per_mm - количество единиц distance_per_step моторов в миллиметре
+ */
+void stepper_gcode_init(int motor_count, stepper** smotors, unsigned long distance_per_mm) {
+    for(int a = 0; a < GCODE_AXES; a++) {
+        _axis_motors[a] = NULL;
+        for(int i = 0; i < motor_count; i++) {
+            char name = smotors[i]->name;
+            if(name >= 'a' && name <= 'z') {
+                name = name - 'a' + 'A';
+            }
+            if(name == _axis_letters[a]) {
+                _axis_motors[a] = smotors[i];
+            }
+        }
+    }
+    _distance_per_mm = distance_per_mm;
+    _sync_position();
+
+    _relative = false;
+    _feed = 0;
+    _motion_mode = 0;
+
+    _line_reset();
+    _line_ready = false;
+    _letter = 0;
+    _skip = GCODE_SKIP_NONE;
+    _dwell_started = false;
+    _home_started = false;
+    _error = GCODE_ERROR_NONE;
+    _line_count = 0;
+}
+
+/**
+ * Передать интерпретатору следующий символ G-кода.
+ *
+ * @return
+ *     true - символ принят
+ *     false - предыдущая строка еще ждет выполнения, символ не принят
+ */
+bool stepper_gcode_put(char c) {
+    if(_line_ready) {
+        return false;
+    }
+
+    if(c == '\n' || c == '\r') {
+        // конец строки
+        _end_word();
+        _skip = GCODE_SKIP_NONE;
+        if(_line.not_empty || _line.error != GCODE_ERROR_NONE) {
+            _line_ready = true;
+            stepper_gcode_run();
+        } else {
+            _line_reset();
+        }
+        return true;
+    }
+
+    if(_skip != GCODE_SKIP_NONE) {
+        if(_skip == GCODE_SKIP_PAREN && c == ')') {
+            _skip = GCODE_SKIP_NONE;
+        }
+        return true;
+    }
+
+    if(c >= 'a' && c <= 'z') {
+        c = c - 'a' + 'A';
+    }
+
+    if(c >= 'A' && c <= 'Z') {
+        // новое слово
+        _end_word();
+        _letter = c;
+        _number = 0;
+        _frac_digits = -1;
+        _negative = false;
+        _has_sign = false;
+        _has_digits = false;
+    } else if(c >= '0' && c <= '9') {
+        if(_letter == 0) {
+            _line_fail(GCODE_ERROR_SYNTAX);
+        } else if(_frac_digits < 0) {
+            if(_number >= GCODE_NUMBER_MAX) {
+                // слишком большое число
+                _line_fail(GCODE_ERROR_SYNTAX);
+            } else {
+                _number = _number * 10 + (c - '0');
+            }
+            _has_digits = true;
+        } else {
+            // знаки после 6-го отбрасываем
+            if(_frac_digits < 6) {
+                _number = _number * 10 + (c - '0');
+                _frac_digits++;
+            }
+            _has_digits = true;
+        }
+    } else if(c == '.') {
+        if(_letter == 0 || _frac_digits >= 0) {
+            _line_fail(GCODE_ERROR_SYNTAX);
+        } else {
+            _frac_digits = 0;
+        }
+    } else if(c == '-' || c == '+') {
+        if(_letter == 0 || _has_sign || _has_digits || _frac_digits >= 0) {
+            _line_fail(GCODE_ERROR_SYNTAX);
+        } else {
+            _has_sign = true;
+            _negative = c == '-';
+        }
+    } else if(c == '(') {
+        _end_word();
+        _skip = GCODE_SKIP_PAREN;
+    } else if(c == ';' || c == '*') {
+        // комментарий или контрольная сумма - до конца строки
+        _end_word();
+        _skip = GCODE_SKIP_EOL;
+    } else if(c == ' ' || c == '\t' || c == '%') {
+        // пробелы внутри слов допустимы, % - начало и конец программы
+    } else {
+        _line_fail(GCODE_ERROR_SYNTAX);
+    }
+    return true;
+}
+
+/**
+ * Передать интерпретатору строку G-кода (или несколько строк) целиком.
+ *
+ * @return количество принятых символов
+ */
+int stepper_gcode_puts(const char* str) {
+    int count = 0;
+    while(str[count] != 0 && stepper_gcode_put(str[count])) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Выполнить строку G-кода, которая ждет выполнения, если моторы готовы.
+ * Вызывать в главном цикле loop как можно чаще.
+ *
+ * @return
+ *     true - строка выполнена, можно передавать следующую
+ *     false - строка еще ждет выполнения или строки нет
+ */
+bool stepper_gcode_run() {
+    if(!_line_ready) {
+        return false;
+    }
+    if(_line.error == GCODE_ERROR_NONE && !_execute()) {
+        return false;
+    }
+
+    _error = _line.error;
+    _line_count++;
+    _line_reset();
+    _line_ready = false;
+    return true;
+}
+
+/**
+ * Интерпретатор готов принять следующий символ.
+ */
+bool stepper_gcode_ready() {
+    return !_line_ready;
+}
+
+/**
+ * Ошибка последней выполненной строки G-кода.
+ */
+stepper_gcode_error_t stepper_gcode_error() {
+    return _error;
+}
+
+/**
+ * Количество строк G-кода, выполненных с момента stepper_gcode_init.
+ */
+unsigned long stepper_gcode_line_count() {
+    return _line_count;
+}
+
@@ -0,0 +1,140 @@
+/**
+ * stepper_gcode.h
+ *
+ * Интерпретатор G-кода поверх prepare_xxx: команды читаются по одному
+ * символу по мере поступления (из последовательного порта или другого
+ * потока), каждая строка сразу превращается в вызовы prepare_xxx
+ * и запуск цикла. Память выделяется только статически: нет буфера
+ * строки и кучи, состояние разбора - несколько переменных.
+ *
+ * Поддерживаются команды:
+ *   G0 - перемещение на максимальной скорости (prepare_line)
+ *   G1 - перемещение по прямой со скоростью F (prepare_line)
+ *   G2, G3 - дуга по часовой/против часовой стрелки в плоскости XY
+ *       с центром I, J (prepare_arc; с Z - винтовая линия, prepare_helix)
+ *   G4 - пауза P миллисекунд или S секунд
+ *   G28 - выход в начальную позицию по концевым датчикам min (по одной оси)
+ *   G92 - задать текущую позицию
+ *   G90, G91 - абсолютные и относительные координаты
+ *   G17, G21 - плоскость XY и миллиметры (единственные поддерживаемые)
+ *   F - скорость подачи, мм/мин
+ * Комментарии в скобках и после ';', номера строк N и контрольные суммы
+ * после '*' пропускаются.
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#ifndef STEPPER_GCODE_H
+#define STEPPER_GCODE_H
+
+#include "stepper.h"
+
+/**
+ * Ошибки выполнения строки G-кода
+ */
+typedef enum {
+    /** Ошибок нет */
+    GCODE_ERROR_NONE = 0,
+
+    /** Строку не удалось разобрать: неожиданный символ, число без цифр и т.п. */
+    GCODE_ERROR_SYNTAX,
+
+    /** Команда или параметр не поддерживаются */
+    GCODE_ERROR_UNSUPPORTED,
+
+    /** В команде есть ось, для которой не задан мотор */
+    GCODE_ERROR_NO_MOTOR,
+
+    /**
+     * Дугу не удалось подготовить: не задан центр или линейная
+     * ось винтовой линии не успевает за дугой (prepare_helix)
+     */
+    GCODE_ERROR_ARC,
+
+    /** Цикл не запустился (см. stepper_cycle_error и ошибки моторов) */
+    GCODE_ERROR_CYCLE
+} stepper_gcode_error_t;
+
+/**
+ * Задать моторы интерпретатора и сбросить его состояние.
+ *
+ * Оси G-кода (X, Y, Z, A, B, C) сопоставляются моторам по имени мотора
+ * (init_stepper, имя 'x' или 'X' - ось X). Координаты G-кода в миллиметрах
+ * переводятся в шаги по distance_per_step моторов, для этого нужно знать,
+ * сколько единиц distance_per_step в миллиметре.
+ *
+ * Пример: distance_per_step моторов в нанометрах
+ *   static stepper* gcode_motors[] = {&sm_x, &sm_y, &sm_z};
+ *   stepper_gcode_init(3, gcode_motors, 1000000);
+ *
+ *   void loop() {
+ *       while(Serial.available() && stepper_gcode_ready()) {
+ *           stepper_gcode_put(Serial.read());
+ *       }
+ *       stepper_gcode_run();
+ *   }
+ *
+ * @param motor_count - количество моторов
+ * @param smotors - моторы
+ * @param distance_per_mm - количество единиц distance_per_step моторов в миллиметре
+ */
+void stepper_gcode_init(int motor_count, stepper** smotors, unsigned long distance_per_mm);
+
+/**
+ * Передать интерпретатору следующий символ G-кода. Конец строки ('\n' или '\r')
+ * запускает выполнение строки (stepper_gcode_run).
+ *
+ * @return
+ *     true - символ принят
+ *     false - предыдущая строка еще ждет выполнения, символ не принят
+ *         (передать его снова после stepper_gcode_run)
+ */
+bool stepper_gcode_put(char c);
+
+/**
+ * Передать интерпретатору строку G-кода (или несколько строк) целиком.
+ *
+ * @return количество принятых символов (меньше длины строки, если
+ *     очередная строка G-кода ждет выполнения)
+ */
+int stepper_gcode_puts(const char* str);
+
+/**
+ * Выполнить строку G-кода, которая ждет выполнения, если моторы
+ * готовы: движение готовится, пока выполняется предыдущее (если программ
+ * цикла две, STEPPER_CYCLE_PROGRAMS), и запускается сразу после него;
+ * паузы, выход в начальную позицию и G92 ждут остановки моторов.
+ * Вызывать в главном цикле loop как можно чаще.
+ *
+ * @return
+ *     true - строка выполнена (движение запущено или поставлено
+ *         в очередь), можно передавать следующую
+ *     false - строка еще ждет выполнения или строки нет
+ */
+bool stepper_gcode_run();
+
+/**
+ * Интерпретатор готов принять следующий символ: никакая строка
+ * не ждет выполнения.
+ */
+bool stepper_gcode_ready();
+
+/**
+ * Ошибка последней выполненной строки G-кода (строка с ошибкой
+ * пропускается, интерпретатор продолжает со следующей).
+ *
+ * @return ошибка из перечисления stepper_gcode_error_t
+ */
+stepper_gcode_error_t stepper_gcode_error();
+
+/**
+ * Количество строк G-кода, выполненных с момента stepper_gcode_init
+ * (включая строки с ошибками, пустые строки не считаются), - например,
+ * чтобы отвечать "ok" на каждую строку.
+ */
+unsigned long stepper_gcode_line_count();
+
+#endif // STEPPER_GCODE_H
+
@@ -8,6 +8,158 @@
 // maximun number of stepper motors
 #define MAX_STEPPERS 6
 
+// количество отрезков в буфере планировщика (stepper_planner.h)
+// number of line segments in the planner buffer (stepper_planner.h)
+#define STEPPER_PLANNER_BUFFER_SIZE 8
+
+// количество движений в очереди для запуска без остановки таймера
+// (stepper_queue_line; на AVR движение занимает около 80 байт)
+// number of moves in the queue to run without stopping the timer
+// (stepper_queue_line; a move takes about 80 bytes on AVR)
+#ifdef ARDUINO_ARCH_AVR
+#define STEPPER_MOVE_QUEUE_SIZE 8
+#else
+#define STEPPER_MOVE_QUEUE_SIZE 16
+#endif
+
+// количество программ цикла: 2 - следующий цикл можно готовить (prepare_xxx),
+// пока выполняется текущий, 1 - только после завершения текущего
+// (по программе на каждый мотор уходит около 100 байт, на AVR это много)
+// number of cycle programs: 2 - prepare the next cycle while the current
+// one runs, 1 - only after the current cycle is finished
+// (a program takes about 100 bytes per motor, that's a lot on AVR)
+#ifdef ARDUINO_ARCH_AVR
+#define STEPPER_CYCLE_PROGRAMS 1
+#else
+#define STEPPER_CYCLE_PROGRAMS 2
+#endif
+
+// протокол stepper_proto.h: количество буферов для принятых кадров
+// (окно: сколько кадров можно отправить, не дожидаясь подтверждения)
+// и наибольший размер данных кадра, байт (не больше 255)
+// binary protocol stepper_proto.h: number of received frame buffers
+// (window: frames to send without waiting for ack) and max frame
+// payload size, bytes (255 max)
+#ifdef ARDUINO_ARCH_AVR
+#define STEPPER_PROTO_FRAMES 2
+#define STEPPER_PROTO_FRAME_SIZE 64
+#else
+#define STEPPER_PROTO_FRAMES 4
+#define STEPPER_PROTO_FRAME_SIZE 240
+#endif
+
+// возможности обработчика прерывания таймера: 0 - выключить (код
+// выключенной возможности не попадает в сборку, обработчик короче
+// и быстрее; время тика для разных наборов - test/stepper_bench.cpp)
+// timer ISR features: 0 - leave out of the build (shorter and faster
+// ISR; tick time for feature sets - test/stepper_bench.cpp)
+//
+// Время тика на хосте (test/stepper_bench.cpp: 6 моторов, период 20мкс,
+// лучший из 5 прогонов, разброс между запусками около 10%), нс:
+//                          линия (prepare_line)   серии (prepare_steps)
+//   все возможности        49-59                  88-99
+//   без одной (_no_XXX)    50-68                  83-106
+//   без всех (_min)        47-50                  59-67
+// Сборка без возможностей быстрее в 1.5 раза на сериях шагов и в 1.1
+// раза на линии, а не в 2: выключенный код работает только на тиках
+// с шагом мотора, а большую часть тика занимает то, что есть в любой
+// сборке, - цикл по моторам с отсчетом step_timer и проверками счетчиков
+// и у группы prepare_line - алгоритм Брезенхэма ведомых моторов.
+// Каждая возможность по отдельности стоит меньше разброса замера,
+// выигрыш заметен, только когда выключены все. Холостые тики убирает
+// режим "по событию" (stepper_set_timer_event_driven).
+// Host tick time, ns (line / steps): full 49-59 / 88-99, one feature off
+// 50-68 / 83-106, all off 47-50 / 59-67. The stripped build is about 1.5x
+// faster on steps and 1.1x on lines, not 2x: the per-motor countdown loop
+// present in every build dominates; use the event-driven timer mode
+// to skip idle ticks.
+//
+// Флаги меняют поля структуры stepper (profile, pos_t и т.п.), поэтому
+// задавать их нужно здесь, а не для отдельных файлов: если файлы одной
+// сборки видят разные значения, они по-разному понимают раскладку
+// структуры. Если флаг все-таки задан из командной строки компилятора,
+// то одинаково для всех файлов сборки, включая код приложения.
+// The flags change the layout of the public stepper struct: set them
+// in this file, never per translation unit (a command line define must
+// be the same for every file of the build, including application code).
+
+// аппаратные концевые датчики (init_stepper_ends: pin_min, pin_max)
+// hardware end switches
+#ifndef STEPPER_HARD_ENDS
+#define STEPPER_HARD_ENDS 1
+#endif
+
+// виртуальные границы координаты (init_stepper_ends: min_pos, max_pos)
+// virtual coordinate bounds
+#ifndef STEPPER_SOFT_ENDS
+#define STEPPER_SOFT_ENDS 1
+#endif
+
+// режимы калибровки (calibrate_mode в prepare_steps, prepare_whirl)
+// calibration modes
+#ifndef STEPPER_CALIBRATE
+#define STEPPER_CALIBRATE 1
+#endif
+
+// серии с буфером задержек (prepare_simple_buffered_steps, prepare_buffered_steps)
+// buffered step series
+#ifndef STEPPER_BUFFERED_STEPS
+#define STEPPER_BUFFERED_STEPS 1
+#endif
+
+// серии с динамической задержкой (prepare_dynamic_steps, prepare_dynamic_whirl)
+// dynamic step delay series
+#ifndef STEPPER_DYNAMIC_STEPS
+#define STEPPER_DYNAMIC_STEPS 1
+#endif
+
+// замер времени обработчика (stepper_cycle_max_time,
+// CYCLE_ERROR_HANDLER_TIMING_EXCEEDED): два вызова micros() на тик
+// ISR timing (two micros() calls per tick)
+#ifndef STEPPER_ISR_TIMING
+#define STEPPER_ISR_TIMING 1
+#endif
+
+// профиль обработчика прерывания (stepper_profile, stepper_profile_motor):
+// гистограмма времени обработчика, тики по фазам шага, время работы
+// на шагах по моторам; два вызова micros() на тик и еще два на шаг мотора
+// ISR profiling: handler time histogram, ticks by step phase,
+// per-motor step work time
+#ifndef STEPPER_ISR_PROFILE
+#define STEPPER_ISR_PROFILE 0
+#endif
+
+// запись шагов в кольцевой буфер (stepper_trace_init, stepper_trace_read):
+// тик, мотор, направление, ошибки - для разбора на компьютере
+// (test/stepper_trace_decode.cpp), несколько инструкций на шаг
+// step event trace ring buffer (decoded on host by test/stepper_trace_decode.cpp)
+#ifndef STEPPER_TRACE
+#define STEPPER_TRACE 0
+#endif
+
+// концевые датчики на прерываниях по изменению пина: обработчик
+// прерывания вызывает stepper_end_changed, обработчик таймера вместо
+// чтения пинов проверяет биты end_flags (см. stepper_end_changed)
+// end switches on pin change interrupts instead of polling
+#ifndef STEPPER_END_INTERRUPTS
+#define STEPPER_END_INTERRUPTS 0
+#endif
+
+// фильтр помех концевых датчиков (init_stepper_end_filter): выборка
+// на каждом тике для моторов с фильтром, сдвиговый регистр
+// end switch noise filter (shift register sampling every tick)
+#ifndef STEPPER_END_FILTER
+#define STEPPER_END_FILTER 1
+#endif
+
+// 64-битные координаты (current_pos, min_pos, max_pos), 0 - 32-битные
+// (с нанометрами рабочая область +-2.1м; на AVR 64-битная арифметика
+// в обработчике прерывания дорогая)
+// 64-bit coordinates, 0 - 32-bit
+#ifndef STEPPER_POS_64
+#define STEPPER_POS_64 1
+#endif
+
 // включить отладку через последовательный порт
 // enable serial port debug messages
 //#define DEBUG_SERIAL
@@ -0,0 +1,329 @@
+/**
+ * stepper_planner.cpp
+ *
+ * Планировщик движения по ломаной линии: буфер из нескольких
+ * следующих отрезков, скорость в точках стыка отрезков выбирается
+ * по углу между отрезками и ускорениям моторов, так что инструмент
+ * проходит промежуточные точки без остановки.
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#include "math.h"
+
+#include "stepper.h"
+#include "stepper_planner.h"
+
+#include "stepper_lib_config.h"
+
+/**
+ * Отрезок в буфере планировщика.
+ *
+ * Длины, скорости и ускорения - вдоль отрезка, в единицах
+ * distance_per_step моторов (в секунду, в секунду за секунду).
+ */
+typedef struct {
+    /** Количество шагов для каждого мотора */
+    long step_counts[MAX_STEPPERS];
+
+    /** Задержка между шагами ведущего мотора на крейсерской скорости, микросекунды */
+    unsigned long step_delay;
+
+    /** Количество шагов ведущего мотора (с максимальным количеством шагов) */
+    unsigned long lead_count;
+
+    /** Длина отрезка */
+    double length;
+
+    /** Ускорение вдоль отрезка (0 - ускорение не задано ни для одного мотора) */
+    double accel;
+
+    /** Крейсерская скорость */
+    double nominal_speed;
+
+    /**
+     * Максимальная скорость в начале отрезка: ограничение по углу
+     * в точке стыка с предыдущим отрезком
+     */
+    double max_entry_speed;
+
+    /** Скорость в начале отрезка по результатам планирования */
+    double entry_speed;
+} planner_block_t;
+
+/** Моторы планировщика */
+static int _motor_count = 0;
+static stepper* _motors[MAX_STEPPERS];
+
+/** Допустимое отклонение от вершины угла в точке стыка отрезков */
+static double _junction_deviation = 0;
+
+/** Буфер отрезков: кольцо, _block_head - следующий на выполнение */
+static planner_block_t _blocks[STEPPER_PLANNER_BUFFER_SIZE];
+static int _block_head = 0;
+static int _block_count = 0;
+
+/** Единичный вектор направления последнего добавленного отрезка */
+static double _prev_unit[MAX_STEPPERS];
+
+/** Планировщик запускал отрезок на выполнение (для проверки ошибок моторов) */
+static bool _block_started = false;
+
+static inline int _block_index(int n) {
+    return (_block_head + n) % STEPPER_PLANNER_BUFFER_SIZE;
+}
+
+/**
+ * Наибольшая скорость, до которой можно разогнаться (или с которой
+ * можно затормозить) со скорости speed на отрезке block.
+ */
+static inline double _reachable_speed(planner_block_t* block, double speed) {
+    return sqrt(speed * speed + 2 * block->accel * block->length);
+}
+
+/**
+ * Пересчитать скорости в начале отрезков буфера.
+ *
+ * Проход с конца: последний отрезок заканчивается остановкой, каждый
+ * отрезок должен успеть затормозить до скорости в начале следующего.
+ * Проход с начала: каждый отрезок должен успеть разогнаться до скорости
+ * в начале следующего.
+ *
+ * Скорость в начале первого отрезка в буфере уже зафиксирована
+ * (с ней закончит предыдущий, уже запущенный отрезок).
+ */
+static void _recalculate() {
+    double exit_speed = 0;
+    for(int n = _block_count - 1; n >= 0; n--) {
+        planner_block_t* block = &_blocks[_block_index(n)];
+        double entry_speed = _reachable_speed(block, exit_speed);
+        block->entry_speed = entry_speed < block->max_entry_speed ? entry_speed : block->max_entry_speed;
+        exit_speed = block->entry_speed;
+    }
+
+    for(int n = 0; n < _block_count - 1; n++) {
+        planner_block_t* block = &_blocks[_block_index(n)];
+        planner_block_t* next = &_blocks[_block_index(n + 1)];
+        double exit_speed = _reachable_speed(block, block->entry_speed);
+        if(exit_speed < next->entry_speed) {
+            next->entry_speed = exit_speed;
+        }
+    }
+}
+
+/**
+ * Задержка между шагами ведущего мотора отрезка при скорости speed
+ * вдоль отрезка, микросекунды (0 - остановка).
+ */
+static unsigned long _lead_step_delay(planner_block_t* block, double speed) {
+    double lead_speed = speed * block->lead_count / block->length;
+    return lead_speed >= 1 ? (unsigned long)(1000000.0 / lead_speed) : 0;
+}
+
+/**
+ * Задать моторы, которыми управляет планировщик, и очистить буфер отрезков.
+ *
+ * @param motor_count - количество моторов
+ * @param smotors - моторы
+ * @param junction_deviation - допустимое отклонение от вершины угла в точке
+ *     стыка отрезков, в единицах distance_per_step моторов
+ */
+void stepper_planner_init(int motor_count, stepper** smotors, unsigned long junction_deviation) {
+    _motor_count = motor_count < MAX_STEPPERS ? motor_count : MAX_STEPPERS;
+    for(int i = 0; i < _motor_count; i++) {
+        _motors[i] = smotors[i];
+    }
+    _junction_deviation = junction_deviation;
+
+    _block_head = 0;
+    _block_count = 0;
+    _block_started = false;
+}
+
+/**
+ * Добавить отрезок в конец буфера и пересчитать скорости в точках стыка
+ * всех отрезков в буфере.
+ *
+ * @param step_counts - количество шагов для каждого мотора (в порядке
+ *     stepper_planner_init), знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами ведущего мотора на крейсерской
+ *     скорости, микросекунды (0 для максимальной скорости)
+ * @return
+ *     true - отрезок добавлен
+ *     false - буфер заполнен, отрезок не добавлен
+ */
+bool stepper_planner_add_line(long* step_counts, unsigned long step_delay) {
+    if(_block_count >= STEPPER_PLANNER_BUFFER_SIZE) {
+        return false;
+    }
+
+    planner_block_t* block = &_blocks[_block_index(_block_count)];
+
+    // длина отрезка, ведущий мотор и максимальная скорость
+    // (как в prepare_line)
+    double length2 = 0;
+    unsigned long max_step_delay = 0;
+    block->lead_count = 0;
+    for(int i = 0; i < _motor_count; i++) {
+        block->step_counts[i] = step_counts[i];
+
+        unsigned long count = step_counts[i] > 0 ? step_counts[i] : -step_counts[i];
+        double dist = (double)count * _motors[i]->distance_per_step;
+        length2 += dist * dist;
+
+        if(count > block->lead_count) {
+            block->lead_count = count;
+        }
+        if(_motors[i]->step_delay > max_step_delay) {
+            max_step_delay = _motors[i]->step_delay;
+        }
+    }
+    if(block->lead_count == 0) {
+        // двигаться некуда
+        return true;
+    }
+    block->length = sqrt(length2);
+    block->step_delay = step_delay;
+    if(step_delay == 0) {
+        step_delay = max_step_delay;
+    }
+    block->nominal_speed = 1000000.0 / step_delay * block->length / block->lead_count;
+
+    // ускорение вдоль отрезка: ни один мотор не должен
+    // разгоняться быстрее своего max_accel (как в prepare_accel_line)
+    block->accel = 0;
+    for(int i = 0; i < _motor_count; i++) {
+        unsigned long count = step_counts[i] > 0 ? step_counts[i] : -step_counts[i];
+        if(count > 0 && _motors[i]->max_accel > 0) {
+            double motor_accel = (double)_motors[i]->max_accel * block->length / count;
+            if(block->accel == 0 || motor_accel < block->accel) {
+                block->accel = motor_accel;
+            }
+        }
+    }
+
+    // скорость в точке стыка с предыдущим отрезком
+    // (cos_theta - косинус угла между направлениями отрезков)
+    double cos_theta = 0;
+    double unit[MAX_STEPPERS];
+    for(int i = 0; i < _motor_count; i++) {
+        unit[i] = (double)step_counts[i] * _motors[i]->distance_per_step / block->length;
+        cos_theta += unit[i] * _prev_unit[i];
+        _prev_unit[i] = unit[i];
+    }
+
+    block->max_entry_speed = 0;
+    planner_block_t* prev = _block_count > 0 ? &_blocks[_block_index(_block_count - 1)] : NULL;
+    if(prev != NULL && prev->accel > 0 && block->accel > 0 && cos_theta > -0.999999) {
+        // предыдущий отрезок еще в буфере и оба отрезка с разгоном;
+        // на развороте назад - остановка
+        double max_speed = prev->nominal_speed < block->nominal_speed ?
+            prev->nominal_speed : block->nominal_speed;
+
+        if(cos_theta < 0.999999) {
+            // проходим угол по дуге, касающейся обоих отрезков, с максимальным
+            // (центростремительным) ускорением; дуга отклоняется от вершины угла
+            // на junction_deviation: v^2 = a * d * sin(alpha/2) / (1 - sin(alpha/2)),
+            // alpha - угол при вершине (180 градусов - прямо, 0 - разворот)
+            double accel = prev->accel < block->accel ? prev->accel : block->accel;
+            double sin_half_alpha = sqrt(0.5 * (1 + cos_theta));
+            double junction_speed = sqrt(accel * _junction_deviation *
+                sin_half_alpha / (1 - sin_half_alpha));
+            if(junction_speed < max_speed) {
+                max_speed = junction_speed;
+            }
+        }
+        block->max_entry_speed = max_speed;
+    }
+
+    _block_count++;
+    _recalculate();
+
+    return true;
+}
+
+/**
+ * Передать следующий отрезок из буфера в очередь движений (stepper_queue_line),
+ * чтобы он запустился сразу после текущего без остановки таймера, и запустить
+ * цикл, если он не запущен. Вызывать в главном цикле loop как можно чаще.
+ *
+ * В очереди движений держим не больше одного отрезка: скорости отрезков
+ * в очереди уже не пересчитываются, а отрезки в буфере планировщика
+ * еще могут ускориться, если за ними добавят новые.
+ *
+ * Если предыдущий отрезок завершился с ошибкой (например, сработал
+ * концевой датчик), моторы стоят, а следующий отрезок рассчитан на старт
+ * с ходу - буфер очищается, ломаная не продолжается.
+ *
+ * @return
+ *     true - отрезок передан на выполнение
+ *     false - следующий отрезок уже ждет в очереди движений или буфер пуст
+ */
+bool stepper_planner_run() {
+    if(!stepper_cycle_running()) {
+        if(stepper_queue_count() > 0) {
+            // цикл успел завершиться раньше, чем отрезок попал в очередь
+            stepper_start_cycle();
+            return false;
+        }
+
+        if(_block_started) {
+            _block_started = false;
+            for(int i = 0; i < _motor_count; i++) {
+                if(_motors[i]->error != STEPPER_ERROR_NONE) {
+                    _block_count = 0;
+                }
+            }
+        }
+    } else if(stepper_queue_count() > 0) {
+        return false;
+    }
+
+    if(_block_count == 0) {
+        return false;
+    }
+
+    planner_block_t* block = &_blocks[_block_head];
+    planner_block_t* next = _block_count > 1 ? &_blocks[_block_index(1)] : NULL;
+
+    // скорость в начале следующего отрезка больше не меняется:
+    // с ней закончит этот отрезок
+    double exit_speed = 0;
+    if(next != NULL) {
+        exit_speed = next->entry_speed;
+        next->max_entry_speed = next->entry_speed;
+    }
+
+    if(!stepper_queue_line(_motor_count, _motors, block->step_counts, block->step_delay,
+            _lead_step_delay(block, block->entry_speed), _lead_step_delay(block, exit_speed))) {
+        // отрезок не запустится с текущими настройками таймера
+        _block_count = 0;
+        return false;
+    }
+
+    _block_head = _block_index(1);
+    _block_count--;
+    _block_started = true;
+
+    if(!stepper_cycle_running()) {
+        stepper_start_cycle();
+    }
+
+    return true;
+}
+
+/**
+ * Количество отрезков в буфере, ожидающих выполнения.
+ */
+int stepper_planner_queued() {
+    return _block_count;
+}
+
+/**
+ * Буфер отрезков заполнен.
+ */
+bool stepper_planner_full() {
+    return _block_count >= STEPPER_PLANNER_BUFFER_SIZE;
+}
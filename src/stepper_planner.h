@@ -0,0 +1,83 @@
+/**
+ * stepper_planner.h
+ *
+ * Планировщик движения по ломаной линии: буфер из нескольких
+ * следующих отрезков, скорость в точках стыка отрезков выбирается
+ * по углу между отрезками и ускорениям моторов, так что инструмент
+ * проходит промежуточные точки без остановки.
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#ifndef STEPPER_PLANNER_H
+#define STEPPER_PLANNER_H
+
+#include "stepper.h"
+
+/**
+ * Задать моторы, которыми управляет планировщик, и очистить буфер отрезков.
+ *
+ * Каждый отрезок в буфере - движение всех моторов планировщика
+ * по прямой линии (prepare_accel_line), моторы должны быть настроены
+ * заранее (init_stepper, init_stepper_ends, init_stepper_accel).
+ *
+ * Допустимое отклонение junction_deviation задает, насколько сильно
+ * можно "срезать угол" в точке стыка: скорость в стыке выбирается так,
+ * чтобы инструмент, двигаясь с максимальным ускорением по дуге,
+ * касающейся обоих отрезков, отклонился от вершины угла не дальше,
+ * чем на junction_deviation. Чем острее угол, тем ниже скорость,
+ * на разворот на 180 градусов - остановка, на прямой - без ограничения.
+ *
+ * Пример: 3 мотора, отклонение 0.05мм (при distance_per_step в нанометрах):
+ *   static stepper* planner_motors[] = {&sm_x, &sm_y, &sm_z};
+ *   stepper_planner_init(3, planner_motors, 50000);
+ *
+ * @param motor_count - количество моторов
+ * @param smotors - моторы
+ * @param junction_deviation - допустимое отклонение от вершины угла в точке
+ *     стыка отрезков, в единицах distance_per_step моторов
+ */
+void stepper_planner_init(int motor_count, stepper** smotors, unsigned long junction_deviation);
+
+/**
+ * Добавить отрезок в конец буфера и пересчитать скорости в точках стыка
+ * всех отрезков в буфере (проход с конца буфера и проход с начала).
+ *
+ * Последний отрезок в буфере всегда заканчивается остановкой, поэтому
+ * чем раньше добавлен следующий отрезок, тем меньше придется тормозить.
+ *
+ * @param step_counts - количество шагов для каждого мотора (в порядке
+ *     stepper_planner_init), знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами ведущего мотора на крейсерской
+ *     скорости, микросекунды (0 для максимальной скорости)
+ * @return
+ *     true - отрезок добавлен
+ *     false - буфер заполнен, отрезок не добавлен
+ */
+bool stepper_planner_add_line(long* step_counts, unsigned long step_delay=0);
+
+/**
+ * Передать следующий отрезок из буфера в очередь движений (stepper_queue_line),
+ * чтобы он запустился сразу после текущего без остановки таймера, и запустить
+ * цикл, если он не запущен. Вызывать в главном цикле loop как можно чаще.
+ *
+ * @return
+ *     true - отрезок передан на выполнение
+ *     false - следующий отрезок уже ждет в очереди движений или буфер пуст
+ */
+bool stepper_planner_run();
+
+/**
+ * Количество отрезков в буфере, ожидающих выполнения.
+ */
+int stepper_planner_queued();
+
+/**
+ * Буфер отрезков заполнен.
+ */
+bool stepper_planner_full();
+
+#endif // STEPPER_PLANNER_H
+
@@ -0,0 +1,469 @@
+/**
+ * stepper_proto.cpp
+ *
+ * Компактный двоичный протокол команд движения: кадры с пачками отрезков,
+ * подтверждение кадров с окном. Отрезки из принятого кадра сразу
+ * передаются в очередь движений (stepper_queue_line).
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#include "stepper.h"
+#include "stepper_proto.h"
+
+#include "stepper_lib_config.h"
+
+/** Наибольшее количество осей в отрезке (биты флагов) */
+#define PROTO_AXES 6
+
+/**
+ * Буфер принятого кадра.
+ */
+typedef struct {
+    unsigned char len;
+    unsigned char seq;
+    unsigned char type;
+    unsigned char payload[STEPPER_PROTO_FRAME_SIZE];
+
+    /** Начало следующего отрезка, который еще не в очереди движений */
+    unsigned char pos;
+
+    /** Задержка предыдущего отрезка кадра */
+    unsigned long step_delay;
+} proto_slot_t;
+
+/** Моторы протокола */
+static int _motor_count = 0;
+static stepper* _motors[PROTO_AXES];
+
+/** Отправка кадров хосту */
+static stepper_proto_reply_t _reply = NULL;
+static void* _reply_context = NULL;
+
+/**
+ * Буферы кадров: кольцо, _slot_head - кадр, отрезки которого передаются
+ * в очередь движений, за ним еще _slot_count-1 принятых кадров.
+ */
+static proto_slot_t _slots[STEPPER_PROTO_FRAMES];
+static int _slot_head = 0;
+static int _slot_count = 0;
+
+/** Состояние приема кадра */
+#define PROTO_RX_SYNC 0
+#define PROTO_RX_LEN 1
+#define PROTO_RX_SEQ 2
+#define PROTO_RX_TYPE 3
+#define PROTO_RX_PAYLOAD 4
+#define PROTO_RX_CRC 5
+static unsigned char _rx_state = PROTO_RX_SYNC;
+static proto_slot_t* _rx_slot = NULL;
+static unsigned char _rx_pos = 0;
+static unsigned char _rx_crc = 0;
+
+/** Номер следующего ожидаемого кадра и последнего принятого */
+static unsigned char _expected_seq = 0;
+static unsigned char _last_seq = 0xFF;
+
+static stepper_proto_error_t _error = PROTO_ERROR_NONE;
+
+/**
+ * CRC-8 (полином 0x07) одного байта.
+ */
+static inline unsigned char _crc8_byte(unsigned char crc, unsigned char b) {
+    crc ^= b;
+    for(int i = 0; i < 8; i++) {
+        crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+/**
+ * CRC-8 (полином 0x07) блока данных.
+ */
+unsigned char stepper_proto_crc8(const unsigned char* data, int size, unsigned char crc) {
+    for(int i = 0; i < size; i++) {
+        crc = _crc8_byte(crc, data[i]);
+    }
+    return crc;
+}
+
+/**
+ * Отправить хосту кадр ACK или NAK.
+ */
+static void _send_reply(unsigned char type) {
+    if(_reply == NULL) {
+        return;
+    }
+    unsigned char data[STEPPER_PROTO_FRAME_OVERHEAD + 2];
+    data[0] = STEPPER_PROTO_SYNC;
+    data[2] = 0;
+    data[3] = type;
+    if(type == STEPPER_PROTO_ACK) {
+        data[1] = 2;
+        data[4] = _last_seq;
+        data[5] = STEPPER_PROTO_FRAMES - _slot_count;
+    } else {
+        data[1] = 1;
+        data[4] = _expected_seq;
+    }
+    int size = 4 + data[1];
+    data[size] = stepper_proto_crc8(data + 1, size - 1);
+    _reply(data, size + 1, _reply_context);
+}
+
+/**
+ * Кадр принят целиком.
+ */
+static void _frame_received(bool crc_ok) {
+    if(!crc_ok) {
+        _error = PROTO_ERROR_CRC;
+        _send_reply(STEPPER_PROTO_NAK);
+        return;
+    }
+
+    if(_rx_slot->type == STEPPER_PROTO_RESET) {
+        // новая сессия: невыполненные кадры больше не нужны
+        _slot_head = 0;
+        _slot_count = 0;
+        _last_seq = _rx_slot->seq;
+        _expected_seq = _rx_slot->seq + 1;
+        _send_reply(STEPPER_PROTO_ACK);
+        return;
+    }
+    if(_rx_slot->type != STEPPER_PROTO_SEGMENTS) {
+        return;
+    }
+
+    if(_rx_slot->seq != _expected_seq) {
+        if((unsigned char)(_expected_seq - _rx_slot->seq - 1) < 128) {
+            // повтор уже принятого кадра (потерялся ACK) - подтвердим еще раз
+            _send_reply(STEPPER_PROTO_ACK);
+        } else {
+            // пропущен кадр - пусть хост повторит с ожидаемого
+            _error = PROTO_ERROR_SEQUENCE;
+            _send_reply(STEPPER_PROTO_NAK);
+        }
+        return;
+    }
+
+    _rx_slot->pos = 0;
+    _rx_slot->step_delay = 0;
+    _slot_count++;
+    _last_seq = _expected_seq;
+    _expected_seq++;
+    _send_reply(STEPPER_PROTO_ACK);
+}
+
+/**
+ * Прочитать varint (беззнаковое LEB128) из кадра.
+ * @return false - кадр закончился раньше числа
+ */
+static bool _read_varint(const proto_slot_t* slot, unsigned char* pos, unsigned long* value) {
+    unsigned long v = 0;
+    for(int shift = 0; shift < 35; shift += 7) {
+        if(*pos >= slot->len) {
+            return false;
+        }
+        unsigned char b = slot->payload[(*pos)++];
+        v |= (unsigned long)(b & 0x7F) << shift;
+        if((b & 0x80) == 0) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Разобрать следующий отрезок кадра и передать его в очередь движений.
+ * @return false - отрезок не разбирается
+ */
+static bool _next_segment(proto_slot_t* slot) {
+    unsigned char pos = slot->pos;
+    unsigned char flags = slot->payload[pos++];
+
+    unsigned long step_delay = slot->step_delay;
+    unsigned long entry_delay = 0;
+    unsigned long exit_delay = 0;
+    if(flags & STEPPER_PROTO_DELAY) {
+        if(!_read_varint(slot, &pos, &step_delay)) {
+            return false;
+        }
+    }
+    if(flags & STEPPER_PROTO_ENTRY_EXIT) {
+        if(!_read_varint(slot, &pos, &entry_delay) || !_read_varint(slot, &pos, &exit_delay)) {
+            return false;
+        }
+    }
+
+    int count = 0;
+    stepper* smotors[PROTO_AXES];
+    long step_counts[PROTO_AXES];
+    for(int a = 0; a < PROTO_AXES; a++) {
+        if(flags & (1 << a)) {
+            unsigned long zigzag;
+            if(a >= _motor_count || !_read_varint(slot, &pos, &zigzag)) {
+                return false;
+            }
+            smotors[count] = _motors[a];
+            step_counts[count] = (long)(zigzag >> 1) ^ -(long)(zigzag & 1);
+            count++;
+        }
+    }
+
+    slot->pos = pos;
+    slot->step_delay = step_delay;
+    if(count > 0 && !stepper_queue_line(count, smotors, step_counts, step_delay, entry_delay, exit_delay)) {
+        _error = PROTO_ERROR_MOTION;
+    }
+    return true;
+}
+
+/**
+ * Задать моторы, которыми управляют кадры протокола, и сбросить состояние
+ * приема.
+ *
+ * @param motor_count - количество моторов (не больше 6)
+ * @param smotors - моторы
+ * @param reply - отправка кадров ACK и NAK хосту
+ * @param context - контекст для reply
+ */
+void stepper_proto_init(int motor_count, stepper** smotors, stepper_proto_reply_t reply, void* context) {
+    _motor_count = motor_count < PROTO_AXES ? motor_count : PROTO_AXES;
+    for(int i = 0; i < _motor_count; i++) {
+        _motors[i] = smotors[i];
+    }
+    _reply = reply;
+    _reply_context = context;
+
+    _slot_head = 0;
+    _slot_count = 0;
+    _rx_state = PROTO_RX_SYNC;
+    _expected_seq = 0;
+    _last_seq = 0xFF;
+    _error = PROTO_ERROR_NONE;
+}
+
+/**
+ * Передать следующий принятый байт.
+ *
+ * @return
+ *     true - байт принят
+ *     false - все буферы кадров заняты, байт не принят
+ */
+bool stepper_proto_put(unsigned char b) {
+    switch(_rx_state) {
+        case PROTO_RX_SYNC:
+            if(b != STEPPER_PROTO_SYNC) {
+                // мусор между кадрами
+                return true;
+            }
+            if(_slot_count >= STEPPER_PROTO_FRAMES) {
+                return false;
+            }
+            _rx_slot = &_slots[(_slot_head + _slot_count) % STEPPER_PROTO_FRAMES];
+            _rx_crc = 0;
+            _rx_state = PROTO_RX_LEN;
+            break;
+        case PROTO_RX_LEN:
+            _rx_crc = _crc8_byte(_rx_crc, b);
+            if(b > STEPPER_PROTO_FRAME_SIZE) {
+                // кадр не поместится, ищем начало следующего
+                _error = PROTO_ERROR_FRAME_SIZE;
+                _rx_state = PROTO_RX_SYNC;
+                _send_reply(STEPPER_PROTO_NAK);
+                break;
+            }
+            _rx_slot->len = b;
+            _rx_state = PROTO_RX_SEQ;
+            break;
+        case PROTO_RX_SEQ:
+            _rx_crc = _crc8_byte(_rx_crc, b);
+            _rx_slot->seq = b;
+            _rx_state = PROTO_RX_TYPE;
+            break;
+        case PROTO_RX_TYPE:
+            _rx_crc = _crc8_byte(_rx_crc, b);
+            _rx_slot->type = b;
+            _rx_pos = 0;
+            _rx_state = _rx_slot->len > 0 ? PROTO_RX_PAYLOAD : PROTO_RX_CRC;
+            break;
+        case PROTO_RX_PAYLOAD:
+            _rx_crc = _crc8_byte(_rx_crc, b);
+            _rx_slot->payload[_rx_pos++] = b;
+            if(_rx_pos == _rx_slot->len) {
+                _rx_state = PROTO_RX_CRC;
+            }
+            break;
+        case PROTO_RX_CRC:
+            _rx_state = PROTO_RX_SYNC;
+            _frame_received(b == _rx_crc);
+            break;
+    }
+    return true;
+}
+
+/**
+ * Есть свободный буфер для следующего кадра или кадр принимается.
+ */
+bool stepper_proto_ready() {
+    return _rx_state != PROTO_RX_SYNC || _slot_count < STEPPER_PROTO_FRAMES;
+}
+
+/**
+ * Передать отрезки из принятых кадров в очередь движений, пока в ней
+ * есть место, и запустить цикл, если он не запущен.
+ *
+ * @return количество отрезков, переданных в очередь
+ */
+int stepper_proto_run() {
+    int queued = 0;
+    while(_slot_count > 0) {
+        proto_slot_t* slot = &_slots[_slot_head];
+        while(slot->pos < slot->len && !stepper_queue_full()) {
+            if(!_next_segment(slot)) {
+                // остаток кадра не разобрать
+                _error = PROTO_ERROR_SEGMENT;
+                slot->pos = slot->len;
+                break;
+            }
+            queued++;
+        }
+        if(slot->pos < slot->len) {
+            // очередь движений заполнена
+            break;
+        }
+
+        // кадр выполнен - буфер свободен
+        _slot_head = (_slot_head + 1) % STEPPER_PROTO_FRAMES;
+        _slot_count--;
+        _send_reply(STEPPER_PROTO_ACK);
+    }
+
+    if(queued > 0 && !stepper_cycle_running()) {
+        stepper_start_cycle();
+    }
+    return queued;
+}
+
+/**
+ * Количество принятых кадров, отрезки которых еще не все в очереди движений.
+ */
+int stepper_proto_pending() {
+    return _slot_count;
+}
+
+/**
+ * Последняя ошибка протокола.
+ */
+stepper_proto_error_t stepper_proto_error() {
+    return _error;
+}
+
+/**
+ * Записать varint в кадр.
+ * @return false - не помещается
+ */
+static bool _write_varint(unsigned char* data, int* size, unsigned long value) {
+    do {
+        if(*size >= 4 + STEPPER_PROTO_FRAME_SIZE) {
+            return false;
+        }
+        unsigned char b = value & 0x7F;
+        value >>= 7;
+        data[(*size)++] = value != 0 ? b | 0x80 : b;
+    } while(value != 0);
+    return true;
+}
+
+/**
+ * Начать кадр с отрезками.
+ */
+void stepper_proto_frame_begin(stepper_proto_frame_t* frame, unsigned char* data, unsigned char seq) {
+    frame->data = data;
+    frame->data[0] = STEPPER_PROTO_SYNC;
+    frame->data[2] = seq;
+    frame->data[3] = STEPPER_PROTO_SEGMENTS;
+    frame->size = 4;
+    frame->step_delay = 0;
+}
+
+/**
+ * Добавить отрезок в кадр.
+ *
+ * @return
+ *     true - отрезок добавлен
+ *     false - отрезок не помещается в кадр (кадр не изменился)
+ */
+bool stepper_proto_frame_add(stepper_proto_frame_t* frame, int motor_count, long* step_counts,
+        unsigned long step_delay, unsigned long entry_delay, unsigned long exit_delay) {
+    int size = frame->size;
+    if(size >= 4 + STEPPER_PROTO_FRAME_SIZE) {
+        return false;
+    }
+
+    unsigned char flags = 0;
+    for(int a = 0; a < motor_count && a < PROTO_AXES; a++) {
+        if(step_counts[a] != 0) {
+            flags |= 1 << a;
+        }
+    }
+    if(step_delay != frame->step_delay) {
+        flags |= STEPPER_PROTO_DELAY;
+    }
+    if(entry_delay != 0 || exit_delay != 0) {
+        flags |= STEPPER_PROTO_ENTRY_EXIT;
+    }
+    frame->data[size++] = flags;
+
+    bool fits = true;
+    if(flags & STEPPER_PROTO_DELAY) {
+        fits = fits && _write_varint(frame->data, &size, step_delay);
+    }
+    if(flags & STEPPER_PROTO_ENTRY_EXIT) {
+        fits = fits && _write_varint(frame->data, &size, entry_delay);
+        fits = fits && _write_varint(frame->data, &size, exit_delay);
+    }
+    for(int a = 0; a < motor_count && a < PROTO_AXES && fits; a++) {
+        if(step_counts[a] != 0) {
+            // zigzag: 0, -1, 1, -2, 2... -> 0, 1, 2, 3, 4...
+            unsigned long zigzag = ((unsigned long)step_counts[a] << 1) ^ (step_counts[a] < 0 ? ~0UL : 0);
+            fits = _write_varint(frame->data, &size, zigzag);
+        }
+    }
+    if(!fits) {
+        return false;
+    }
+
+    frame->size = size;
+    frame->step_delay = step_delay;
+    return true;
+}
+
+/**
+ * Закончить кадр: длина и контрольная сумма.
+ *
+ * @return размер кадра для отправки, байт
+ */
+int stepper_proto_frame_end(stepper_proto_frame_t* frame) {
+    frame->data[1] = frame->size - 4;
+    frame->data[frame->size] = stepper_proto_crc8(frame->data + 1, frame->size - 1);
+    return frame->size + 1;
+}
+
+/**
+ * Собрать служебный кадр без отрезков.
+ *
+ * @return размер кадра, байт
+ */
+int stepper_proto_frame_control(unsigned char* data, unsigned char type, unsigned char seq) {
+    data[0] = STEPPER_PROTO_SYNC;
+    data[1] = 0;
+    data[2] = seq;
+    data[3] = type;
+    data[4] = stepper_proto_crc8(data + 1, 3);
+    return 5;
+}
+
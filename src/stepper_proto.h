@@ -0,0 +1,221 @@
+/**
+ * stepper_proto.h
+ *
+ * Компактный двоичный протокол команд движения: в одном кадре - много
+ * отрезков (шаги по осям в varint, задержка, флаги), подтверждение кадров
+ * с окном (сколько кадров можно отправить, не дожидаясь подтверждения).
+ * Отрезки из принятого кадра сразу передаются в очередь движений
+ * (stepper_queue_line), без промежуточных копий.
+ *
+ * Кадр (в обе стороны):
+ *   0xA5 | len | seq | type | payload[len] | crc8
+ *   len - размер payload (не больше STEPPER_PROTO_FRAME_SIZE),
+ *   seq - номер кадра (по модулю 256),
+ *   crc8 - CRC-8 (полином 0x07) по len, seq, type и payload.
+ *
+ * Кадры хоста:
+ *   STEPPER_PROTO_SEGMENTS - отрезки, payload - отрезки подряд
+ *   STEPPER_PROTO_RESET - начать сессию: следующий ожидаемый кадр seq+1,
+ *       принятые, но не выполненные кадры отбрасываются
+ * Кадры устройства:
+ *   STEPPER_PROTO_ACK - payload: seq последнего принятого кадра, количество
+ *       свободных буферов кадров (кредит: столько кадров можно отправить)
+ *   STEPPER_PROTO_NAK - payload: seq ожидаемого кадра (кадр с ошибкой
+ *       контрольной суммы или не по порядку - отправить снова начиная с него)
+ *
+ * Отрезок:
+ *   flags | [step_delay] | [entry_delay exit_delay] | шаги по осям
+ *   flags: биты 0-5 - оси с ненулевым количеством шагов (моторы в порядке
+ *       stepper_proto_init), бит 6 - задержка задана (иначе - задержка
+ *       предыдущего отрезка кадра, в начале кадра - 0), бит 7 - заданы
+ *       задержки на старте и в конце отрезка (иначе 0)
+ *   задержки - varint (беззнаковое LEB128), микросекунды,
+ *   шаги - zigzag varint для каждой оси из flags по порядку.
+ * Отрезок из 3 осей по ~100 шагов занимает 7 байт вместо ~25 символов G1.
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#ifndef STEPPER_PROTO_H
+#define STEPPER_PROTO_H
+
+#include "stepper.h"
+
+/** Начало кадра */
+#define STEPPER_PROTO_SYNC 0xA5
+
+/** Типы кадров */
+#define STEPPER_PROTO_SEGMENTS 0x01
+#define STEPPER_PROTO_RESET 0x02
+#define STEPPER_PROTO_ACK 0x81
+#define STEPPER_PROTO_NAK 0x82
+
+/** Флаги отрезка */
+#define STEPPER_PROTO_AXES_MASK 0x3F
+#define STEPPER_PROTO_DELAY 0x40
+#define STEPPER_PROTO_ENTRY_EXIT 0x80
+
+/** Наибольший размер кадра со служебными байтами */
+#define STEPPER_PROTO_FRAME_OVERHEAD 5
+
+/**
+ * Ошибки протокола
+ */
+typedef enum {
+    /** Ошибок нет */
+    PROTO_ERROR_NONE = 0,
+
+    /** Не сошлась контрольная сумма кадра */
+    PROTO_ERROR_CRC,
+
+    /** Кадр не по порядку (пропущен предыдущий) */
+    PROTO_ERROR_SEQUENCE,
+
+    /** Кадр длиннее STEPPER_PROTO_FRAME_SIZE */
+    PROTO_ERROR_FRAME_SIZE,
+
+    /** Отрезок не разбирается (обрезан, ось без мотора), остаток кадра пропущен */
+    PROTO_ERROR_SEGMENT,
+
+    /** Очередь движений не приняла отрезок (см. stepper_queue_line) */
+    PROTO_ERROR_MOTION
+} stepper_proto_error_t;
+
+/**
+ * Отправить кадр устройства хосту (например, Serial.write).
+ *
+ * @param data - кадр
+ * @param size - размер кадра
+ * @param context - контекст из stepper_proto_init
+ */
+typedef void (*stepper_proto_reply_t)(const unsigned char* data, int size, void* context);
+
+/**
+ * Кадр, который собирает отправитель отрезков (хост или другое устройство).
+ */
+typedef struct {
+    /** Буфер кадра (не меньше STEPPER_PROTO_FRAME_SIZE+STEPPER_PROTO_FRAME_OVERHEAD) */
+    unsigned char* data;
+
+    /** Размер кадра, байт */
+    int size;
+
+    /** Задержка предыдущего отрезка кадра */
+    unsigned long step_delay;
+} stepper_proto_frame_t;
+
+//////////////////////////////////////////
+// Устройство: прием кадров
+
+/**
+ * Задать моторы, которыми управляют кадры протокола, и сбросить состояние
+ * приема.
+ *
+ * Пример:
+ *   static void proto_reply(const unsigned char* data, int size, void* context) {
+ *       Serial.write(data, size);
+ *   }
+ *
+ *   static stepper* proto_motors[] = {&sm_x, &sm_y, &sm_z};
+ *   stepper_proto_init(3, proto_motors, proto_reply);
+ *
+ *   void loop() {
+ *       while(Serial.available() && stepper_proto_ready()) {
+ *           stepper_proto_put(Serial.read());
+ *       }
+ *       stepper_proto_run();
+ *   }
+ *
+ * @param motor_count - количество моторов (не больше 6)
+ * @param smotors - моторы (бит 0 в флагах отрезка - первый мотор и т.д.)
+ * @param reply - отправка кадров ACK и NAK хосту
+ * @param context - контекст для reply
+ */
+void stepper_proto_init(int motor_count, stepper** smotors, stepper_proto_reply_t reply, void* context=NULL);
+
+/**
+ * Передать следующий принятый байт.
+ *
+ * @return
+ *     true - байт принят
+ *     false - все буферы кадров заняты (хост отправил больше кадров,
+ *         чем разрешает кредит), байт не принят
+ */
+bool stepper_proto_put(unsigned char b);
+
+/**
+ * Есть свободный буфер для следующего кадра или кадр принимается.
+ */
+bool stepper_proto_ready();
+
+/**
+ * Передать отрезки из принятых кадров в очередь движений, пока в ней
+ * есть место, и запустить цикл, если он не запущен. Когда кадр выполнен
+ * целиком, буфер освобождается и хост получает ACK с новым кредитом.
+ * Вызывать в главном цикле loop как можно чаще.
+ *
+ * @return количество отрезков, переданных в очередь
+ */
+int stepper_proto_run();
+
+/**
+ * Количество принятых кадров, отрезки которых еще не все в очереди движений.
+ */
+int stepper_proto_pending();
+
+/**
+ * Последняя ошибка протокола (сбрасывается в stepper_proto_init).
+ */
+stepper_proto_error_t stepper_proto_error();
+
+//////////////////////////////////////////
+// Отправитель: сборка кадров
+
+/**
+ * Начать кадр с отрезками.
+ *
+ * @param frame - кадр
+ * @param data - буфер кадра, не меньше STEPPER_PROTO_FRAME_SIZE+STEPPER_PROTO_FRAME_OVERHEAD байт
+ * @param seq - номер кадра
+ */
+void stepper_proto_frame_begin(stepper_proto_frame_t* frame, unsigned char* data, unsigned char seq);
+
+/**
+ * Добавить отрезок в кадр.
+ *
+ * @param frame - кадр
+ * @param motor_count - количество моторов (как в stepper_proto_init)
+ * @param step_counts - количество шагов для каждого мотора, знак задает направление
+ * @param step_delay, entry_delay, exit_delay - как у stepper_queue_line
+ * @return
+ *     true - отрезок добавлен
+ *     false - отрезок не помещается в кадр (кадр не изменился)
+ */
+bool stepper_proto_frame_add(stepper_proto_frame_t* frame, int motor_count, long* step_counts,
+        unsigned long step_delay=0, unsigned long entry_delay=0, unsigned long exit_delay=0);
+
+/**
+ * Закончить кадр: длина и контрольная сумма.
+ *
+ * @return размер кадра для отправки, байт
+ */
+int stepper_proto_frame_end(stepper_proto_frame_t* frame);
+
+/**
+ * Собрать служебный кадр без отрезков (STEPPER_PROTO_RESET).
+ *
+ * @return размер кадра, байт
+ */
+int stepper_proto_frame_control(unsigned char* data, unsigned char type, unsigned char seq);
+
+/**
+ * CRC-8 (полином 0x07) блока данных.
+ *
+ * @param crc - CRC предыдущих данных (0 в начале)
+ */
+unsigned char stepper_proto_crc8(const unsigned char* data, int size, unsigned char crc=0);
+
+#endif // STEPPER_PROTO_H
+
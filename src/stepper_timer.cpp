@@ -12,6 +12,7 @@
 #include "Arduino.h"
 #include "stdio.h"
 #include "string.h"
+#include "math.h"
 
 extern "C"{
     #include "timer_setup.h"
@@ -21,8 +22,16 @@ extern "C"{
 
 #include "stepper_lib_config.h"
 
+// барьер для компилятора в кольцевых буферах (очередь движений,
+// потоковый буфер): элемент записан (прочитан) до того, как сдвинут индекс
+#define _ring_barrier() __asm__ __volatile__("" ::: "memory")
+
 /**
  * Способы вычисления задержки перед следующим шагом
+ * 
+ * BUFFER, DYNAMIC, ACCEL и SCURVE ("тяжелые", их можно отложить -
+ * stepper_set_step_work_limit) идут подряд сразу после CONSTANT,
+ * обработчик прерывания проверяет их одним сравнением.
  */
 typedef enum {
     /** Константа */
@@ -32,17 +41,45 @@ typedef enum {
     BUFFER,
     
     /** Динамическая задержка */
-    DYNAMIC
+    DYNAMIC,
+    
+    /** Разгон и торможение с постоянным ускорением (трапеция) */
+    ACCEL,
+    
+    /** Разгон и торможение с ограничением рывка (S-кривая) */
+    SCURVE,
+    
+    /** Задержка ведущего мотора (ведомый мотор в группе движения по линии) */
+    LINE,
+    
+    /** Шаг дуги окружности (ведущий мотор пары prepare_arc) */
+    ARC,
+    
+    /** Шаг кривой Безье (ведущий мотор группы prepare_bezier) */
+    BEZIER
 } delay_source_t;
 
 /**
  * Статус текущего цикла мотора. Серия вращения (главный цикл) мотора состоит из
  * нескольких циклов (подциклов). Каждый цикл включает фиксированное количество шагов,
  * настройки для направления и задержек между шагами при вращении.
+ * 
+ * Статус хранится для каждого мотора в каждой программе цикла, поэтому
+ * на AVR (2КБ ОЗУ) его размер важен. Поля, которые нужны только одному
+ * способу вычисления задержки (delay_source) или одному виду движения,
+ * лежат в объединении - мотор в цикле использует только один из них;
+ * флаги упакованы в битовые поля. Флаги одной программы цикла меняет
+ * либо главный цикл (программа _fill еще не запущена), либо обработчик
+ * прерывания (программа _run), поэтому чтение-модификация-запись
+ * битовых полей не гоняется. Размер статуса - stepper_cycle_info_size().
+ * 
+ * Поля, которые обработчик прерывания читает на каждом тике для каждого
+ * мотора (таймер, счетчик шагов, флаги, ножка step), лежат не здесь,
+ * а отдельными массивами в программе цикла (cycle_program_t).
  */
 typedef struct {
-    /** Количество циклов в текущей серии */
-    int cycle_count = 0;
+    /** Количество циклов в текущей серии (больше 0 только для prepare_buffered_steps) */
+    int cycle_count;
     
 //// Настройки для текущего цикла шагов
 
@@ -51,10 +88,55 @@ typedef struct {
      *  1: вперед (увеличение виртуальной координаты curr_pos),
      * -1: назад (уменьшение виртуальной координаты curr_pos)
      */
-    int dir;
+    signed char dir;
     
-    /** true: вращение без остановки, false: использовать step_count */
-    bool non_stop;
+    /**
+     * CONSTANT: вращение с постоянной скоростью (использовать значение step_delay), 
+     * BUFFER: вращение с переменной скоростью (использовать delay_buffer)
+     * DYNAMIC: вращение с переменной скоростью (использовать next_step_delay)
+     */
+    delay_source_t delay_source : 4;
+    
+    /** Режим калибровки */
+    calibrate_mode_t calibrate_mode : 2;
+    
+    /**
+     * Мотор - ведомый в группе моторов, движущихся по прямой линии:
+     * таймер мотора идет синхронно с ведущим мотором группы, но шаг
+     * делается только тогда, когда переполняется ошибка алгоритма
+     * Брезенхэма (DDA).
+     */
+    bool line_follower : 1;
+    
+    /**
+     * Мотор - один из пары, движущейся по дуге: ведущий (ось X, delay_source=ARC,
+     * ведет состояние дуги) или ведомый (ось Y, delay_source=LINE).
+     * Оба мотора пропускают шаги дуги так же, как ведомые моторы линии
+     * (cycle_program_t.line_skip).
+     * Моторы кривой Безье (prepare_bezier) - тоже моторы дуги.
+     */
+    bool arc : 1;
+    
+    /** Дуга пройдена: текущий шаг - последний */
+    bool arc_done : 1;
+    
+    /** Ведущий мотор дуги: движение по часовой стрелке */
+    bool arc_cw : 1;
+    
+    /**
+     * Ведущий мотор группы: задержка перед следующим шагом уже вычислена
+     * заранее (line_ahead_delay, stepper_set_step_work_limit)
+     */
+    bool work_ahead : 1;
+    
+    /**
+     * Ведущий мотор дуги: за ведомым мотором дуги идет линейная ось винтовой линии
+     * (prepare_helix, ведомый мотор группы с line_lead_count - суммой шагов по X и Y)
+     */
+    bool arc_helix : 1;
+    
+    /** Шаг мотора на следующем шаге дуги: 1 - вперед, -1 - назад, 0 - пропуск */
+    signed char arc_move;
     
     /**
      * Количество шагов в текущей серии (если non_stop=false).
@@ -82,13 +164,6 @@ typedef struct {
      */
     long step_count;
     
-    /**
-     * CONSTANT: вращение с постоянной скоростью (использовать значение step_delay), 
-     * BUFFER: вращение с переменной скоростью (использовать delay_buffer)
-     * DYNAMIC: вращение с переменной скоростью (использовать next_step_delay)
-     */
-    delay_source_t delay_source;
-    
     /**
      * Задержка между 2мя шагами мотора (определяет скорость вращения,
      * 0 для максимальной скорости), микросекунды
@@ -117,61 +192,229 @@ typedef struct {
     unsigned long step_delay;
     
     /**
-     * Массив задержек перед каждым следующим шагом, микросекунды.
+     * Потоковый буфер подсерий (prepare_stream_steps), NULL - не используется.
      */
-    unsigned long* delay_buffer;
+    stepper_stream_t* stream;
+
+//// Динамика
+    // (счетчики шагов и таймеры - в cycle_program_t)
     
-    /**
-     * Массив с количеством шагов для каждого цикла серии. Знак задает направление вращения.
-     */
-    long* step_buffer;
+    /** Счетчик циклов (возрастает) */
+    unsigned int cycle_counter;
+
+//// Движение по линии (prepare_line)
+    /** Количество шагов ведущего мотора группы */
+    unsigned long line_lead_count;
     
-    /**
-     * Масштабирование шагов (повтор шагов с одинаковой задержкой при использовании буфера задержек)
-     */
-    int scale;
+    /** Накопленная ошибка алгоритма Брезенхэма, [0, line_lead_count) */
+    unsigned long line_error;
+    
+    /** Индекс ведущего мотора группы (для ведомого мотора) */
+    unsigned char line_lead;
     
     /**
-     * Указатель на объект, содержащий всю необходимую информацию для вычисления
-     * времени до следующего шага (должен подходить для параметра curve_context
-     * функции next_step_delay).
-     * 
-     * Для встроенного алгоритма рисования дуги окружности тип curve_context будет circle_context_t
-     * 
-     * Используется при delay_source=DYNAMIC
+     * Задержка перед следующим шагом мотора, микросекунды: ведомые
+     * моторы группы берут ее у ведущего (delay_source=LINE)
      */
-    void* curve_context;
+    unsigned long line_step_delay;
     
     /**
-     * Ссылка на функцию, вычисляющую динамическую задержку перед следующим шагом мотора
-     * (определяет скорость вращения):
-     * - при постоянной задержке мотор движется с постоянной скоростью (рисование прямой линии)
-     * - при переменной задержке на 2х моторах движение инструмента криволинейно (рисование дуги окружности)
-     * 
-     * Используется при delay_source=DYNAMIC
-     * 
-     * @param curr_step - номер текущего шага
-     * @param curve_context - указатель на объект, содержащий всю необходимую информацию для вычисления
-     *     времени до следующего шага
-     * @return время до следующего шага, микросекунды
+     * Ведущий мотор группы: задержка перед шагом после следующего,
+     * вычисленная заранее на тике без другой тяжелой работы (work_ahead)
      */
-    unsigned long (*next_step_delay)(unsigned long curr_step, void* curve_context);
-    
-    /** Режим калибровки */
-    calibrate_mode_t calibrate_mode;
+    unsigned long line_ahead_delay;
 
-//// Динамика
-    /** Счетчик циклов (возрастает) */
-    unsigned int cycle_counter = 0;
+//// Разгон и торможение (delay_source=ACCEL и SCURVE)
+    /** Количество шагов разгона */
+    unsigned long accel_steps;
     
-    /** Мотор остановлен в процессе работы */
-    bool stopped = false;
-
-    /** Счетчик шагов для текущей серии (убывает) */
-    unsigned long step_counter = 0;
+    /** Номер шага, с которого начинается торможение */
+    unsigned long decel_start;
     
-    /** Счетчик микросекунд для текущего шага (убывает) */
-    unsigned long step_timer = 0;
+    /**
+     * Дробная часть микросекунд, отброшенная при взводе таймера на предыдущих
+     * шагах (8 бит): переносим на следующий шаг, чтобы ошибка округления
+     * задержек не накапливалась
+     */
+    unsigned int accel_frac;
+
+//// Поля отдельных режимов: мотор использует только один из вариантов
+    union {
+        // Буферы задержек и шагов (delay_source=BUFFER, prepare_buffered_steps)
+        struct {
+            /**
+             * Массив задержек перед каждым следующим шагом, микросекунды.
+             */
+            unsigned long* delay_buffer;
+            
+            /**
+             * Массив с количеством шагов для каждого цикла серии. Знак задает направление вращения.
+             */
+            long* step_buffer;
+            
+            /**
+             * Масштабирование шагов (повтор шагов с одинаковой задержкой при использовании буфера задержек)
+             */
+            int scale;
+        };
+        
+        // Динамическая задержка (delay_source=DYNAMIC)
+        struct {
+        /**
+         * Указатель на объект, содержащий всю необходимую информацию для вычисления
+         * времени до следующего шага (должен подходить для параметра curve_context
+         * функции next_step_delay).
+         * 
+         * (для дуги окружности есть встроенный целочисленный алгоритм - prepare_arc)
+         * 
+         * Используется при delay_source=DYNAMIC
+         */
+            void* curve_context;
+            
+        /**
+         * Ссылка на функцию, вычисляющую динамическую задержку перед следующим шагом мотора
+         * (определяет скорость вращения):
+         * - при постоянной задержке мотор движется с постоянной скоростью (рисование прямой линии)
+         * - при переменной задержке на 2х моторах движение инструмента криволинейно (рисование дуги окружности)
+         * 
+         * Используется при delay_source=DYNAMIC
+         * 
+         * @param curr_step - номер текущего шага
+         * @param curve_context - указатель на объект, содержащий всю необходимую информацию для вычисления
+         *     времени до следующего шага
+         * @return время до следующего шага, микросекунды
+         */
+            unsigned long (*next_step_delay)(unsigned long curr_step, void* curve_context);
+            
+#if STEPPER_DYNAMIC_STEPS
+            /**
+             * Задержки, вычисленные заранее вне обработчика прерывания
+             * (stepper_prefetch_fill), NULL - вычислять на каждом шаге
+             */
+            stepper_prefetch_t* prefetch;
+#endif
+        };
+        
+        // Разгон и торможение (delay_source=ACCEL)
+        struct {
+            /**
+             * Задержка перед шагом с нулевой скоростью (1000000/sqrt(max_accel)),
+             * микросекунды с 8 битами дробной части
+             */
+            unsigned long accel_c0;
+            
+            /** Индекс на кривой разгона с нуля для первого шага торможения */
+            unsigned long decel_index;
+            
+            /** Множитель 1/sqrt(2*decel_index+1) для первого шага торможения (см. accel_u) */
+            unsigned long decel_u;
+            unsigned char decel_u_exp;
+            
+            /**
+             * Текущий индекс на кривой разгона с нуля: шаг с индексом k
+             * делается на скорости sqrt(2*max_accel*(k+0.5)) шагов в секунду
+             */
+            unsigned long accel_index;
+            
+            /**
+             * Текущий множитель u=1/sqrt(2*accel_index+1) для задержки
+             * delay=accel_c0*u: мантисса с 31 битом дробной части
+             * в диапазоне [0.5, 1] и двоичный порядок: u=accel_u/2^(31+accel_u_exp)
+             */
+            unsigned long accel_u;
+            unsigned char accel_u_exp;
+        };
+        
+        // Разгон и торможение с ограничением рывка (delay_source=SCURVE)
+        struct {
+            /**
+             * Множитель и сдвиг для перевода времени в долю длительности
+             * участка нарастания ускорения T1 (16 бит дробной части) без деления:
+             * theta = (t * scurve_theta_mult) >> scurve_theta_shift, t - микросекунды
+             */
+            unsigned long scurve_theta_mult;
+            unsigned char scurve_theta_shift;
+            
+            /** Длительность разгона в долях T1, 16 бит дробной части */
+            unsigned long scurve_theta_end;
+            
+            /** Доля крейсерской скорости в конце участка нарастания ускорения, 31 бит дробной части */
+            unsigned long scurve_nu1;
+            
+            /** Задержка на крейсерской скорости, микросекунды с 8 битами дробной части */
+            unsigned long scurve_cruise_delay;
+            
+            /** Задержка перед первым шагом разгона с места, микросекунды с 8 битами дробной части */
+            unsigned long scurve_first_delay;
+            
+            /** Доля T1 на первом шаге разгона (минимальная скорость при торможении) */
+            unsigned long scurve_theta_min;
+            
+            /**
+             * Отношение крейсерской скорости к текущей (>= 1), 16 бит дробной
+             * части: задержка перед шагом = scurve_cruise_delay * scurve_rho
+             */
+            unsigned long scurve_rho;
+            
+            /**
+             * Половина задержки перед следующим шагом по текущему scurve_rho
+             * (до округления), микросекунды: (scurve_cruise_delay*scurve_rho)>>25
+             */
+            unsigned long scurve_half_delay;
+            
+            /** Время с начала разгона или торможения, микросекунды */
+            unsigned long scurve_time;
+        };
+        
+        // Ведущий мотор дуги окружности (delay_source=ARC, prepare_arc)
+        struct {
+            /** Текущая точка относительно центра дуги, шаги */
+            long arc_x;
+            long arc_y;
+            
+            /** Конечная точка относительно центра дуги, шаги */
+            long arc_end_x;
+            long arc_end_y;
+            
+            /** Ошибка текущей точки x^2+y^2-R^2 */
+            long long arc_err;
+            
+            /** Осталось шагов по осям X и Y */
+            unsigned long arc_x_left;
+            unsigned long arc_y_left;
+            
+            /** Задержка перед шагом по одной оси и по обеим осям (по диагонали), микросекунды */
+            unsigned long arc_delay;
+            unsigned long arc_diag_delay;
+        };
+        
+        // Моторы кривой Безье (prepare_bezier): шаг или пропуск на следующем
+        // шаге кривой решает ведущий мотор (delay_source=BEZIER) в arc_move
+        struct {
+            /**
+             * Остаток n^3*B(k/n) - n^3*позиция мотора, k - номер шага параметра,
+             * n - количество шагов параметра (координата мотора в шагах с n^3 дробных долей)
+             */
+            long long bez_r;
+            
+            /** Первая, вторая и третья конечные разности n^3*B(k/n) по k */
+            long long bez_d1;
+            long long bez_d2;
+            long long bez_d3;
+            
+            /** Ведущий: n^3 - целый шаг мотора в единицах bez_r */
+            long long bez_s;
+            
+            /** Ведущий: осталось шагов параметра кривой */
+            unsigned long bez_left;
+            
+            /** Ведущий: количество моторов группы (ведущий и следующие за ним) */
+            unsigned char bez_count;
+            
+            /** Ведущий: задержка перед шагом кривой по одной оси, микросекунды */
+            unsigned long bez_delay;
+        };
+    };
 } motor_cycle_info_t;
 
 // из stepper_lib_config.h
@@ -179,9 +422,218 @@ typedef struct {
 #define MAX_STEPPERS 6
 #endif
 
-static int _stepper_count = 0;
-static stepper* _smotors[MAX_STEPPERS];
-static motor_cycle_info_t _cstatuses[MAX_STEPPERS];
+// из stepper_lib_config.h
+#ifndef STEPPER_CYCLE_PROGRAMS
+#define STEPPER_CYCLE_PROGRAMS 2
+#endif
+
+// возможности обработчика прерывания - в stepper_lib_config.h
+// (выключенные ветки выбрасывает компилятор - условия константные)
+
+#if STEPPER_END_INTERRUPTS
+// концевые датчики на прерываниях: состояние уже в end_flags
+// (stepper_end_changed), в обработчике таймера - одна проверка бита
+#define _hard_end_min(smotor) ((smotor)->end_flags & STEPPER_END_MIN)
+#define _hard_end_max(smotor) ((smotor)->end_flags & STEPPER_END_MAX)
+#else
+// концевые датчики опрашиваются перед каждым шагом
+#define _hard_end_min(smotor) fast_io_read(&(smotor)->pin_min_io)
+#define _hard_end_max(smotor) fast_io_read(&(smotor)->pin_max_io)
+#endif
+
+#if STEPPER_END_FILTER
+/**
+ * Фильтр помех концевых датчиков: сдвинуть значения датчиков в регистры
+ * выборок и обновить состояние после фильтра - нажат, если последние
+ * выборки по маске все нажат, отпущен, если все отпущен, иначе без изменений.
+ * 
+ * @param smotor
+ * @param mask - маска выборок (end_filter младших бит)
+ */
+static inline void _end_filter_sample(stepper* smotor, unsigned char mask) {
+    smotor->end_min_samples = (smotor->end_min_samples << 1) | (_hard_end_min(smotor) ? 1 : 0);
+    smotor->end_max_samples = (smotor->end_max_samples << 1) | (_hard_end_max(smotor) ? 1 : 0);
+    
+    if((smotor->end_min_samples & mask) == mask) {
+        smotor->end_state |= STEPPER_END_MIN;
+    } else if((smotor->end_min_samples & mask) == 0) {
+        smotor->end_state &= ~STEPPER_END_MIN;
+    }
+    if((smotor->end_max_samples & mask) == mask) {
+        smotor->end_state |= STEPPER_END_MAX;
+    } else if((smotor->end_max_samples & mask) == 0) {
+        smotor->end_state &= ~STEPPER_END_MAX;
+    }
+}
+
+/**
+ * Начальное состояние фильтра помех: датчик, нажатый на старте, - нажат сразу.
+ * 
+ * @param smotor
+ */
+static void _end_filter_seed(stepper* smotor) {
+    bool min = _hard_end_min(smotor);
+    bool max = _hard_end_max(smotor);
+    smotor->end_min_samples = min ? 0xff : 0;
+    smotor->end_max_samples = max ? 0xff : 0;
+    smotor->end_state = (min ? STEPPER_END_MIN : 0) | (max ? STEPPER_END_MAX : 0);
+}
+
+// концевой датчик перед шагом: после фильтра, если он задан
+#define _end_min_hit(i) (_run->end_filter[i] ? \
+    _run->smotors[i]->end_state & STEPPER_END_MIN : _hard_end_min(_run->smotors[i]))
+#define _end_max_hit(i) (_run->end_filter[i] ? \
+    _run->smotors[i]->end_state & STEPPER_END_MAX : _hard_end_max(_run->smotors[i]))
+#else
+#define _end_min_hit(i) _hard_end_min(_run->smotors[i])
+#define _end_max_hit(i) _hard_end_max(_run->smotors[i])
+#endif
+
+/**
+ * Программа цикла - моторы и их настройки, подготовленные prepare_xxx.
+ * 
+ * Состояние моторов разделено на горячее и холодное: то, что обработчик
+ * прерывания читает на каждом тике для каждого мотора, - массивы по
+ * индексу мотора (структура массивов), проход по моторам читает их
+ * подряд и не ходит по указателю smotors[i]; остальное (настройки
+ * режимов, разгон, дуги и т.п.) нужно только на шаге мотора - в cstatuses.
+ *
+ * Зачем: на AVR поле cstatuses[i] адресуется умножением индекса на размер
+ * структуры (не степень двойки, десятки байт), элемент массива long -
+ * сдвигом индекса на 2, а импульс step не читает smotors[i]->pin_step_io.
+ * На хосте (x86, вся программа помещается в L1) разницы нет: холостой тик
+ * 6 моторов - 30-50нс до и после разделения, в пределах шума. На массивах
+ * построены и пакетный вывод импульсов (step_port, step_mask), и лимит
+ * тяжелой работы (work_deferrable, work_deferred), и расчет следующего
+ * события в режиме "по событию" (_timer_next_event_ticks читает только их).
+ */
+typedef struct {
+    int stepper_count;
+    
+//// Горячие данные (каждый тик)
+    /** Счетчик микросекунд для текущего шага (убывает) */
+    unsigned long step_timer[MAX_STEPPERS];
+    
+    /** Счетчик шагов для текущей серии (убывает) */
+    unsigned long step_counter[MAX_STEPPERS];
+    
+    /** true: вращение без остановки, false: использовать step_count */
+    bool non_stop[MAX_STEPPERS];
+    
+    /** Мотор остановлен в процессе работы */
+    bool stopped[MAX_STEPPERS];
+    
+    /** Ведомый мотор (линии, дуги) пропускает текущий шаг ведущего мотора */
+    bool line_skip[MAX_STEPPERS];
+    
+    /** Индекс порта ножки step в списке портов цикла _step_ports */
+    unsigned char step_port[MAX_STEPPERS];
+    
+    /** Маска ножки step в порте (копия smotors[i]->pin_step_io.mask) */
+    fast_io_mask_t step_mask[MAX_STEPPERS];
+    
+    /**
+     * Маска выборок фильтра концевых датчиков (smotors[i]->end_filter
+     * младших бит), 0 - фильтра нет
+     */
+    unsigned char end_filter[MAX_STEPPERS];
+    
+    /**
+     * Вычисление задержки перед следующим шагом можно отложить
+     * (stepper_set_step_work_limit)
+     */
+    bool work_deferrable[MAX_STEPPERS];
+    
+    /**
+     * Вычисление задержки перед следующим шагом отложено: таймер взведен
+     * на минимальную задержку мотора, поправка - когда дойдет очередь
+     */
+    bool work_deferred[MAX_STEPPERS];
+    
+//// Холодные данные (на шаге мотора)
+    stepper* smotors[MAX_STEPPERS];
+    motor_cycle_info_t cstatuses[MAX_STEPPERS];
+} cycle_program_t;
+
+/**
+ * Две программы цикла (двойная буферизация): обработчик прерывания
+ * выполняет программу _run, в это время prepare_xxx заполняют
+ * программу _fill. Когда цикл завершается, заполненная программа
+ * (если для нее вызван stepper_start_cycle) становится выполняемой
+ * без остановки таймера.
+ * 
+ * При STEPPER_CYCLE_PROGRAMS=1 (по умолчанию на AVR - экономим память)
+ * программа одна, _run и _fill - это она же.
+ * 
+ * _run меняет только обработчик прерывания или stepper_start_cycle
+ * при остановленном таймере; _fill читает главный цикл, пока обработчик
+ * может его поменять, поэтому volatile.
+ */
+static cycle_program_t _programs[STEPPER_CYCLE_PROGRAMS];
+static cycle_program_t* _run = &_programs[0];
+static cycle_program_t* volatile _fill = &_programs[STEPPER_CYCLE_PROGRAMS - 1];
+
+/** Программа _fill ждет запуска сразу после завершения _run */
+static volatile bool _fill_pending = false;
+
+/**
+ * Очистить программу цикла.
+ */
+static void _clear_program(cycle_program_t* program) {
+    for(int i = 0; i < program->stepper_count; i++) {
+        // освободим место в группе движения по линии
+        program->cstatuses[i].line_follower = false;
+        program->line_skip[i] = false;
+        program->cstatuses[i].arc = false;
+        
+        // потоковый буфер больше не читаем
+        program->cstatuses[i].stream = NULL;
+        
+        // буферы циклов тоже (step_buffer в объединении с полями других режимов)
+        program->cstatuses[i].cycle_count = 0;
+    }
+    program->stepper_count = 0;
+}
+
+/**
+ * Поменять местами выполняемую и заполненную программы,
+ * новая заполняемая программа пуста.
+ */
+static void _swap_programs() {
+    cycle_program_t* run = _fill;
+    _fill = _run;
+    _run = run;
+    _clear_program(_fill);
+    _fill_pending = false;
+}
+
+// Пакетный вывод импульсов step: ножки step моторов, подключенные к одному
+// порту, взводятся и сбрасываются одной записью в регистр порта в конце
+// обработчика прерывания (импульсы на разных осях строго одновременны,
+// записей в порты - не больше, чем портов, а не моторов)
+
+// Порты ножек step моторов в текущем цикле (без повторов)
+static int _step_port_count = 0;
+static fast_io_port_t _step_ports[MAX_STEPPERS];
+// Маски ножек step, которые нужно взвести или сбросить на текущем тике
+static fast_io_mask_t _step_port_set[MAX_STEPPERS];
+static fast_io_mask_t _step_port_clear[MAX_STEPPERS];
+
+// Моторы, которые сменили направление на текущем тике: ножка dir пишется
+// после пакетного вывода импульсов, иначе драйвер примет шаг этого тика
+// (спад step HIGH->LOW) уже в новом направлении
+static unsigned char _dir_pending[MAX_STEPPERS];
+static int _dir_pending_count = 0;
+
+/**
+ * Сменить направление мотора i выполняемой программы (cstatuses[i].dir)
+ * на ножке dir в конце обработчика прерывания, после импульсов step.
+ */
+static inline void _dir_defer(int i) {
+    if(_dir_pending_count < MAX_STEPPERS) {
+        _dir_pending[_dir_pending_count++] = i;
+    }
+}
 
 ///////////////////////////
 // Настройки таймера
@@ -277,6 +729,26 @@ static unsigned long _timer_period_us = STEPPER_TIMER_DEFAULT_PERIOD_US;
 //(выключенный таймер может пригодиться для тестов и отладки)
 bool _timer_enabled = true;
 
+// Режим "по событию": таймер вызывает обработчик не каждый период
+// _timer_period_us, а только на тех периодах, когда хотя бы одному
+// из моторов нужно что-то сделать (проверить границы, взвести или
+// сбросить ножку step)
+static bool _timer_event_driven = false;
+
+// Количество периодов _timer_period_us до следующего вызова обработчика
+// (в обычном режиме всегда 1)
+static unsigned int _timer_event_ticks = 1;
+
+// Не больше стольких моторов вычисляют задержку следующего шага на одном
+// вызове обработчика, у остальных вычисление отложено (0 - без ограничения)
+static int _step_work_limit = 0;
+
+// Максимальное количество периодов между двумя вызовами обработчика
+// в режиме "по событию": значение сравнения таймера должно влезать
+// в 16 бит, частное вычисляем за 10 итераций сдвига (не больше 1023)
+#define TIMER_EVENT_TICKS_SHIFT 10
+static unsigned int _timer_event_ticks_max = (1 << TIMER_EVENT_TICKS_SHIFT) - 1;
+
 ///////////////////////////
 // Текущий статус цикла
 static bool _cycle_running = false;
@@ -288,6 +760,26 @@ static stepper_cycle_error_t _cycle_error = CYCLE_ERROR_NONE;
 // таймера в текущем цикле
 static unsigned long _cycle_max_time = 0;
 
+#if STEPPER_ISR_PROFILE
+// Профиль обработчика прерывания (stepper_profile): копится между циклами
+static stepper_profile_t _profile;
+// Запрошен сброс профиля (обнулит обработчик прерывания)
+static volatile bool _profile_reset = false;
+#endif
+
+#if STEPPER_TRACE
+// Трасса шагов (stepper_trace_init): кольцевой буфер событий, пишет
+// обработчик прерывания (_trace_head), читает главный цикл (_trace_tail)
+static stepper_trace_event_t* _trace_buffer = NULL;
+static unsigned char _trace_size = 0;
+static volatile unsigned char _trace_head = 0;
+static volatile unsigned char _trace_tail = 0;
+// Событий отброшено: буфер полон
+static volatile unsigned long _trace_dropped = 0;
+// Номер текущего тика таймера для событий трассы
+static unsigned long _trace_tick = 0;
+#endif
+
 // Стратегия реакции на ошибки
 // STOP_MOTOR/CANCEL_CYCLE
 //static error_handle_strategy_t _hard_end_handle = STOP_MOTOR;
@@ -307,132 +799,835 @@ static error_handle_strategy_t _cycle_timing_exceed_handle = CANCEL_CYCLE;
 
 
 /**
- * Подготовить мотор к запуску ограниченной серии шагов - задать нужное количество
- * шагов и задержку между шагами для регулирования скорости (0 для максимальной скорости).
+ * Ведомый мотор в группе движения по линии: решить, делать ли шаг
+ * на следующем шаге ведущего мотора (шаг алгоритма Брезенхэма).
+ * Одно сложение и одно сравнение, без деления.
+ */
+static inline void _line_follower_next_step(cycle_program_t* program, int i) {
+    motor_cycle_info_t* cstatus = &program->cstatuses[i];
+    cstatus->line_error += cstatus->step_count;
+    if(cstatus->line_error >= cstatus->line_lead_count) {
+        cstatus->line_error -= cstatus->line_lead_count;
+        program->line_skip[i] = false;
+    } else {
+        program->line_skip[i] = true;
+    }
+}
+
+/**
+ * Следующий шаг дуги окружности (алгоритм средней точки): по главной оси
+ * (вдоль которой касательная круче) шаг делается всегда, по второй оси -
+ * если средняя точка между двумя вариантами лежит по другую сторону
+ * окружности. Ошибка x^2+y^2-R^2 обновляется сложениями, без умножения,
+ * деления и тригонометрии.
  * 
- * @param step_count - количество шагов, знак задает направление вращения
- * @param step_delay - задержка между двумя шагами, микросекунды (0 для максимальной скорости)
- * @param calibrate_mode - режим калибровки
- *     NONE: режим калибровки выключен - останавливать вращение при выходе за виртуальные границы
- *           рабочей области [min_pos, max_pos] (аппаратные проверяются ВСЕГДА);
- *     CALIBRATE_START_MIN_POS: установка начальной позиции (сбрасывать current_pos в min_pos при каждом шаге);
- *     CALIBRATE_BOUNDS_MAX_POS: установка размеров рабочей области (сбрасывать max_pos в current_pos при каждом шаге)
+ * Решение записывается в arc_move ведущего и ведомого мотора (и линейной
+ * оси винтовой линии), моторы применяют его сами после своего текущего
+ * шага (_arc_apply).
+ * 
+ * @return задержка перед следующим шагом дуги, микросекунды
  */
-void prepare_steps(stepper *smotor, long step_count, unsigned long step_delay, calibrate_mode_t calibrate_mode) {
-    // резерв нового места на мотор в списке
-    int sm_i = _stepper_count;
-    _stepper_count++;
+static unsigned long _arc_next(motor_cycle_info_t* lead, motor_cycle_info_t* follower) {
+    if(lead->arc_x_left == 0 && lead->arc_y_left == 0) {
+        // дуга пройдена
+        lead->arc_move = 0;
+        follower->arc_move = 0;
+        lead->arc_done = true;
+        follower->arc_done = true;
+        if(lead->arc_helix) {
+            (follower + 1)->arc_done = true;
+        }
+        return lead->arc_delay;
+    }
     
-    // ссылка на мотор
-    _smotors[sm_i] = smotor;
+    long x = lead->arc_x;
+    long y = lead->arc_y;
+    long long err = lead->arc_err;
     
-    // Подготовить движение
+    // направление касательной: против часовой стрелки (-y, x),
+    // по часовой (y, -x)
+    signed char sx = y > 0 ? -1 : (y < 0 ? 1 : 0);
+    signed char sy = x > 0 ? 1 : (x < 0 ? -1 : 0);
+    if(lead->arc_cw) {
+        sx = -sx;
+        sy = -sy;
+    }
     
-    // задать направление
-    _cstatuses[sm_i].dir = step_count > 0 ? 1 : -1;
-    if(_cstatuses[sm_i].dir * _smotors[sm_i]->dir_inv > 0) {
-        digitalWrite(_smotors[sm_i]->pin_dir, HIGH); // туда
+    signed char dx = 0;
+    signed char dy = 0;
+    if((y > 0 ? y : -y) > (x > 0 ? x : -x)) {
+        // главная ось X
+        dx = sx;
+        long long f = dx > 0 ? err + x + x + 1 : err - x - x + 1;
+        // 4*ошибка в средней точке (x+dx, y+sy/2)
+        long long e = (f << 2) + (sy > 0 ? (long long)y << 2 : -((long long)y << 2)) + 1;
+        // шаг по Y от центра (наружу) - если средняя точка внутри окружности,
+        // к центру - если снаружи
+        if(sy != 0 && ((sy > 0) == (y > 0)) == (e < 0)) {
+            dy = sy;
+        }
     } else {
-        digitalWrite(_smotors[sm_i]->pin_dir, LOW); // обратно
+        // главная ось Y
+        dy = sy;
+        long long f = dy > 0 ? err + y + y + 1 : err - y - y + 1;
+        // 4*ошибка в средней точке (x+sx/2, y+dy)
+        long long e = (f << 2) + (sx > 0 ? (long long)x << 2 : -((long long)x << 2)) + 1;
+        if(sx != 0 && ((sx > 0) == (x > 0)) == (e < 0)) {
+            dx = sx;
+        }
     }
     
-    // шагаем ограниченное количество шагов
-    _cstatuses[sm_i].non_stop = false;
-    // сделать step_count положительным
-    _cstatuses[sm_i].step_count = step_count > 0 ? step_count : -step_count;
-    
-    // скорость вращения - постоянная
-    _cstatuses[sm_i].delay_source = CONSTANT;
-    if(step_delay == 0) {
-        // 0 - движение с максимальной скоростью
-        _cstatuses[sm_i].step_delay = smotor->step_delay;
-    } else {
-        _cstatuses[sm_i].step_delay = step_delay;
+    // по оси, где шаги закончились, больше не шагаем
+    if(lead->arc_x_left == 0) dx = 0;
+    if(lead->arc_y_left == 0) dy = 0;
+    if(dx == 0 && dy == 0) {
+        // точка ушла с расчетного пути (не должно случаться) - добираем
+        // оставшиеся шаги к конечной точке
+        if(lead->arc_x_left > 0) {
+            dx = lead->arc_end_x > x ? 1 : -1;
+        } else {
+            dy = lead->arc_end_y > y ? 1 : -1;
+        }
     }
     
-    // режим калибровки
-    _cstatuses[sm_i].calibrate_mode = calibrate_mode;
+    // новая точка и ошибка: (x+d)^2 = x^2 + 2*d*x + 1
+    if(dx != 0) {
+        err += dx > 0 ? x + x + 1 : -x - x + 1;
+        lead->arc_x = x + dx;
+        lead->arc_x_left--;
+    }
+    if(dy != 0) {
+        err += dy > 0 ? y + y + 1 : -y - y + 1;
+        lead->arc_y = y + dy;
+        lead->arc_y_left--;
+    }
+    lead->arc_err = err;
     
-    // Взводим счетчики
-    _cstatuses[sm_i].step_counter = _cstatuses[sm_i].step_count;
-    // задержка перед первым шагом
-    _cstatuses[sm_i].step_timer = _cstatuses[sm_i].step_delay;
+    lead->arc_move = dx;
+    follower->arc_move = dy;
     
-    // Динамический статус мотора в цикле вращения
-    // ожидаем пуска
-    _smotors[sm_i]->status = STEPPER_STATUS_IDLE;
-    // обнулим ошибки
-    _smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    if(lead->arc_helix) {
+        // линейная ось винтовой линии: продвижение дуги - 1 или 2 единицы
+        // (шаг по одной оси или по диагонали), не больше одного переполнения
+        motor_cycle_info_t* linear = follower + 1;
+        linear->line_error += linear->step_count;
+        if(dx != 0 && dy != 0) {
+            linear->line_error += linear->step_count;
+        }
+        if(linear->line_error >= linear->line_lead_count) {
+            linear->line_error -= linear->line_lead_count;
+            linear->arc_move = linear->dir;
+        } else {
+            linear->arc_move = 0;
+        }
+    }
     
-    //
-    _cstatuses[sm_i].stopped = false;
+    return dx != 0 && dy != 0 ? lead->arc_diag_delay : lead->arc_delay;
 }
 
 /**
- * Подготовить мотор к запуску на беспрерывное вращение - задать направление и задержку между
- * шагами для регулирования скорости (0 для максимальной скорости).
- *
- * Мотор будет вращаться до тех пор, пока не будет вручную остановлен вызовом finish_stepper_cycle()
- *
- * @param dir - направление вращения: 1 - вращать вперед, -1 - назад.
- * @param step_delay - задержка между двумя шагами, микросекунды (0 для максимальной скорости).
- * @param calibrate_mode - режим калибровки
- *     NONE: режим калибровки выключен - останавливать вращение при выходе за виртуальные границы
- *           рабочей области [min_pos, max_pos] (аппаратные проверяются ВСЕГДА);
- *     CALIBRATE_START_MIN_POS: установка начальной позиции (сбрасывать current_pos в min_pos при каждом шаге);
- *     CALIBRATE_BOUNDS_MAX_POS: установка размеров рабочей области (сбрасывать max_pos в current_pos при каждом шаге)
+ * Мотор пары prepare_arc после своего шага (или пропуска шага):
+ * применить решение _arc_next для следующего шага дуги.
  */
-void prepare_whirl(stepper *smotor, int dir, unsigned long step_delay, calibrate_mode_t calibrate_mode) {
-    // резерв нового места на мотор в списке
-    int sm_i = _stepper_count;
-    _stepper_count++;
-    
-    // ссылка на мотор
-    _smotors[sm_i] = smotor;
-    
-    // Подготовить движение
-    
-    // задать направление
-    _cstatuses[sm_i].dir = dir;
-    if(_cstatuses[sm_i].dir * _smotors[sm_i]->dir_inv > 0) {
-        digitalWrite(_smotors[sm_i]->pin_dir, HIGH); // туда
-    } else {
-        digitalWrite(_smotors[sm_i]->pin_dir, LOW); // обратно
+static inline void _arc_apply(cycle_program_t* program, int i) {
+    motor_cycle_info_t* cstatus = &program->cstatuses[i];
+    stepper* smotor = program->smotors[i];
+    if(cstatus->arc_done) {
+        // это был последний шаг дуги
+        program->stopped[i] = true;
+        smotor->status = STEPPER_STATUS_FINISHED;
+        return;
     }
     
-    // шагаем без остановки
-    _cstatuses[sm_i].non_stop = true;
-    
-    // скорость вращения - постоянная
-    _cstatuses[sm_i].delay_source = CONSTANT;
-    if(step_delay == 0 ) {
-        // 0 - движение с максимальной скоростью
-        _cstatuses[sm_i].step_delay = smotor->step_delay;
-    } else {
-        _cstatuses[sm_i].step_delay = step_delay;
+    program->line_skip[i] = cstatus->arc_move == 0;
+    if(cstatus->arc_move != 0 && cstatus->arc_move != cstatus->dir) {
+        // сменить направление (перешли в другую четверть окружности);
+        // ножку dir - после спада step этого шага, в конце обработчика
+        // (program - всегда выполняемая программа _run)
+        cstatus->dir = cstatus->arc_move;
+        _dir_defer(i);
     }
-    
-    // режим калибровки
-    _cstatuses[sm_i].calibrate_mode = calibrate_mode;
-    
-    // взводим счетчики
-    // задержка перед первым шагом
-    _cstatuses[sm_i].step_timer = _cstatuses[sm_i].step_delay;
-    
-    // на всякий случай обнулим
-    _cstatuses[sm_i].step_count = 0;
-    _cstatuses[sm_i].step_counter = 0;
-    
-    // Динамический статус мотора в цикле вращения
-    // ожидаем пуска
-    _smotors[sm_i]->status = STEPPER_STATUS_IDLE;
-    // обнулим ошибки
-    _smotors[sm_i]->error = STEPPER_ERROR_NONE;
-    
-    //
-    _cstatuses[sm_i].stopped = false;
 }
 
+/**
+ * Множители задержки шага кривой Безье в зависимости от количества
+ * моторов, шагающих одновременно: sqrt(m), 8 бит дробной части
+ */
+#define BEZIER_SQRT_TABLE_SIZE 8
+static const unsigned int _bezier_sqrt_table[BEZIER_SQRT_TABLE_SIZE] = {
+    256, 362, 443, 512, 572, 627, 677, 724
+};
+
+/**
+ * Сколько шагов параметра кривой Безье пройти за один вызов _bezier_next
+ * в поисках шага, на котором шагает хотя бы один мотор
+ */
+#define BEZIER_MAX_SUBSTEPS 8
+
+/**
+ * Следующий шаг кривой Безье: продвигаем параметр кривой с шагом 1/n
+ * (прямые конечные разности кубического многочлена - три сложения на мотор,
+ * без умножения и деления) и сравниваем координату кривой с позицией
+ * мотора: мотор шагает, когда кривая ушла от него больше, чем на пол-шага.
+ * n выбран при подготовке так, что за шаг параметра кривая уходит по каждой
+ * оси не дальше, чем на шаг мотора.
+ * 
+ * Там, где кривая идет медленно, на шаге параметра может не шагать ни один
+ * мотор - такие шаги проходим сразу (не больше BEZIER_MAX_SUBSTEPS за вызов).
+ * 
+ * Решение записывается в arc_move моторов группы, моторы применяют его
+ * сами после своего текущего шага (_arc_apply).
+ * 
+ * @return задержка перед следующим шагом кривой, микросекунды
+ */
+static unsigned long _bezier_next(motor_cycle_info_t* lead) {
+    long long s = lead->bez_s;
+    long long half = s >> 1;
+    for(int substep = 0; substep < BEZIER_MAX_SUBSTEPS; substep++) {
+        if(lead->bez_left == 0) {
+            // кривая пройдена
+            for(int i = 0; i < lead->bez_count; i++) {
+                lead[i].arc_move = 0;
+                lead[i].arc_done = true;
+            }
+            return lead->bez_delay;
+        }
+        lead->bez_left--;
+        
+        int moved = 0;
+        for(int i = 0; i < lead->bez_count; i++) {
+            motor_cycle_info_t* axis = &lead[i];
+            axis->bez_r += axis->bez_d1;
+            axis->bez_d1 += axis->bez_d2;
+            axis->bez_d2 += axis->bez_d3;
+            if(axis->bez_r >= half) {
+                axis->bez_r -= s;
+                axis->arc_move = 1;
+                moved++;
+            } else if(axis->bez_r < -half) {
+                axis->bez_r += s;
+                axis->arc_move = -1;
+                moved++;
+            } else {
+                axis->arc_move = 0;
+            }
+        }
+        
+        if(moved > 0) {
+            // путь вдоль кривой - sqrt(moved) шагов
+            return (lead->bez_delay * _bezier_sqrt_table[moved - 1]) >> 8;
+        }
+    }
+    
+    // кривая почти стоит на месте (например, в точке возврата):
+    // пропускаем шаг всеми моторами
+    return lead->bez_delay;
+}
+
+///////////////////////////
+// Разгон и торможение
+
+// Множители для первых шагов разгона с нуля 1/sqrt(2k+1), 31 бит дробной части:
+// на малых скоростях рекуррентная формула дает большую погрешность,
+// поэтому начало кривой берем из таблицы
+#define ACCEL_TABLE_SIZE 17
+static const unsigned long _accel_table[ACCEL_TABLE_SIZE] = {
+    2147483648ul, 1239850262ul, 960383883ul, 811672525ul, 715827883ul,
+    647490682ul, 595604800ul, 554477894ul, 520841289ul, 492666537ul,
+    468619351ul, 447781295ul, 429496730ul, 413283421ul, 398777702ul,
+    385699449ul, 373828920ul
+};
+
+/**
+ * Произведение 32-битных чисел со сдвигом вправо (a*b)>>shift, точно,
+ * без 64-битной арифметики: 4 умножения 16x16->32. На AVR 64-битное
+ * умножение - вызов библиотечной функции на сотни тактов, а 16x16->32 -
+ * несколько аппаратных MUL. Результат должен помещаться в 32 бита.
+ * 
+ * @param shift - сдвиг, 0..63
+ */
+static inline unsigned long _accel_mul_shr(unsigned long a, unsigned long b, unsigned char shift) {
+    unsigned int ah = a >> 16, al = a & 0xFFFF;
+    unsigned int bh = b >> 16, bl = b & 0xFFFF;
+    unsigned long hl = (unsigned long)ah * bl;
+    unsigned long lh = (unsigned long)al * bh;
+    unsigned long ll = (unsigned long)al * bl;
+    // перенос из младших 32 бит
+    unsigned long mid = (ll >> 16) + (hl & 0xFFFF) + (lh & 0xFFFF);
+    unsigned long hi = (unsigned long)ah * bh + (hl >> 16) + (lh >> 16) + (mid >> 16);
+    if(shift >= 32) {
+        return hi >> (shift - 32);
+    }
+    unsigned long lo = ((mid & 0xFFFF) << 16) | (ll & 0xFFFF);
+    return shift == 0 ? lo : (hi << (32 - shift)) | (lo >> shift);
+}
+
+/**
+ * Старшие 32 бита произведения 32-битных чисел (a*b)>>32, точно
+ * (_accel_mul_shr).
+ */
+static inline unsigned long _accel_mul_hi(unsigned long a, unsigned long b) {
+    return _accel_mul_shr(a, b, 32);
+}
+
+/**
+ * Привести мантиссу множителя u к диапазону [0.5, 1] (31 бит дробной части),
+ * поправив двоичный порядок.
+ */
+static inline void _accel_normalize_u(unsigned long m, unsigned char exp,
+        unsigned long* u, unsigned char* u_exp) {
+    while(m > (1ul << 31)) {
+        m >>= 1;
+        exp--;
+    }
+    while(m < (1ul << 30)) {
+        m <<= 1;
+        exp++;
+    }
+    *u = m;
+    *u_exp = exp;
+}
+
+/**
+ * Множитель u=1/sqrt(2*index+1) в формате accel_u/accel_u_exp,
+ * вычисление в плавающей точке для подготовки серии.
+ */
+static void _accel_u_at(unsigned long index, unsigned long* u, unsigned char* u_exp) {
+    double uf = 1.0 / sqrt(2.0 * index + 1);
+    unsigned char exp = 0;
+    while(uf < 0.5) {
+        uf *= 2;
+        exp++;
+    }
+    _accel_normalize_u((unsigned long)(uf * (1ul << 31) + 0.5), exp, u, u_exp);
+}
+
+/**
+ * Пересчитать множитель accel_u для нового индекса accel_index
+ * (соседнего с предыдущим) на кривой разгона с нуля:
+ *   u = 1/sqrt(2*accel_index+1), delay = accel_c0*u.
+ * 
+ * Для индексов из таблицы - значение из таблицы, для остальных -
+ * без деления и корня:
+ * 1) предсказание от множителя на соседнем индексе
+ *    (1/u'^2 = 1/u^2 +/- 2, q = u^2 < 1/33):
+ *      u' = u*(1 - q + 1.5*q^2) (разгон),
+ *      u' = u*(1 + q + 1.5*q^2) (торможение);
+ * 2) одна итерация Ньютона для обратного корня из n=2*accel_index+1:
+ *      u' = u'*(1.5 - 0.5*n*u'^2).
+ * Поправка Ньютона считается от точного значения индекса, поэтому
+ * ошибка округления не накапливается от шага к шагу (иначе при
+ * торможении она растет пропорционально пройденному индексу).
+ * 
+ * Все величины - 32 бит с фиксированной точкой, произведения -
+ * старшие 32 бита (_accel_mul_hi), 64-битной арифметики на шаге нет.
+ */
+static void _accel_update_u(motor_cycle_info_t* cstatus, bool decel) {
+    if(cstatus->accel_index < ACCEL_TABLE_SIZE) {
+        _accel_normalize_u(_accel_table[cstatus->accel_index], 0,
+            &cstatus->accel_u, &cstatus->accel_u_exp);
+        return;
+    }
+    
+    unsigned long m = cstatus->accel_u;
+    unsigned char exp = cstatus->accel_u_exp;
+    
+    // предсказание: q = u^2 = m^2/2^(62+2*exp), 31 бит дробной части
+    // (за таблицей exp >= 2, q < 1/33)
+    unsigned long q = _accel_mul_hi(m, m) >> (2 * exp - 1);
+    unsigned long f = (1ul << 31) + 3 * _accel_mul_hi(q, q);
+    f = decel ? f + q : f - q;
+    _accel_normalize_u(_accel_mul_hi(m, f) << 1, exp, &cstatus->accel_u, &cstatus->accel_u_exp);
+    
+    // поправка Ньютона: r = n*u'^2 (около 1), 31 бит дробной части;
+    // n около 2^(2*exp+1), сдвигаем его к 2^31 - так произведение
+    // сохраняет точность
+    m = cstatus->accel_u;
+    exp = cstatus->accel_u_exp;
+    unsigned long n = 2 * cstatus->accel_index + 1;
+    n = 2 * exp <= 29 ? n << (29 - 2 * exp) : n >> (2 * exp - 29);
+    unsigned long r = _accel_mul_hi(n, _accel_mul_hi(m, m)) << 4;
+    _accel_normalize_u(_accel_mul_hi(m, (3ul << 30) - (r >> 1)) << 1, exp,
+        &cstatus->accel_u, &cstatus->accel_u_exp);
+}
+
+/**
+ * Задержка перед шагом, микросекунды: не быстрее заданной скорости
+ * step_delay, дробная часть микросекунд переносится на следующий шаг.
+ * 
+ * @param delay - вычисленная задержка, микросекунды с 8 битами дробной части
+ */
+static unsigned long _accel_clip_delay(motor_cycle_info_t* cstatus, unsigned long delay) {
+    delay += cstatus->accel_frac;
+    if((delay >> 8) <= cstatus->step_delay) {
+        cstatus->accel_frac = 0;
+        return cstatus->step_delay;
+    }
+    cstatus->accel_frac = delay & 0xFF;
+    return delay >> 8;
+}
+
+/**
+ * Задержка перед шагом для текущего значения accel_u, микросекунды.
+ */
+static unsigned long _accel_clip_step_delay(motor_cycle_info_t* cstatus) {
+    // accel_c0*u = (accel_c0*accel_u)>>(31+accel_u_exp),
+    // микросекунды с 8 битами дробной части
+    unsigned long delay = _accel_mul_hi(cstatus->accel_c0, cstatus->accel_u);
+    return _accel_clip_delay(cstatus, cstatus->accel_u_exp > 0 ?
+        delay >> (cstatus->accel_u_exp - 1) : delay << 1);
+}
+
+/**
+ * Задержка перед шагом с номером step (шаги с нуля) для мотора
+ * с разгоном и торможением, микросекунды. Вызывается по порядку
+ * для каждого следующего шага.
+ */
+static unsigned long _accel_next_step_delay(motor_cycle_info_t* cstatus, unsigned long step) {
+    if(step < cstatus->accel_steps) {
+        // разгон
+        cstatus->accel_index++;
+        _accel_update_u(cstatus, false);
+    } else if(step > cstatus->decel_start) {
+        // торможение
+        cstatus->accel_index--;
+        _accel_update_u(cstatus, true);
+    } else if(step == cstatus->decel_start) {
+        // первый шаг торможения
+        cstatus->accel_index = cstatus->decel_index;
+        cstatus->accel_u = cstatus->decel_u;
+        cstatus->accel_u_exp = cstatus->decel_u_exp;
+    } else {
+        // движение с постоянной скоростью
+        return cstatus->step_delay;
+    }
+    
+    return _accel_clip_step_delay(cstatus);
+}
+
+/**
+ * Рассчитать профиль разгона и торможения (трапецию) для мотора,
+ * подготовленного к запуску ограниченной серии шагов с постоянной
+ * скоростью (prepare_steps): разгон с начальной скорости entry_speed до
+ * скорости step_delay, торможение до конечной скорости exit_speed.
+ * 
+ * Вызывается при подготовке серии, поэтому может позволить себе
+ * деление и корень в плавающей точке.
+ * 
+ * @param entry_speed - начальная скорость, шагов в секунду
+ * @param exit_speed - конечная скорость, шагов в секунду
+ * @return задержка перед первым шагом, микросекунды
+ */
+static unsigned long _prepare_accel(motor_cycle_info_t* cstatus, unsigned long max_accel,
+        unsigned long entry_speed, unsigned long exit_speed) {
+    unsigned long step_count = cstatus->step_count;
+    
+    cstatus->delay_source = ACCEL;
+    cstatus->accel_c0 = (unsigned long)(1000000.0 * 256 / sqrt((double)max_accel));
+    
+    // индексы на кривой разгона с нуля: скорость v на индексе k=v^2/(2*max_accel)-0.5
+    double cruise_speed = 1000000.0 / cstatus->step_delay;
+    double cruise_index = cruise_speed * cruise_speed / (2.0 * max_accel) - 0.5;
+    double entry_index = (double)entry_speed * entry_speed / (2.0 * max_accel) - 0.5;
+    double exit_index = (double)exit_speed * exit_speed / (2.0 * max_accel) - 0.5;
+    if(entry_index < 0) entry_index = 0;
+    if(exit_index < 0) exit_index = 0;
+    
+    unsigned long entry_k = (unsigned long)(entry_index + 0.5);
+    unsigned long exit_k = (unsigned long)(exit_index + 0.5);
+    
+    // шаги разгона и торможения до/с крейсерской скорости
+    double accel_steps = cruise_index > entry_k ? ceil(cruise_index - entry_k) : 0;
+    double decel_steps = cruise_index > exit_k ? ceil(cruise_index - exit_k) : 0;
+    if(accel_steps + decel_steps > step_count) {
+        // до крейсерской скорости не разгоняемся - треугольник
+        accel_steps = floor(((double)step_count + exit_k - entry_k) / 2);
+        if(accel_steps < 0) accel_steps = 0;
+        if(accel_steps > step_count) accel_steps = step_count;
+        decel_steps = step_count - accel_steps;
+    }
+    cstatus->accel_steps = (unsigned long)accel_steps;
+    cstatus->decel_start = step_count - (unsigned long)decel_steps;
+    cstatus->decel_index = exit_k + (unsigned long)decel_steps - 1;
+    _accel_u_at(cstatus->decel_index,
+        &cstatus->decel_u, &cstatus->decel_u_exp);
+    
+    // задержка перед первым шагом (дальше - _accel_next_step_delay в обработчике)
+    if(cstatus->accel_steps > 0) {
+        // первый шаг разгона
+        cstatus->accel_index = entry_k;
+        _accel_u_at(entry_k, &cstatus->accel_u, &cstatus->accel_u_exp);
+    } else if(cstatus->decel_start == 0) {
+        // сразу торможение
+        cstatus->accel_index = cstatus->decel_index;
+        cstatus->accel_u = cstatus->decel_u;
+        cstatus->accel_u_exp = cstatus->decel_u_exp;
+    } else {
+        // сразу крейсерская скорость
+        cstatus->accel_u = 0;
+        cstatus->accel_u_exp = 0;
+    }
+    cstatus->accel_frac = 0;
+    return _accel_clip_step_delay(cstatus);
+}
+
+/**
+ * Подготовить мотор к запуску ограниченной серии шагов с плавным разгоном
+ * и торможением: мотор разгоняется с места с постоянным ускорением
+ * max_accel (init_stepper_accel) до скорости step_delay, идет с этой
+ * скоростью и тормозит до полной остановки к последнему шагу
+ * (трапецеидальный профиль скорости). Если шагов не хватает на разгон
+ * до заданной скорости, начинает тормозить с середины пути (треугольник).
+ * 
+ * Задержки перед шагами вычисляются в обработчике прерывания по ходу
+ * движения, без деления, квадратного корня и 64-битной арифметики
+ * на каждом шаге (умножения 32 бит с фиксированной точкой).
+ * 
+ * Если для мотора не задано ускорение (max_accel=0), мотор движется
+ * с постоянной скоростью, как с prepare_steps.
+ * 
+ * @param step_count - количество шагов, знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами на крейсерской скорости,
+ *     микросекунды (0 для максимальной скорости)
+ * @param calibrate_mode - режим калибровки (см. prepare_steps)
+ */
+void prepare_accel_steps(stepper *smotor, long step_count, unsigned long step_delay, calibrate_mode_t calibrate_mode) {
+    int sm_i = _fill->stepper_count;
+    prepare_steps(smotor, step_count, step_delay, calibrate_mode);
+    
+    if(smotor->max_accel > 0) {
+        _fill->step_timer[sm_i] = _prepare_accel(&_fill->cstatuses[sm_i], smotor->max_accel, 0, 0);
+    }
+}
+
+///////////////////////////
+// Разгон и торможение с ограничением рывка (S-кривая)
+//
+// Разгон с места до крейсерской скорости V из 3х участков по времени:
+// ускорение растет с рывком max_jerk от 0 до ap (T1=ap/max_jerk),
+// держится на ap, падает с рывком max_jerk до 0 (еще T1); торможение -
+// зеркально разгону, вместе с движением на крейсерской скорости - 7 участков.
+// Скорость - известная функция времени, поэтому ошибка не накапливается:
+// в обработчике считаем скорость в середине следующего шага и задержку
+// как обратную к ней величину (итерациями Ньютона от предыдущей задержки,
+// без деления; умножения 32 бит - _accel_mul_shr).
+
+/**
+ * Доля крейсерской скорости в момент времени theta с начала разгона,
+ * 31 бит дробной части.
+ * 
+ * @param theta - время в долях T1, 16 бит дробной части
+ */
+static unsigned long _scurve_velocity_at(motor_cycle_info_t* cstatus, unsigned long theta) {
+    if(theta >= cstatus->scurve_theta_end) {
+        // крейсерская скорость
+        return 1ul << 31;
+    } else if(cstatus->scurve_theta_end - theta <= 65536) {
+        // ускорение падает: nu = 1 - nu1*(theta_end-theta)^2
+        unsigned long s = cstatus->scurve_theta_end - theta;
+        return (1ul << 31) - _accel_mul_shr(cstatus->scurve_nu1, _accel_mul_shr(s, s, 16), 16);
+    } else if(theta <= 65536) {
+        // ускорение растет: nu = nu1*theta^2
+        return _accel_mul_shr(cstatus->scurve_nu1, _accel_mul_shr(theta, theta, 16), 16);
+    } else {
+        // постоянное ускорение: nu = nu1 + 2*nu1*(theta-1)
+        return cstatus->scurve_nu1 + _accel_mul_shr(cstatus->scurve_nu1, theta - 65536, 15);
+    }
+}
+
+/**
+ * Задержка перед шагом с номером step (шаги с нуля) для мотора
+ * с разгоном и торможением по S-кривой, микросекунды. Вызывается
+ * по порядку для каждого следующего шага.
+ */
+static unsigned long _scurve_next_step_delay(motor_cycle_info_t* cstatus, unsigned long step) {
+    unsigned long delay;
+    if(step + 1 >= (unsigned long)cstatus->step_count) {
+        // последний шаг торможения - зеркально первому шагу разгона
+        delay = cstatus->scurve_first_delay;
+    } else if(step < cstatus->accel_steps || step >= cstatus->decel_start) {
+        if(step == cstatus->decel_start) {
+            // начало торможения
+            cstatus->scurve_time = 0;
+        }
+        
+        // время в середине следующего шага в долях T1 (длительность шага -
+        // по скорости на предыдущем шаге)
+        unsigned long theta = _accel_mul_shr(cstatus->scurve_time + cstatus->scurve_half_delay,
+            cstatus->scurve_theta_mult, cstatus->scurve_theta_shift);
+        if(step >= cstatus->decel_start) {
+            // торможение - разгон в обратном времени
+            theta = theta + cstatus->scurve_theta_min < cstatus->scurve_theta_end ?
+                cstatus->scurve_theta_end - theta : cstatus->scurve_theta_min;
+        }
+        unsigned long nu = _scurve_velocity_at(cstatus, theta);
+        
+        // rho = 1/nu: две итерации Ньютона rho = rho*(2 - nu*rho)
+        // от значения на предыдущем шаге
+        for(int i = 0; i < 2; i++) {
+            // nu*rho, 16 бит дробной части (nu <= 1: nu*rho <= rho)
+            unsigned long nu_rho = nu >= (1ul << 31) ? cstatus->scurve_rho :
+                _accel_mul_hi(nu << 1, cstatus->scurve_rho);
+            if(nu_rho >= (2ul << 16)) {
+                // слишком грубое приближение - уменьшаем и пробуем еще раз
+                cstatus->scurve_rho >>= 1;
+            } else {
+                cstatus->scurve_rho = _accel_mul_shr(cstatus->scurve_rho, (2ul << 16) - nu_rho, 16);
+            }
+        }
+        delay = _accel_mul_shr(cstatus->scurve_cruise_delay, cstatus->scurve_rho, 16);
+        cstatus->scurve_half_delay = delay >> (8 + 1);
+    } else {
+        // движение с постоянной скоростью
+        delay = cstatus->scurve_cruise_delay;
+    }
+    
+    delay = _accel_clip_delay(cstatus, delay);
+    cstatus->scurve_time += delay;
+    return delay;
+}
+
+/**
+ * Рассчитать профиль разгона и торможения по S-кривой для мотора,
+ * подготовленного к запуску ограниченной серии шагов с постоянной
+ * скоростью (prepare_steps): разгон с места до скорости step_delay
+ * и торможение до остановки с ограничением ускорения и рывка.
+ * 
+ * Вызывается при подготовке серии, поэтому может позволить себе
+ * деление и корень в плавающей точке.
+ */
+static void _prepare_scurve(int sm_i, unsigned long max_accel, unsigned long max_jerk) {
+    motor_cycle_info_t* cstatus = &_fill->cstatuses[sm_i];
+    double step_count = cstatus->step_count;
+    double accel = max_accel;
+    double jerk = max_jerk;
+    
+    // крейсерская скорость, шагов в секунду: если шагов не хватает на разгон
+    // и торможение, снижаем (половина пути при разгоне до скорости v:
+    // v*(v/a+a/j)/2 с участком постоянного ускорения, v*sqrt(v/j) без него)
+    double v = 1000000.0 / cstatus->step_delay;
+    double accel_dist = v >= accel * accel / jerk ?
+        v * (v / accel + accel / jerk) / 2 : v * sqrt(v / jerk);
+    if(2 * accel_dist > step_count) {
+        double v_min = 0, v_max = v;
+        for(int i = 0; i < 32; i++) {
+            v = (v_min + v_max) / 2;
+            accel_dist = v >= accel * accel / jerk ?
+                v * (v / accel + accel / jerk) / 2 : v * sqrt(v / jerk);
+            if(2 * accel_dist > step_count) {
+                v_max = v;
+            } else {
+                v_min = v;
+            }
+        }
+        v = v_min;
+        accel_dist = v >= accel * accel / jerk ?
+            v * (v / accel + accel / jerk) / 2 : v * sqrt(v / jerk);
+    }
+    
+    // наибольшее ускорение и длительности участков, секунды
+    double accel_peak = v >= accel * accel / jerk ? accel : sqrt(v * jerk);
+    double t1 = accel_peak / jerk;
+    double t_accel = v / accel_peak + t1;
+    
+    cstatus->delay_source = SCURVE;
+    cstatus->accel_steps = (unsigned long)(accel_dist + 0.5);
+    if(cstatus->accel_steps > (unsigned long)cstatus->step_count) {
+        cstatus->accel_steps = cstatus->step_count;
+    }
+    cstatus->decel_start = cstatus->step_count - cstatus->accel_steps;
+    
+    // theta = t/T1: 16 бит дробной части, множитель - 21 бит
+    double theta_mult = 65536.0 / (t1 * 1000000);
+    unsigned char theta_shift = 0;
+    while(theta_mult < (1ul << 20) && theta_shift < 63) {
+        theta_mult *= 2;
+        theta_shift++;
+    }
+    cstatus->scurve_theta_mult = (unsigned long)theta_mult;
+    cstatus->scurve_theta_shift = theta_shift;
+    cstatus->scurve_theta_end = (unsigned long)(t_accel / t1 * 65536);
+    cstatus->scurve_nu1 = (unsigned long)(jerk * t1 * t1 / 2 / v * (1ul << 31));
+    cstatus->scurve_cruise_delay = (unsigned long)(1000000.0 * 256 / v);
+    
+    // первый шаг с места: на участке нарастания ускорения j*t^3/6=1,
+    // иначе на участке постоянного ускорения
+    double t_first, v_first;
+    if(jerk * t1 * t1 * t1 / 6 >= 1) {
+        t_first = pow(6 / jerk, 1.0 / 3);
+        v_first = jerk * t_first * t_first / 2;
+    } else {
+        double x1 = jerk * t1 * t1 * t1 / 6;
+        double v1 = jerk * t1 * t1 / 2;
+        double s = (sqrt(v1 * v1 + 2 * accel_peak * (1 - x1)) - v1) / accel_peak;
+        t_first = t1 + s;
+        v_first = v1 + accel_peak * s;
+    }
+    cstatus->scurve_first_delay = (unsigned long)(t_first * 1000000 * 256);
+    cstatus->scurve_theta_min = (unsigned long)(t_first / t1 * 65536);
+    cstatus->scurve_rho = (unsigned long)(v / v_first * 65536);
+    cstatus->scurve_half_delay = _accel_mul_shr(cstatus->scurve_cruise_delay, cstatus->scurve_rho, 16 + 8 + 1);
+    
+    cstatus->accel_frac = 0;
+    cstatus->scurve_time = 0;
+    _fill->step_timer[sm_i] = _scurve_next_step_delay(cstatus, cstatus->step_count);
+}
+
+/**
+ * Подготовить мотор к запуску ограниченной серии шагов с плавным разгоном
+ * и торможением по S-кривой: как prepare_accel_steps, но ускорение
+ * нарастает и спадает постепенно с рывком max_jerk (init_stepper_accel),
+ * а не включается сразу. Профиль скорости из 7 участков: рост ускорения,
+ * постоянное ускорение, спад ускорения, крейсерская скорость и зеркально
+ * для торможения. Резкие скачки ускорения на границах трапеции раскачивают
+ * механику (резонанс ремней), с ограничением рывка можно оставить
+ * ускорение больше при той же вибрации.
+ * 
+ * Задержки перед шагами вычисляются в обработчике прерывания по ходу
+ * движения в фиксированной точке, без деления, квадратного корня
+ * и 64-битной арифметики (умножения 32 бит).
+ * 
+ * Если для мотора не задан рывок (max_jerk=0), профиль - трапеция
+ * (prepare_accel_steps), если не задано ускорение - постоянная скорость.
+ * 
+ * @param step_count - количество шагов, знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами на крейсерской скорости,
+ *     микросекунды (0 для максимальной скорости)
+ * @param calibrate_mode - режим калибровки (см. prepare_steps)
+ */
+void prepare_scurve_steps(stepper *smotor, long step_count, unsigned long step_delay, calibrate_mode_t calibrate_mode) {
+    int sm_i = _fill->stepper_count;
+    prepare_steps(smotor, step_count, step_delay, calibrate_mode);
+    
+    if(smotor->max_accel > 0 && smotor->max_jerk > 0) {
+        _prepare_scurve(sm_i, smotor->max_accel, smotor->max_jerk);
+    } else if(smotor->max_accel > 0) {
+        _fill->step_timer[sm_i] = _prepare_accel(&_fill->cstatuses[sm_i], smotor->max_accel, 0, 0);
+    }
+}
+
+/**
+ * Подготовить мотор к запуску ограниченной серии шагов - задать нужное количество
+ * шагов и задержку между шагами для регулирования скорости (0 для максимальной скорости).
+ * 
+ * @param step_count - количество шагов, знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами, микросекунды (0 для максимальной скорости)
+ * @param calibrate_mode - режим калибровки
+ *     NONE: режим калибровки выключен - останавливать вращение при выходе за виртуальные границы
+ *           рабочей области [min_pos, max_pos] (аппаратные проверяются ВСЕГДА);
+ *     CALIBRATE_START_MIN_POS: установка начальной позиции (сбрасывать current_pos в min_pos при каждом шаге);
+ *     CALIBRATE_BOUNDS_MAX_POS: установка размеров рабочей области (сбрасывать max_pos в current_pos при каждом шаге)
+ */
+void prepare_steps(stepper *smotor, long step_count, unsigned long step_delay, calibrate_mode_t calibrate_mode) {
+    // резерв нового места на мотор в списке
+    int sm_i = _fill->stepper_count;
+    _fill->stepper_count++;
+    
+    // ссылка на мотор
+    _fill->smotors[sm_i] = smotor;
+    
+    // Подготовить движение
+    
+    // задать направление
+    _fill->cstatuses[sm_i].dir = step_count > 0 ? 1 : -1;
+    
+    // шагаем ограниченное количество шагов
+    _fill->non_stop[sm_i] = false;
+    // сделать step_count положительным
+    _fill->cstatuses[sm_i].step_count = step_count > 0 ? step_count : -step_count;
+    
+    // скорость вращения - постоянная
+    _fill->cstatuses[sm_i].delay_source = CONSTANT;
+    if(step_delay == 0) {
+        // 0 - движение с максимальной скоростью
+        _fill->cstatuses[sm_i].step_delay = smotor->step_delay;
+    } else {
+        _fill->cstatuses[sm_i].step_delay = step_delay;
+    }
+    
+    // режим калибровки
+    _fill->cstatuses[sm_i].calibrate_mode = calibrate_mode;
+    
+    // Взводим счетчики
+    _fill->step_counter[sm_i] = _fill->cstatuses[sm_i].step_count;
+    // задержка перед первым шагом
+    _fill->step_timer[sm_i] = _fill->cstatuses[sm_i].step_delay;
+    
+    // Динамический статус мотора в цикле вращения
+    // ожидаем пуска (мотор может еще вращаться в текущем цикле)
+    if(_fill->smotors[sm_i]->status != STEPPER_STATUS_RUNNING) {
+        _fill->smotors[sm_i]->status = STEPPER_STATUS_IDLE;
+        // обнулим ошибки
+        _fill->smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    }
+    
+    //
+    _fill->stopped[sm_i] = false;
+}
+
+/**
+ * Подготовить мотор к запуску на беспрерывное вращение - задать направление и задержку между
+ * шагами для регулирования скорости (0 для максимальной скорости).
+ *
+ * Мотор будет вращаться до тех пор, пока не будет вручную остановлен вызовом finish_stepper_cycle()
+ *
+ * @param dir - направление вращения: 1 - вращать вперед, -1 - назад.
+ * @param step_delay - задержка между двумя шагами, микросекунды (0 для максимальной скорости).
+ * @param calibrate_mode - режим калибровки
+ *     NONE: режим калибровки выключен - останавливать вращение при выходе за виртуальные границы
+ *           рабочей области [min_pos, max_pos] (аппаратные проверяются ВСЕГДА);
+ *     CALIBRATE_START_MIN_POS: установка начальной позиции (сбрасывать current_pos в min_pos при каждом шаге);
+ *     CALIBRATE_BOUNDS_MAX_POS: установка размеров рабочей области (сбрасывать max_pos в current_pos при каждом шаге)
+ */
+void prepare_whirl(stepper *smotor, int dir, unsigned long step_delay, calibrate_mode_t calibrate_mode) {
+    // резерв нового места на мотор в списке
+    int sm_i = _fill->stepper_count;
+    _fill->stepper_count++;
+    
+    // ссылка на мотор
+    _fill->smotors[sm_i] = smotor;
+    
+    // Подготовить движение
+    
+    // задать направление
+    _fill->cstatuses[sm_i].dir = dir;
+    
+    // шагаем без остановки
+    _fill->non_stop[sm_i] = true;
+    
+    // скорость вращения - постоянная
+    _fill->cstatuses[sm_i].delay_source = CONSTANT;
+    if(step_delay == 0 ) {
+        // 0 - движение с максимальной скоростью
+        _fill->cstatuses[sm_i].step_delay = smotor->step_delay;
+    } else {
+        _fill->cstatuses[sm_i].step_delay = step_delay;
+    }
+    
+    // режим калибровки
+    _fill->cstatuses[sm_i].calibrate_mode = calibrate_mode;
+    
+    // взводим счетчики
+    // задержка перед первым шагом
+    _fill->step_timer[sm_i] = _fill->cstatuses[sm_i].step_delay;
+    
+    // на всякий случай обнулим
+    _fill->cstatuses[sm_i].step_count = 0;
+    _fill->step_counter[sm_i] = 0;
+    
+    // Динамический статус мотора в цикле вращения
+    // ожидаем пуска (мотор может еще вращаться в текущем цикле)
+    if(_fill->smotors[sm_i]->status != STEPPER_STATUS_RUNNING) {
+        _fill->smotors[sm_i]->status = STEPPER_STATUS_IDLE;
+        // обнулим ошибки
+        _fill->smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    }
+    
+    //
+    _fill->stopped[sm_i] = false;
+}
+
+#if STEPPER_BUFFERED_STEPS
 /**
  * Подготовить мотор к запуску ограниченной серии шагов с переменной скоростью - задержки на каждом
  * шаге вычисляются заранее, передаются в буфере delay_buffer.
@@ -478,247 +1673,1346 @@ void prepare_whirl(stepper *smotor, int dir, unsigned long step_delay, calibrate
  *     виртуальном шаге, знак задает направление вращения мотора.
  * Значение по умолчанию step_count=1: виртуальные шаги соответствуют аппаратным
  */
-void prepare_simple_buffered_steps(stepper *smotor, int buf_size, unsigned long* delay_buffer, long step_count) {
-    // резерв нового места на мотор в списке
-    int sm_i = _stepper_count;
-    _stepper_count++;
+void prepare_simple_buffered_steps(stepper *smotor, int buf_size, unsigned long* delay_buffer, long step_count) {
+    // резерв нового места на мотор в списке
+    int sm_i = _fill->stepper_count;
+    _fill->stepper_count++;
+    
+    // ссылка на мотор
+    _fill->smotors[sm_i] = smotor;
+    
+    // Подготовить движение
+    
+    // задать направление
+    _fill->cstatuses[sm_i].dir = step_count > 0 ? 1 : -1;
+    
+    // шагаем ограниченное количество шагов
+    _fill->non_stop[sm_i] = false;
+    // сделать step_count положительным
+    _fill->cstatuses[sm_i].step_count = buf_size > 0 ? buf_size*step_count : -buf_size*step_count;
+    
+    // настройки переменной скорости вращения
+    _fill->cstatuses[sm_i].delay_source = BUFFER;
+    _fill->cstatuses[sm_i].delay_buffer = delay_buffer;
+    _fill->cstatuses[sm_i].scale = step_count;
+    
+    
+    // выключить режим калибровки
+    _fill->cstatuses[sm_i].calibrate_mode = NONE;
+    
+    // Взводим счетчики
+    _fill->step_counter[sm_i] = _fill->cstatuses[sm_i].step_count;
+    // задержка перед первым шагом
+    _fill->step_timer[sm_i] = _fill->cstatuses[sm_i].delay_buffer[0];
+    
+    // Динамический статус мотора в цикле вращения
+    // ожидаем пуска (мотор может еще вращаться в текущем цикле)
+    if(_fill->smotors[sm_i]->status != STEPPER_STATUS_RUNNING) {
+        _fill->smotors[sm_i]->status = STEPPER_STATUS_IDLE;
+        // обнулим ошибки
+        _fill->smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    }
+    
+    //
+    _fill->stopped[sm_i] = false;
+}
+
+/**
+ * Подготовить серию шагов с переменной скоростью. Для каждой подсерии задаётся задержка между шагами,
+ * количество шагов и направление вращения (знак количества шагов) - соответствующие элементы
+ * массивов delay_buffer и step_buffer.
+ * 
+ * Оба массива delay_buffer и step_buffer должны существовать и не меняться до завершения
+ * цикла вращения (рекомендуется объявлять их как глобальные переменные модуля или
+ * как локальные переменные внутри функции с модификатором static).
+ * 
+ *   // 
+ *   static unsigned long delay_buffer[3];
+ *   static long step_buffer[3];
+ * 
+ *   // значения задержек между шагами на каждом подцикле
+ *   delay_buffer[0] = y_step_delay_us; // базовая скорость
+ *   delay_buffer[1] = y_step_delay_us*10; // в 10 раз медленнее
+ *   delay_buffer[2] = y_step_delay_us*2; // в 2 раза медленнее
+ * 
+ *   // количество шагов на каждом подцикле
+ *   step_buffer[0] = 200*10; // туда
+ *   step_buffer[1] = -200*5; // обратно
+ *   step_buffer[2] = 200*2; // туда
+ * 
+ *   prepare_buffered_steps(&sm_y, 3, delay_buffer, step_buffer);
+ * 
+ * @param buf_size - количество элементов в буфере delay_buffer (количество подциклов)
+ * @param delay_buffer - (step delay buffer) - массив задержек перед каждым следующим шагом, микросекунды
+ * @param step_buffer - (step count buffer) - массив с количеством шагов для каждого
+ *     значения задержки из delay_buffer. Может содержать положительные и отрицательные значения,
+ *     знак задает направление вращения мотора.
+ *     Должен содержать ровно столько же элементов, сколько delay_buffer
+ */
+void prepare_buffered_steps(stepper *smotor, int buf_size, unsigned long* delay_buffer, long* step_buffer) {
+    // резерв нового места на мотор в списке
+    int sm_i = _fill->stepper_count;
+    _fill->stepper_count++;
+    
+    // ссылка на мотор
+    _fill->smotors[sm_i] = smotor;
+    
+    // Подготовить движение
+    _fill->cstatuses[sm_i].cycle_count = buf_size;
+    _fill->cstatuses[sm_i].cycle_counter = 0;
+    _fill->cstatuses[sm_i].step_buffer = step_buffer;
+
+    long step_count = _fill->cstatuses[sm_i].step_buffer[0];
+    // сделать step_count положительным
+    _fill->cstatuses[sm_i].step_count = step_count > 0 ? step_count : -step_count;
+    
+    // задать направление
+    _fill->cstatuses[sm_i].dir = step_count > 0 ? 1 : -1;
+    
+    // скорость вращения - постоянная на каждом цикле
+    _fill->cstatuses[sm_i].delay_source = CONSTANT;
+    _fill->cstatuses[sm_i].delay_buffer = delay_buffer;
+    unsigned long step_delay = _fill->cstatuses[sm_i].delay_buffer[0];
+    if(step_delay == 0) {
+        // движение с максимальной скоростью
+        _fill->cstatuses[sm_i].step_delay = _fill->smotors[sm_i]->step_delay;
+    } else {
+        _fill->cstatuses[sm_i].step_delay = step_delay;
+    }
+    
+    // Взводим счетчики
+    _fill->step_counter[sm_i] = _fill->cstatuses[sm_i].step_count;
+    // задержка перед первым шагом
+    _fill->step_timer[sm_i] = _fill->cstatuses[sm_i].step_delay;
+    
+    // Динамический статус мотора в цикле вращения
+    // ожидаем пуска (мотор может еще вращаться в текущем цикле)
+    if(_fill->smotors[sm_i]->status != STEPPER_STATUS_RUNNING) {
+        _fill->smotors[sm_i]->status = STEPPER_STATUS_IDLE;
+        // обнулим ошибки
+        _fill->smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    }
+    
+    //
+    _fill->stopped[sm_i] = false;
+}
+#endif // STEPPER_BUFFERED_STEPS
+
+///////////////////////////
+// Потоковый буфер подсерий
+//
+// Как очередь движений: писатель (главный цикл или refill) меняет только
+// head, читатель (обработчик прерывания) - только tail, индексы однобайтовые.
+
+/**
+ * Подготовить потоковый буфер подсерий шагов.
+ */
+void stepper_stream_init(stepper_stream_t* stream, int buf_size, unsigned long* delay_buffer, long* step_buffer,
+        int low_watermark, void (*refill)(stepper_stream_t* stream, void* context), void* context) {
+    stream->delay_buffer = delay_buffer;
+    stream->step_buffer = step_buffer;
+    stream->size = buf_size < 255 ? buf_size : 255;
+    stream->head = 0;
+    stream->tail = 0;
+    stream->ended = false;
+    stream->low_watermark = low_watermark;
+    stream->refill = refill;
+    stream->context = context;
+}
+
+/**
+ * Добавить подсерию шагов в конец потокового буфера.
+ * 
+ * @return
+ *     true - подсерия добавлена (подсерия без шагов пропускается)
+ *     false - буфер заполнен или уже завершен
+ */
+bool stepper_stream_put(stepper_stream_t* stream, unsigned long step_delay, long step_count) {
+    if(stream->ended) {
+        return false;
+    }
+    
+    unsigned char head = stream->head;
+    unsigned char next_head = head + 1 < stream->size ? head + 1 : 0;
+    if(next_head == stream->tail) {
+        return false;
+    }
+    if(step_count == 0) {
+        // шагать некуда
+        return true;
+    }
+    
+    stream->delay_buffer[head] = step_delay;
+    stream->step_buffer[head] = step_count;
+    
+    _ring_barrier();
+    stream->head = next_head;
+    return true;
+}
+
+/**
+ * Больше подсерий не будет.
+ */
+void stepper_stream_end(stepper_stream_t* stream) {
+    stream->ended = true;
+}
+
+/**
+ * Количество подсерий в потоковом буфере, ожидающих выполнения.
+ */
+int stepper_stream_count(stepper_stream_t* stream) {
+    int count = (int)stream->head - (int)stream->tail;
+    return count >= 0 ? count : count + stream->size;
+}
+
+/**
+ * Потоковый буфер заполнен.
+ */
+bool stepper_stream_full(stepper_stream_t* stream) {
+    return stepper_stream_count(stream) >= stream->size - 1;
+}
+
+/**
+ * В потоковом буфере осталось не больше low_watermark подсерий.
+ */
+bool stepper_stream_low(stepper_stream_t* stream) {
+    return !stream->ended && stepper_stream_count(stream) <= stream->low_watermark;
+}
+
+/**
+ * Загрузить следующую подсерию из потокового буфера (сторона читателя):
+ * количество шагов, направление и задержку между шагами.
+ * 
+ * @return
+ *     true - подсерия загружена
+ *     false - буфер пуст
+ */
+static bool _stream_next(cycle_program_t* program, int i) {
+    motor_cycle_info_t* cstatus = &program->cstatuses[i];
+    stepper* smotor = program->smotors[i];
+    stepper_stream_t* stream = cstatus->stream;
+    unsigned char tail = stream->tail;
+    if(tail == stream->head) {
+        return false;
+    }
+    _ring_barrier();
+    
+    long step_count = stream->step_buffer[tail];
+    unsigned long step_delay = stream->delay_buffer[tail];
+    
+    _ring_barrier();
+    stream->tail = tail + 1 < stream->size ? tail + 1 : 0;
+    
+    // сделать step_count положительным
+    cstatus->step_count = step_count > 0 ? step_count : -step_count;
+    program->step_counter[i] = cstatus->step_count;
+    cstatus->dir = step_count > 0 ? 1 : -1;
+    
+    // 0 - движение с максимальной скоростью
+    cstatus->step_delay = step_delay != 0 ? step_delay : smotor->step_delay;
+    
+    // пора пополнить буфер
+    if(stream->refill != NULL && !stream->ended &&
+            stepper_stream_count(stream) <= stream->low_watermark) {
+        stream->refill(stream, stream->context);
+    }
+    return true;
+}
+
+/**
+ * Подготовить серию шагов с переменной скоростью из потокового буфера.
+ * 
+ * @param stream - потоковый буфер с первой подсерией
+ */
+void prepare_stream_steps(stepper *smotor, stepper_stream_t* stream) {
+    // резерв нового места на мотор в списке
+    int sm_i = _fill->stepper_count;
+    _fill->stepper_count++;
+    
+    // ссылка на мотор
+    _fill->smotors[sm_i] = smotor;
+    
+    // Динамический статус мотора в цикле вращения
+    // ожидаем пуска (мотор может еще вращаться в текущем цикле)
+    if(_fill->smotors[sm_i]->status != STEPPER_STATUS_RUNNING) {
+        _fill->smotors[sm_i]->status = STEPPER_STATUS_IDLE;
+        // обнулим ошибки
+        _fill->smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    }
+    
+    // Подготовить движение
+    
+    // подсерии загружаются из буфера по ходу движения
+    _fill->cstatuses[sm_i].cycle_count = 0;
+    _fill->cstatuses[sm_i].cycle_counter = 0;
+    _fill->cstatuses[sm_i].stream = stream;
+    _fill->non_stop[sm_i] = false;
+    
+    // скорость вращения - постоянная на каждой подсерии
+    _fill->cstatuses[sm_i].delay_source = CONSTANT;
+    
+    // выключить режим калибровки
+    _fill->cstatuses[sm_i].calibrate_mode = NONE;
+    
+    _fill->stopped[sm_i] = false;
+    
+    // первая подсерия
+    if(!_stream_next(_fill, sm_i)) {
+        // шагать нечего
+        _fill->cstatuses[sm_i].step_count = 0;
+        _fill->step_counter[sm_i] = 0;
+        _fill->cstatuses[sm_i].dir = 1;
+        _fill->cstatuses[sm_i].step_delay = smotor->step_delay;
+        _fill->stopped[sm_i] = true;
+        
+        if(!stream->ended) {
+            // буфер пуст, а серия не завершена
+            _fill->smotors[sm_i]->error |= STEPPER_ERROR_BUFFER_UNDERRUN;
+        }
+    }
+    
+    // задержка перед первым шагом
+    _fill->step_timer[sm_i] = _fill->cstatuses[sm_i].step_delay;
+}
+
+#if STEPPER_DYNAMIC_STEPS
+/**
+ * Подготовить мотор к запуску ограниченной серии шагов с переменной скоростью - задать нужное количество
+ * шагов и указатель на функцию, вычисляющую задержку перед каждым шагом для регулирования скорости.
+ * 
+ * @param step_count - количество шагов, знак задает направление вращения
+ * @param curve_context - указатель на объект, содержащий всю необходимую информацию для вычисления
+ *     времени до следующего шага
+ * @param next_step_delay - указатель на функцию, вычисляющую задержку перед следующим шагом, микросекунды
+ */
+void prepare_dynamic_steps(stepper *smotor, long step_count,
+        void* curve_context, unsigned long (*next_step_delay)(unsigned long curr_step, void* curve_context)) {
+    // резерв нового места на мотор в списке
+    int sm_i = _fill->stepper_count;
+    _fill->stepper_count++;
+    
+    // ссылка на мотор
+    _fill->smotors[sm_i] = smotor;
+    
+    // Подготовить движение
+    
+    // задать направление
+    _fill->cstatuses[sm_i].dir = step_count > 0 ? 1 : -1;
+    
+    // шагаем ограниченное количество шагов
+    _fill->non_stop[sm_i] = false;
+    // сделать step_count положительным
+    _fill->cstatuses[sm_i].step_count = step_count > 0 ? step_count : -step_count;
+    
+    // настройки переменной скорости вращения
+    _fill->cstatuses[sm_i].delay_source = DYNAMIC;
+    _fill->cstatuses[sm_i].curve_context = curve_context;
+    _fill->cstatuses[sm_i].next_step_delay = next_step_delay;
+    _fill->cstatuses[sm_i].prefetch = NULL;
+    
+    // выключить режим калибровки
+    _fill->cstatuses[sm_i].calibrate_mode = NONE;
+    
+    // Взводим счетчики
+    _fill->step_counter[sm_i] = _fill->cstatuses[sm_i].step_count;
+    // задержка перед первым шагом (step_delay - для проверки в _check_program)
+    _fill->step_timer[sm_i] = _fill->cstatuses[sm_i].next_step_delay(0, _fill->cstatuses[sm_i].curve_context);
+    _fill->cstatuses[sm_i].step_delay = _fill->step_timer[sm_i];
+    
+    // Динамический статус мотора в цикле вращения
+    // ожидаем пуска (мотор может еще вращаться в текущем цикле)
+    if(_fill->smotors[sm_i]->status != STEPPER_STATUS_RUNNING) {
+        _fill->smotors[sm_i]->status = STEPPER_STATUS_IDLE;
+        // обнулим ошибки
+        _fill->smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    }
+    
+    //
+    _fill->stopped[sm_i] = false;
+}
+
+/**
+ * Подготовить мотор к запуску на беспрерывное вращение с переменной скоростью - задать нужное количество
+ * шагов и указатель на функцию, вычисляющую задержку перед каждым шагом для регулирования скорости.
+ * 
+ * @param dir - направление вращения: 1 - вращать вперед, -1 - назад.
+ * @param curve_context - указатель на объект, содержащий всю необходимую информацию для вычисления
+ *     времени до следующего шага
+ * @param next_step_delay - указатель на функцию, вычисляющую задержку перед следующим шагом, микросекунды
+ */
+void prepare_dynamic_whirl(stepper *smotor, int dir,
+        void* curve_context, unsigned long (*next_step_delay)(unsigned long curr_step, void* curve_context)) {
+    // резерв нового места на мотор в списке
+    int sm_i = _fill->stepper_count;
+    _fill->stepper_count++;
+    
+    // ссылка на мотор
+    _fill->smotors[sm_i] = smotor;
+    
+    // Подготовить движение
+    
+    // задать направление
+    _fill->cstatuses[sm_i].dir = dir;
+    
+    // шагаем без остановки
+    _fill->non_stop[sm_i] = true;
+    
+    // настройки переменной скорости вращения
+    _fill->cstatuses[sm_i].delay_source = DYNAMIC;
+    _fill->cstatuses[sm_i].curve_context = curve_context;
+    _fill->cstatuses[sm_i].next_step_delay = next_step_delay;
+    _fill->cstatuses[sm_i].prefetch = NULL;
+    
+    // выключить режим калибровки
+    _fill->cstatuses[sm_i].calibrate_mode = NONE;
+    
+    // Взводим счетчики
+    // задержка перед первым шагом (step_delay - для проверки в _check_program)
+    _fill->step_timer[sm_i] = _fill->cstatuses[sm_i].next_step_delay(0, _fill->cstatuses[sm_i].curve_context);
+    _fill->cstatuses[sm_i].step_delay = _fill->step_timer[sm_i];
+    
+    // на всякий случай обнулим
+    _fill->cstatuses[sm_i].step_count = 0;
+    _fill->step_counter[sm_i] = 0;
+    
+    // Динамический статус мотора в цикле вращения
+    // ожидаем пуска (мотор может еще вращаться в текущем цикле)
+    if(_fill->smotors[sm_i]->status != STEPPER_STATUS_RUNNING) {
+        _fill->smotors[sm_i]->status = STEPPER_STATUS_IDLE;
+        // обнулим ошибки
+        _fill->smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    }
+    
+    //
+    _fill->stopped[sm_i] = false;
+}
+
+/**
+ * Подготовить буфер опережающего вычисления задержек для prepare_dynamic_steps
+ * и prepare_dynamic_whirl.
+ * 
+ * @param buf_size - количество элементов в массиве buffer (не больше 255)
+ * @param buffer - массив для вычисленных задержек, микросекунды
+ * @param curve_context - контекст для функции next_step_delay
+ * @param next_step_delay - функция, вычисляющая задержку перед следующим шагом
+ */
+void stepper_prefetch_init(stepper_prefetch_t* prefetch, int buf_size, unsigned long* buffer,
+        void* curve_context, unsigned long (*next_step_delay)(unsigned long curr_step, void* curve_context)) {
+    prefetch->buffer = buffer;
+    prefetch->size = buf_size < 255 ? buf_size : 255;
+    prefetch->head = 0;
+    prefetch->tail = 0;
+    prefetch->curve_context = curve_context;
+    prefetch->next_step_delay = next_step_delay;
+    prefetch->next_step = 0;
+    prefetch->step_count = 0;
+    prefetch->last_delay = 0;
+    prefetch->underruns = 0;
+}
+
+/**
+ * Вычислить задержки для следующих шагов, пока в буфере есть место
+ * (вызывать в главном цикле или низкоприоритетном прерывании).
+ * 
+ * @return количество вычисленных задержек
+ */
+int stepper_prefetch_fill(stepper_prefetch_t* prefetch) {
+    int count = 0;
+    unsigned char head = prefetch->head;
+    unsigned char next_head = head + 1 < prefetch->size ? head + 1 : 0;
+    while(next_head != prefetch->tail &&
+            (prefetch->step_count == 0 || prefetch->next_step < prefetch->step_count)) {
+        // номер шага - как у обработчика прерывания без буфера:
+        // для вращения без остановки всегда 0
+        prefetch->buffer[head] = prefetch->next_step_delay(
+            prefetch->step_count != 0 ? prefetch->next_step : 0, prefetch->curve_context);
+        prefetch->next_step++;
+        count++;
+        
+        _ring_barrier();
+        prefetch->head = head = next_head;
+        next_head = head + 1 < prefetch->size ? head + 1 : 0;
+    }
+    return count;
+}
+
+/**
+ * Сколько раз к шагу мотора в буфере не оказалось вычисленной задержки.
+ */
+unsigned int stepper_prefetch_underruns(stepper_prefetch_t* prefetch) {
+    return prefetch->underruns;
+}
+
+/**
+ * Следующая задержка из буфера опережающего вычисления (из обработчика
+ * прерывания). Если буфер пуст, повторяется предыдущая задержка
+ * и увеличивается счетчик underruns: вычисленные задержки не теряются,
+ * а сдвигаются на шаг позже.
+ * 
+ * @param prefetch - буфер задержек
+ * @param last_step - мотор сделал последний шаг серии, задержка не нужна
+ */
+static unsigned long _prefetch_pop(stepper_prefetch_t* prefetch, bool last_step) {
+    unsigned char tail = prefetch->tail;
+    if(last_step) {
+        return prefetch->last_delay;
+    }
+    if(tail == prefetch->head) {
+        // главный цикл не успел вычислить задержку
+        prefetch->underruns++;
+        return prefetch->last_delay;
+    }
+    _ring_barrier();
+    
+    unsigned long step_delay = prefetch->buffer[tail];
+    
+    _ring_barrier();
+    prefetch->tail = tail + 1 < prefetch->size ? tail + 1 : 0;
+    prefetch->last_delay = step_delay;
+    return step_delay;
+}
+
+/**
+ * Начать серию с опережающим вычислением задержек: сбросить буфер,
+ * заполнить его (здесь, в главном цикле) и взять задержку перед первым шагом.
+ */
+static void _prepare_prefetch(int sm_i, stepper_prefetch_t* prefetch, unsigned long step_count) {
+    prefetch->head = 0;
+    prefetch->tail = 0;
+    prefetch->next_step = 0;
+    prefetch->step_count = step_count;
+    prefetch->last_delay = 0;
+    prefetch->underruns = 0;
+    stepper_prefetch_fill(prefetch);
+    
+    // настройки переменной скорости вращения
+    _fill->cstatuses[sm_i].delay_source = DYNAMIC;
+    _fill->cstatuses[sm_i].curve_context = prefetch->curve_context;
+    _fill->cstatuses[sm_i].next_step_delay = prefetch->next_step_delay;
+    _fill->cstatuses[sm_i].prefetch = prefetch;
+    
+    // выключить режим калибровки
+    _fill->cstatuses[sm_i].calibrate_mode = NONE;
+    
+    // задержка перед первым шагом (ее проверяет _check_program)
+    _fill->cstatuses[sm_i].step_delay = _prefetch_pop(prefetch, false);
+    _fill->step_timer[sm_i] = _fill->cstatuses[sm_i].step_delay;
+    
+    // Динамический статус мотора в цикле вращения
+    // ожидаем пуска (мотор может еще вращаться в текущем цикле)
+    if(_fill->smotors[sm_i]->status != STEPPER_STATUS_RUNNING) {
+        _fill->smotors[sm_i]->status = STEPPER_STATUS_IDLE;
+        // обнулим ошибки
+        _fill->smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    }
+    
+    _fill->stopped[sm_i] = false;
+}
+
+/**
+ * Подготовить серию шагов с переменной скоростью, задержки для которой
+ * вычисляются заранее в главном цикле (stepper_prefetch_fill).
+ * 
+ * @param step_count - количество шагов, знак задает направление вращения
+ * @param prefetch - буфер задержек (stepper_prefetch_init)
+ */
+void prepare_dynamic_steps(stepper *smotor, long step_count, stepper_prefetch_t* prefetch) {
+    // резерв нового места на мотор в списке
+    int sm_i = _fill->stepper_count;
+    _fill->stepper_count++;
+    
+    // ссылка на мотор
+    _fill->smotors[sm_i] = smotor;
+    
+    // задать направление
+    _fill->cstatuses[sm_i].dir = step_count > 0 ? 1 : -1;
+    
+    // шагаем ограниченное количество шагов
+    _fill->non_stop[sm_i] = false;
+    // сделать step_count положительным
+    _fill->cstatuses[sm_i].step_count = step_count > 0 ? step_count : -step_count;
+    _fill->step_counter[sm_i] = _fill->cstatuses[sm_i].step_count;
+    
+    _prepare_prefetch(sm_i, prefetch, _fill->cstatuses[sm_i].step_count);
+}
+
+/**
+ * Подготовить беспрерывное вращение с переменной скоростью, задержки
+ * для которого вычисляются заранее в главном цикле (stepper_prefetch_fill).
+ * 
+ * @param dir - направление вращения: 1 - вращать вперед, -1 - назад.
+ * @param prefetch - буфер задержек (stepper_prefetch_init)
+ */
+void prepare_dynamic_whirl(stepper *smotor, int dir, stepper_prefetch_t* prefetch) {
+    // резерв нового места на мотор в списке
+    int sm_i = _fill->stepper_count;
+    _fill->stepper_count++;
+    
+    // ссылка на мотор
+    _fill->smotors[sm_i] = smotor;
+    
+    // задать направление
+    _fill->cstatuses[sm_i].dir = dir;
+    
+    // шагаем без остановки
+    _fill->non_stop[sm_i] = true;
+    _fill->cstatuses[sm_i].step_count = 0;
+    _fill->step_counter[sm_i] = 0;
+    
+    _prepare_prefetch(sm_i, prefetch, 0);
+}
+#endif // STEPPER_DYNAMIC_STEPS
+
+///////////////////////////
+// Движение по линии
+
+/**
+ * Рассчитанное движение группы моторов по прямой линии: все, что нужно
+ * для запуска движения без деления и плавающей точки (профиль разгона
+ * ведущего мотора рассчитан заранее), поэтому его можно запустить
+ * из обработчика прерывания (см. stepper_queue_line).
+ */
+typedef struct {
+    /** Моторы группы */
+    int motor_count;
+    stepper* smotors[MAX_STEPPERS];
+    
+    /** Количество шагов для каждого мотора, знак задает направление вращения */
+    long step_counts[MAX_STEPPERS];
+    
+    /** Ведущий мотор (индекс в smotors) и количество его шагов */
+    int lead;
+    unsigned long lead_count;
+    
+    /** Задержка между шагами ведущего мотора на крейсерской скорости, микросекунды */
+    unsigned long step_delay;
+    
+    /** Ведущий мотор разгоняется и тормозит (delay_source=ACCEL) */
+    bool accel;
+    
+    /** Профиль разгона ведущего мотора (см. motor_cycle_info_t) */
+    unsigned long accel_c0;
+    unsigned long accel_steps;
+    unsigned long decel_start;
+    unsigned long decel_index;
+    unsigned long decel_u;
+    unsigned char decel_u_exp;
+    unsigned long accel_index;
+    unsigned long accel_u;
+    unsigned char accel_u_exp;
+    
+    /** Задержка перед первым шагом, микросекунды */
+    unsigned long first_delay;
+} line_move_t;
+
+/**
+ * Рассчитать движение группы моторов по прямой линии (prepare_line,
+ * prepare_accel_line, stepper_queue_line): ведущий мотор, скорость
+ * и профиль разгона. Вызывается при подготовке движения, поэтому может
+ * позволить себе деление и корень в плавающей точке.
+ * 
+ * @param accel - разгоняться и тормозить с ускорением моторов группы
+ * @param entry_speed - начальная скорость ведущего мотора, шагов в секунду
+ * @param exit_speed - конечная скорость ведущего мотора, шагов в секунду
+ */
+static void _plan_line(line_move_t* move, int motor_count, stepper** smotors, long* step_counts,
+        unsigned long step_delay, bool accel, unsigned long entry_speed, unsigned long exit_speed) {
+    if(motor_count > MAX_STEPPERS) {
+        motor_count = MAX_STEPPERS;
+    }
+    move->motor_count = motor_count;
+    
+    // ведущий мотор - тот, у которого больше всего шагов
+    move->lead = 0;
+    move->lead_count = 0;
+    // максимальная скорость - минимальная задержка, допустимая для всех моторов группы
+    unsigned long max_step_delay = 0;
+    for(int i = 0; i < motor_count; i++) {
+        move->smotors[i] = smotors[i];
+        move->step_counts[i] = step_counts[i];
+        
+        unsigned long count = step_counts[i] > 0 ? step_counts[i] : -step_counts[i];
+        if(count > move->lead_count) {
+            move->lead = i;
+            move->lead_count = count;
+        }
+        if(smotors[i]->step_delay > max_step_delay) {
+            max_step_delay = smotors[i]->step_delay;
+        }
+    }
+    move->step_delay = step_delay == 0 ? max_step_delay : step_delay;
+    move->first_delay = move->step_delay;
+    
+    // ускорение ведущего мотора: ни один мотор группы не должен
+    // разгоняться быстрее своего max_accel
+    double lead_accel = 0;
+    for(int i = 0; accel && i < motor_count; i++) {
+        unsigned long count = step_counts[i] > 0 ? step_counts[i] : -step_counts[i];
+        if(count > 0 && smotors[i]->max_accel > 0) {
+            double motor_lead_accel = (double)smotors[i]->max_accel * move->lead_count / count;
+            if(lead_accel == 0 || motor_lead_accel < lead_accel) {
+                lead_accel = motor_lead_accel;
+            }
+        }
+    }
+    
+    move->accel = lead_accel > 0;
+    if(move->accel) {
+        // профиль разгона - на временной структуре, обработчик
+        // прерывания получит только готовые значения
+        motor_cycle_info_t cstatus;
+        cstatus.step_count = move->lead_count;
+        cstatus.step_delay = move->step_delay;
+        unsigned long first_delay = _prepare_accel(&cstatus, (unsigned long)lead_accel, entry_speed, exit_speed);
+        
+        move->accel_c0 = cstatus.accel_c0;
+        move->accel_steps = cstatus.accel_steps;
+        move->decel_start = cstatus.decel_start;
+        move->decel_index = cstatus.decel_index;
+        move->decel_u = cstatus.decel_u;
+        move->decel_u_exp = cstatus.decel_u_exp;
+        move->accel_index = cstatus.accel_index;
+        move->accel_u = cstatus.accel_u;
+        move->accel_u_exp = cstatus.accel_u_exp;
+        move->first_delay = first_delay;
+    }
+}
+
+/**
+ * Добавить в цикл группу моторов, движущихся по прямой линии
+ * (рассчитанной в _plan_line). Без деления и плавающей точки.
+ */
+static void _layout_line(const line_move_t* move) {
+    if(move->motor_count <= 0) {
+        return;
+    }
+    
+    // ведущий мотор - обычная серия шагов с постоянной скоростью
+    // или с разгоном и торможением
+    int lead_i = _fill->stepper_count;
+    prepare_steps(move->smotors[move->lead], move->step_counts[move->lead], move->step_delay);
+    if(move->accel) {
+        _fill->cstatuses[lead_i].delay_source = ACCEL;
+        _fill->cstatuses[lead_i].accel_c0 = move->accel_c0;
+        _fill->cstatuses[lead_i].accel_steps = move->accel_steps;
+        _fill->cstatuses[lead_i].decel_start = move->decel_start;
+        _fill->cstatuses[lead_i].decel_index = move->decel_index;
+        _fill->cstatuses[lead_i].decel_u = move->decel_u;
+        _fill->cstatuses[lead_i].decel_u_exp = move->decel_u_exp;
+        _fill->cstatuses[lead_i].accel_index = move->accel_index;
+        _fill->cstatuses[lead_i].accel_u = move->accel_u;
+        _fill->cstatuses[lead_i].accel_u_exp = move->accel_u_exp;
+        _fill->cstatuses[lead_i].accel_frac = 0;
+        _fill->step_timer[lead_i] = move->first_delay;
+    }
+    
+    // ведомые моторы - синхронно с ведущим, шаги по переполнению ошибки
+    for(int i = 0; i < move->motor_count; i++) {
+        if(i == move->lead) {
+            continue;
+        }
+        
+        int sm_i = _fill->stepper_count;
+        prepare_steps(move->smotors[i], move->step_counts[i], move->step_delay);
+        
+        // первый шаг - одновременно с ведущим (при разгоне задержка
+        // перед первым шагом не равна step_delay)
+        _fill->step_timer[sm_i] = _fill->step_timer[lead_i];
+        _fill->cstatuses[sm_i].delay_source = LINE;
+        _fill->cstatuses[sm_i].line_follower = true;
+        _fill->cstatuses[sm_i].line_lead = lead_i;
+        _fill->cstatuses[sm_i].line_lead_count = move->lead_count;
+        // начинаем с середины интервала - симметричное округление
+        _fill->cstatuses[sm_i].line_error = move->lead_count / 2;
+        
+        // нужен ли ведомому мотору первый шаг ведущего
+        _line_follower_next_step(_fill, sm_i);
+    }
+}
+
+/**
+ * Подготовить группу моторов к движению по прямой линии: все моторы группы
+ * одновременно начинают и одновременно заканчивают движение, инструмент
+ * идет по отрезку прямой без накопления ошибок округления.
+ * 
+ * Ведущий мотор группы (с максимальным количеством шагов) задает тайминг,
+ * остальные моторы шагают синхронно с ним по алгоритму Брезенхэма (DDA):
+ * на каждом шаге ведущего мотора ведомый мотор добавляет свое количество
+ * шагов к накопленной ошибке и делает шаг только при ее переполнении.
+ * Задержка между шагами для всех моторов группы одна и та же, поэтому
+ * не нужно подбирать отдельную задержку для каждой координаты (которая
+ * к тому же должна быть кратна периоду таймера) - расхождения координат
+ * из-за округления задержек на длинных отрезках нет.
+ * 
+ * Пример: X на 20000 шагов, Y на 6666 шагов, Z на 2666 шагов
+ * (см. examples/draw_triangle):
+ * 
+ *   static stepper* line_motors[] = {&sm_x, &sm_y, &sm_z};
+ *   long line_steps[] = {20000, 6666, 2666};
+ *   prepare_line(3, line_motors, line_steps, 1000);
+ * 
+ * Ведомый мотор делает шаги не чаще, чем ведущий, поэтому задержка
+ * step_delay должна быть не меньше минимальной задержки для каждого
+ * из моторов группы (проверяется при запуске цикла так же, как для
+ * prepare_steps).
+ * 
+ * @param motor_count - количество моторов в группе
+ * @param smotors - моторы группы
+ * @param step_counts - количество шагов для каждого мотора, знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами ведущего мотора, микросекунды
+ *     (0 для максимальной скорости - минимальная задержка, допустимая для всех моторов группы)
+ */
+void prepare_line(int motor_count, stepper** smotors, long* step_counts, unsigned long step_delay) {
+    line_move_t move;
+    _plan_line(&move, motor_count, smotors, step_counts, step_delay, false, 0, 0);
+    _layout_line(&move);
+}
+
+/**
+ * Подготовить группу моторов к движению по прямой линии с плавным разгоном
+ * и торможением: как prepare_line, но ведущий мотор разгоняется и тормозит
+ * по трапеции (как в prepare_accel_steps), ведомые моторы шагают
+ * с его задержками.
+ * 
+ * Ускорение ведущего мотора выбирается так, чтобы ни один мотор группы
+ * не превысил свое максимальное ускорение max_accel (init_stepper_accel);
+ * если ускорение не задано ни для одного мотора, группа движется
+ * с постоянной скоростью, как с prepare_line.
+ * 
+ * Начальная и конечная скорость не обязательно нулевые: так отрезки
+ * ломаной линии можно проходить без остановки в промежуточных точках
+ * (см. stepper_planner.h).
+ * 
+ * @param motor_count - количество моторов в группе
+ * @param smotors - моторы группы
+ * @param step_counts - количество шагов для каждого мотора, знак задает направление вращения
+ * @param step_delay - задержка между двумя шагами ведущего мотора на крейсерской
+ *     скорости, микросекунды (0 для максимальной скорости - минимальная задержка,
+ *     допустимая для всех моторов группы)
+ * @param entry_delay - задержка между шагами ведущего мотора на старте,
+ *     микросекунды (0 - старт с места)
+ * @param exit_delay - задержка между шагами ведущего мотора в конце отрезка,
+ *     микросекунды (0 - торможение до полной остановки)
+ */
+void prepare_accel_line(int motor_count, stepper** smotors, long* step_counts,
+        unsigned long step_delay, unsigned long entry_delay, unsigned long exit_delay) {
+    line_move_t move;
+    _plan_line(&move, motor_count, smotors, step_counts, step_delay, true,
+        entry_delay > 0 ? 1000000 / entry_delay : 0,
+        exit_delay > 0 ? 1000000 / exit_delay : 0);
+    _layout_line(&move);
+}
+
+///////////////////////////
+// Движение по дуге окружности
+
+/**
+ * Ближайшее целое к квадратному корню: n, для которого (n-1/2)^2 < v < (n+1/2)^2
+ * (так же округляет алгоритм средней точки в _arc_next).
+ */
+static long _arc_round_sqrt(long long v) {
+    if(v <= 0) {
+        return 0;
+    }
+    long long n = (long long)(sqrt((double)v) + 0.5);
+    while(4*n*n + 4*n + 1 < 4*v) n++;
+    while(n > 0 && 4*n*n - 4*n + 1 > 4*v) n--;
+    return (long)n;
+}
+
+/**
+ * Точка дуги, ближайшая к заданной: по главной оси (см. _arc_next)
+ * координата остается, по второй - ближайшая к окружности.
+ */
+static void _arc_snap(long long r2, long r, long* x, long* y) {
+    if((*y > 0 ? *y : -*y) > (*x > 0 ? *x : -*x)) {
+        // главная ось X
+        if(*x > r) *x = r;
+        if(*x < -r) *x = -r;
+        long minor = _arc_round_sqrt(r2 - (long long)*x * *x);
+        *y = *y > 0 ? minor : -minor;
+    } else {
+        // главная ось Y
+        if(*y > r) *y = r;
+        if(*y < -r) *y = -r;
+        long minor = _arc_round_sqrt(r2 - (long long)*y * *y);
+        *x = *x > 0 ? minor : (*x < 0 ? -minor : 0);
+    }
+}
+
+/**
+ * Добавить в цикл пару моторов дуги окружности (prepare_arc) и, если
+ * задан sm_z, линейную ось винтовой линии (prepare_helix).
+ * 
+ * @return false - линейная ось не успевает за дугой, ничего не добавлено
+ */
+static bool _layout_arc(stepper* sm_x, stepper* sm_y, stepper* sm_z,
+        long x_steps, long y_steps, long z_steps,
+        long center_x, long center_y, bool cw, unsigned long step_delay) {
+    // минимальная задержка шага по одной оси, допустимая для всех моторов
+    unsigned long min_delay = sm_x->step_delay > sm_y->step_delay ? sm_x->step_delay : sm_y->step_delay;
+    if(sm_z != NULL && sm_z->step_delay > min_delay) {
+        min_delay = sm_z->step_delay;
+    }
     
-    // ссылка на мотор
-    _smotors[sm_i] = smotor;
+    // Задержки шага по одной оси и по диагонали: ломаная из шагов по осям
+    // и диагоналям длиннее дуги (в среднем на 5.5%), поэтому берем не 1 и sqrt(2),
+    // а веса 0.948 и 1.343 (Kulpa), дающие в среднем точную длину дуги;
+    // но шаг по оси - не чаще, чем могут моторы (0 - максимальная скорость)
+    unsigned long arc_delay = (step_delay * 243) >> 8;
+    if(arc_delay < min_delay) {
+        arc_delay = min_delay;
+    }
+    unsigned long arc_diag_delay = arc_delay * 344 / 243;
     
-    // Подготовить движение
+    // начальная и конечная точки относительно центра
+    long x0 = -center_x;
+    long y0 = -center_y;
+    long long r2 = (long long)x0 * x0 + (long long)y0 * y0;
+    long r = _arc_round_sqrt(r2);
+    long x1 = x_steps - center_x;
+    long y1 = y_steps - center_y;
+    _arc_snap(r2, r, &x1, &y1);
     
-    // задать направление
-    _cstatuses[sm_i].dir = step_count > 0 ? 1 : -1;
-    if(_cstatuses[sm_i].dir * _smotors[sm_i]->dir_inv > 0) {
-        digitalWrite(_smotors[sm_i]->pin_dir, HIGH); // туда
-    } else {
-        digitalWrite(_smotors[sm_i]->pin_dir, LOW); // обратно
+    // Количество шагов по осям (при подготовке можно в плавающей точке):
+    // внутри четверти окружности координаты меняются монотонно, на осях
+    // алгоритм проходит через точки (+-r, 0), (0, +-r)
+    unsigned long x_left = 0;
+    unsigned long y_left = 0;
+    if(r > 0) {
+        double a0 = atan2((double)y0, (double)x0);
+        double a1 = atan2((double)y1, (double)x1);
+        double sweep = cw ? a0 - a1 : a1 - a0;
+        if(x1 == x0 && y1 == y0) {
+            // полная окружность
+            sweep = 2 * M_PI;
+        } else {
+            while(sweep <= 0) sweep += 2 * M_PI;
+            while(sweep > 2 * M_PI) sweep -= 2 * M_PI;
+        }
+        
+        // точки на осях по пути от начальной точки к конечной
+        long px = x0;
+        long py = y0;
+        long q = (long)floor(a0 / (M_PI / 2));
+        for(int k = 0; k < 5; k++) {
+            // следующая ось по ходу движения
+            long next_q = cw ? (k == 0 ? (long)ceil(a0 / (M_PI / 2)) - 1 : q - 1) : q + 1;
+            double a = next_q * (M_PI / 2);
+            if((cw ? a0 - a : a - a0) > sweep) {
+                break;
+            }
+            q = next_q;
+            long qx = 0;
+            long qy = 0;
+            switch(((q % 4) + 4) % 4) {
+                case 0: qx = r; break;
+                case 1: qy = r; break;
+                case 2: qx = -r; break;
+                case 3: qy = -r; break;
+            }
+            x_left += px > qx ? px - qx : qx - px;
+            y_left += py > qy ? py - qy : qy - py;
+            px = qx;
+            py = qy;
+        }
+        x_left += px > x1 ? px - x1 : x1 - px;
+        y_left += py > y1 ? py - y1 : y1 - py;
     }
     
-    // шагаем ограниченное количество шагов
-    _cstatuses[sm_i].non_stop = false;
-    // сделать step_count положительным
-    _cstatuses[sm_i].step_count = buf_size > 0 ? buf_size*step_count : -buf_size*step_count;
+    // линейная ось винтовой линии шагает не чаще шагов дуги: за шаг дуги
+    // продвигаемся на 1 (шаг по одной оси) или 2 (по диагонали) из x_left+y_left
+    unsigned long z_count = z_steps > 0 ? z_steps : -z_steps;
+    unsigned long progress = x_left + y_left;
+    if(sm_z != NULL && z_count * 2 > progress) {
+        return false;
+    }
     
-    // настройки переменной скорости вращения
-    _cstatuses[sm_i].delay_source = BUFFER;
-    _cstatuses[sm_i].delay_buffer = delay_buffer;
-    _cstatuses[sm_i].scale = step_count;
+    // ведущий мотор (ось X) - ведет состояние дуги
+    int lead_i = _fill->stepper_count;
+    prepare_steps(sm_x, x_left, arc_delay);
+    motor_cycle_info_t* lead = &_fill->cstatuses[lead_i];
     
+    // ведомый мотор (ось Y) - задержки ведущего
+    prepare_steps(sm_y, y_left, arc_delay);
+    motor_cycle_info_t* follower = &_fill->cstatuses[lead_i + 1];
     
-    // выключить режим калибровки
-    _cstatuses[sm_i].calibrate_mode = NONE;
+    // шагов не больше, чем решит алгоритм: останавливаемся по arc_done
+    _fill->non_stop[lead_i] = true;
+    lead->delay_source = ARC;
+    lead->line_lead = lead_i;
+    lead->arc = true;
+    lead->arc_done = false;
+    lead->arc_x = x0;
+    lead->arc_y = y0;
+    lead->arc_end_x = x1;
+    lead->arc_end_y = y1;
+    lead->arc_err = 0;
+    lead->arc_x_left = x_left;
+    lead->arc_y_left = y_left;
+    lead->arc_cw = cw;
+    lead->arc_delay = arc_delay;
+    lead->arc_diag_delay = arc_diag_delay;
     
-    // Взводим счетчики
-    _cstatuses[sm_i].step_counter = _cstatuses[sm_i].step_count;
-    // задержка перед первым шагом
-    _cstatuses[sm_i].step_timer = _cstatuses[sm_i].delay_buffer[0];
+    _fill->non_stop[lead_i + 1] = true;
+    follower->delay_source = LINE;
+    follower->line_follower = true;
+    follower->line_lead = lead_i;
+    follower->arc = true;
+    follower->arc_done = false;
     
-    // Динамический статус мотора в цикле вращения
-    // ожидаем пуска
-    _smotors[sm_i]->status = STEPPER_STATUS_IDLE;
-    // обнулим ошибки
-    _smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    // линейная ось (Z) - ведомая, шаги по алгоритму Брезенхэма от прогресса дуги
+    lead->arc_helix = sm_z != NULL;
+    int motor_count = 2;
+    if(sm_z != NULL) {
+        prepare_steps(sm_z, z_steps, arc_delay);
+        motor_cycle_info_t* linear = &_fill->cstatuses[lead_i + 2];
+        _fill->non_stop[lead_i + 2] = true;
+        linear->delay_source = LINE;
+        linear->line_follower = true;
+        linear->line_lead = lead_i;
+        linear->line_lead_count = progress;
+        // начинаем с середины интервала - симметричное округление
+        linear->line_error = progress / 2;
+        linear->arc = true;
+        linear->arc_done = false;
+        motor_count = 3;
+    }
     
-    //
-    _cstatuses[sm_i].stopped = false;
+    // первый шаг дуги (направление на ножки выводится при запуске цикла)
+    unsigned long first_delay = _arc_next(lead, follower);
+    motor_cycle_info_t* arc_motors = lead;
+    for(int i = 0; i < motor_count; i++) {
+        _fill->step_timer[lead_i + i] = first_delay;
+        arc_motors[i].line_step_delay = first_delay;
+        _fill->line_skip[lead_i + i] = arc_motors[i].arc_move == 0;
+        if(arc_motors[i].arc_move != 0) {
+            arc_motors[i].dir = arc_motors[i].arc_move;
+        }
+        if(arc_motors[i].arc_done) {
+            // двигаться некуда
+            _fill->stopped[lead_i + i] = true;
+        }
+    }
+    return true;
 }
 
 /**
- * Подготовить серию шагов с переменной скоростью. Для каждой подсерии задаётся задержка между шагами,
- * количество шагов и направление вращения (знак количества шагов) - соответствующие элементы
- * массивов delay_buffer и step_buffer.
+ * Подготовить пару моторов к движению по дуге окружности (как G2/G3):
+ * шаги по осям выбирает целочисленный алгоритм средней точки (Брезенхэма
+ * для окружности) - в обработчике прерывания на каждом шаге дуги только
+ * сложения и сравнения, без тригонометрии, поэтому дуга идет на той же
+ * частоте таймера, что и прямая линия.
  * 
- * Оба массива delay_buffer и step_buffer должны существовать и не меняться до завершения
- * цикла вращения (рекомендуется объявлять их как глобальные переменные модуля или
- * как локальные переменные внутри функции с модификатором static).
+ * Моторы шагают синхронно, как группа prepare_line: на каждом шаге дуги
+ * каждый мотор делает шаг вперед, назад или пропускает его; задержка
+ * шага по диагонали (оба мотора) больше задержки шага по одной оси,
+ * так что средняя скорость вдоль дуги равна заданной (местами
+ * отклоняется до 5%). Направление моторов меняется на ходу при переходе
+ * в другую четверть окружности.
  * 
- *   // 
- *   static unsigned long delay_buffer[3];
- *   static long step_buffer[3];
+ * Координаты - в шагах моторов (distance_per_step у моторов
+ * предполагается одинаковым). Радиус - расстояние от начальной точки до
+ * центра; если конечная точка не лежит на окружности, дуга заканчивается
+ * в ближайшей к ней точке окружности. Конечная точка, совпадающая
+ * с начальной, - полная окружность.
  * 
- *   // значения задержек между шагами на каждом подцикле
- *   delay_buffer[0] = y_step_delay_us; // базовая скорость
- *   delay_buffer[1] = y_step_delay_us*10; // в 10 раз медленнее
- *   delay_buffer[2] = y_step_delay_us*2; // в 2 раза медленнее
+ * Пример: полуокружность радиусом 1000 шагов против часовой стрелки
+ *   prepare_arc(&sm_x, &sm_y, -2000, 0, -1000, 0, false, 1000);
  * 
- *   // количество шагов на каждом подцикле
- *   step_buffer[0] = 200*10; // туда
- *   step_buffer[1] = -200*5; // обратно
- *   step_buffer[2] = 200*2; // туда
+ * @param sm_x - мотор оси X
+ * @param sm_y - мотор оси Y
+ * @param x_steps - конечная точка дуги относительно начальной по оси X, шаги
+ * @param y_steps - конечная точка дуги относительно начальной по оси Y, шаги
+ * @param center_x - центр окружности относительно начальной точки по оси X, шаги (I в G-коде)
+ * @param center_y - центр окружности относительно начальной точки по оси Y, шаги (J в G-коде)
+ * @param cw - true: по часовой стрелке (G2), false: против часовой стрелки (G3)
+ * @param step_delay - время на путь длиной в один шаг вдоль дуги, микросекунды
+ *     (0 для максимальной скорости - шаг по одной оси с минимальной задержкой,
+ *     допустимой для всех моторов; меньшая задержка тоже ограничивается ею)
+ */
+void prepare_arc(stepper* sm_x, stepper* sm_y, long x_steps, long y_steps,
+        long center_x, long center_y, bool cw, unsigned long step_delay) {
+    _layout_arc(sm_x, sm_y, NULL, x_steps, y_steps, 0, center_x, center_y, cw, step_delay);
+}
+
+/**
+ * Подготовить три мотора к движению по винтовой линии (G2/G3 с Z): X и Y
+ * идут по дуге окружности, как в prepare_arc, третий мотор (Z) - линейно,
+ * синхронно с дугой: на каждом шаге дуги он добавляет свое количество
+ * шагов к ошибке алгоритма Брезенхэма (один раз за шаг по одной оси, два
+ * раза - за шаг по диагонали) и шагает при ее переполнении. Все три мотора
+ * работают на одной временной шкале, начинают и заканчивают одновременно.
  * 
- *   prepare_buffered_steps(&sm_y, 3, delay_buffer, step_buffer);
+ * Линейная ось делает не больше одного шага за шаг дуги, поэтому количество
+ * ее шагов - не больше половины суммы шагов по X и Y (для полной окружности
+ * радиусом R - не больше 4R, подъем на виток не больше 4R).
  * 
- * @param buf_size - количество элементов в буфере delay_buffer (количество подциклов)
- * @param delay_buffer - (step delay buffer) - массив задержек перед каждым следующим шагом, микросекунды
- * @param step_buffer - (step count buffer) - массив с количеством шагов для каждого
- *     значения задержки из delay_buffer. Может содержать положительные и отрицательные значения,
- *     знак задает направление вращения мотора.
- *     Должен содержать ровно столько же элементов, сколько delay_buffer
+ * Пример: фрезерование резьбы - виток радиусом 1000 шагов с подъемом 200 шагов
+ *   prepare_helix(&sm_x, &sm_y, &sm_z, 0, 0, 200, -1000, 0, false);
+ * 
+ * @param sm_z - мотор линейной оси
+ * @param z_steps - количество шагов линейной оси, знак задает направление вращения
+ * Остальные параметры - как у prepare_arc.
+ * @return
+ *     true - движение подготовлено
+ *     false - линейная ось не успевает за дугой (слишком много шагов),
+ *         ничего не подготовлено
  */
-void prepare_buffered_steps(stepper *smotor, int buf_size, unsigned long* delay_buffer, long* step_buffer) {
-    // резерв нового места на мотор в списке
-    int sm_i = _stepper_count;
-    _stepper_count++;
-    
-    // ссылка на мотор
-    _smotors[sm_i] = smotor;
-    
-    // Подготовить движение
-    _cstatuses[sm_i].cycle_count = buf_size;
-    _cstatuses[sm_i].cycle_counter = 0;
-    _cstatuses[sm_i].step_buffer = step_buffer;
+bool prepare_helix(stepper* sm_x, stepper* sm_y, stepper* sm_z, long x_steps, long y_steps, long z_steps,
+        long center_x, long center_y, bool cw, unsigned long step_delay) {
+    return _layout_arc(sm_x, sm_y, sm_z, x_steps, y_steps, z_steps, center_x, center_y, cw, step_delay);
+}
 
-    long step_count = _cstatuses[sm_i].step_buffer[0];
-    // сделать step_count положительным
-    _cstatuses[sm_i].step_count = step_count > 0 ? step_count : -step_count;
+///////////////////////////
+// Движение по кривой Безье
+
+/**
+ * Наибольшее количество шагов параметра кривой Безье: n^3 с запасом
+ * (остаток bez_r доходит до 3/2*n^3) помещается в long long
+ */
+#define BEZIER_MAX_N (1UL << 20)
+
+/**
+ * Подготовить группу моторов к движению по кубической кривой Безье
+ * (плавный переход между отрезками, сплайн из нескольких кривых): моторы
+ * шагают синхронно, как группа prepare_line, одним движением от начальной
+ * точки (текущей позиции моторов) к конечной p3, кривая притягивается
+ * к контрольным точкам p1 и p2.
+ * 
+ * Кривую B(t) обходим с постоянным шагом параметра 1/n в целых числах:
+ * n^3*B(k/n) - целочисленный кубический многочлен от k, в обработчике
+ * прерывания на каждом шаге параметра только три сложения на мотор
+ * (прямые конечные разности) и сравнение, без умножения и деления. Количество
+ * шагов параметра n выбирается по кривой (по наибольшему отрезку между
+ * контрольными точками по каждой оси) так, что за один шаг параметра мотор
+ * делает не больше одного шага; шаги параметра, на которых не шагает
+ * ни один мотор, проходятся сразу, без ожидания таймера. Кривая приходит
+ * точно в конечную точку, без накопления ошибки.
+ * 
+ * Задержка шага кривой зависит от количества моторов, шагающих одновременно
+ * (1, sqrt(2), sqrt(3)...), так что скорость вдоль кривой примерно
+ * постоянна (веса для шага по одной оси - как у prepare_arc).
+ * 
+ * Координаты - в шагах моторов относительно начальной точки
+ * (distance_per_step у моторов предполагается одинаковым).
+ * 
+ * Пример: плавный поворот на 90 градусов из (0, 0) в (1000, 1000)
+ *   static stepper* bezier_motors[] = {&sm_x, &sm_y};
+ *   long p1[] = {550, 0};
+ *   long p2[] = {1000, 450};
+ *   long p3[] = {1000, 1000};
+ *   prepare_bezier(2, bezier_motors, p1, p2, p3, 1000);
+ * 
+ * @param motor_count - количество моторов в группе
+ * @param smotors - моторы группы
+ * @param p1 - первая контрольная точка, шаги для каждого мотора
+ * @param p2 - вторая контрольная точка, шаги для каждого мотора
+ * @param p3 - конечная точка, шаги для каждого мотора
+ * @param step_delay - время на путь длиной в один шаг вдоль кривой, микросекунды
+ *     (0 для максимальной скорости - шаг по одной оси с минимальной задержкой,
+ *     допустимой для всех моторов группы; меньшая задержка тоже ограничивается ею)
+ * @return
+ *     true - движение подготовлено
+ *     false - слишком много моторов или слишком большая кривая
+ *         (отрезок между соседними контрольными точками по одной оси длиннее
+ *         BEZIER_MAX_N/3 шагов), ничего не подготовлено
+ */
+bool prepare_bezier(int motor_count, stepper** smotors, long* p1, long* p2, long* p3,
+        unsigned long step_delay) {
+    if(motor_count < 1 || motor_count > BEZIER_SQRT_TABLE_SIZE) {
+        return false;
+    }
     
-    // задать направление
-    _cstatuses[sm_i].dir = step_count > 0 ? 1 : -1;
-    if(_cstatuses[sm_i].dir * _smotors[sm_i]->dir_inv > 0) {
-        digitalWrite(_smotors[sm_i]->pin_dir, HIGH); // туда
-    } else {
-        digitalWrite(_smotors[sm_i]->pin_dir, LOW); // обратно
+    // Скорость кривой не больше 3*(наибольший отрезок между контрольными
+    // точками) шагов на единицу параметра - шагов параметра не меньше
+    unsigned long n = 1;
+    unsigned long max_step_delay = 0;
+    for(int i = 0; i < motor_count; i++) {
+        long long d0 = p1[i];
+        long long d1 = (long long)p2[i] - p1[i];
+        long long d2 = (long long)p3[i] - p2[i];
+        if(d0 < 0) d0 = -d0;
+        if(d1 < 0) d1 = -d1;
+        if(d2 < 0) d2 = -d2;
+        long long d = d0 > d1 ? d0 : d1;
+        if(d2 > d) d = d2;
+        if(d * 3 > (long long)BEZIER_MAX_N) {
+            return false;
+        }
+        if(d * 3 > (long long)n) {
+            n = d * 3;
+        }
+        
+        if(smotors[i]->step_delay > max_step_delay) {
+            max_step_delay = smotors[i]->step_delay;
+        }
     }
     
-    // скорость вращения - постоянная на каждом цикле
-    _cstatuses[sm_i].delay_source = CONSTANT;
-    _cstatuses[sm_i].delay_buffer = delay_buffer;
-    unsigned long step_delay = _cstatuses[sm_i].delay_buffer[0];
-    if(step_delay == 0) {
-        // движение с максимальной скоростью
-        _cstatuses[sm_i].step_delay = _smotors[sm_i]->step_delay;
-    } else {
-        _cstatuses[sm_i].step_delay = step_delay;
+    // задержка шага по одной оси, не чаще, чем могут моторы (см. _layout_arc)
+    unsigned long bez_delay = (step_delay * 243) >> 8;
+    if(bez_delay < max_step_delay) {
+        bez_delay = max_step_delay;
     }
     
-    // Взводим счетчики
-    _cstatuses[sm_i].step_counter = _cstatuses[sm_i].step_count;
-    // задержка перед первым шагом
-    _cstatuses[sm_i].step_timer = _cstatuses[sm_i].step_delay;
+    long long nn = (long long)n * n;
+    int lead_i = _fill->stepper_count;
+    for(int i = 0; i < motor_count; i++) {
+        // шагов не больше, чем решит ведущий: останавливаемся по arc_done
+        prepare_steps(smotors[i], 0, bez_delay);
+        motor_cycle_info_t* axis = &_fill->cstatuses[lead_i + i];
+        _fill->non_stop[lead_i + i] = true;
+        axis->line_lead = lead_i;
+        axis->arc = true;
+        axis->arc_done = false;
+        if(i > 0) {
+            axis->delay_source = LINE;
+            axis->line_follower = true;
+        }
+        
+        // B(t) = a*t^3 + b*t^2 + c*t (начальная точка - 0),
+        // F(k) = n^3*B(k/n) = a*k^3 + b*n*k^2 + c*n^2*k
+        long long a = (long long)p3[i] - 3LL * p2[i] + 3LL * p1[i];
+        long long b = 3LL * p2[i] - 6LL * p1[i];
+        long long c = 3LL * p1[i];
+        axis->bez_r = 0;
+        axis->bez_d1 = a + b * n + c * nn;
+        axis->bez_d2 = 6 * a + 2 * b * n;
+        axis->bez_d3 = 6 * a;
+    }
     
-    // Динамический статус мотора в цикле вращения
-    // ожидаем пуска
-    _smotors[sm_i]->status = STEPPER_STATUS_IDLE;
-    // обнулим ошибки
-    _smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    motor_cycle_info_t* lead = &_fill->cstatuses[lead_i];
+    lead->delay_source = BEZIER;
+    lead->bez_s = nn * n;
+    lead->bez_left = n;
+    lead->bez_count = motor_count;
+    lead->bez_delay = bez_delay;
     
-    //
-    _cstatuses[sm_i].stopped = false;
+    // первый шаг кривой (направление на ножки выводится при запуске цикла)
+    unsigned long first_delay = _bezier_next(lead);
+    for(int i = 0; i < motor_count; i++) {
+        _fill->step_timer[lead_i + i] = first_delay;
+        lead[i].line_step_delay = first_delay;
+        _fill->line_skip[lead_i + i] = lead[i].arc_move == 0;
+        if(lead[i].arc_move != 0) {
+            lead[i].dir = lead[i].arc_move;
+        }
+        if(lead[i].arc_done) {
+            // двигаться некуда
+            _fill->stopped[lead_i + i] = true;
+        }
+    }
+    return true;
 }
 
+///////////////////////////
+// Очередь движений
+//
+// Кольцевой буфер с одним писателем (главный цикл, stepper_queue_line)
+// и одним читателем (обработчик прерывания): писатель меняет только
+// _move_queue_head, читатель - только _move_queue_tail, индексы
+// однобайтовые - запись атомарна на AVR, SAM и PIC32, запрещать
+// прерывания не нужно. Одна ячейка всегда пустая, чтобы отличать
+// полную очередь от пустой.
+
+// из stepper_lib_config.h
+#ifndef STEPPER_MOVE_QUEUE_SIZE
+#define STEPPER_MOVE_QUEUE_SIZE 4
+#endif
+
+#define MOVE_QUEUE_LEN (STEPPER_MOVE_QUEUE_SIZE + 1)
+
+static line_move_t _move_queue[MOVE_QUEUE_LEN];
+static volatile unsigned char _move_queue_head = 0;
+static volatile unsigned char _move_queue_tail = 0;
+
 /**
- * Подготовить мотор к запуску ограниченной серии шагов с переменной скоростью - задать нужное количество
- * шагов и указатель на функцию, вычисляющую задержку перед каждым шагом для регулирования скорости.
+ * Добавить движение группы моторов по прямой линии в очередь. Движения
+ * из очереди запускаются одно за другим без остановки таймера: следующее
+ * движение загружается в обработчике прерывания сразу после последнего
+ * шага предыдущего, первый шаг - через entry_delay после последнего
+ * шага предыдущего движения.
  * 
- * @param step_count - количество шагов, знак задает направление вращения
- * @param curve_context - указатель на объект, содержащий всю необходимую информацию для вычисления
- *     времени до следующего шага
- * @param next_step_delay - указатель на функцию, вычисляющую задержку перед следующим шагом, микросекунды
+ * Если цикл не запущен (или успел завершиться до того, как движение
+ * попало в очередь), первое движение из очереди запускает stepper_start_cycle.
+ * 
+ * Параметры - как у prepare_accel_line (для моторов без ускорения -
+ * как у prepare_line).
+ * 
+ * @return
+ *     true - движение добавлено в очередь
+ *     false - очередь заполнена или движение нельзя запустить
+ *         с текущими настройками таймера (см. stepper_start_cycle)
  */
-void prepare_dynamic_steps(stepper *smotor, long step_count,
-        void* curve_context, unsigned long (*next_step_delay)(unsigned long curr_step, void* curve_context)) {
-    // резерв нового места на мотор в списке
-    int sm_i = _stepper_count;
-    _stepper_count++;
-    
-    // ссылка на мотор
-    _smotors[sm_i] = smotor;
-    
-    // Подготовить движение
-    
-    // задать направление
-    _cstatuses[sm_i].dir = step_count > 0 ? 1 : -1;
-    if(_cstatuses[sm_i].dir * _smotors[sm_i]->dir_inv > 0) {
-        digitalWrite(_smotors[sm_i]->pin_dir, HIGH); // туда
-    } else {
-        digitalWrite(_smotors[sm_i]->pin_dir, LOW); // обратно
+bool stepper_queue_line(int motor_count, stepper** smotors, long* step_counts,
+        unsigned long step_delay, unsigned long entry_delay, unsigned long exit_delay) {
+    unsigned char head = _move_queue_head;
+    unsigned char next_head = head + 1 < MOVE_QUEUE_LEN ? head + 1 : 0;
+    if(next_head == _move_queue_tail) {
+        return false;
     }
     
-    // шагаем ограниченное количество шагов
-    _cstatuses[sm_i].non_stop = false;
-    // сделать step_count положительным
-    _cstatuses[sm_i].step_count = step_count > 0 ? step_count : -step_count;
-    
-    // настройки переменной скорости вращения
-    _cstatuses[sm_i].delay_source = DYNAMIC;
-    _cstatuses[sm_i].curve_context = curve_context;
-    _cstatuses[sm_i].next_step_delay = next_step_delay;
-    
-    // выключить режим калибровки
-    _cstatuses[sm_i].calibrate_mode = NONE;
-    
-    // Взводим счетчики
-    _cstatuses[sm_i].step_counter = _cstatuses[sm_i].step_count;
-    // задержка перед первым шагом
-    _cstatuses[sm_i].step_timer = _cstatuses[sm_i].next_step_delay(0, _cstatuses[sm_i].curve_context);
+    // проверки stepper_start_cycle: в обработчике прерывания
+    // их уже некому делать
+    for(int i = 0; i < motor_count; i++) {
+        if(smotors[i]->step_delay < _timer_period_us*3 ||
+                smotors[i]->step_delay % _timer_period_us != 0 ||
+                (step_delay != 0 && step_delay < smotors[i]->step_delay)) {
+            return false;
+        }
+    }
     
-    // Динамический статус мотора в цикле вращения
-    // ожидаем пуска
-    _smotors[sm_i]->status = STEPPER_STATUS_IDLE;
-    // обнулим ошибки
-    _smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    _plan_line(&_move_queue[head], motor_count, smotors, step_counts, step_delay, true,
+        entry_delay > 0 ? 1000000 / entry_delay : 0,
+        exit_delay > 0 ? 1000000 / exit_delay : 0);
     
-    //
-    _cstatuses[sm_i].stopped = false;
+    _ring_barrier();
+    _move_queue_head = next_head;
+    return true;
 }
 
 /**
- * Подготовить мотор к запуску на беспрерывное вращение с переменной скоростью - задать нужное количество
- * шагов и указатель на функцию, вычисляющую задержку перед каждым шагом для регулирования скорости.
+ * Количество движений в очереди, ожидающих запуска.
+ */
+int stepper_queue_count() {
+    int count = (int)_move_queue_head - (int)_move_queue_tail;
+    return count >= 0 ? count : count + MOVE_QUEUE_LEN;
+}
+
+/**
+ * Очередь движений заполнена.
+ */
+bool stepper_queue_full() {
+    return stepper_queue_count() >= STEPPER_MOVE_QUEUE_SIZE;
+}
+
+/**
+ * Добавить в цикл следующее движение из очереди (сторона читателя).
  * 
- * @param dir - направление вращения: 1 - вращать вперед, -1 - назад.
- * @param curve_context - указатель на объект, содержащий всю необходимую информацию для вычисления
- *     времени до следующего шага
- * @param next_step_delay - указатель на функцию, вычисляющую задержку перед следующим шагом, микросекунды
+ * @return
+ *     true - движение добавлено
+ *     false - очередь пуста
  */
-void prepare_dynamic_whirl(stepper *smotor, int dir,
-        void* curve_context, unsigned long (*next_step_delay)(unsigned long curr_step, void* curve_context)) {
-    // резерв нового места на мотор в списке
-    int sm_i = _stepper_count;
-    _stepper_count++;
-    
-    // ссылка на мотор
-    _smotors[sm_i] = smotor;
-    
-    // Подготовить движение
-    
-    // задать направление
-    _cstatuses[sm_i].dir = dir;
-    if(_cstatuses[sm_i].dir * _smotors[sm_i]->dir_inv > 0) {
-        digitalWrite(_smotors[sm_i]->pin_dir, HIGH); // туда
-    } else {
-        digitalWrite(_smotors[sm_i]->pin_dir, LOW); // обратно
+static bool _move_queue_pop() {
+    unsigned char tail = _move_queue_tail;
+    if(tail == _move_queue_head) {
+        return false;
     }
+    _ring_barrier();
     
-    // шагаем без остановки
-    _cstatuses[sm_i].non_stop = true;
-    
-    // настройки переменной скорости вращения
-    _cstatuses[sm_i].delay_source = DYNAMIC;
-    _cstatuses[sm_i].curve_context = curve_context;
-    _cstatuses[sm_i].next_step_delay = next_step_delay;
-    
-    // выключить режим калибровки
-    _cstatuses[sm_i].calibrate_mode = NONE;
-    
-    // Взводим счетчики
-    // задержка перед первым шагом
-    _cstatuses[sm_i].step_timer = _cstatuses[sm_i].next_step_delay(0, _cstatuses[sm_i].curve_context);
-    
-    // на всякий случай обнулим
-    _cstatuses[sm_i].step_count = 0;
-    _cstatuses[sm_i].step_counter = 0;
-    
-    // Динамический статус мотора в цикле вращения
-    // ожидаем пуска
-    _smotors[sm_i]->status = STEPPER_STATUS_IDLE;
-    // обнулим ошибки
-    _smotors[sm_i]->error = STEPPER_ERROR_NONE;
+    _layout_line(&_move_queue[tail]);
     
-    //
-    _cstatuses[sm_i].stopped = false;
+    _ring_barrier();
+    _move_queue_tail = tail + 1 < MOVE_QUEUE_LEN ? tail + 1 : 0;
+    return true;
+}
+
+/**
+ * Очистить очередь движений (сторона читателя: обработчик прерывания
+ * или главный цикл при остановленном таймере).
+ */
+static void _move_queue_clear() {
+    _move_queue_tail = _move_queue_head;
 }
 
 /**
@@ -794,6 +3088,16 @@ void stepper_configure_timer(unsigned long target_period_us, int timer, int pres
     _timer_id = timer;
     _timer_prescaler = prescaler;
     _timer_adjustment = adjustment;
+    
+    // максимальный интервал между вызовами обработчика в режиме "по событию":
+    // значение сравнения таймера ticks*adjustment-1 должно влезать в 16 бит
+    _timer_event_ticks_max = (1 << TIMER_EVENT_TICKS_SHIFT) - 1;
+    if(adjustment > 0 && 0xFFFF / adjustment < _timer_event_ticks_max) {
+        _timer_event_ticks_max = 0xFFFF / adjustment;
+    }
+    if(_timer_event_ticks_max == 0) {
+        _timer_event_ticks_max = 1;
+    }
 }
 
 /**
@@ -808,6 +3112,140 @@ void stepper_set_timer_enabled(bool enabled) {
     _timer_enabled = enabled;
 }
 
+/**
+ * Режим таймера "по событию": вызывать обработчик прерывания не на каждом
+ * периоде таймера, а только тогда, когда хотя бы одному из моторов нужно
+ * что-то сделать (проверить границы перед шагом, взвести или сбросить
+ * ножку step). Между событиями аппаратный таймер перенастраивается
+ * на несколько периодов вперед (_timer_update_ISR), поэтому нагрузка
+ * на процессор зависит от частоты шагов, а не от частоты таймера.
+ * 
+ * Все события по-прежнему происходят на сетке периодов _timer_period_us,
+ * поэтому тайминг шагов полностью совпадает с обычным режимом.
+ * 
+ * Режим нельзя переключить во время работы цикла.
+ * 
+ * @param enabled
+ *   true: режим "по событию"
+ *   false: обычный режим - обработчик вызывается каждый период таймера
+ */
+void stepper_set_timer_event_driven(bool enabled) {
+    // не переключать режим, пока не отработал старый цикл
+    if(_cycle_running) {
+        return;
+    }
+    
+    _timer_event_driven = enabled;
+}
+
+/**
+ * Ограничить "тяжелую" работу на шаге: не больше max_motors моторов
+ * вычисляют задержку перед следующим шагом (delay_source=BUFFER, DYNAMIC,
+ * ACCEL, SCURVE) на одном вызове обработчика прерывания. У остальных
+ * моторов таймер взводится на минимальную задержку мотора, а вычисление
+ * откладывается на следующие вызовы (поправка таймера - когда дойдет
+ * очередь). Отложенная работа выполняется вне очереди, когда мотор
+ * подходит к проверке границ перед следующим шагом (за 3 периода до шага),
+ * поэтому тайминг шагов не меняется. Чем больше минимальная задержка мотора
+ * по сравнению с 3мя периодами таймера, тем на большее количество тиков
+ * раскладывается работа.
+ * 
+ * Ведущие моторы групп (линии, дуги, кривые Безье) не откладывают задержку:
+ * ведомые берут ее на том же тике. Ведущий мотор линии вместо этого
+ * вычисляет задержку заранее - на шаге N ее берет из line_ahead_delay,
+ * а задержку для шага N+1 считает на одном из следующих тиков, когда дойдет
+ * очередь. Ведущие моторы дуг и кривых Безье считают следующий шаг кривой
+ * на тике шага и занимают место в лимите. Последний шаг серии тоже
+ * не откладывается.
+ * 
+ * Лимит нельзя поменять во время работы цикла.
+ * 
+ * @param max_motors - моторов с тяжелой работой на тик,
+ *     0 - без ограничения (по умолчанию)
+ */
+void stepper_set_step_work_limit(int max_motors) {
+    // не менять лимит, пока не отработал старый цикл
+    if(_cycle_running || max_motors < 0) {
+        return;
+    }
+    
+    _step_work_limit = max_motors;
+}
+
+/**
+ * Количество периодов таймера _timer_period_us до следующего вызова
+ * обработчика прерывания. В обычном режиме всегда 1, в режиме
+ * "по событию" (stepper_set_timer_event_driven) - время до ближайшего
+ * события у моторов в цикле.
+ * 
+ * Может быть полезно при тестировании: вызывать _timer_handle_interrupts
+ * вручную, отсчитывая stepper_timer_event_ticks() периодов между вызовами.
+ */
+unsigned int stepper_timer_event_ticks() {
+    return _timer_event_ticks;
+}
+
+/**
+ * Количество целых периодов таймера в интервале time_us (но не больше
+ * _timer_event_ticks_max). Обходимся без деления, которое на AVR стоит
+ * сотни тактов: частное не больше 10 бит, поэтому хватает 10 итераций
+ * сдвига и вычитания.
+ */
+static unsigned int _timer_ticks_in(unsigned long time_us) {
+    unsigned int ticks = 0;
+    for(int shift = TIMER_EVENT_TICKS_SHIFT - 1; shift >= 0; shift--) {
+        unsigned long period_shifted = _timer_period_us << shift;
+        if(time_us >= period_shifted) {
+            time_us -= period_shifted;
+            ticks |= 1 << shift;
+        }
+    }
+    return ticks < _timer_event_ticks_max ? ticks : _timer_event_ticks_max;
+}
+
+/**
+ * Количество периодов таймера до ближайшего события у моторов
+ * в цикле (для режима "по событию").
+ * 
+ * Мотору нужен вызов обработчика, когда его счетчик step_timer попадает
+ * в интервал [0, _timer_period_us*3) - на трех последних периодах перед
+ * шагом проверяются границы, взводится и сбрасывается ножка step.
+ * До этого момента вызовы обработчика только уменьшают счетчик,
+ * их можно пропустить.
+ */
+static unsigned int _timer_next_event_ticks() {
+    unsigned int ticks = _timer_event_ticks_max;
+    bool active = false;
+    for(int i = 0; i < _run->stepper_count; i++) {
+        if( (_run->non_stop[i] || _run->step_counter[i] > 0) && !_run->stopped[i]) {
+            active = true;
+            
+            // начало проверки границ перед шагом
+            unsigned long window_us = _timer_period_us*3;
+#if STEPPER_HARD_ENDS && STEPPER_END_FILTER
+            // фильтру помех концевых датчиков нужны выборки на каждом
+            // периоде перед проверкой
+            window_us += _timer_period_us*_run->smotors[i]->end_filter;
+#endif
+            
+            if(_run->step_timer[i] < window_us || _run->work_deferred[i]) {
+                // мотор в процессе шага или ждет отложенного вычисления
+                // задержки - событие на следующем периоде
+                return 1;
+            }
+            
+            // через сколько периодов счетчик войдет в интервал [0, window_us)
+            unsigned int motor_ticks = _timer_ticks_in(_run->step_timer[i] - window_us + _timer_period_us);
+            if(motor_ticks < ticks) {
+                ticks = motor_ticks;
+            }
+        }
+    }
+    
+    // если активных моторов не осталось, цикл завершится на следующем периоде
+    return active ? ticks : 1;
+}
+
 /**
  * Стратегия реакции на некоторые исключительные ситуации, которые
  * могут произойти во время вращения моторов.
@@ -849,36 +3287,175 @@ void stepper_set_error_handle_strategy(
         _small_step_delay_handle = small_step_delay_handle;
     }
     
-    // допустимые значения: IGNORE/CANCEL_CYCLE
-    if(cycle_timing_exceed_handle == IGNORE || cycle_timing_exceed_handle == CANCEL_CYCLE) {
-        _cycle_timing_exceed_handle = cycle_timing_exceed_handle;
+    // допустимые значения: IGNORE/CANCEL_CYCLE
+    if(cycle_timing_exceed_handle == IGNORE || cycle_timing_exceed_handle == CANCEL_CYCLE) {
+        _cycle_timing_exceed_handle = cycle_timing_exceed_handle;
+    }
+}
+
+/**
+ * Включить моторы цикла и собрать порты ножек step для пакетного вывода
+ * (при запуске цикла и при продолжении цикла новой программой).
+ * 
+ * @param enabled - моторы прошлой программы (продолжение цикла): их ножки
+ *     Enable уже включены, digitalWrite (медленный на AVR) для них
+ *     в обработчике прерывания не повторяем
+ * @param enabled_count - количество моторов в enabled
+ */
+static void _cycle_enable_motors(stepper** enabled, int enabled_count) {
+    for(int i = 0; i < _run->stepper_count; i++) {
+#if STEPPER_END_FILTER
+        // фильтр помех концевых датчиков: мотор, который не вращался
+        // в прошлой программе, начинает с текущего состояния датчиков
+        _run->end_filter[i] = (unsigned char)((1 << _run->smotors[i]->end_filter) - 1);
+        if(_run->end_filter[i] && _run->smotors[i]->status != STEPPER_STATUS_RUNNING) {
+            _end_filter_seed(_run->smotors[i]);
+        }
+#endif
+        
+        // обновим статусы
+        _run->smotors[i]->status = STEPPER_STATUS_RUNNING;
+        
+        // задать направление (не в prepare_xxx: мотор может
+        // еще вращаться в предыдущем цикле)
+        if(_run->cstatuses[i].dir * _run->smotors[i]->dir_inv > 0) {
+            fast_io_write_high(&_run->smotors[i]->pin_dir_io); // туда
+        } else {
+            fast_io_write_low(&_run->smotors[i]->pin_dir_io); // обратно
+        }
+        
+        // аппаратная ножка Enable->LOW (вкл), если задана
+        // и еще не включена в прошлой программе
+        bool was_enabled = false;
+        for(int j = 0; j < enabled_count && !was_enabled; j++) {
+            was_enabled = enabled[j] == _run->smotors[i];
+        }
+        if(_run->smotors[i]->pin_en != NO_PIN && !was_enabled) {
+            digitalWrite(_run->smotors[i]->pin_en, LOW);
+        }
+    }
+    
+    // вычисление задержки можно отложить (stepper_set_step_work_limit)
+    // у всех, кроме ведущих моторов групп
+    for(int i = 0; i < _run->stepper_count; i++) {
+        _run->work_deferrable[i] = true;
+        _run->work_deferred[i] = false;
+        _run->cstatuses[i].work_ahead = false;
+    }
+    for(int i = 0; i < _run->stepper_count; i++) {
+        if(_run->cstatuses[i].line_follower) {
+            _run->work_deferrable[_run->cstatuses[i].line_lead] = false;
+        }
+    }
+    
+    // соберем порты ножек step для пакетного вывода
+    _step_port_count = 0;
+    for(int i = 0; i < _run->stepper_count; i++) {
+        int port_i = 0;
+        while(port_i < _step_port_count && _step_ports[port_i] != _run->smotors[i]->pin_step_io.port) {
+            port_i++;
+        }
+        if(port_i == _step_port_count) {
+            _step_ports[port_i] = _run->smotors[i]->pin_step_io.port;
+            _step_port_set[port_i] = 0;
+            _step_port_clear[port_i] = 0;
+            _step_port_count++;
+        }
+        _run->step_port[i] = port_i;
+        _run->step_mask[i] = _run->smotors[i]->pin_step_io.mask;
     }
 }
 
 /**
- * Запустить цикл шагов на выполнение - запускаем таймер с
- * обработчиком прерываний отрабатывать подготовленную программу.
+ * Продолжить цикл без остановки таймера (из обработчика прерывания
+ * на периоде после последнего шага): запустить программу, подготовленную
+ * во время цикла (stepper_start_cycle), или следующее движение из очереди
+ * (stepper_queue_line).
+ * 
+ * Моторы прошлой программы, которых нет в новой, выключаются.
+ * Задержка перед первым шагом новой программы отсчитывается
+ * от последнего шага прошлой.
  * 
+ * @param elapsed_us - время с последнего шага прошлой программы, микросекунды
  * @return
- *     true - цикл запущен
- *     false - цикл не запущен, т.к. предыдущий цикл еще не завершен
+ *     true - новая программа загружена, цикл продолжается
+ *     false - продолжать нечем
  */
-bool stepper_start_cycle() {
-    // Преварительные проверки перед запуском цикла
-
-    // не запускать новый цикл, если старый не отработал,
-    // статус цикла не обновляем
-    if(_cycle_running) {
+static bool _cycle_chain(unsigned long elapsed_us) {
+    if(!_fill_pending && _move_queue_tail == _move_queue_head) {
         return false;
     }
     
-    // можем считать, что цикл запущен
+    int prev_count = _run->stepper_count;
+    stepper* prev_smotors[MAX_STEPPERS];
+    for(int i = 0; i < prev_count; i++) {
+        prev_smotors[i] = _run->smotors[i];
+    }
     
-    // сбросим информацию о статусе цикла в значения по умолчанию
-    _cycle_running = false;
-    _cycle_paused = false;
-    _cycle_error = CYCLE_ERROR_NONE;
-    _cycle_max_time = 0;
+    if(_fill_pending) {
+        // заполненная программа становится выполняемой
+        _swap_programs();
+    } else {
+        // движение из очереди - на место прошлой программы; заполняемую
+        // программу не трогаем (главный цикл может быть на середине prepare_xxx),
+        // только на время раскладки направляем prepare_xxx в выполняемую
+        _clear_program(_run);
+        cycle_program_t* fill = _fill;
+        _fill = _run;
+        _move_queue_pop();
+        _fill = fill;
+    }
+    
+    for(int i = 0; i < prev_count; i++) {
+        bool in_program = false;
+        for(int j = 0; j < _run->stepper_count && !in_program; j++) {
+            in_program = prev_smotors[i] == _run->smotors[j];
+        }
+        if(!in_program) {
+            if(prev_smotors[i]->pin_en != NO_PIN) {
+                digitalWrite(prev_smotors[i]->pin_en, HIGH);
+            }
+            prev_smotors[i]->status = STEPPER_STATUS_FINISHED;
+        }
+    }
+    
+    _cycle_enable_motors(prev_smotors, prev_count);
+    
+    // не пропускаем проверку границ на периоде [2, 3) перед первым шагом
+    for(int i = 0; i < _run->stepper_count; i++) {
+        if(_run->step_timer[i] >= elapsed_us + _timer_period_us*3) {
+            _run->step_timer[i] -= elapsed_us;
+        }
+    }
+    
+    return true;
+}
+
+/**
+ * Ведущий мотор дуги (ARC) или кривой Безье (BEZIER) берет задержки
+ * следующих шагов из своих полей, а не из step_delay: если задержку
+ * группы исправили (FIX), исправляем и их, иначе дуга продолжит шагать
+ * слишком часто.
+ */
+static void _fix_curve_delays(motor_cycle_info_t* lead) {
+    if(lead->delay_source == ARC && lead->arc_delay < lead->step_delay) {
+        lead->arc_delay = lead->step_delay;
+        lead->arc_diag_delay = lead->arc_delay * 344 / 243;
+    } else if(lead->delay_source == BEZIER && lead->bez_delay < lead->step_delay) {
+        lead->bez_delay = lead->step_delay;
+    }
+}
+
+/**
+ * Проверить программу цикла перед запуском: настройки таймера
+ * и задержки моторов (при необходимости задержки исправляются).
+ * 
+ * @return
+ *     CYCLE_ERROR_NONE - программу можно запускать
+ *     >0 - код ошибки из перечисления stepper_cycle_error_t
+ */
+static stepper_cycle_error_t _check_program(cycle_program_t* program) {
+    stepper_cycle_error_t error = CYCLE_ERROR_NONE;
     
     // завершить ли цикл с ошибкой, не дожидаясь первого шага
     bool canceled = false;
@@ -886,21 +3463,21 @@ bool stepper_start_cycle() {
     // мы не можем обеспечить корректность работы цикла
     // при некоторых комбинациях значений периода таймера
     // и минимальной задержки между шагами мотора
-    for(int i = 0; i < _stepper_count && !canceled; i++) {
-        if(_smotors[i]->step_delay < _timer_period_us*3) {
+    for(int i = 0; i < program->stepper_count && !canceled; i++) {
+        if(program->smotors[i]->step_delay < _timer_period_us*3) {
             // не запускать цикл, если хотябы у одного из моторов
             // минимальная задержка между шагами не вмещает минимум 3
             // периода таймера
-            _cycle_error = CYCLE_ERROR_TIMER_PERIOD_TOO_LONG;
+            error = CYCLE_ERROR_TIMER_PERIOD_TOO_LONG;
             
             canceled = true;
-        } else if(_smotors[i]->step_delay % _timer_period_us != 0) {
+        } else if(program->smotors[i]->step_delay % _timer_period_us != 0) {
             // не запускать цикл, если период таймера не кратен
             // минимальной задержке между шагами хотябы одного из моторов
-            _cycle_error = CYCLE_ERROR_TIMER_PERIOD_ALIQUANT_STEP_DELAY;
+            error = CYCLE_ERROR_TIMER_PERIOD_ALIQUANT_STEP_DELAY;
             
             canceled = true;
-        } else if(_cstatuses[i].step_delay < _smotors[i]->step_delay) {
+        } else if(program->cstatuses[i].step_delay < program->smotors[i]->step_delay) {
             // проверим, корректна ли задержка перед первым шагом,
             // заданная во время prepare_steps/whirl/xxx:
             
@@ -908,73 +3485,154 @@ bool stepper_start_cycle() {
             // между двумя шагами мотора - это не хорошо
             
             // обозначим ошибку в статусе мотора
-            _smotors[i]->error |= STEPPER_ERROR_STEP_DELAY_SMALL;
+            program->smotors[i]->error |= STEPPER_ERROR_STEP_DELAY_SMALL;
             
             // посмотрим, что делать с ошибкой
             if(_small_step_delay_handle == FIX) {
                 // попробуем исправить:
                 // не будем делать шаги чаще, чем может мотор
                 // (следует понимать, что корректность вращения уже нарушена)
-                _cstatuses[i].step_delay = _smotors[i]->step_delay;
+                program->cstatuses[i].step_delay = program->smotors[i]->step_delay;
                 
                 // задержка перед первым шагом
-                _cstatuses[i].step_timer = _cstatuses[i].step_delay;
+                program->step_timer[i] = program->cstatuses[i].step_delay;
             } else if(_small_step_delay_handle == STOP_MOTOR) {
                 // останавливаем мотор
-                _cstatuses[i].stopped = true;
+                program->stopped[i] = true;
                 
-                _smotors[i]->status = STEPPER_STATUS_FINISHED;
+                program->smotors[i]->status = STEPPER_STATUS_FINISHED;
             } else { //if(_small_step_delay_handle == CANCEL_CYCLE) {
                 // по умолчанию: завершаем весь цикл
                 
-                _cycle_error = CYCLE_ERROR_MOTOR_ERROR;
+                error = CYCLE_ERROR_MOTOR_ERROR;
                 
                 canceled = true;
             }
         }
     }
     
-    if(canceled) {
+    // ведомые моторы в группах движения по линии (prepare_line) должны
+    // шагать синхронно с ведущим: если задержку исправили (FIX) хотя бы
+    // для одного мотора группы, выравниваем всю группу по самой большой
+    if(!canceled) {
+        int lead = -1;
+        for(int i = 0; i < program->stepper_count; i++) {
+            if(!program->cstatuses[i].line_follower) {
+                lead = i;
+            } else if(lead != -1 && program->cstatuses[i].step_delay > program->cstatuses[lead].step_delay) {
+                program->cstatuses[lead].step_delay = program->cstatuses[i].step_delay;
+                program->step_timer[lead] = program->cstatuses[i].step_delay;
+            }
+        }
+        for(int i = 0; i < program->stepper_count; i++) {
+            if(!program->cstatuses[i].line_follower) {
+                lead = i;
+                _fix_curve_delays(&program->cstatuses[i]);
+            } else if(lead != -1) {
+                program->cstatuses[i].step_delay = program->cstatuses[lead].step_delay;
+                program->step_timer[i] = program->step_timer[lead];
+            }
+        }
+    }
+    
+    return error;
+}
+
+/**
+ * Запустить цикл шагов на выполнение - запускаем таймер с
+ * обработчиком прерываний отрабатывать подготовленную программу.
+ * 
+ * Если программа не подготовлена (ни одного вызова prepare_xxx),
+ * запускается первое движение из очереди (stepper_queue_line).
+ * 
+ * Если цикл уже выполняется, программу, подготовленную во время цикла,
+ * обработчик прерывания запустит сразу после его завершения, не останавливая
+ * таймер (при STEPPER_CYCLE_PROGRAMS=2). Пока она ждет запуска
+ * (stepper_cycle_pending), следующую программу готовить нельзя.
+ * 
+ * @return
+ *     true - цикл запущен или программа будет запущена после текущего цикла
+ *     false - цикл не запущен, т.к. предыдущий цикл еще не завершен
+ *         (и программа не подготовлена, уже ждет запуска или не прошла проверки)
+ */
+bool stepper_start_cycle() {
+    // Преварительные проверки перед запуском цикла
+
+    // цикл еще не отработал: следующую программу запустим
+    // сразу после него, статус цикла не обновляем
+    if(_cycle_running) {
+        if(_fill == _run || _fill_pending || _fill->stepper_count == 0) {
+            return false;
+        }
+        if(_check_program(_fill) != CYCLE_ERROR_NONE) {
+            _clear_program(_fill);
+            return false;
+        }
+        _fill_pending = true;
+        return true;
+    }
+    
+    // программа не подготовлена - берем движение из очереди
+    if(_fill->stepper_count == 0) {
+        _move_queue_pop();
+    }
+    
+    // можем считать, что цикл запущен
+    
+    // сбросим информацию о статусе цикла в значения по умолчанию
+    _cycle_running = false;
+    _cycle_paused = false;
+    _cycle_error = CYCLE_ERROR_NONE;
+    _cycle_max_time = 0;
+    
+    // мы не можем обеспечить корректность работы цикла
+    // при некоторых комбинациях значений периода таймера
+    // и минимальной задержки между шагами мотора
+    _cycle_error = _check_program(_fill);
+    
+    if(_cycle_error != CYCLE_ERROR_NONE) {
         // неудачная попытка - очищаем все предварительные заготовки
         stepper_finish_cycle();
     } else {
+        // подготовленная программа становится выполняемой
+        if(_fill != _run) {
+            _clear_program(_run);
+            _swap_programs();
+        }
+        
         _cycle_running = true;
         _cycle_paused = false;
         
         // включить моторы
-        for(int i = 0; i < _stepper_count; i++) {
-            // обновим статусы
-            _smotors[i]->status = STEPPER_STATUS_RUNNING;
-            
-            // аппаратная ножка Enable->LOW (вкл), если задана
-            if(_smotors[i]->pin_en != NO_PIN) {
-                digitalWrite(_smotors[i]->pin_en, LOW);
-            }
-        }
+        _cycle_enable_motors(NULL, 0);
+        
+        // в режиме "по событию" первый вызов обработчика - на ближайшем событии
+        _timer_event_ticks = _timer_event_driven ? _timer_next_event_ticks() : 1;
         
         // Запустим таймер с периодом _timer_period_us, для этого
         // должны быть заданы правильные _timer_prescaler и _timer_adjustment
-        if(_timer_enabled) _timer_init_ISR(_timer_id, _timer_prescaler, _timer_adjustment-1);
+        if(_timer_enabled) _timer_init_ISR(_timer_id, _timer_prescaler, _timer_event_ticks*_timer_adjustment-1);
     }
     return true;
 }
 
 /**
- * Завершить цикл шагов - остановить таймер, обнулить список моторов.
+ * Завершить цикл шагов - остановить таймер, обнулить список моторов
+ * (очередь движений не трогаем).
  */
-void stepper_finish_cycle() {
+static void _finish_cycle() {
     // остановим таймер
     _timer_stop_ISR(_timer_id);
     
     // выключим все моторы
-    for(int i = 0; i < _stepper_count; i++) {
+    for(int i = 0; i < _run->stepper_count; i++) {
         // аппаратная ножка Enable->HIGH (выкл), если задана
-        if(_smotors[i]->pin_en != NO_PIN) {
-            digitalWrite(_smotors[i]->pin_en, HIGH);
+        if(_run->smotors[i]->pin_en != NO_PIN) {
+            digitalWrite(_run->smotors[i]->pin_en, HIGH);
         }
         
         // обновим статусы (на случай, если это уже не сделано заранее)
-        _smotors[i]->status = STEPPER_STATUS_FINISHED;
+        _run->smotors[i]->status = STEPPER_STATUS_FINISHED;
     }
     
     // цикл завершился
@@ -982,7 +3640,41 @@ void stepper_finish_cycle() {
     _cycle_paused = false;
     
     // обнулим список моторов
-    _stepper_count = 0;
+    _clear_program(_run);
+}
+
+/**
+ * Прервать цикл из обработчика прерывания (что-то пошло не так):
+ * движения из очереди и программа, ждущая запуска, уже не актуальны.
+ * Программу, которую главный цикл, возможно, еще заполняет, не трогаем.
+ */
+static void _cancel_cycle() {
+    _finish_cycle();
+    _move_queue_clear();
+    if(_fill_pending) {
+        _clear_program(_fill);
+        _fill_pending = false;
+    }
+}
+
+/**
+ * Завершить цикл шагов - остановить таймер, обнулить список моторов
+ * (в том числе подготовленных для следующего цикла), очистить
+ * очередь движений.
+ */
+void stepper_finish_cycle() {
+    _finish_cycle();
+    _move_queue_clear();
+    _clear_program(_fill);
+    _fill_pending = false;
+}
+
+/**
+ * Программа, подготовленная во время цикла, ждет запуска
+ * после его завершения (см. stepper_start_cycle).
+ */
+bool stepper_cycle_pending() {
+    return _fill_pending;
 }
 
 /**
@@ -1036,6 +3728,288 @@ unsigned long stepper_cycle_max_time() {
     return _cycle_max_time;
 }
 
+#if STEPPER_TRACE
+/**
+ * Включить трассу шагов: обработчик прерывания записывает в буфер событие
+ * на каждый шаг мотора. Вызывать, когда цикл не запущен.
+ * 
+ * @param buf_size - размер буфера, не больше 255
+ * @param buffer - буфер событий, NULL - выключить трассу
+ */
+void stepper_trace_init(int buf_size, stepper_trace_event_t* buffer) {
+    // не трогать буфер, пока в него пишет обработчик
+    if(_cycle_running) {
+        return;
+    }
+    
+    _trace_buffer = buffer;
+    _trace_size = buffer != NULL && buf_size > 1 ? (buf_size < 255 ? buf_size : 255) : 0;
+    _trace_head = 0;
+    _trace_tail = 0;
+    _trace_dropped = 0;
+    _trace_tick = 0;
+}
+
+/**
+ * Забрать события трассы шагов из буфера (читатель - главный цикл).
+ * 
+ * @return количество скопированных событий
+ */
+int stepper_trace_read(stepper_trace_event_t* events, int max_count) {
+    int count = 0;
+    unsigned char tail = _trace_tail;
+    while(count < max_count && tail != _trace_head) {
+        // событие записано до того, как сдвинут _trace_head
+        _ring_barrier();
+        events[count++] = _trace_buffer[tail];
+        tail = tail + 1 < _trace_size ? tail + 1 : 0;
+    }
+    // событие прочитано до того, как ячейка освобождена
+    _ring_barrier();
+    _trace_tail = tail;
+    return count;
+}
+
+/**
+ * Сколько событий трассы отброшено из-за переполнения буфера.
+ */
+unsigned long stepper_trace_dropped() {
+    return _trace_dropped;
+}
+
+/**
+ * Событие трассы в поток байт: тик (младший байт первым), имя мотора, флаги.
+ */
+int stepper_trace_encode(const stepper_trace_event_t* event, unsigned char* data) {
+    data[0] = event->tick;
+    data[1] = event->tick >> 8;
+    data[2] = event->tick >> 16;
+    data[3] = event->tick >> 24;
+    data[4] = event->motor;
+    data[5] = event->flags;
+    return STEPPER_TRACE_EVENT_BYTES;
+}
+#endif // STEPPER_TRACE
+
+#if STEPPER_ISR_PROFILE
+/**
+ * Профиль обработчика прерывания таймера: гистограмма времени вызовов,
+ * вызовы по фазам шага.
+ * 
+ * Обработчик прерывания обновляет профиль целиком за один вызов и в конце
+ * увеличивает счетчик ticks: если счетчик поменялся во время копирования,
+ * копируем заново. Сброс во время цикла делает сам обработчик (иначе
+ * его запись поверх обнуления вернет старые значения).
+ * 
+ * @param profile - копия профиля
+ * @param reset - сбросить профиль
+ */
+void stepper_profile(stepper_profile_t* profile, bool reset) {
+    unsigned long ticks;
+    do {
+        ticks = _profile.ticks;
+        _ring_barrier();
+        *profile = _profile;
+        _ring_barrier();
+    } while(ticks != _profile.ticks);
+    
+    if(reset) {
+        if(_cycle_running) {
+            _profile_reset = true;
+        } else {
+            memset(&_profile, 0, sizeof(_profile));
+        }
+    }
+}
+
+/**
+ * Профиль мотора в обработчике прерывания: шаги и время работы на шагах.
+ * Копия согласованная, как у stepper_profile.
+ * 
+ * @param smotor - мотор
+ * @param profile - копия профиля
+ * @param reset - сбросить профиль
+ */
+void stepper_profile_motor(stepper* smotor, stepper_motor_profile_t* profile, bool reset) {
+    unsigned long ticks;
+    do {
+        ticks = _profile.ticks;
+        _ring_barrier();
+        profile->steps = smotor->profile.steps;
+        profile->work_time = smotor->profile.work_time;
+        profile->work_max_time = smotor->profile.work_max_time;
+        profile->reset = smotor->profile.reset;
+        _ring_barrier();
+    } while(ticks != _profile.ticks);
+    
+    if(reset) {
+        if(smotor->status == STEPPER_STATUS_RUNNING) {
+            // мотор в цикле: обнулит обработчик на следующем шаге
+            smotor->profile.reset = true;
+        } else {
+            smotor->profile.steps = 0;
+            smotor->profile.work_time = 0;
+            smotor->profile.work_max_time = 0;
+            smotor->profile.reset = false;
+        }
+    }
+}
+#endif // STEPPER_ISR_PROFILE
+
+/**
+ * Память под программы цикла: размер статуса цикла одного мотора, байт.
+ */
+unsigned int stepper_cycle_info_size() {
+    return sizeof(motor_cycle_info_t);
+}
+
+#if STEPPER_ISR_PROFILE
+/**
+ * Профиль мотора: время работы на шаге (или отложенной работы).
+ */
+static inline void _profile_motor_work(stepper* smotor, unsigned long work_time) {
+    if(smotor->profile.reset) {
+        smotor->profile.steps = 0;
+        smotor->profile.work_time = 0;
+        smotor->profile.work_max_time = 0;
+        smotor->profile.reset = false;
+    }
+    smotor->profile.work_time += work_time;
+    if(work_time > smotor->profile.work_max_time) {
+        smotor->profile.work_max_time = work_time;
+    }
+}
+
+/**
+ * Профиль обработчика: время вызова в корзину гистограммы по старшему биту,
+ * фаза тика; счетчик ticks - последним (см. stepper_profile).
+ */
+static inline void _profile_tick(unsigned long cycle_time, unsigned char phase) {
+    if(_profile_reset) {
+        memset(&_profile, 0, sizeof(_profile));
+        _profile_reset = false;
+    }
+    
+    unsigned char bucket = 0;
+    for(unsigned long t = cycle_time; t != 0 && bucket < STEPPER_PROFILE_BUCKETS - 1; t >>= 1) {
+        bucket++;
+    }
+    _profile.time_buckets[bucket]++;
+    _profile.phase_ticks[phase]++;
+    if(cycle_time > _profile.max_time) {
+        _profile.max_time = cycle_time;
+        _profile.max_time_phase = phase;
+    }
+    _ring_barrier();
+    _profile.ticks++;
+}
+
+// фаза тика: самая тяжелая работа среди моторов
+#define _profile_phase(p) if(phase < (p)) phase = (p)
+#else
+#define _profile_phase(p)
+#endif // STEPPER_ISR_PROFILE
+
+#if STEPPER_TRACE
+/**
+ * Записать событие трассы шагов для мотора i (если трасса включена
+ * и в буфере есть место, иначе событие отброшено).
+ * 
+ * @param flags - STEPPER_TRACE_STOP или 0
+ */
+static inline void _trace_event(int i, unsigned char flags) {
+    if(_trace_size == 0) return;
+    
+    unsigned char head = _trace_head;
+    unsigned char next_head = head + 1 < _trace_size ? head + 1 : 0;
+    if(next_head == _trace_tail) {
+        _trace_dropped++;
+        return;
+    }
+    _trace_buffer[head].tick = _trace_tick;
+    _trace_buffer[head].motor = _run->smotors[i]->name;
+    _trace_buffer[head].flags = flags | (_run->smotors[i]->error & STEPPER_TRACE_ERROR_MASK) |
+        (_run->cstatuses[i].dir > 0 ? STEPPER_TRACE_DIR : 0);
+    _ring_barrier();
+    _trace_head = next_head;
+}
+#else
+#define _trace_event(i, flags)
+#endif // STEPPER_TRACE
+
+/**
+ * Задержка перед следующим шагом мотора для delay_source=BUFFER, DYNAMIC,
+ * ACCEL, SCURVE ("тяжелая" работа на шаге, ее можно отложить -
+ * stepper_set_step_work_limit).
+ * 
+ * @param step_counter - оставшиеся шаги серии после шага, за которым
+ *     идет задержка (для задержки сразу после шага - уже уменьшенный
+ *     program->step_counter[i], для вычисления заранее - на 1 меньше)
+ */
+static inline unsigned long _heavy_step_delay(cycle_program_t* program, int i, unsigned long step_counter) {
+    motor_cycle_info_t* cstatus = &program->cstatuses[i];
+    if(STEPPER_BUFFERED_STEPS && cstatus->delay_source == BUFFER) {
+        // координата внутри цикла движется с переменной скоростью,
+        // значения задержек получаем из буфера
+        return cstatus->delay_buffer[(cstatus->step_count - step_counter)/cstatus->scale];
+#if STEPPER_DYNAMIC_STEPS
+    } else if(cstatus->delay_source == DYNAMIC) {
+        // координата движется с переменной скоростью (например, рисуем дугу),
+        // значения задержек вычисляем динамически
+        if(cstatus->prefetch != NULL) {
+            // задержка уже вычислена в главном цикле
+            return _prefetch_pop(cstatus->prefetch,
+                !program->non_stop[i] && step_counter == 0);
+        } else {
+            return cstatus->next_step_delay(cstatus->step_count - step_counter,
+                cstatus->curve_context);
+        }
+#endif // STEPPER_DYNAMIC_STEPS
+    } else if(cstatus->delay_source == ACCEL) {
+        // разгон и торможение с постоянным ускорением,
+        // задержку вычисляем по предыдущей
+        return _accel_next_step_delay(cstatus, cstatus->step_count - step_counter);
+    } else { // SCURVE
+        // разгон и торможение с ограничением рывка,
+        // задержку вычисляем по времени с начала разгона или торможения
+        return _scurve_next_step_delay(cstatus, cstatus->step_count - step_counter);
+    }
+}
+
+/**
+ * Проверить, не меньше ли задержка перед следующим шагом минимально
+ * допустимой для мотора, и поступить по _small_step_delay_handle.
+ * 
+ * @param canceled - выставляется в true, если нужно завершить весь цикл
+ * @return задержка (исправленная при FIX)
+ */
+static inline unsigned long _check_step_delay(int i, unsigned long step_delay, bool* canceled) {
+    if(step_delay < _run->smotors[i]->step_delay) {
+        // вычисленная задержка перед очередным шагом меньше,
+        // чем минимально допустимая для этого мотора
+        
+        // посмотрим, что делать с ошибкой
+        if(_small_step_delay_handle == FIX) {
+            // попробуем исправить:
+            // не будем делать шаги чаще, чем может мотор
+            // (следует понимать, что корректность вращения уже нарушена)
+            step_delay = _run->smotors[i]->step_delay;
+        } else if(_small_step_delay_handle == STOP_MOTOR) {
+            // останавливаем мотор
+            _run->stopped[i] = true;
+            
+            _run->smotors[i]->status = STEPPER_STATUS_FINISHED;
+        } else { //if(_small_step_delay_handle == CANCEL_CYCLE) {
+            // по умолчанию: завершаем весь цикл
+            *canceled = true;
+        }
+        
+        // в любом случае, обозначим ошибку
+        _run->smotors[i]->error |= STEPPER_ERROR_STEP_DELAY_SMALL;
+    }
+    return step_delay;
+}
+
 /**
  * Обработчик прерывания от таймера - дёргается каждые _timer_period_us микросекунд.
  *
@@ -1052,14 +4026,29 @@ unsigned long stepper_cycle_max_time() {
  *
  * Следует учитывать, что "тяжелые" вычисления для разных моторов могут попасть на одну
  * итерацию таймера, поэтому период следует выбирать исходя из суммы максимальных времен
- * для всех задействованных в цикле моторов (как вариант - раскидать вычисления
- * для разных моторов на разные итерации таймера, но для этого придется усложнить
- * алгоритм, сейчас не рализовано).
+ * для всех задействованных в цикле моторов. Другой вариант - раскидать вычисления
+ * для разных моторов на разные итерации таймера: stepper_set_step_work_limit
+ * ограничивает количество моторов, которые вычисляют задержку следующего шага
+ * на одной итерации, у остальных вычисление откладывается.
+ *
+ * В режиме "по событию" (stepper_set_timer_event_driven) обработчик вызывается
+ * только на тех периодах таймера, на которых что-то происходит, холостые
+ * проверки пропускаются вместе с вызовами.
  */
 void _timer_handle_interrupts(int timer) {
 
+#if STEPPER_TRACE
+    // тики трассы идут и на паузе
+    _trace_tick += _timer_event_ticks;
+#endif
+    
     // если на паузе, вообще ничего не трогаем
     if(_cycle_paused) {
+        // в режиме "по событию" на паузе просто ждем следующего периода
+        if(_timer_event_ticks != 1) {
+            _timer_event_ticks = 1;
+            if(_timer_enabled) _timer_update_ISR(_timer_id, _timer_adjustment-1);
+        }
         return;
     }
 
@@ -1069,34 +4058,110 @@ void _timer_handle_interrupts(int timer) {
     // возможные ошибки:
     // - выход за виртуальные границы координаты (останов всего цикла или запрет движения только одного мотора),
     // - концевой датчик (останов всего цикла или запрет движения только одного мотора),
-    // - задержка между двумя импульсами меньше, чем оптимальное значение (_smotors[i]->step_delay)
+    // - задержка между двумя импульсами меньше, чем оптимальное значение (_run->smotors[i]->step_delay)
     // - время выполнения обработчика таймера превышает задержку между двумя вызовами обработчика по таймеру
     // (код слишком медленный) - лучше останавливать весь цикл с ошибкой
 
+#if STEPPER_ISR_TIMING || STEPPER_ISR_PROFILE
     // засечем время выполнения обработчика
     unsigned long cycle_start = micros();
+#endif
+#if STEPPER_ISR_PROFILE
+    // фаза тика для профиля (stepper_phase_t)
+    unsigned char phase = STEPPER_PHASE_IDLE;
+#endif
+    
+    // время, прошедшее с предыдущего вызова обработчика
+    // (в режиме "по событию" может быть больше одного периода)
+    unsigned long elapsed_us = _timer_event_ticks == 1 ?
+        _timer_period_us : _timer_period_us * _timer_event_ticks;
     
     // завершился ли цикл - все моторы закончили движение
     bool finished = true;
     // завершился ли цикл - что-то пошло не так, сворачиваемся раньше времени
     bool canceled = false;
     
+    // сколько моторов уже вычислили задержку следующего шага на этом вызове
+    // (stepper_set_step_work_limit)
+    int step_work = 0;
+    
     // цикл по всем моторам
-    for(int i = 0; i < _stepper_count && !canceled; i++) {
-        _cstatuses[i].step_timer -= _timer_period_us;
+    for(int i = 0; i < _run->stepper_count && !canceled; i++) {
+        _run->step_timer[i] -= elapsed_us;
         
-        if( (_cstatuses[i].non_stop || _cstatuses[i].step_counter > 0) && !_cstatuses[i].stopped) {
+        if( (_run->non_stop[i] || _run->step_counter[i] > 0) && !_run->stopped[i]) {
             
             // если хотя бы у одного мотора остались шаги или он запущен нон-стоп, при этом
             // не остановлен по другой причине (например, из-за концевого датчика),
             // то мы еще не закончили
             finished = false;
             
+#if STEPPER_HARD_ENDS && STEPPER_END_FILTER
+            if(_run->end_filter[i]) {
+                // фильтр помех концевых датчиков: выборка на каждом тике
+                _end_filter_sample(_run->smotors[i], _run->end_filter[i]);
+            }
+#endif
+            
+            if(_run->work_deferred[i] &&
+                    (step_work < _step_work_limit || _run->step_timer[i] < _timer_period_us*3)) {
+                // отложенное вычисление задержки перед следующим шагом: дошла
+                // очередь или мотор подошел к проверке границ перед шагом
+                // (тогда вне очереди); таймер был взведен на минимальную задержку
+#if STEPPER_ISR_PROFILE
+                unsigned long work_start = micros();
+#endif
+                _run->work_deferred[i] = false;
+                step_work++;
+                if(!_run->work_deferrable[i]) {
+                    // ведущий мотор группы: задержку перед шагом после
+                    // следующего вычисляем заранее, таймер не трогаем
+                    _run->cstatuses[i].line_ahead_delay =
+                        _heavy_step_delay(_run, i, _run->step_counter[i] - 1);
+                    _run->cstatuses[i].work_ahead = true;
+                } else {
+                    unsigned long step_delay = _check_step_delay(i,
+                        _heavy_step_delay(_run, i, _run->step_counter[i]), &canceled);
+                    _run->step_timer[i] += step_delay - _run->smotors[i]->step_delay;
+                    _run->cstatuses[i].line_step_delay = step_delay;
+                }
+#if STEPPER_ISR_PROFILE
+                _profile_motor_work(_run->smotors[i], micros() - work_start);
+#endif
+                
+                if(_run->stopped[i] || canceled) {
+                    _trace_event(i, STEPPER_TRACE_STOP);
+                    continue;
+                }
+            }
             
-            if(_cstatuses[i].step_timer < _timer_period_us*3 && _cstatuses[i].step_timer >= _timer_period_us*2) {
+            if(_run->line_skip[i]) {
+                // ведомый мотор в группе движения по линии пропускает
+                // этот шаг ведущего мотора: не проверяем границы, не трогаем
+                // ножку step, только держим таймер синхронно с ведущим
+                if(_run->step_timer[i] < _timer_period_us) {
+                    if(_run->cstatuses[i].delay_source == ARC) {
+                        // ведущий мотор дуги пропускает шаг, но ведет дугу
+                        _run->cstatuses[i].line_step_delay =
+                            _arc_next(&_run->cstatuses[i], &_run->cstatuses[i + 1]);
+                    } else if(_run->cstatuses[i].delay_source == BEZIER) {
+                        // ведущий мотор кривой Безье пропускает шаг, но ведет кривую
+                        _run->cstatuses[i].line_step_delay = _bezier_next(&_run->cstatuses[i]);
+                    }
+                    _run->step_timer[i] =
+                        _run->cstatuses[_run->cstatuses[i].line_lead].line_step_delay + _run->step_timer[i];
+                    if(_run->cstatuses[i].arc) {
+                        _arc_apply(_run, i);
+                    } else {
+                        _line_follower_next_step(_run, i);
+                    }
+                }
+#if STEPPER_HARD_ENDS || STEPPER_SOFT_ENDS
+            } else if(_run->step_timer[i] < _timer_period_us*3 && _run->step_timer[i] >= _timer_period_us*2) {
                 // >>>За 2 импульса до обнуления таймера
                 // проверим пограничные значения координат и концевики непосредственно перед шагом
                 // (если все ок, то на следующем импульсе пин мотора пойдет в HIGH, а еще на следующем - в LOW)
+                _profile_phase(STEPPER_PHASE_CHECK);
                 
                 
                 // различать левый и правый концевой датчик:
@@ -1107,16 +4172,16 @@ void _timer_handle_interrupts(int timer) {
                 // мотор, при старте следующего цикла датчик все еще будет нажат и у нас должна быть возможность
                 // уйти вправо (влево блок, как и в прошлый раз).
                 
-                if(_smotors[i]->pin_min != NO_PIN && digitalRead(_smotors[i]->pin_min) && _cstatuses[i].dir < 0) {
+                if(STEPPER_HARD_ENDS && _run->cstatuses[i].dir < 0 && _end_min_hit(i)) {
                     // сработал левый аппаратный концевой датчик и мы движемся влево -
                     // завершаем вращение для этого мотора
-                    _cstatuses[i].stopped = true;
+                    _run->stopped[i] = true;
                     
                     // обновим статус мотора
-                    _smotors[i]->status = STEPPER_STATUS_FINISHED;
+                    _run->smotors[i]->status = STEPPER_STATUS_FINISHED;
                     
                     // обозначим ошибку
-                    _smotors[i]->error |= STEPPER_ERROR_HARD_END_MIN;
+                    _run->smotors[i]->error |= STEPPER_ERROR_HARD_END_MIN;
                     
                     // как себя вести - остановить только этот мотор (в любом случае) или
                     // сразу завершить весь цикл
@@ -1125,18 +4190,17 @@ void _timer_handle_interrupts(int timer) {
                         canceled = true;
                     } // иначе STOP_MOTOR - останавливается только этот мотор
                     
-                } else if(_smotors[i]->pin_max != NO_PIN &&
-                        digitalRead(_smotors[i]->pin_max) && _cstatuses[i].dir > 0) {
+                } else if(STEPPER_HARD_ENDS && _run->cstatuses[i].dir > 0 && _end_max_hit(i)) {
                     // сработал правый аппаратный концевой датчик и мы движемся вправо -
                     // завершаем вращение для этого мотора
-                    _cstatuses[i].stopped = true;
+                    _run->stopped[i] = true;
                     
                     
                     // обновим статус мотора
-                    _smotors[i]->status = STEPPER_STATUS_FINISHED;
+                    _run->smotors[i]->status = STEPPER_STATUS_FINISHED;
                         
                     // обозначим ошибку
-                    _smotors[i]->error |= STEPPER_ERROR_HARD_END_MAX;
+                    _run->smotors[i]->error |= STEPPER_ERROR_HARD_END_MAX;
                     
                     // как себя вести - остановить только этот мотор (в любом случае) или
                     // сразу завершить весь цикл
@@ -1145,26 +4209,26 @@ void _timer_handle_interrupts(int timer) {
                         canceled = true;
                     } // иначе STOP_MOTOR - останавливается только этот мотор
                     
-                } else if( _cstatuses[i].calibrate_mode == NONE &&
-                        (_cstatuses[i].dir > 0 ?
-                            _smotors[i]->max_end_strategy != INF &&
-                                _smotors[i]->current_pos + (long long)_smotors[i]->distance_per_step > _smotors[i]->max_pos :
-                            _smotors[i]->min_end_strategy != INF &&
-                                _smotors[i]->current_pos - (long long)_smotors[i]->distance_per_step < _smotors[i]->min_pos) ) {
+                } else if( STEPPER_SOFT_ENDS && (!STEPPER_CALIBRATE || _run->cstatuses[i].calibrate_mode == NONE) &&
+                        (_run->cstatuses[i].dir > 0 ?
+                            _run->smotors[i]->max_end_strategy != INF &&
+                                _run->smotors[i]->current_pos + (stepper_pos_t)_run->smotors[i]->distance_per_step > _run->smotors[i]->max_pos :
+                            _run->smotors[i]->min_end_strategy != INF &&
+                                _run->smotors[i]->current_pos - (stepper_pos_t)_run->smotors[i]->distance_per_step < _run->smotors[i]->min_pos) ) {
                     // выход за пределы виртуальной границы:
                     // не в режиме калибровки, включены виртуальные границы координаты и
                     // собираемся выйти за виртуальные границы во время предстоящего шага -
                     // завершаем вращение для этого мотора
-                    _cstatuses[i].stopped = true;
+                    _run->stopped[i] = true;
                     
                     // обновим статус мотора
-                    _smotors[i]->status = STEPPER_STATUS_FINISHED;
+                    _run->smotors[i]->status = STEPPER_STATUS_FINISHED;
                         
                     // обозначим ошибку
-                    if(_cstatuses[i].dir < 0) {
-                        _smotors[i]->error |= STEPPER_ERROR_SOFT_END_MIN;
+                    if(_run->cstatuses[i].dir < 0) {
+                        _run->smotors[i]->error |= STEPPER_ERROR_SOFT_END_MIN;
                     } else {
-                        _smotors[i]->error |= STEPPER_ERROR_SOFT_END_MAX;
+                        _run->smotors[i]->error |= STEPPER_ERROR_SOFT_END_MAX;
                     }
                     
                     // как себя вести - остановить только этот мотор (в любом случае) или
@@ -1174,19 +4238,20 @@ void _timer_handle_interrupts(int timer) {
                         canceled = true;
                     } // иначе STOP_MOTOR - останавливается только этот мотор
                     
-                } else if( _cstatuses[i].calibrate_mode == CALIBRATE_BOUNDS_MAX_POS &&
-                        _cstatuses[i].dir < 0 &&
-                        _smotors[i]->current_pos - (long long)_smotors[i]->distance_per_step < _smotors[i]->min_pos ) {
+                } else if( STEPPER_SOFT_ENDS && STEPPER_CALIBRATE &&
+                        _run->cstatuses[i].calibrate_mode == CALIBRATE_BOUNDS_MAX_POS &&
+                        _run->cstatuses[i].dir < 0 &&
+                        _run->smotors[i]->current_pos - (stepper_pos_t)_run->smotors[i]->distance_per_step < _run->smotors[i]->min_pos ) {
                     // в режиме калибровки размера рабочей области при движении влево
                     // собираемся сместиться ниже нижней виртуальной границы
                     // во время предстоящего шага - завершаем вращение для этого мотора
-                    _cstatuses[i].stopped = true;
+                    _run->stopped[i] = true;
                     
                     // обновим статус мотора
-                    _smotors[i]->status = STEPPER_STATUS_FINISHED;
+                    _run->smotors[i]->status = STEPPER_STATUS_FINISHED;
                     
                     // обозначим ошибку мотора
-                    _smotors[i]->error |= STEPPER_ERROR_SOFT_END_MIN;
+                    _run->smotors[i]->error |= STEPPER_ERROR_SOFT_END_MIN;
                     
                     // как себя вести - остановить только этот мотор (в любом случае) или
                     // сразу завершить весь цикл
@@ -1196,143 +4261,237 @@ void _timer_handle_interrupts(int timer) {
                     } // иначе STOP_MOTOR - останавливается только этот мотор
                     
                 }
-            } else if(_cstatuses[i].step_timer < _timer_period_us*2 && _cstatuses[i].step_timer >= _timer_period_us) {
+#endif // STEPPER_HARD_ENDS || STEPPER_SOFT_ENDS
+            } else if(_run->step_timer[i] < _timer_period_us*2 && _run->step_timer[i] >= _timer_period_us) {
                 // >>>За 1 импульс до обнуления таймера
                 // Шаг происходит по фронту сигнала HIGH>LOW, ширина ступени HIGH при этом не важна.
                 // Поэтому сформируем ступень HIGH за один цикл таймера до сброса в LOW
                 
-                // _cstatuses[i].step_timer ~ _timer_period_us с учетом погрешности таймера (_timer_period_us) =>
+                // _run->step_timer[i] ~ _timer_period_us с учетом погрешности таймера (_timer_period_us) =>
                 // импульс1 - готовим шаг
-                digitalWrite(_smotors[i]->pin_step, HIGH);
-            } else if(_cstatuses[i].step_timer < _timer_period_us) {
+                // (запишем в порт вместе с другими моторами в конце обработчика)
+                _step_port_set[_run->step_port[i]] |= _run->step_mask[i];
+                _profile_phase(STEPPER_PHASE_PULSE);
+            } else if(_run->step_timer[i] < _timer_period_us) {
                 // >>>Таймер обнулился
                 // Шагаем
-                // _cstatuses[i].step_timer ~ 0 с учетом погрешности таймера (_timer_period_us) =>
+                // _run->step_timer[i] ~ 0 с учетом погрешности таймера (_timer_period_us) =>
                 // импульс2 (спустя _timer_period_us микросекунд после импульса1) - совершаем шаг
-                digitalWrite(_smotors[i]->pin_step, LOW);
+                // (запишем в порт вместе с другими моторами в конце обработчика)
+                _step_port_clear[_run->step_port[i]] |= _run->step_mask[i];
+                _profile_phase(STEPPER_PHASE_STEP);
+                _trace_event(i, 0);
+#if STEPPER_ISR_PROFILE
+                unsigned long work_start = micros();
+#endif
                 
                 // шагнули, отметимся в разных местах и приготовимся к следующему шагу (если он будет)
                 
                 // посчитаем шаг
-                if(!_cstatuses[i].non_stop) {
-                    _cstatuses[i].step_counter--;
+                if(!_run->non_stop[i]) {
+                    _run->step_counter[i]--;
                 }
                 
                 // Текущее положение координаты
-                if(_cstatuses[i].calibrate_mode == NONE || _cstatuses[i].calibrate_mode == CALIBRATE_BOUNDS_MAX_POS) {
+                if(!STEPPER_CALIBRATE || _run->cstatuses[i].calibrate_mode == NONE ||
+                        _run->cstatuses[i].calibrate_mode == CALIBRATE_BOUNDS_MAX_POS) {
                     // не калибруем или калибруем ширину рабочего поля
                     
                     // обновим текущее положение координаты
-                    if(_cstatuses[i].dir > 0) {
-                        _smotors[i]->current_pos += _smotors[i]->distance_per_step;
+                    if(_run->cstatuses[i].dir > 0) {
+                        _run->smotors[i]->current_pos += _run->smotors[i]->distance_per_step;
                     } else {
-                        _smotors[i]->current_pos -= _smotors[i]->distance_per_step;
+                        _run->smotors[i]->current_pos -= _run->smotors[i]->distance_per_step;
                     }
                     
                     // калибруем ширину рабочего поля - сдвинем правую границу в текущее положение
-                    if(_cstatuses[i].calibrate_mode == CALIBRATE_BOUNDS_MAX_POS) {
-                        _smotors[i]->max_pos = _smotors[i]->current_pos;
+                    if(STEPPER_CALIBRATE && _run->cstatuses[i].calibrate_mode == CALIBRATE_BOUNDS_MAX_POS) {
+                        _run->smotors[i]->max_pos = _run->smotors[i]->current_pos;
                     }
-                } else if(_cstatuses[i].calibrate_mode == CALIBRATE_START_MIN_POS) {
+                } else if(_run->cstatuses[i].calibrate_mode == CALIBRATE_START_MIN_POS) {
                     // режим калибровки начального положения - сбрасываем current_pos в min_pos на каждом шаге
-                    _smotors[i]->current_pos = _smotors[i]->min_pos;
+                    _run->smotors[i]->current_pos = _run->smotors[i]->min_pos;
                 }
                 
                 // сделали последний шаг в цикле
-                if(!_cstatuses[i].non_stop && _cstatuses[i].step_counter == 0) {
+                if(_run->cstatuses[i].stream != NULL && _run->step_counter[i] == 0) {
+                    // следующая подсерия из потокового буфера
+                    if(_stream_next(_run, i)) {
+                        // задать направление (ножку dir - после спада step
+                        // этого шага, в конце обработчика)
+                        _dir_defer(i);
+                        
+                        // задержку перед первым шагом ставим ниже
+                    } else {
+                        if(!_run->cstatuses[i].stream->ended) {
+                            // следующая подсерия не успела попасть в буфер -
+                            // останавливаем мотор
+                            _run->stopped[i] = true;
+                            
+                            // обозначим ошибку
+                            _run->smotors[i]->error |= STEPPER_ERROR_BUFFER_UNDERRUN;
+                        }
+                        
+                        // сделали последний шаг в последней подсерии
+                        _run->smotors[i]->status = STEPPER_STATUS_FINISHED;
+                    }
+                } else if(!_run->non_stop[i] && _run->step_counter[i] == 0) {
                     // увеличиваем счетчик циклов
-                    _cstatuses[i].cycle_counter++;
+                    _run->cstatuses[i].cycle_counter++;
                     
                     // загружаем настройки для нового цикла
-                    if (_cstatuses[i].cycle_counter < _cstatuses[i].cycle_count) {
+                    if (STEPPER_BUFFERED_STEPS && _run->cstatuses[i].cycle_counter < _run->cstatuses[i].cycle_count) {
                         // заходим на новый цикл внутри текущей серии
-                        long step_count = _cstatuses[i].step_buffer[_cstatuses[i].cycle_counter];
+                        long step_count = _run->cstatuses[i].step_buffer[_run->cstatuses[i].cycle_counter];
                         // сделать step_count положительным
-                        _cstatuses[i].step_count = step_count > 0 ? step_count : -step_count;
+                        _run->cstatuses[i].step_count = step_count > 0 ? step_count : -step_count;
                         
-                        // задать направление
-                        _cstatuses[i].dir = step_count > 0 ? 1 : -1;
-                        if(_cstatuses[i].dir * _smotors[i]->dir_inv > 0) {
-                            digitalWrite(_smotors[i]->pin_dir, HIGH); // туда
-                        } else {
-                            digitalWrite(_smotors[i]->pin_dir, LOW); // обратно
-                        }
+                        // задать направление (ножку dir - после спада step
+                        // этого шага, в конце обработчика)
+                        _run->cstatuses[i].dir = step_count > 0 ? 1 : -1;
+                        _dir_defer(i);
                         
                         // скорость вращения (задержка между шагами)
-                        _cstatuses[i].step_delay = _cstatuses[i].delay_buffer[_cstatuses[i].cycle_counter];
+                        _run->cstatuses[i].step_delay = _run->cstatuses[i].delay_buffer[_run->cstatuses[i].cycle_counter];
                         
                         // взводим счетчик шагов в новом цикле
-                        _cstatuses[i].step_counter = _cstatuses[i].step_count;
+                        _run->step_counter[i] = _run->cstatuses[i].step_count;
                         
                         // задержку перед первым шагом ставим ниже
                     } else {
                         // сделали последний шаг в последнем цикле
-                        _smotors[i]->status = STEPPER_STATUS_FINISHED;
+                        _run->smotors[i]->status = STEPPER_STATUS_FINISHED;
                     }
                 }
                 
                 // вычисляем задержку перед следующим шагом
                 unsigned long step_delay;
-                if(_cstatuses[i].delay_source == CONSTANT) {
+                if(_run->cstatuses[i].delay_source == CONSTANT) {
                     // координата внутри цикла движется с постоянной скоростью
-                    step_delay = _cstatuses[i].step_delay;
-                } if(_cstatuses[i].delay_source == BUFFER) {
-                    // координата внутри цикла движется с переменной скоростью,
-                    // значения задержек получаем из буфера
-                    
-                    // вычислим время до следующего шага (step_counter уже уменьшили)
-                    step_delay = _cstatuses[i].delay_buffer[
-                        (_cstatuses[i].step_count - _cstatuses[i].step_counter)/_cstatuses[i].scale];
-                } else if(_cstatuses[i].delay_source == DYNAMIC) {
-                    // координата движется с переменной скоростью (например, рисуем дугу),
-                    // значения задержек вычисляем динамически
-                    
-                    // вычислим время до следующего шага (step_counter уже уменьшили)
-                    step_delay = _cstatuses[i].next_step_delay(
-                            _cstatuses[i].step_count - _cstatuses[i].step_counter,
-                            _cstatuses[i].curve_context);
+                    step_delay = _run->cstatuses[i].step_delay;
+                } else if(_run->cstatuses[i].delay_source <= SCURVE) {
+                    // BUFFER, DYNAMIC, ACCEL, SCURVE (идут в delay_source_t
+                    // подряд после CONSTANT): задержку вычисляем, если не
+                    // исчерпан лимит моторов на этот вызов, иначе откладываем
+                    if(_run->cstatuses[i].work_ahead) {
+                        // ведущий мотор группы: задержка уже вычислена заранее
+                        _run->cstatuses[i].work_ahead = false;
+                        step_delay = _run->cstatuses[i].line_ahead_delay;
+                    } else if(_step_work_limit && step_work >= _step_work_limit &&
+                            _run->work_deferrable[i] && (_run->non_stop[i] || _run->step_counter[i] > 0)) {
+                        // таймер на минимальную задержку, поправим позже
+                        _run->work_deferred[i] = true;
+                        step_delay = _run->smotors[i]->step_delay;
+                    } else {
+                        step_work++;
+                        step_delay = _heavy_step_delay(_run, i, _run->step_counter[i]);
+                    }
+                    if(_step_work_limit && !_run->work_deferrable[i] &&
+                            !_run->non_stop[i] && _run->step_counter[i] > 0) {
+                        // ведущий мотор группы не откладывает задержку (ведомые
+                        // берут ее на этом же тике), зато следующую вычислит
+                        // заранее, когда дойдет очередь (не позже, чем за
+                        // 3 периода таймера до шага)
+                        _run->work_deferred[i] = true;
+                    }
+                } else if(_run->cstatuses[i].delay_source == LINE) {
+                    // ведомый мотор в группе движения по линии: задержка
+                    // ведущего мотора (он шагает на этом же тике и обработан раньше)
+                    step_delay = _run->cstatuses[_run->cstatuses[i].line_lead].line_step_delay;
+                } else if(_run->cstatuses[i].delay_source == ARC) {
+                    // ведущий мотор дуги: следующий шаг дуги (ведомый мотор
+                    // обработан позже и берет задержку у ведущего)
+                    step_work++;
+                    step_delay = _arc_next(&_run->cstatuses[i], &_run->cstatuses[i + 1]);
+                } else { // BEZIER
+                    // ведущий мотор кривой Безье: следующий шаг кривой
+                    // (ведомые моторы обработаны позже и берут задержку у ведущего)
+                    step_work++;
+                    step_delay = _bezier_next(&_run->cstatuses[i]);
                 }
                 
                 // проверим, корректна ли задержка
-                if(step_delay < _smotors[i]->step_delay) {
-                    // вычисленная задержка перед очередным шагом меньше,
-                    // чем минимально допустимая для этого мотора
-                    
-                    // посмотрим, что делать с ошибкой
-                    if(_small_step_delay_handle == FIX) {
-                        // попробуем исправить:
-                        // не будем делать шаги чаще, чем может мотор
-                        // (следует понимать, что корректность вращения уже нарушена)
-                        step_delay = _smotors[i]->step_delay;
-                    } else if(_small_step_delay_handle == STOP_MOTOR) {
-                        // останавливаем мотор
-                        _cstatuses[i].stopped = true;
-                        
-                        _smotors[i]->status = STEPPER_STATUS_FINISHED;
-                    } else { //if(_small_step_delay_handle == CANCEL_CYCLE) {
-                        // по умолчанию: завершаем весь цикл
-                        canceled = true;
-                    }
-                    
-                    // в любом случае, обозначим ошибку
-                    _smotors[i]->error |= STEPPER_ERROR_STEP_DELAY_SMALL;
-                }
+                step_delay = _check_step_delay(i, step_delay, &canceled);
                 
                 // взводим таймер на новый шаг с учетом погрешности
                 // (неиспользованных микросекунд) предыдущего шага
-                _cstatuses[i].step_timer = step_delay + _cstatuses[i].step_timer;
+                _run->step_timer[i] = step_delay + _run->step_timer[i];
+                _run->cstatuses[i].line_step_delay = step_delay;
+                
+                // ведомый мотор в группе движения по линии:
+                // шагать ли на следующем шаге ведущего
+                if(_run->cstatuses[i].arc) {
+                    // моторы дуги (кривой): шагать ли и куда на следующем шаге дуги
+                    _arc_apply(_run, i);
+                } else if(_run->cstatuses[i].line_follower) {
+                    _line_follower_next_step(_run, i);
+                }
+                
+#if STEPPER_ISR_PROFILE
+                _profile_motor_work(_run->smotors[i], micros() - work_start);
+                _run->smotors[i]->profile.steps++;
+#endif
+            }
+            
+#if STEPPER_TRACE
+            if(_run->stopped[i] || canceled) {
+                // мотор остановлен (или цикл завершен) на этом тике
+                _trace_event(i, STEPPER_TRACE_STOP);
             }
+#endif
+        }
+    }
+    
+    // пакетный вывод импульсов step: одна запись на порт
+    for(int port_i = 0; port_i < _step_port_count; port_i++) {
+        if(_step_port_set[port_i]) {
+            fast_io_set(_step_ports[port_i], _step_port_set[port_i]);
+            _step_port_set[port_i] = 0;
+        }
+        if(_step_port_clear[port_i]) {
+            fast_io_clear(_step_ports[port_i], _step_port_clear[port_i]);
+            _step_port_clear[port_i] = 0;
+        }
+    }
+    
+    // смена направления - после того, как спад step ушел в порт
+    for(int k = 0; k < _dir_pending_count; k++) {
+        int i = _dir_pending[k];
+        if(_run->cstatuses[i].dir * _run->smotors[i]->dir_inv > 0) {
+            fast_io_write_high(&_run->smotors[i]->pin_dir_io); // туда
+        } else {
+            fast_io_write_low(&_run->smotors[i]->pin_dir_io); // обратно
         }
     }
+    _dir_pending_count = 0;
     
-    if(finished || canceled) {
+    if(finished && !canceled && _cycle_running && _cycle_chain(elapsed_us)) {
+        // все моторы сделали все шаги, но есть следующая программа
+        // или движение в очереди - продолжаем цикл, не останавливая таймер
+        finished = false;
+    }
+    
+    if(canceled) {
+        // что-то пошло не так
+        _cancel_cycle();
+    } else if(finished) {
         // все моторы сделали все шаги, цикл завершился
-        stepper_finish_cycle();
+        _finish_cycle();
+    } else if(_timer_event_driven) {
+        // следующий вызов обработчика - на ближайшем событии
+        _timer_event_ticks = _timer_next_event_ticks();
+        if(_timer_enabled) _timer_update_ISR(_timer_id, _timer_event_ticks*_timer_adjustment-1);
     }
     
-    // проверим, уложились ли в желаемое время
+#if STEPPER_ISR_TIMING || STEPPER_ISR_PROFILE
     unsigned long cycle_finish = micros();
     unsigned long cycle_time = cycle_finish - cycle_start;
+#endif
+#if STEPPER_ISR_PROFILE
+    _profile_tick(cycle_time, phase);
+#endif
+#if STEPPER_ISR_TIMING
+    // проверим, уложились ли в желаемое время
     // обновим максимальное значение, если требуется
     _cycle_max_time = cycle_time > _cycle_max_time ? cycle_time : _cycle_max_time;
     if(cycle_time >= _timer_period_us) {
@@ -1345,8 +4504,9 @@ void _timer_handle_interrupts(int timer) {
         // что с этим делать
         if(_cycle_timing_exceed_handle == CANCEL_CYCLE) {
             // ничего хорошего - все завершаем
-            stepper_finish_cycle();
+            _cancel_cycle();
         } // иначе игнорируем
     }
+#endif // STEPPER_ISR_TIMING
 }
 
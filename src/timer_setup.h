@@ -82,6 +82,26 @@ extern const int TIMER_PRESCALER_1_1024;
  */
 void _timer_init_ISR(int timer, int prescaler, unsigned int period);
 
+/**
+ * Update compare match value for already started timer: next interrupt
+ * would be fired after adjustment+1 timer clocks (prescaler is not changed).
+ *
+ * Intended to be called from inside of timer ISR (_timer_handle_interrupts)
+ * right after the timer counter was cleared to program the time of the
+ * next interrupt (one-shot, or "next event" mode).
+ *
+ * Example: timer was started with prescaler 1:8 and adjustment=400-1
+ * (200us period on 16MHz CPU), to get next interrupt after 5 periods
+ * (1000us) call _timer_update_ISR(timer, 400*5-1).
+ *
+ * @param timer
+ *     system timer id for started ISR
+ * @param adjustment
+ *   adjustment divider after timer prescaled - timer compare match value.
+ *   note: value is truncated to timer width (16 bits for 16-bit timers).
+ */
+void _timer_update_ISR(int timer, unsigned int adjustment);
+
 /**
  * Stop ISR (Interrupt service routine) for the timer.
  * 
@@ -1,4 +1,8 @@
 #include "stepper.h"
+#include "stepper_planner.h"
+#include "stepper_gcode.h"
+#include "stepper_proto.h"
+#include "stepper_lib_config.h"
 
 extern "C"{
     #include "timer_setup.h"
@@ -6,6 +10,9 @@ extern "C"{
 
 #include "Arduino.h"
 
+#include "math.h"
+#include "time.h"
+
 //#include "stddef.h"
 //#include "stdio.h"
 //#include <iostream>
@@ -20,6 +27,9 @@ extern "C"{
 
 using namespace std;
 
+// текущее время для micros в заглушке (test/Arduino.cpp)
+extern unsigned long dbg_micros;
+
 /**
  * Симуляция таймера: "сгенерировать" нужное количество импульсов -
  * вызвать обработчик прерывания stepper_handle_interrupts нужное количество
@@ -65,6 +75,10 @@ static void test_lifecycle() {
     // Z в три раза медленнее, чем X
     prepare_whirl(&sm_z, 1, 3000);
     
+    // статус цикла мотора компактный: поля отдельных режимов в объединении
+    // (было больше 50 слов long)
+    sput_fail_unless(stepper_cycle_info_size() <= 24*sizeof(long), "stepper_cycle_info_size() <= 24*sizeof(long)");
+    
     // сначала цикл не запущен
     sput_fail_unless(!stepper_cycle_running(), "not started: stepper_cycle_running() == false");
     
@@ -1896,235 +1910,2794 @@ static void test_square_sig_issue16() {
     //if(!ok) cout<<"square sig failed at "<<i-1<<endl;
 }
 
-
-
-/////////////////////////////////////////////////////////
-// test suites
-
-/** Stepper cycle lifecycle */
-int stepper_test_suite_lifecycle() {
-    sput_start_testing();
-
-    sput_enter_suite("Stepper cycle lifecycle");
-    sput_run_test(test_lifecycle);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Stepper cycle timer period settings */
-int stepper_test_suite_timer_period() {
-    sput_start_testing();
-
-    sput_enter_suite("Stepper cycle timer period settings");
-    sput_run_test(test_timer_period);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Stepper cycle timer period is aliquant part of motor step pulse delay */
-int stepper_test_suite_timer_period_aliquant_step_delay() {
-    sput_start_testing();
+static void test_timer_event_driven() {
+    // режим таймера "по событию": обработчик вызывается только на тех
+    // периодах таймера, на которых моторам нужно что-то сделать,
+    // результат должен полностью совпадать с обычным режимом
     
-    sput_enter_suite("Stepper cycle timer period is aliquant part of motor step pulse delay");
-    sput_run_test(test_timer_period_aliquant_step_delay);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Single motor: 3 steps tick by tick on max speed */
-int stepper_test_suite_max_speed_tick_by_tick() {
-    sput_start_testing();
+    // настройки частоты таймера
+    unsigned long timer_period_us = 200;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 2000);
     
-    sput_enter_suite("Single motor: 3 steps tick by tick on max speed");
-    sput_run_test(test_max_speed_tick_by_tick);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Single motor: 30000 steps on max speed */
-int stepper_test_suite_max_speed_30000steps() {
-    sput_start_testing();
+    // моторы - минимальная задержка между шагами 1000 мкс,
+    // расстояние за шаг - 7.5мкм=7500нм
+    stepper sm_x, sm_y;
+    int x_step = 8;
+    init_stepper(&sm_x, 'x', x_step, 9, 10, false, 1000, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, CONST, CONST, 0, 300000000);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 1000, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, CONST, CONST, 0, 300000000);
     
-    sput_enter_suite("Single motor: 30000 steps on max speed");
-    sput_run_test(test_max_speed_30000steps);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Single motor: 5 steps tick by tick on aliquant speed */
-int stepper_test_suite_aliquant_speed_tick_by_tick() {
-    sput_start_testing();
+    //////////////
+    // #1: обычный режим - эталон
     
-    sput_enter_suite("Single motor: 5 steps tick by tick on aliquant speed");
-    sput_run_test(test_aliquant_speed_tick_by_tick);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** 3 motors: draw triangle */
-int stepper_test_suite_draw_triangle() {
-    sput_start_testing();
+    // x: 20 шагов с задержкой 1000 мкс - 20*5=100 тиков
+    // y: 3 шага с задержкой 10000 мкс - 3*50=150 тиков
+    // весь цикл: 150 тиков + 1 завершающий тик
+    prepare_steps(&sm_x, 20, 1000);
+    prepare_steps(&sm_y, 3, 10000);
+    stepper_start_cycle();
+    sput_fail_unless(stepper_timer_event_ticks() == 1, "periodic: stepper_timer_event_ticks() == 1");
     
-    sput_enter_suite("3 motors: draw triangle");
-    sput_run_test(test_draw_triangle);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Small step delay error handlers */
-int stepper_test_suite_small_step_delay_handlers() {
-    sput_start_testing();
+    timer_tick(150+1);
+    sput_fail_unless(!stepper_cycle_running(), "periodic: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.current_pos == 7500*20, "periodic: sm_x.current_pos == 7500*20");
+    sput_fail_unless(sm_y.current_pos == 7500*3, "periodic: sm_y.current_pos == 7500*3");
     
-    sput_enter_suite("Small step delay error handlers");
-    sput_run_test(test_small_step_delay_handlers);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Moving with variable speed: buffered steps tick by tick */
-int stepper_test_suite_buffered_steps_tick_by_tick() {
-    sput_start_testing();
+    //////////////
+    // #2: режим "по событию" - тот же цикл в обратную сторону
+    stepper_set_timer_event_driven(true);
     
-    sput_enter_suite("Moving with variable speed: buffered steps tick by tick");
-    sput_run_test(test_buffered_steps_tick_by_tick);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Moving with variable speed: buffered steps */
-int stepper_test_suite_buffered_steps() {
-    sput_start_testing();
+    prepare_steps(&sm_x, -20, 1000);
+    prepare_steps(&sm_y, -3, 10000);
+    stepper_start_cycle();
     
-    sput_enter_suite("Moving with variable speed: buffered steps");
-    sput_run_test(test_buffered_steps);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Step-dir driver std divider modes: 1/1, 1/18, 1/16, 1/32 */
-int stepper_test_suite_driver_std_modes() {
-    sput_start_testing();
+    // до первого события: 1000-600=400 мкс = 2 тика холостого хода,
+    // третий тик - проверка границ перед шагом
+    sput_fail_unless(stepper_timer_event_ticks() == 3, "event driven: stepper_timer_event_ticks() == 3");
     
-    sput_enter_suite("Step-dir driver std divider modes: 1/1, 1/18, 1/16, 1/32");
-    sput_run_test(test_driver_std_modes);
-
-    sput_finish_testing();
-    return sput_get_return_value();
+    // вызываем обработчик только на запланированных периодах,
+    // на каждом вызове проверяем, что сигнал step остается прямоугольным:
+    // взводится ровно на один период перед шагом
+    unsigned long ticks = 0;
+    unsigned long calls = 0;
+    bool ok = true;
+    while(stepper_cycle_running() && ticks < 1000) {
+        unsigned long event_ticks = stepper_timer_event_ticks();
+        ticks += event_ticks;
+        int x_step_before = digitalRead(x_step);
+        _timer_handle_interrupts(3);
+        calls++;
+        
+        // за несколько периодов без вызовов step не может подняться и опуститься
+        if(ok && x_step_before == 1) ok = (event_ticks == 1 && digitalRead(x_step) == 0);
+        
+        // первый шаг x - на 5м тике
+        if(ticks == 5) {
+            sput_fail_unless(sm_x.current_pos == 7500*20-7500,
+                "event driven: tick 5: sm_x.current_pos == 7500*20-7500");
+        }
+    }
+    sput_fail_unless(ok, "event driven: square sig ok");
+    sput_fail_unless(!stepper_cycle_running(), "event driven: stepper_cycle_running() == false");
+    sput_fail_unless(ticks == 150+1, "event driven: ticks == 150+1");
+    sput_fail_unless(sm_x.current_pos == 0, "event driven: sm_x.current_pos == 0");
+    sput_fail_unless(sm_y.current_pos == 0, "event driven: sm_y.current_pos == 0");
+    
+    // обработчик вызывался не больше 3х раз на шаг (+ промежуточные
+    // вызовы, если интервал до события не влезает в 16 бит таймера),
+    // а не на каждом тике
+    sput_fail_unless(calls < (150+1)/2, "event driven: calls < (150+1)/2");
+    
+    stepper_set_timer_event_driven(false);
 }
 
-/** Step-dir driver std divider modes for 2 motors at a time */
-int stepper_test_suite_driver_std_modes_2motors() {
-    sput_start_testing();
-    
-    sput_enter_suite("Step-dir driver std divider modes for 2 motors at a time");
-    sput_run_test(test_driver_std_modes_2motors);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
 
-/** Single motor: exit bounds (issue #1) - whirl */
-int stepper_test_suite_exit_bounds_issue1_whirl() {
-    sput_start_testing();
+static void test_line_dda() {
+    // движение группы моторов по прямой линии (prepare_line):
+    // ведущий мотор задает тайминг, ведомые шагают по алгоритму Брезенхэма
     
-    sput_enter_suite("Single motor: exit bounds (issue #1) - whirl");
-    sput_run_test(test_exit_bounds_issue1_whirl);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Single motor: exit bounds (issue #1) - steps */
-int stepper_test_suite_exit_bounds_issue1_steps() {
-    sput_start_testing();
+    // настройки частоты таймера
+    unsigned long timer_period_us = 200;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 2000);
     
-    sput_enter_suite("Single motor: exit bounds (issue #1) - steps");
-    sput_run_test(test_exit_bounds_issue1_steps);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Single motor: exit bounds (issue #9) - steps */
-int stepper_test_suite_exit_bounds_issue9_steps() {
-    sput_start_testing();
+    // моторы - минимальная задержка между шагами 1000 мкс,
+    // расстояние за шаг - 7.5мкм=7500нм
+    stepper sm_x, sm_y, sm_z;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 1000, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, CONST, CONST, 0, 300000000);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 1000, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, CONST, CONST, 0, 300000000);
+    init_stepper(&sm_z, 'z', 2, 3, 4, false, 1000, 7500);
+    init_stepper_ends(&sm_z, NO_PIN, NO_PIN, CONST, CONST, 0, 300000000);
     
-    sput_enter_suite("Single motor: exit bounds (issue #9) - steps");
-    sput_run_test(test_exit_bounds_issue9_steps);
-
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-/** Single motor: test square signal (issue #16) */
-int stepper_test_suite_square_sig_issue16() {
-    sput_start_testing();
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
     
-    sput_enter_suite("Single motor: test square signal (issue #16)");
-    sput_run_test(test_square_sig_issue16);
+    // line1 из examples/draw_triangle: (0,0,0) -> (150000000,49995000,19995000)
+    // ведущий мотор - x (20000 шагов), y и z - ведомые;
+    // ведущий мотор указан не первым - порядок не важен
+    stepper* line_motors[] = {&sm_y, &sm_x, &sm_z};
+    long line_steps[] = {6666, 20000, 2666};
+    // 0 - максимальная скорость для всех моторов группы: 1000 мкс
+    prepare_line(3, line_motors, line_steps, 0);
     
-    sput_finish_testing();
-    return sput_get_return_value();
-}
-
-
-/** All tests in one bundle */
-int stepper_test_suite() {
-    sput_start_testing();
-
-    sput_enter_suite("Stepper cycle lifecycle");
-    sput_run_test(test_lifecycle);
+    stepper_start_cycle();
+    sput_fail_unless(stepper_cycle_running(), "stepper_cycle_running() == true");
+    sput_fail_unless(stepper_cycle_error() == CYCLE_ERROR_NONE, "stepper_cycle_error() == CYCLE_ERROR_NONE");
     
-    sput_enter_suite("Stepper cycle timer period settings");
-    sput_run_test(test_timer_period);
+    // на каждом шаге ведущего мотора (5 тиков таймера) ведомые моторы
+    // отклоняются от идеальной линии не больше, чем на полшага
+    bool ok = true;
+    for(long k = 1; k <= 20000 && ok; k++) {
+        timer_tick(5);
+        long x = sm_x.current_pos / 7500;
+        long y = sm_y.current_pos / 7500;
+        long z = sm_z.current_pos / 7500;
+        if(ok) ok = (x == k);
+        if(ok) ok = (abs(y*20000 - k*6666) <= 20000/2);
+        if(ok) ok = (abs(z*20000 - k*2666) <= 20000/2);
+    }
+    sput_fail_unless(ok, "line: followers stay within half step of the line");
     
-    sput_enter_suite("Stepper cycle timer period is aliquant part of motor step pulse delay");
-    sput_run_test(test_timer_period_aliquant_step_delay);
+    // все моторы приходят в конечную точку одновременно
+    sput_fail_unless(sm_x.current_pos == 150000000, "line: sm_x.current_pos == 150000000");
+    sput_fail_unless(sm_y.current_pos == 49995000, "line: sm_y.current_pos == 49995000");
+    sput_fail_unless(sm_z.current_pos == 19995000, "line: sm_z.current_pos == 19995000");
+    sput_fail_unless(stepper_cycle_running(), "line: stepper_cycle_running() == true");
     
-    sput_enter_suite("Single motor: 3 steps tick by tick on max speed");
-    sput_run_test(test_max_speed_tick_by_tick);
+    // завершающий тик
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "line: stepper_cycle_running() == false");
+    sput_fail_unless(sm_y.status == STEPPER_STATUS_FINISHED, "line: sm_y.status == STEPPER_STATUS_FINISHED");
     
-    sput_enter_suite("Single motor: 30000 steps on max speed");
-    sput_run_test(test_max_speed_30000steps);
+    // ведомый мотор с минимальной задержкой больше, чем задержка группы:
+    // с исправлением задержки (FIX) вся группа выравнивается
+    // по самому медленному мотору
+    stepper_set_error_handle_strategy(DONT_CHANGE, DONT_CHANGE, FIX, DONT_CHANGE);
+    sm_y.step_delay = 2000;
+    stepper* line_motors2[] = {&sm_x, &sm_y};
+    long line_steps2[] = {-10, -5};
+    prepare_line(2, line_motors2, line_steps2, 1000);
+    stepper_start_cycle();
+    sput_fail_unless(sm_y.error == STEPPER_ERROR_STEP_DELAY_SMALL,
+        "line fix: sm_y.error == STEPPER_ERROR_STEP_DELAY_SMALL");
     
-    sput_enter_suite("Single motor: 5 steps tick by tick on aliquant speed");
-    sput_run_test(test_aliquant_speed_tick_by_tick);
+    // 10 шагов по 2000 мкс = 100 тиков + завершающий
+    timer_tick(100);
+    sput_fail_unless(sm_x.current_pos == 150000000-7500*10, "line fix: sm_x.current_pos == 150000000-7500*10");
+    sput_fail_unless(sm_y.current_pos == 49995000-7500*5, "line fix: sm_y.current_pos == 49995000-7500*5");
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "line fix: stepper_cycle_running() == false");
     
-    sput_enter_suite("3 motors: draw triangle");
-    sput_run_test(test_draw_triangle);
+    stepper_set_error_handle_strategy(DONT_CHANGE, DONT_CHANGE, CANCEL_CYCLE, DONT_CHANGE);
     
-    sput_enter_suite("Small step delay error handlers");
-    sput_run_test(test_small_step_delay_handlers);
+    // скорость обработчика прерывания: линия на 6 моторах, большая часть
+    // тиков - проход по горячим данным моторов без шага
+    stepper_configure_timer(20, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    stepper sm_a, sm_b, sm_c;
+    init_stepper(&sm_a, 'a', 11, 12, 13, false, 100, 7500);
+    init_stepper(&sm_b, 'b', 14, 15, 16, false, 100, 7500);
+    init_stepper(&sm_c, 'c', 17, 18, 19, false, 100, 7500);
+    stepper* bench_motors[] = {&sm_x, &sm_y, &sm_z, &sm_a, &sm_b, &sm_c};
+    for(int i = 0; i < 6; i++) {
+        bench_motors[i]->step_delay = 100;
+        init_stepper_ends(bench_motors[i], NO_PIN, NO_PIN, INF, INF, 0, 0);
+    }
+    long bench_steps[] = {400000, 150000, -100000, 50000, -20000, 1};
+    prepare_line(6, bench_motors, bench_steps, 100);
+    stepper_start_cycle();
+    clock_t start = clock();
+    timer_tick(1000000);
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    // шаг ведущего мотора - каждые 5 тиков
+    sput_fail_unless(stepper_cycle_running() && sm_x.current_pos > 150000000 + 7500*(1000000/5 - 100),
+        "bench: 6 motors on the line");
+    sput_fail_unless(seconds < 1, "bench: >= 1000000 ticks per second");
+    stepper_finish_cycle();
+}
+static void test_hard_end_fast_io() {
+    // концевые датчики читаются в обработчике прерывания напрямую
+    // из регистра порта (stepper_fast_io.h), а не через digitalRead
     
-    sput_enter_suite("Moving with variable speed: buffered steps tick by tick");
-    sput_run_test(test_buffered_steps_tick_by_tick);
+    // настройки частоты таймера
+    unsigned long timer_period_us = 200;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 2000);
     
-    sput_enter_suite("Moving with variable speed: buffered steps");
-    sput_run_test(test_buffered_steps);
+    // мотор с концевыми датчиками на пинах 11 (min) и 12 (max),
+    // step и концевые датчики в одном порту
+    stepper sm_x;
+    int x_step = 8;
+    int x_min = 11;
+    int x_max = 12;
+    init_stepper(&sm_x, 'x', x_step, 9, 10, false, 1000, 7500);
+    init_stepper_ends(&sm_x, x_min, x_max, INF, INF, 0, 0);
     
+    sput_fail_unless(sm_x.pin_step_io.mask != 0, "sm_x.pin_step_io.mask != 0");
+    sput_fail_unless(sm_x.pin_min_io.mask != sm_x.pin_max_io.mask,
+        "sm_x.pin_min_io.mask != sm_x.pin_max_io.mask");
     
-    sput_enter_suite("Step-dir driver std divider modes: 1/1, 1/18, 1/16, 1/32");
-    sput_run_test(test_driver_std_modes);
+    // NO_PIN - пустая маска, чтение всегда 0
+    stepper sm_y;
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 1000, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    sput_fail_unless(sm_y.pin_min_io.mask == 0, "NO_PIN: sm_y.pin_min_io.mask == 0");
+    sput_fail_unless(fast_io_read(&sm_y.pin_min_io) == 0, "NO_PIN: fast_io_read == 0");
     
-    sput_enter_suite("Step-dir driver std divider modes for 2 motors at a time");
-    sput_run_test(test_driver_std_modes_2motors);
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
     
+    // #1: нажат верхний концевик, едем вниз - не мешает
+    digitalWrite(x_min, LOW);
+    digitalWrite(x_max, HIGH);
+    // (при STEPPER_END_INTERRUPTS=1 - из прерывания по изменению пина)
+    stepper_end_changed(&sm_x);
+    prepare_steps(&sm_x, -3, 1000);
+    stepper_start_cycle();
+    timer_tick(3*5+1);
+    sput_fail_unless(!stepper_cycle_running(), "max pressed, go min: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_NONE, "max pressed, go min: sm_x.error == STEPPER_ERROR_NONE");
+    sput_fail_unless(sm_x.current_pos == -7500*3, "max pressed, go min: sm_x.current_pos == -7500*3");
     
-    sput_enter_suite("Single motor: exit bounds (issue #1) - whirl");
-    sput_run_test(test_exit_bounds_issue1_whirl);
+    // #2: нажат верхний концевик, едем вверх - цикл отменяется
+    // перед первым шагом, ножка step не взводится
+    prepare_steps(&sm_x, 3, 1000);
+    stepper_start_cycle();
+    timer_tick(3);
+    sput_fail_unless(!stepper_cycle_running(), "max pressed, go max: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_HARD_END_MAX,
+        "max pressed, go max: sm_x.error == STEPPER_ERROR_HARD_END_MAX");
+    sput_fail_unless(sm_x.current_pos == -7500*3, "max pressed, go max: sm_x.current_pos == -7500*3");
+    sput_fail_unless(digitalRead(x_step) == LOW, "max pressed, go max: digitalRead(x_step) == LOW");
+    
+    // #3: нажат нижний концевик, едем вниз
+    digitalWrite(x_max, LOW);
+    digitalWrite(x_min, HIGH);
+    stepper_end_changed(&sm_x);
+    prepare_steps(&sm_x, -3, 1000);
+    stepper_start_cycle();
+    timer_tick(3);
+    sput_fail_unless(!stepper_cycle_running(), "min pressed, go min: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_HARD_END_MIN,
+        "min pressed, go min: sm_x.error == STEPPER_ERROR_HARD_END_MIN");
     
-    sput_enter_suite("Single motor: exit bounds (issue #1) - steps");
-    sput_run_test(test_exit_bounds_issue1_steps);
+    digitalWrite(x_min, LOW);
+}
+
+static void test_hard_end_interrupts() {
+    // состояние концевых датчиков в end_flags обновляет stepper_end_changed
+    // (из прерывания по изменению пина); при STEPPER_END_INTERRUPTS=1
+    // обработчик таймера проверяет только end_flags
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 200;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 2000);
+    
+    stepper sm_x;
+    int x_min = 11;
+    int x_max = 12;
+    digitalWrite(x_min, LOW);
+    digitalWrite(x_max, HIGH);
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 1000, 7500);
+    sput_fail_unless(sm_x.end_flags == 0, "init_stepper: sm_x.end_flags == 0");
+    
+    // начальное состояние датчиков читает init_stepper_ends
+    init_stepper_ends(&sm_x, x_min, x_max, INF, INF, 0, 0);
+    sput_fail_unless(sm_x.end_flags == STEPPER_END_MAX,
+        "init_stepper_ends: sm_x.end_flags == STEPPER_END_MAX");
+    
+    digitalWrite(x_max, LOW);
+    digitalWrite(x_min, HIGH);
+    stepper_end_changed(&sm_x);
+    sput_fail_unless(sm_x.end_flags == STEPPER_END_MIN, "min pressed: sm_x.end_flags == STEPPER_END_MIN");
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // #1: нажат нижний концевик, едем вниз - цикл отменяется перед первым шагом
+    prepare_steps(&sm_x, -3, 1000);
+    stepper_start_cycle();
+    timer_tick(3);
+    sput_fail_unless(!stepper_cycle_running(), "min pressed, go min: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_HARD_END_MIN,
+        "min pressed, go min: sm_x.error == STEPPER_ERROR_HARD_END_MIN");
+    sput_fail_unless(sm_x.current_pos == 0, "min pressed, go min: sm_x.current_pos == 0");
+    
+    // #2: датчик нажат во время движения вверх: прерывание по изменению
+    // пина обновляет end_flags, мотор останавливается перед следующим шагом
+    digitalWrite(x_min, LOW);
+    stepper_end_changed(&sm_x);
+    prepare_steps(&sm_x, 5, 1000);
+    stepper_start_cycle();
+    timer_tick(5+1);
+    sput_fail_unless(sm_x.current_pos == 7500, "go max: sm_x.current_pos == 7500");
+    digitalWrite(x_max, HIGH);
+    stepper_end_changed(&sm_x);
+    timer_tick(5);
+    sput_fail_unless(!stepper_cycle_running(), "max pressed, go max: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_HARD_END_MAX,
+        "max pressed, go max: sm_x.error == STEPPER_ERROR_HARD_END_MAX");
+    sput_fail_unless(sm_x.current_pos == 7500, "max pressed, go max: sm_x.current_pos == 7500");
+    
+    // #3: пин изменился, а прерывания не было: с прерываниями
+    // обработчик таймера пин не читает, без них - читает
+    digitalWrite(x_max, LOW);
+    stepper_end_changed(&sm_x);
+    digitalWrite(x_max, HIGH);
+    prepare_steps(&sm_x, 1, 1000);
+    stepper_start_cycle();
+    timer_tick(5+1);
+#if STEPPER_END_INTERRUPTS
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_NONE, "no interrupt: sm_x.error == STEPPER_ERROR_NONE");
+    sput_fail_unless(sm_x.current_pos == 7500*2, "no interrupt: sm_x.current_pos == 7500*2");
+#else
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_HARD_END_MAX,
+        "polling: sm_x.error == STEPPER_ERROR_HARD_END_MAX");
+    sput_fail_unless(sm_x.current_pos == 7500, "polling: sm_x.current_pos == 7500");
+#endif
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    digitalWrite(x_max, LOW);
+}
+
+/**
+ * Импульс помехи на концевом датчике max шириной width периодов таймера,
+ * заканчивается на проверке границ перед шагом.
+ * 
+ * @return true - мотор остановлен по STEPPER_ERROR_HARD_END_MAX
+ */
+static bool end_glitch_trips(unsigned long timer_period_us, unsigned char samples, int width) {
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, timer_period_us*10);
+    
+    stepper sm_x;
+    int x_max = 12;
+    digitalWrite(x_max, LOW);
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, timer_period_us*3, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, x_max, INF, INF, 0, 0);
+    init_stepper_end_filter(&sm_x, samples);
+    
+    // шаг каждые 20 периодов, проверка границ перед первым шагом - на 18-м
+    prepare_steps(&sm_x, 10, timer_period_us*20);
+    stepper_start_cycle();
+    timer_tick(18 - width);
+    digitalWrite(x_max, HIGH);
+    stepper_end_changed(&sm_x);
+    timer_tick(width);
+    digitalWrite(x_max, LOW);
+    stepper_end_changed(&sm_x);
+    timer_tick(3);
+    
+    bool tripped = sm_x.error == STEPPER_ERROR_HARD_END_MAX;
+    stepper_finish_cycle();
+    return tripped;
+}
+
+static void test_hard_end_filter() {
+    // фильтр помех концевых датчиков: датчик нажат, если нажат
+    // samples выборок (тиков таймера) подряд
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // без фильтра срабатывает импульс на 1 период, попавший на проверку
+    sput_fail_unless(end_glitch_trips(200, 0, 1), "no filter: 200us glitch trips");
+    
+    // 4 выборки: помехи короче 4 периодов отбрасываются
+    // 20мкс (50кГц): до 60мкс
+    sput_fail_unless(!end_glitch_trips(20, 4, 1), "20us timer, 4 samples: 20us glitch rejected");
+    sput_fail_unless(!end_glitch_trips(20, 4, 3), "20us timer, 4 samples: 60us glitch rejected");
+    sput_fail_unless(end_glitch_trips(20, 4, 4), "20us timer, 4 samples: 80us press trips");
+    // 50мкс (20кГц): до 150мкс
+    sput_fail_unless(!end_glitch_trips(50, 4, 3), "50us timer, 4 samples: 150us glitch rejected");
+    sput_fail_unless(end_glitch_trips(50, 4, 4), "50us timer, 4 samples: 200us press trips");
+    // 200мкс (5кГц): до 600мкс
+    sput_fail_unless(!end_glitch_trips(200, 4, 3), "200us timer, 4 samples: 600us glitch rejected");
+    sput_fail_unless(end_glitch_trips(200, 4, 4), "200us timer, 4 samples: 800us press trips");
+    
+    // 8 выборок (наибольший фильтр) на 20мкс: до 140мкс
+    sput_fail_unless(!end_glitch_trips(20, 8, 7), "20us timer, 8 samples: 140us glitch rejected");
+    sput_fail_unless(end_glitch_trips(20, 8, 8), "20us timer, 8 samples: 160us press trips");
+    sput_fail_unless(!end_glitch_trips(20, 9, 7), "20us timer, 9 samples = 8: 140us glitch rejected");
+    
+    // отпускание тоже фильтруется: короткий провал нажатого датчика
+    // на проверке границ не снимает нажатие
+    stepper_configure_timer(20, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    stepper sm_x;
+    int x_max = 12;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 60, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, x_max, INF, INF, 0, 0);
+    init_stepper_end_filter(&sm_x, 4);
+    prepare_steps(&sm_x, 10, 400);
+    stepper_start_cycle();
+    timer_tick(18 - 8);
+    digitalWrite(x_max, HIGH);
+    stepper_end_changed(&sm_x);
+    timer_tick(6);
+    digitalWrite(x_max, LOW);
+    stepper_end_changed(&sm_x);
+    timer_tick(2);
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_HARD_END_MAX, "40us release: sm_x.error == STEPPER_ERROR_HARD_END_MAX");
+    sput_fail_unless(sm_x.current_pos == 0, "40us release: sm_x.current_pos == 0");
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // датчик, нажатый на старте цикла, - нажат сразу
+    digitalWrite(x_max, HIGH);
+    stepper_end_changed(&sm_x);
+    prepare_steps(&sm_x, 10, 400);
+    stepper_start_cycle();
+    timer_tick(18);
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_HARD_END_MAX, "pressed at start: sm_x.error == STEPPER_ERROR_HARD_END_MAX");
+    sput_fail_unless(sm_x.current_pos == 0, "pressed at start: sm_x.current_pos == 0");
+    
+    digitalWrite(x_max, LOW);
+    stepper_end_changed(&sm_x);
+}
+
+// количество записей в порты в заглушке (test/Arduino.cpp)
+extern unsigned long dbg_port_writes;
+extern int dbg_pin_values[64];
+extern void (*dbg_pin_changed)(int pin, int val);
+
+// ножки step и dir мотора, за которым следит _dbg_dir_changed
+static int _dbg_step_pin, _dbg_dir_pin;
+// сколько раз менялось направление, из них - при поднятой ножке step
+static int _dbg_dir_changes, _dbg_dir_changes_step_high;
+
+/**
+ * Смена значения на ножке (вызывается до записи нового значения):
+ * направление должно меняться только при опущенной ножке step,
+ * иначе драйвер сделает шаг (спад step) уже в новом направлении.
+ */
+static void _dbg_dir_changed(int pin, int) {
+    if(pin == _dbg_dir_pin) {
+        _dbg_dir_changes++;
+        if(dbg_pin_values[_dbg_step_pin] == HIGH) _dbg_dir_changes_step_high++;
+    }
+}
+
+static void test_batched_step_pulses() {
+    // ножки step моторов на одном порту взводятся и сбрасываются
+    // одной записью в регистр порта
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 200;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 2000);
+    
+    // x, y, z: ножки step 16, 17, 18 - один порт (в заглушке порты по 8 пинов),
+    // a: ножка step 24 - другой порт
+    stepper sm_x, sm_y, sm_z, sm_a;
+    init_stepper(&sm_x, 'x', 16, 20, 21, false, 1000, 7500);
+    init_stepper(&sm_y, 'y', 17, 20, 21, false, 1000, 7500);
+    init_stepper(&sm_z, 'z', 18, 20, 21, false, 1000, 7500);
+    init_stepper(&sm_a, 'a', 24, 20, 21, false, 1000, 7500);
+    
+    sput_fail_unless(sm_x.pin_step_io.port == sm_z.pin_step_io.port,
+        "sm_x.pin_step_io.port == sm_z.pin_step_io.port");
+    sput_fail_unless(sm_x.pin_step_io.port != sm_a.pin_step_io.port,
+        "sm_x.pin_step_io.port != sm_a.pin_step_io.port");
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // #1: 3 мотора на одном порту шагают одновременно
+    prepare_steps(&sm_x, 2, 1000);
+    prepare_steps(&sm_y, 2, 1000);
+    prepare_steps(&sm_z, 2, 1000);
+    stepper_start_cycle();
+    
+    // холостой ход и проверка границ - в порты не пишем
+    dbg_port_writes = 0;
+    timer_tick(3);
+    sput_fail_unless(dbg_port_writes == 0, "same port, idle: dbg_port_writes == 0");
+    
+    // взвести step - одна запись на все 3 мотора
+    timer_tick(1);
+    sput_fail_unless(dbg_port_writes == 1, "same port, HIGH: dbg_port_writes == 1");
+    sput_fail_unless(digitalRead(16) == HIGH && digitalRead(17) == HIGH && digitalRead(18) == HIGH,
+        "same port, HIGH: step pins == HIGH");
+    
+    // шаг - еще одна запись
+    timer_tick(1);
+    sput_fail_unless(dbg_port_writes == 2, "same port, LOW: dbg_port_writes == 2");
+    sput_fail_unless(digitalRead(16) == LOW && digitalRead(17) == LOW && digitalRead(18) == LOW,
+        "same port, LOW: step pins == LOW");
+    sput_fail_unless(sm_y.current_pos == 7500, "same port: sm_y.current_pos == 7500");
+    
+    timer_tick(5+1);
+    sput_fail_unless(!stepper_cycle_running(), "same port: stepper_cycle_running() == false");
+    sput_fail_unless(dbg_port_writes == 4, "same port: dbg_port_writes == 4");
+    
+    // #2: 2 порта - по одной записи на порт
+    prepare_steps(&sm_x, 1, 1000);
+    prepare_steps(&sm_a, 1, 1000);
+    prepare_steps(&sm_y, 1, 1000);
+    stepper_start_cycle();
+    
+    dbg_port_writes = 0;
+    timer_tick(4);
+    sput_fail_unless(dbg_port_writes == 2, "2 ports, HIGH: dbg_port_writes == 2");
+    sput_fail_unless(digitalRead(24) == HIGH, "2 ports, HIGH: digitalRead(24) == HIGH");
+    timer_tick(1);
+    sput_fail_unless(dbg_port_writes == 4, "2 ports, LOW: dbg_port_writes == 4");
+    sput_fail_unless(digitalRead(24) == LOW, "2 ports, LOW: digitalRead(24) == LOW");
+    
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "2 ports: stepper_cycle_running() == false");
+    
+    // #3: смена направления в буфере шагов - спад step последнего шага
+    // серии уходит в порт в конце тика, ножка dir должна меняться после него
+    const int buf_size = 3;
+    static unsigned long delay_buffer[buf_size] = {1000, 1000, 1000};
+    static long step_buffer[buf_size] = {2, -2, 2};
+    long pos_x = sm_x.current_pos;
+    prepare_buffered_steps(&sm_x, buf_size, delay_buffer, step_buffer);
+    
+    _dbg_step_pin = 16;
+    _dbg_dir_pin = 20;
+    _dbg_dir_changes = 0;
+    _dbg_dir_changes_step_high = 0;
+    dbg_pin_changed = _dbg_dir_changed;
+    
+    stepper_start_cycle();
+    timer_tick(6*5+1);
+    dbg_pin_changed = NULL;
+    
+    sput_fail_unless(!stepper_cycle_running(), "buffered dir: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.current_pos == pos_x + 7500*2,
+        "buffered dir: sm_x.current_pos == pos_x + 15000");
+    sput_fail_unless(_dbg_dir_changes >= 2, "buffered dir: _dbg_dir_changes >= 2");
+    sput_fail_unless(_dbg_dir_changes_step_high == 0,
+        "buffered dir: _dbg_dir_changes_step_high == 0");
+}
+/**
+ * Задержка перед шагом с индексом k на кривой разгона с нуля
+ * с ускорением accel шагов/с^2, микросекунды (точное значение).
+ */
+static double accel_delay_exact(unsigned long accel, unsigned long k) {
+    return 1000000.0 / sqrt((double)accel * (2*k + 1));
+}
+
+static void test_accel_steps() {
+    // разгон и торможение с постоянным ускорением (prepare_accel_steps):
+    // сравним время каждого шага с точным профилем
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    // мотор - минимальная задержка между шагами 200 мкс (5000 шагов/с),
+    // ускорение 250000 шагов/с^2: разгон до максимальной скорости
+    // за 5000^2/(2*250000)=50 шагов
+    stepper sm_x;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper_accel(&sm_x, 250000);
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // #1: трапеция - 50 шагов разгона, 200 шагов с постоянной скоростью,
+    // 50 шагов торможения
+    long step_count = 300;
+    prepare_accel_steps(&sm_x, step_count, 0);
+    stepper_start_cycle();
+    
+    double expected_time = 0;
+    unsigned long tick = 0;
+    bool ok = true;
+    for(long step = 0; step < step_count && ok; step++) {
+        // точная задержка перед шагом
+        double delay;
+        if(step < 50) {
+            delay = accel_delay_exact(250000, step);
+        } else if(step >= step_count - 50) {
+            delay = accel_delay_exact(250000, step_count - 1 - step);
+        } else {
+            delay = 200;
+        }
+        expected_time += delay < 200 ? 200 : delay;
+        
+        // ждем шага
+        long pos = sm_x.current_pos;
+        while(sm_x.current_pos == pos && tick < 1000000) {
+            timer_tick(1);
+            tick++;
+        }
+        
+        // шаг происходит на тике таймера, на котором до точного времени
+        // шага остается меньше периода таймера
+        double err = expected_time - tick*timer_period_us;
+        ok = err > -1 && err < timer_period_us + 1;
+        //if(!ok) cout<<"step="<<step<<" tick="<<tick<<" expected="<<expected_time<<endl;
+    }
+    sput_fail_unless(ok, "trapezoid: step times match exact profile");
+    sput_fail_unless(sm_x.current_pos == 7500*300, "trapezoid: sm_x.current_pos == 7500*300");
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "trapezoid: stepper_cycle_running() == false");
+    
+    // #2: треугольник - 40 шагов: 20 шагов разгона, 20 шагов торможения,
+    // до максимальной скорости не разгоняемся
+    prepare_accel_steps(&sm_x, -40, 0);
+    stepper_start_cycle();
+    expected_time = 0;
+    for(long step = 0; step < 40; step++) {
+        expected_time += accel_delay_exact(250000, step < 20 ? step : 39 - step);
+    }
+    // время на весь путь - как для точного профиля (с точностью до тика)
+    unsigned long ticks = (unsigned long)(expected_time / timer_period_us);
+    timer_tick(ticks);
+    sput_fail_unless(sm_x.current_pos == 7500*300 - 7500*39 || sm_x.current_pos == 7500*300 - 7500*40,
+        "triangle: sm_x.current_pos == 7500*(300-40) +/- 1 step");
+    timer_tick(2);
+    sput_fail_unless(sm_x.current_pos == 7500*300 - 7500*40, "triangle: sm_x.current_pos == 7500*(300-40)");
+    sput_fail_unless(!stepper_cycle_running(), "triangle: stepper_cycle_running() == false");
+    
+    // #3: без ускорения - как prepare_steps
+    init_stepper_accel(&sm_x, 0);
+    prepare_accel_steps(&sm_x, 10, 400);
+    stepper_start_cycle();
+    timer_tick(10*20);
+    sput_fail_unless(sm_x.current_pos == 7500*(300 - 40 + 10), "no accel: sm_x.current_pos == 7500*(300-40+10)");
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "no accel: stepper_cycle_running() == false");
+
+    // #4: длинный треугольник - 10000 шагов разгона и 10000 торможения
+    // с ускорением 1000 шагов/с^2: индексы далеко за таблицей,
+    // ошибка 32-битной рекуррентной формулы не должна накапливаться
+    init_stepper_accel(&sm_x, 1000);
+    sm_x.current_pos = 0;
+    prepare_accel_steps(&sm_x, 20000, 0);
+    stepper_start_cycle();
+    expected_time = 0;
+    for(long step = 0; step < 10000; step++) {
+        expected_time += 2*accel_delay_exact(1000, step);
+    }
+    ticks = (unsigned long)(expected_time / timer_period_us);
+    timer_tick(ticks);
+    sput_fail_unless(sm_x.current_pos == 7500*19999 || sm_x.current_pos == 7500*20000,
+        "long triangle: sm_x.current_pos == 7500*20000 +/- 1 step");
+    timer_tick(2);
+    sput_fail_unless(sm_x.current_pos == 7500*20000, "long triangle: sm_x.current_pos == 7500*20000");
+    sput_fail_unless(!stepper_cycle_running(), "long triangle: stepper_cycle_running() == false");
+}
+
+/**
+ * Разгон с места по S-кривой (точный профиль): путь в шагах за время t
+ * при крейсерской скорости v, наибольшем ускорении accel_peak и рывке jerk.
+ */
+static double scurve_dist_exact(double v, double accel_peak, double jerk, double t) {
+    double t1 = accel_peak / jerk;
+    double t2 = v / accel_peak - t1;
+    double x1 = jerk * t1 * t1 * t1 / 6;
+    double v1 = jerk * t1 * t1 / 2;
+    double x2 = x1 + v1 * t2 + accel_peak * t2 * t2 / 2;
+    double v2 = v1 + accel_peak * t2;
+    double x3 = x2 + v2 * t1 + accel_peak * t1 * t1 / 2 - jerk * t1 * t1 * t1 / 6;
+    if(t <= t1) {
+        return jerk * t * t * t / 6;
+    } else if(t <= t1 + t2) {
+        double s = t - t1;
+        return x1 + v1 * s + accel_peak * s * s / 2;
+    } else if(t <= 2 * t1 + t2) {
+        double s = t - t1 - t2;
+        return x2 + v2 * s + accel_peak * s * s / 2 - jerk * s * s * s / 6;
+    } else {
+        return x3 + v * (t - 2 * t1 - t2);
+    }
+}
+
+/**
+ * Разгон с места по S-кривой (точный профиль): время шага k, микросекунды.
+ */
+static double scurve_time_exact(double v, double accel_peak, double jerk, double k) {
+    double t_min = 0, t_max = 1;
+    while(scurve_dist_exact(v, accel_peak, jerk, t_max) < k) {
+        t_max *= 2;
+    }
+    for(int i = 0; i < 60; i++) {
+        double t = (t_min + t_max) / 2;
+        if(scurve_dist_exact(v, accel_peak, jerk, t) < k) {
+            t_min = t;
+        } else {
+            t_max = t;
+        }
+    }
+    return t_max * 1000000;
+}
+
+static void test_scurve_steps() {
+    // разгон и торможение с ограничением рывка (prepare_scurve_steps):
+    // сравним время каждого шага с точным профилем и с трапецией
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    // мотор - минимальная задержка между шагами 200 мкс (5000 шагов/с),
+    // ускорение 250000 шагов/с^2 набирается за 1мс (рывок 250000000 шагов/с^3):
+    // разгон до максимальной скорости за 21мс и 52.5 шагов
+    stepper sm_x;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper_accel(&sm_x, 250000, 250000000);
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // #1: S-кривая - 300 шагов: разгон, крейсерская скорость, торможение
+    long step_count = 300;
+    prepare_scurve_steps(&sm_x, step_count, 0);
+    stepper_start_cycle();
+    
+    // точное время на весь путь: 2 разгона по 21мс + (300-2*52.5) шагов по 200мкс
+    double total_time = 2*21000 + (300 - 2*52.5)*200;
+    unsigned long tick = 0;
+    bool ok = true;
+    for(long step = 0; step < step_count && ok; step++) {
+        // точное время шага: торможение - разгон в обратном времени
+        double expected_time = step + 1 <= step_count/2 ?
+            scurve_time_exact(5000, 250000, 250000000, step + 1) :
+            total_time - scurve_time_exact(5000, 250000, 250000000, step_count - 1 - step);
+        
+        // ждем шага
+        long pos = sm_x.current_pos;
+        while(sm_x.current_pos == pos && tick < 1000000) {
+            timer_tick(1);
+            tick++;
+        }
+        
+        // в обработчике скорость считается приближенно (по середине шага),
+        // допускаем расхождение в 1% от времени с начала движения
+        double err = expected_time - tick*timer_period_us;
+        double tolerance = timer_period_us + expected_time/100;
+        ok = err > -tolerance && err < tolerance;
+        //if(!ok) cout<<"step="<<step<<" tick="<<tick<<" expected="<<expected_time<<endl;
+    }
+    sput_fail_unless(ok, "s-curve: step times match exact profile");
+    sput_fail_unless(sm_x.current_pos == 7500*300, "s-curve: sm_x.current_pos == 7500*300");
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "s-curve: stepper_cycle_running() == false");
+    unsigned long scurve_ticks = tick;
+    
+    // #2: трапеция с тем же ускорением: скачок ускорения с 0 до 250000 шагов/с^2
+    // на старте (первый шаг через 2мс вместо 3.3мс), при той же вибрации
+    // ускорение для трапеции приходится снижать
+    prepare_accel_steps(&sm_x, -step_count, 0);
+    stepper_start_cycle();
+    timer_tick(2000/timer_period_us);
+    sput_fail_unless(sm_x.current_pos == 7500*299, "trapezoid: first step after 2ms");
+    timer_tick(1000000);
+    sput_fail_unless(!stepper_cycle_running(), "trapezoid: stepper_cycle_running() == false");
+    
+    // #3: трапеция со сниженным вдвое ускорением: 100 шагов разгона (38.8мс),
+    // 100 шагов на крейсерской скорости (20мс), 100 шагов торможения - 97.6мс,
+    // S-кривая с полным ускорением проходит тот же путь быстрее (81мс)
+    init_stepper_accel(&sm_x, 125000);
+    prepare_accel_steps(&sm_x, step_count, 0);
+    stepper_start_cycle();
+    tick = 0;
+    while(stepper_cycle_running() && tick < 1000000) {
+        timer_tick(1);
+        tick++;
+    }
+    sput_fail_unless(sm_x.current_pos == 7500*300, "derated trapezoid: sm_x.current_pos == 7500*300");
+    sput_fail_unless(tick*timer_period_us > 97000 && tick*timer_period_us < 98200,
+        "derated trapezoid: cycle time == 97.6ms");
+    sput_fail_unless(scurve_ticks < tick, "s-curve: cycle time < derated trapezoid cycle time");
+    
+    // #4: рывок не задан - трапеция
+    init_stepper_accel(&sm_x, 250000, 0);
+    prepare_scurve_steps(&sm_x, -step_count, 0);
+    stepper_start_cycle();
+    timer_tick(2000/timer_period_us);
+    sput_fail_unless(sm_x.current_pos == 7500*299, "no jerk: first step after 2ms");
+    timer_tick(1000000);
+    sput_fail_unless(sm_x.current_pos == 0, "no jerk: sm_x.current_pos == 0");
+    sput_fail_unless(!stepper_cycle_running(), "no jerk: stepper_cycle_running() == false");
+}
+
+/**
+ * Генератор подсерий для потокового буфера: count подсерий
+ * по 5 шагов с задержкой 1000мкс.
+ */
+static void stream_refill(stepper_stream_t* stream, void* context) {
+    int* count = (int*)context;
+    while(*count > 0 && stepper_stream_put(stream, 1000, 5)) {
+        (*count)--;
+    }
+    if(*count == 0) {
+        stepper_stream_end(stream);
+    }
+}
+
+static void test_stream_steps() {
+    // потоковый буфер: обработчик прерывания загружает подсерии
+    // по ходу движения, главный цикл (или refill) пополняет буфер
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    stepper sm_x;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // буфер на 3 подсерии
+    static unsigned long delay_buffer[4];
+    static long step_buffer[4];
+    static stepper_stream_t stream;
+    
+    // #1: 20 подсерий по 5 шагов через буфер на 3 подсерии,
+    // пополняем из главного цикла
+    stepper_stream_init(&stream, 4, delay_buffer, step_buffer, 1);
+    int put = 0;
+    while(stepper_stream_put(&stream, 1000, put % 2 == 0 ? 5 : -2)) {
+        put++;
+    }
+    sput_fail_unless(put == 3, "stepper_stream_put: 3 segments fit in 4 cells");
+    sput_fail_unless(stepper_stream_full(&stream), "stepper_stream_full() == true");
+    
+    prepare_stream_steps(&sm_x, &stream);
+    
+    // смена направления между подсериями - только при опущенной ножке step
+    _dbg_step_pin = 8;
+    _dbg_dir_pin = 9;
+    _dbg_dir_changes = 0;
+    _dbg_dir_changes_step_high = 0;
+    dbg_pin_changed = _dbg_dir_changed;
+    
+    stepper_start_cycle();
+    unsigned long tick = 0;
+    while(stepper_cycle_running() && tick < 1000000) {
+        if(put < 20 && stepper_stream_low(&stream)) {
+            stepper_stream_put(&stream, 1000, put % 2 == 0 ? 5 : -2);
+            put++;
+            if(put == 20) {
+                stepper_stream_end(&stream);
+            }
+        }
+        timer_tick(1);
+        tick++;
+    }
+    // 10*5 шагов вперед, 10*2 назад, 70 шагов по 1000мкс
+    sput_fail_unless(sm_x.current_pos == 7500*30, "main loop: sm_x.current_pos == 7500*30");
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_NONE, "main loop: sm_x.error == NONE");
+    sput_fail_unless(tick == 70*50 + 1, "main loop: cycle time == 70ms");
+    dbg_pin_changed = NULL;
+    sput_fail_unless(_dbg_dir_changes >= 19, "main loop: _dbg_dir_changes >= 19");
+    sput_fail_unless(_dbg_dir_changes_step_high == 0,
+        "main loop: _dbg_dir_changes_step_high == 0");
+    
+    // #2: буфер опустел раньше, чем серия завершилась
+    stepper_stream_init(&stream, 4, delay_buffer, step_buffer, 1);
+    stepper_stream_put(&stream, 1000, -5);
+    prepare_stream_steps(&sm_x, &stream);
+    stepper_start_cycle();
+    timer_tick(1000);
+    sput_fail_unless(!stepper_cycle_running(), "underrun: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.current_pos == 7500*25, "underrun: sm_x.current_pos == 7500*25");
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_BUFFER_UNDERRUN, "underrun: sm_x.error == BUFFER_UNDERRUN");
+    
+    // поздняя подсерия уже не выполняется
+    stepper_stream_put(&stream, 1000, 5);
+    timer_tick(1000);
+    sput_fail_unless(sm_x.current_pos == 7500*25, "underrun: late segment not stepped");
+    
+    // #3: буфер пополняет генератор в обработчике прерывания
+    int count = 30;
+    stepper_stream_init(&stream, 4, delay_buffer, step_buffer, 1, stream_refill, &count);
+    stream_refill(&stream, &count);
+    prepare_stream_steps(&sm_x, &stream);
+    stepper_start_cycle();
+    timer_tick(30*5*50);
+    sput_fail_unless(sm_x.current_pos == 7500*(25 + 30*5), "refill: sm_x.current_pos == 7500*175");
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "refill: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_NONE, "refill: sm_x.error == NONE");
+    sput_fail_unless(!stepper_stream_put(&stream, 1000, 5), "ended: stepper_stream_put() == false");
+    
+    // #4: пустой буфер при подготовке
+    stepper_stream_init(&stream, 4, delay_buffer, step_buffer);
+    prepare_stream_steps(&sm_x, &stream);
+    stepper_start_cycle();
+    timer_tick(2);
+    sput_fail_unless(!stepper_cycle_running(), "empty: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_BUFFER_UNDERRUN, "empty: sm_x.error == BUFFER_UNDERRUN");
+}
+
+/**
+ * Пройти дугу prepare_arc до конца, проверяя на каждом тике, что точка
+ * не отходит от окружности дальше, чем на шаг.
+ * @return количество тиков таймера на всю дугу (0 - точка ушла с окружности)
+ */
+static unsigned long arc_run(stepper* sm_x, stepper* sm_y, long x_steps, long y_steps,
+        long center_x, long center_y, bool cw, unsigned long step_delay) {
+    long x0 = sm_x->current_pos / (long)sm_x->distance_per_step;
+    long y0 = sm_y->current_pos / (long)sm_y->distance_per_step;
+    double r = sqrt((double)center_x * center_x + (double)center_y * center_y);
+    
+    prepare_arc(sm_x, sm_y, x_steps, y_steps, center_x, center_y, cw, step_delay);
+    stepper_start_cycle();
+    
+    unsigned long ticks = 0;
+    bool on_circle = true;
+    while(stepper_cycle_running() && ticks < 10000000) {
+        timer_tick(1);
+        ticks++;
+        double dx = (double)(sm_x->current_pos / (long)sm_x->distance_per_step - x0 - center_x);
+        double dy = (double)(sm_y->current_pos / (long)sm_y->distance_per_step - y0 - center_y);
+        double d = sqrt(dx * dx + dy * dy) - r;
+        on_circle = on_circle && d > -1 && d < 1;
+    }
+    return on_circle ? ticks : 0;
+}
+
+// вызовы функции задержки из обработчика прерывания (timer_tick)
+static bool prefetch_in_isr = false;
+static unsigned long prefetch_isr_calls = 0;
+static unsigned long prefetch_max_step = 0;
+
+/**
+ * Переменная скорость: задержка меняется по шагам с периодом 5 шагов.
+ */
+static unsigned long prefetch_curve_delay(unsigned long curr_step, void* curve_context) {
+    if(prefetch_in_isr) prefetch_isr_calls++;
+    if(curr_step > prefetch_max_step) prefetch_max_step = curr_step;
+    return *(unsigned long*)curve_context + (curr_step % 5) * 200;
+}
+
+/**
+ * Тики таймера: номера тиков, на которых мотор сделал шаги.
+ * 
+ * @param prefetch - заполнять буфер перед каждым тиком (NULL - не заполнять)
+ * @return количество шагов
+ */
+static int prefetch_step_ticks(stepper* smotor, stepper_prefetch_t* prefetch, int ticks, int* step_ticks) {
+    int steps = 0;
+    stepper_pos_t pos = smotor->current_pos;
+    for(int t = 0; t < ticks; t++) {
+        if(prefetch != NULL) stepper_prefetch_fill(prefetch);
+        prefetch_in_isr = true;
+        timer_tick(1);
+        prefetch_in_isr = false;
+        if(smotor->current_pos != pos) {
+            pos = smotor->current_pos;
+            step_ticks[steps++] = t;
+        }
+    }
+    return steps;
+}
+
+static void test_dynamic_prefetch() {
+    // задержки prepare_dynamic_steps вычисляются заранее в главном цикле
+    // (stepper_prefetch_fill), обработчик прерывания только забирает их из буфера
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 200;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 2000);
+    
+    stepper sm_x;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 1000, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    unsigned long base_delay = 1000;
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // #1: без буфера - функция вызывается в обработчике прерывания на каждом шаге
+    static int ticks_direct[40];
+    prefetch_isr_calls = 0;
+    prepare_dynamic_steps(&sm_x, 30, &base_delay, prefetch_curve_delay);
+    stepper_start_cycle();
+    int steps_direct = prefetch_step_ticks(&sm_x, NULL, 300, ticks_direct);
+    sput_fail_unless(!stepper_cycle_running(), "direct: stepper_cycle_running() == false");
+    sput_fail_unless(steps_direct == 30, "direct: 30 steps");
+    sput_fail_unless(prefetch_isr_calls == 30, "direct: next_step_delay in ISR on every step");
+    
+    // #2: с буфером - те же шаги на тех же тиках, функция в обработчике не вызывается
+    static unsigned long prefetch_buffer[8];
+    static stepper_prefetch_t prefetch;
+    static int ticks_prefetch[40];
+    stepper_prefetch_init(&prefetch, 8, prefetch_buffer, &base_delay, prefetch_curve_delay);
+    sm_x.current_pos = 0;
+    prefetch_isr_calls = 0;
+    prefetch_max_step = 0;
+    prepare_dynamic_steps(&sm_x, 30, &prefetch);
+    sput_fail_unless(prefetch.head == 7, "prepare: buffer filled (buf_size-1)");
+    stepper_start_cycle();
+    int steps_prefetch = prefetch_step_ticks(&sm_x, &prefetch, 300, ticks_prefetch);
+    sput_fail_unless(!stepper_cycle_running(), "prefetch: stepper_cycle_running() == false");
+    sput_fail_unless(steps_prefetch == 30 && sm_x.current_pos == 7500*30, "prefetch: 30 steps");
+    sput_fail_unless(prefetch_isr_calls == 0, "prefetch: no next_step_delay calls in ISR");
+    sput_fail_unless(prefetch_max_step == 29, "prefetch: steps 0..29 computed, no extra");
+    sput_fail_unless(stepper_prefetch_underruns(&prefetch) == 0, "prefetch: no underruns");
+    bool same_ticks = steps_prefetch == steps_direct;
+    for(int i = 0; i < steps_direct && same_ticks; i++) {
+        same_ticks = ticks_prefetch[i] == ticks_direct[i];
+    }
+    sput_fail_unless(same_ticks, "prefetch: same step timing as direct");
+    
+    // #3: главный цикл не успевает - повторяется предыдущая задержка,
+    // счетчик underruns, все шаги серии сделаны
+    sm_x.current_pos = 0;
+    prepare_dynamic_steps(&sm_x, -20, &prefetch);
+    stepper_start_cycle();
+    prefetch_step_ticks(&sm_x, NULL, 60, ticks_prefetch);
+    sput_fail_unless(stepper_prefetch_underruns(&prefetch) > 0, "no fill: underruns > 0");
+    sput_fail_unless(sm_x.error == STEPPER_ERROR_NONE, "no fill: sm_x.error == STEPPER_ERROR_NONE");
+    prefetch_step_ticks(&sm_x, &prefetch, 300, ticks_prefetch);
+    sput_fail_unless(!stepper_cycle_running(), "no fill: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.current_pos == -7500*20, "no fill: sm_x.current_pos == -7500*20");
+    
+    // #4: вращение без остановки - номер шага для функции всегда 0
+    // (как у prepare_dynamic_whirl без буфера)
+    prefetch_max_step = 0;
+    prefetch_isr_calls = 0;
+    prepare_dynamic_whirl(&sm_x, 1, &prefetch);
+    stepper_start_cycle();
+    prefetch_step_ticks(&sm_x, &prefetch, 100, ticks_prefetch);
+    sput_fail_unless(stepper_cycle_running(), "whirl: stepper_cycle_running() == true");
+    sput_fail_unless(prefetch_max_step == 0 && prefetch_isr_calls == 0, "whirl: curr_step == 0, no calls in ISR");
+    sput_fail_unless(stepper_prefetch_underruns(&prefetch) == 0, "whirl: no underruns");
+    stepper_finish_cycle();
+}
+
+#define WORK_MOTORS 6
+#define WORK_MAX_STEPS 120
+
+static int work_calls_tick = 0;
+
+/**
+ * Переменная скорость для проверки лимита тяжелой работы: считаем вызовы
+ * на текущем тике.
+ */
+static unsigned long work_curve_delay(unsigned long curr_step, void* curve_context) {
+    work_calls_tick++;
+    return *(unsigned long*)curve_context + (curr_step % 3) * 400;
+}
+
+/**
+ * Прогнать запущенный цикл до конца (в режиме "по событию" - с пропуском
+ * периодов по stepper_timer_event_ticks).
+ * 
+ * @param step_ticks - номера тиков, на которых моторы сделали шаги,
+ *     WORK_MAX_STEPS на мотор
+ * @param max_calls - наибольшее количество вызовов work_curve_delay на одном тике
+ * @return количество тиков
+ */
+static long work_limit_run(int motor_count, stepper** smotors,
+        long step_ticks[][WORK_MAX_STEPS], int* max_calls) {
+    stepper_pos_t pos[WORK_MOTORS];
+    int steps[WORK_MOTORS];
+    for(int i = 0; i < motor_count; i++) {
+        pos[i] = smotors[i]->current_pos;
+        steps[i] = 0;
+    }
+    *max_calls = 0;
+    long ticks = 0;
+    while(stepper_cycle_running() && ticks < 20000) {
+        ticks += stepper_timer_event_ticks();
+        work_calls_tick = 0;
+        _timer_handle_interrupts(3);
+        if(work_calls_tick > *max_calls) *max_calls = work_calls_tick;
+        for(int i = 0; i < motor_count; i++) {
+            if(smotors[i]->current_pos != pos[i]) {
+                pos[i] = smotors[i]->current_pos;
+                if(steps[i] < WORK_MAX_STEPS) step_ticks[i][steps[i]++] = ticks;
+            }
+        }
+    }
+    return ticks;
+}
+
+static bool work_same_ticks(int motor_count, long ticks1[][WORK_MAX_STEPS], long ticks2[][WORK_MAX_STEPS]) {
+    for(int i = 0; i < motor_count; i++) {
+        for(int s = 0; s < WORK_MAX_STEPS; s++) {
+            if(ticks1[i][s] != ticks2[i][s]) return false;
+        }
+    }
+    return true;
+}
+
+static void test_step_work_limit() {
+    // stepper_set_step_work_limit: не больше K моторов вычисляют задержку
+    // следующего шага на одном тике, остальные откладывают вычисление,
+    // тайминг шагов не меняется
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 200;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 2000);
+    
+    static stepper sm[WORK_MOTORS];
+    stepper* smotors[WORK_MOTORS];
+    for(int i = 0; i < WORK_MOTORS; i++) {
+        init_stepper(&sm[i], 'a' + i, 2 + i*3, 3 + i*3, 4 + i*3, false, 1000, 7500);
+        init_stepper_ends(&sm[i], NO_PIN, NO_PIN, INF, INF, 0, 0);
+        init_stepper_accel(&sm[i], 250000);
+        smotors[i] = &sm[i];
+    }
+    unsigned long base_delay = 2000;
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    static long ticks_free[WORK_MOTORS][WORK_MAX_STEPS];
+    static long ticks_limit[WORK_MOTORS][WORK_MAX_STEPS];
+    int max_calls;
+    
+    // #1: 3 мотора с одинаковыми динамическими задержками шагают на одних тиках
+    // (последний шаг серии не откладывается, поэтому серии разной длины)
+    memset(ticks_free, 0, sizeof(ticks_free));
+    for(int i = 0; i < 3; i++) {
+        prepare_dynamic_steps(&sm[i], 48 + i, &base_delay, work_curve_delay);
+    }
+    stepper_start_cycle();
+    work_limit_run(3, smotors, ticks_free, &max_calls);
+    sput_fail_unless(max_calls == 3, "no limit: 3 calls on one tick");
+    
+    // с лимитом 1 - не больше одного вычисления на тик, шаги на тех же тиках
+    memset(ticks_limit, 0, sizeof(ticks_limit));
+    stepper_set_step_work_limit(1);
+    for(int i = 0; i < 3; i++) {
+        prepare_dynamic_steps(&sm[i], -48 - i, &base_delay, work_curve_delay);
+    }
+    stepper_start_cycle();
+    work_limit_run(3, smotors, ticks_limit, &max_calls);
+    sput_fail_unless(max_calls == 1, "limit 1: 1 call per tick");
+    sput_fail_unless(work_same_ticks(3, ticks_free, ticks_limit), "limit 1: same step ticks");
+    sput_fail_unless(sm[0].current_pos == 0 && sm[1].current_pos == 0 && sm[2].current_pos == 0,
+        "limit 1: all steps done");
+    sput_fail_unless(sm[0].error == STEPPER_ERROR_NONE && sm[2].error == STEPPER_ERROR_NONE,
+        "limit 1: no errors");
+    
+    // #2: 6 моторов - группа с разгоном (ведущий мотор вычисляет задержку заранее),
+    // динамические задержки, разгон, S-кривая
+    long line_steps[] = {100, 60};
+    for(int limit = 0; limit <= 2; limit++) {
+        stepper_set_step_work_limit(limit);
+        for(int i = 0; i < WORK_MOTORS; i++) {
+            sm[i].current_pos = 0;
+        }
+        prepare_accel_line(2, smotors, line_steps);
+        prepare_dynamic_steps(&sm[2], 40, &base_delay, work_curve_delay);
+        prepare_dynamic_steps(&sm[3], -40, &base_delay, work_curve_delay);
+        prepare_accel_steps(&sm[4], 80, 0);
+        prepare_accel_steps(&sm[5], -80, 0);
+        stepper_start_cycle();
+        work_limit_run(WORK_MOTORS, smotors, limit == 0 ? ticks_free : ticks_limit, &max_calls);
+        if(limit > 0) {
+            sput_fail_unless(work_same_ticks(WORK_MOTORS, ticks_free, ticks_limit),
+                limit == 1 ? "mixed, limit 1: same step ticks" : "mixed, limit 2: same step ticks");
+        }
+    }
+    sput_fail_unless(sm[0].current_pos == 7500*100 && sm[1].current_pos == 7500*60,
+        "mixed: line done");
+    sput_fail_unless(sm[2].current_pos == 7500*40 && sm[3].current_pos == -7500*40,
+        "mixed: dynamic done");
+    sput_fail_unless(sm[4].current_pos == 7500*80 && sm[5].current_pos == -7500*80,
+        "mixed: accel done");
+    
+    // #3: режим "по событию" - те же тики шагов
+    stepper_set_timer_event_driven(true);
+    stepper_set_step_work_limit(1);
+    for(int i = 0; i < WORK_MOTORS; i++) {
+        sm[i].current_pos = 0;
+    }
+    prepare_accel_line(2, smotors, line_steps);
+    prepare_dynamic_steps(&sm[2], 40, &base_delay, work_curve_delay);
+    prepare_dynamic_steps(&sm[3], -40, &base_delay, work_curve_delay);
+    prepare_accel_steps(&sm[4], 80, 0);
+    prepare_accel_steps(&sm[5], -80, 0);
+    stepper_start_cycle();
+    work_limit_run(WORK_MOTORS, smotors, ticks_limit, &max_calls);
+    sput_fail_unless(work_same_ticks(WORK_MOTORS, ticks_free, ticks_limit), "event driven: same step ticks");
+    
+    stepper_set_timer_event_driven(false);
+    stepper_set_step_work_limit(0);
+}
+
+#if STEPPER_ISR_PROFILE
+/**
+ * Динамическая задержка, на вычисление которой уходит 5 мкс
+ * (двигаем время заглушки micros).
+ */
+static unsigned long profile_curve_delay(unsigned long, void* curve_context) {
+    dbg_micros += 5;
+    return *(unsigned long*)curve_context;
+}
+#endif // STEPPER_ISR_PROFILE
+
+static void test_isr_profile() {
+    // профиль обработчика прерывания (STEPPER_ISR_PROFILE=1): гистограмма
+    // времени, тики по фазам, время работы на шагах по моторам
+#if STEPPER_ISR_PROFILE
+    // настройки частоты таймера
+    unsigned long timer_period_us = 200;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 2000);
+    
+    stepper sm_x, sm_y;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 1000, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 1000, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    unsigned long y_delay = 2000;
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    stepper_profile_t profile;
+    stepper_motor_profile_t x_profile, y_profile;
+    stepper_profile(&profile, true);
+    stepper_profile(&profile);
+    sput_fail_unless(profile.ticks == 0 && profile.max_time == 0, "reset: profile.ticks == 0");
+    
+    // #1: x шагает каждые 5 тиков, y - каждые 10 (вычисление задержки - 5 мкс)
+    prepare_steps(&sm_x, 10, 1000);
+    prepare_dynamic_steps(&sm_y, 10, &y_delay, profile_curve_delay);
+    stepper_start_cycle();
+    unsigned long ticks = 0;
+    while(stepper_cycle_running() && ticks < 1000) {
+        timer_tick(1);
+        ticks++;
+    }
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    stepper_profile(&profile);
+    sput_fail_unless(profile.ticks == ticks, "profile.ticks == ticks");
+    sput_fail_unless(profile.time_buckets[3] == 10, "time_buckets[3] (4-7 us) == 10 steps of y");
+    sput_fail_unless(profile.time_buckets[0] == ticks - 10, "time_buckets[0] (< 1 us) == other ticks");
+    sput_fail_unless(profile.max_time == 5, "profile.max_time == 5");
+    sput_fail_unless(profile.max_time_phase == STEPPER_PHASE_STEP, "profile.max_time_phase == STEPPER_PHASE_STEP");
+    // шаги x на тиках 5, 10, ..., 50, шаги y на 10, 20, ..., 100
+    sput_fail_unless(profile.phase_ticks[STEPPER_PHASE_STEP] == 15, "phase_ticks[STEPPER_PHASE_STEP] == 15");
+    sput_fail_unless(profile.phase_ticks[STEPPER_PHASE_IDLE] + profile.phase_ticks[STEPPER_PHASE_CHECK] +
+        profile.phase_ticks[STEPPER_PHASE_PULSE] + profile.phase_ticks[STEPPER_PHASE_STEP] == ticks,
+        "phase_ticks: sum == ticks");
+    
+    stepper_profile_motor(&sm_x, &x_profile);
+    stepper_profile_motor(&sm_y, &y_profile);
+    sput_fail_unless(x_profile.steps == 10 && x_profile.work_time == 0, "x: 10 steps, work_time == 0");
+    sput_fail_unless(y_profile.steps == 10, "y: y_profile.steps == 10");
+    sput_fail_unless(y_profile.work_time == 50 && y_profile.work_max_time == 5,
+        "y: work_time == 50, work_max_time == 5");
+    
+    // #2: сброс во время цикла - на следующем вызове обработчика (профиль)
+    // и на следующем шаге мотора (профиль мотора)
+    stepper_profile(&profile, true);
+    stepper_profile_motor(&sm_y, &y_profile, true);
+    prepare_dynamic_steps(&sm_y, 10, &y_delay, profile_curve_delay);
+    stepper_start_cycle();
+    timer_tick(25);
+    stepper_profile(&profile, true);
+    sput_fail_unless(profile.ticks == 25, "running: profile.ticks == 25");
+    stepper_profile_motor(&sm_y, &y_profile, true);
+    sput_fail_unless(y_profile.steps == 2, "running: y_profile.steps == 2");
+    timer_tick(1);
+    stepper_profile(&profile);
+    sput_fail_unless(profile.ticks == 1, "reset: profile.ticks == 1");
+    while(stepper_cycle_running() && ticks < 2000) {
+        timer_tick(1);
+        ticks++;
+    }
+    stepper_profile_motor(&sm_y, &y_profile);
+    sput_fail_unless(y_profile.steps == 8 && y_profile.work_time == 40, "reset: y: 8 steps after reset");
+#endif // STEPPER_ISR_PROFILE
+}
+
+static void test_trace() {
+    // трасса шагов (STEPPER_TRACE=1): кольцевой буфер событий,
+    // обработчик прерывания пишет, главный цикл читает
+#if STEPPER_TRACE
+    // настройки частоты таймера
+    unsigned long timer_period_us = 200;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 2000);
+    
+    stepper sm_x, sm_y;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 1000, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 1000, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    static stepper_trace_event_t trace_buffer[8];
+    stepper_trace_event_t events[8];
+    stepper_trace_init(8, trace_buffer);
+    
+    // #1: x - 3 шага вперед, y - 2 шага назад, шаг каждые 5 тиков
+    prepare_steps(&sm_x, 3, 1000);
+    prepare_steps(&sm_y, -2, 1000);
+    stepper_start_cycle();
+    timer_tick(7);
+    // читаем во время движения
+    int count = stepper_trace_read(events, 8);
+    sput_fail_unless(count == 2, "tick 7: 2 events");
+    sput_fail_unless(events[0].tick == 5 && events[0].motor == 'x' && events[0].flags == STEPPER_TRACE_DIR,
+        "tick 7: x, tick 5, forward");
+    sput_fail_unless(events[1].tick == 5 && events[1].motor == 'y' && events[1].flags == 0,
+        "tick 7: y, tick 5, backward");
+    timer_tick(20);
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    count = stepper_trace_read(events, 8);
+    sput_fail_unless(count == 3, "finished: 3 more events");
+    sput_fail_unless(events[0].tick == 10 && events[0].motor == 'x', "finished: x, tick 10");
+    sput_fail_unless(events[1].tick == 10 && events[1].motor == 'y', "finished: y, tick 10");
+    sput_fail_unless(events[2].tick == 15 && events[2].motor == 'x', "finished: x, tick 15");
+    sput_fail_unless(stepper_trace_read(events, 8) == 0, "finished: buffer empty");
+    sput_fail_unless(stepper_trace_dropped() == 0, "finished: stepper_trace_dropped() == 0");
+    
+    // #2: читатель не успевает - новые события отбрасываются, старые целы
+    prepare_steps(&sm_x, 10, 1000);
+    stepper_start_cycle();
+    timer_tick(60);
+    count = stepper_trace_read(events, 8);
+    sput_fail_unless(count == 7, "overflow: 7 events (buf_size-1)");
+    sput_fail_unless(events[6].tick - events[0].tick == 5*6, "overflow: first 7 steps");
+    sput_fail_unless(stepper_trace_dropped() == 3, "overflow: stepper_trace_dropped() == 3");
+    
+    // #3: остановка на виртуальной границе - событие STOP с флагом ошибки
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, CONST, 0, sm_x.current_pos + 7500);
+    prepare_steps(&sm_x, 3, 1000);
+    stepper_start_cycle();
+    timer_tick(20);
+    sput_fail_unless(!stepper_cycle_running(), "soft end: stepper_cycle_running() == false");
+    count = stepper_trace_read(events, 8);
+    sput_fail_unless(count == 2, "soft end: 2 events");
+    sput_fail_unless(!(events[0].flags & STEPPER_TRACE_STOP), "soft end: step");
+    sput_fail_unless(events[1].flags == (STEPPER_TRACE_STOP | STEPPER_TRACE_DIR | STEPPER_ERROR_SOFT_END_MAX),
+        "soft end: stop with STEPPER_ERROR_SOFT_END_MAX");
+    
+    // #4: событие в поток байт
+    unsigned char data[STEPPER_TRACE_EVENT_BYTES];
+    events[0].tick = 0x01020304;
+    events[0].motor = 'z';
+    events[0].flags = STEPPER_TRACE_DIR;
+    sput_fail_unless(stepper_trace_encode(&events[0], data) == STEPPER_TRACE_EVENT_BYTES,
+        "encode: STEPPER_TRACE_EVENT_BYTES");
+    sput_fail_unless(data[0] == 0x04 && data[3] == 0x01 && data[4] == 'z' && data[5] == STEPPER_TRACE_DIR,
+        "encode: tick LSB first, motor, flags");
+    
+    stepper_trace_init(0, NULL);
+#endif // STEPPER_TRACE
+}
+
+static void test_arc() {
+    // дуга окружности: целочисленный алгоритм средней точки
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    stepper sm_x, sm_y;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 200, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // #1: четверть окружности радиусом 1000 шагов против часовой стрелки
+    // из (1000, 0) в (0, 1000) относительно центра, 1000мкс на шаг по оси
+    unsigned long ticks = arc_run(&sm_x, &sm_y, -1000, 1000, -1000, 0, false, 1000);
+    sput_fail_unless(ticks > 0, "quarter: point stays on the circle");
+    sput_fail_unless(sm_x.current_pos == -7500*1000, "quarter: sm_x.current_pos == -7500*1000");
+    sput_fail_unless(sm_y.current_pos == 7500*1000, "quarter: sm_y.current_pos == 7500*1000");
+    sput_fail_unless(sm_x.status == STEPPER_STATUS_FINISHED && sm_y.status == STEPPER_STATUS_FINISHED,
+        "quarter: sm_x.status == sm_y.status == FINISHED");
+    // длина дуги 1571 шаг, скорость 1000 шагов в секунду - 1.571с
+    sput_fail_unless(ticks*timer_period_us > 1571000*0.99 && ticks*timer_period_us < 1571000*1.01,
+        "quarter: cycle time == 1.571s (constant speed along the arc)");
+    
+    // #2: полная окружность по часовой стрелке через все четверти -
+    // возвращаемся в начальную точку
+    ticks = arc_run(&sm_x, &sm_y, 0, 0, 300, -400, true, 250);
+    sput_fail_unless(ticks > 0, "full circle: point stays on the circle");
+    sput_fail_unless(sm_x.current_pos == -7500*1000, "full circle: sm_x.current_pos back to start");
+    sput_fail_unless(sm_y.current_pos == 7500*1000, "full circle: sm_y.current_pos back to start");
+    // длина окружности 3142 шага по 250мкс
+    sput_fail_unless(ticks*timer_period_us > 785400*0.99 && ticks*timer_period_us < 785400*1.01,
+        "full circle: cycle time == 785ms");
+    
+    // #3: конечная точка не на окружности - ближайшая точка окружности
+    ticks = arc_run(&sm_x, &sm_y, -1005, -3, -500, 0, false, 0);
+    sput_fail_unless(ticks > 0, "off circle end: point stays on the circle");
+    sput_fail_unless(sm_x.current_pos == 7500*(-1000 - 1000), "off circle end: sm_x.current_pos == -2000 steps");
+    sput_fail_unless(sm_y.current_pos == 7500*(1000 - 3), "off circle end: sm_y.current_pos == 997 steps");
+    
+    // #4: дуги с разными радиусами, направлениями и концами: дуга заканчивается
+    // в заданной конечной точке (она на окружности с точностью до полушага)
+    bool ok = true;
+    for(int n = 0; n < 40 && ok; n++) {
+        long r = 10 + n * 7;
+        double a0 = n * 0.7;
+        double a1 = a0 + (n % 2 == 0 ? 1 : -1) * (0.3 + n * 0.15);
+        long cx = -(long)floor(r * cos(a0) + 0.5);
+        long cy = -(long)floor(r * sin(a0) + 0.5);
+        double r_exact = sqrt((double)cx * cx + (double)cy * cy);
+        long ex = (long)floor(r_exact * cos(a1) + 0.5) + cx;
+        long ey = (long)floor(r_exact * sin(a1) + 0.5) + cy;
+        
+        long x0 = sm_x.current_pos / 7500;
+        long y0 = sm_y.current_pos / 7500;
+        ticks = arc_run(&sm_x, &sm_y, ex, ey, cx, cy, n % 2 != 0, 0);
+        long dx = sm_x.current_pos / 7500 - x0 - ex;
+        long dy = sm_y.current_pos / 7500 - y0 - ey;
+        ok = ticks > 0 && dx >= -1 && dx <= 1 && dy >= -1 && dy <= 1;
+        //if(!ok) cout<<"n="<<n<<" ticks="<<ticks<<" dx="<<dx<<" dy="<<dy<<endl;
+    }
+    sput_fail_unless(ok, "arcs: end at the given point, stay on the circle");
+    
+    // #5: задержка равна минимальной задержке моторов: шаг по одной оси
+    // (243/256 задержки) не чаще, чем могут моторы, - дуга идет без ошибок
+    long x_start = sm_x.current_pos;
+    ticks = arc_run(&sm_x, &sm_y, 0, 0, 300, -400, true, 200);
+    sput_fail_unless(ticks > 0, "min delay: point stays on the circle");
+    sput_fail_unless(stepper_cycle_error() == CYCLE_ERROR_NONE, "min delay: stepper_cycle_error() == NONE");
+    sput_fail_unless(sm_x.error == 0 && sm_y.error == 0, "min delay: sm_x.error == sm_y.error == 0");
+    sput_fail_unless(sm_x.current_pos == x_start, "min delay: sm_x.current_pos back to start");
+    // не меньше 3142 шагов дуги по 200мкс по одной оси (по диагонали - дольше)
+    sput_fail_unless(ticks*timer_period_us >= 200*3142*0.95, "min delay: not faster than the motors");
+    
+    // #5.1: минимальную задержку мотора подняли после подготовки дуги,
+    // FIX исправляет и задержки шагов дуги (а не только первого шага)
+    stepper_set_error_handle_strategy(DONT_CHANGE, DONT_CHANGE, FIX, DONT_CHANGE);
+    prepare_arc(&sm_x, &sm_y, 0, 0, 300, -400, true, 200);
+    sm_x.step_delay = 400;
+    stepper_start_cycle();
+    ticks = 0;
+    while(stepper_cycle_running() && ticks < 10000000) {
+        timer_tick(1);
+        ticks++;
+    }
+    sm_x.step_delay = 200;
+    stepper_set_error_handle_strategy(DONT_CHANGE, DONT_CHANGE, CANCEL_CYCLE, DONT_CHANGE);
+    sput_fail_unless(sm_x.current_pos == x_start, "fixed delay: sm_x.current_pos back to start");
+    sput_fail_unless(ticks*timer_period_us >= 400*3142*0.95, "fixed delay: arc steps not faster than 400us");
+    sm_x.error = 0;
+    
+    // #6: нулевой радиус - двигаться некуда
+    long x = sm_x.current_pos;
+    prepare_arc(&sm_x, &sm_y, 0, 0, 0, 0, false);
+    stepper_start_cycle();
+    timer_tick(2);
+    sput_fail_unless(!stepper_cycle_running(), "zero radius: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.current_pos == x, "zero radius: sm_x.current_pos not changed");
+}
+
+static void test_helix() {
+    // винтовая линия: X и Y по дуге, Z линейно, синхронно с дугой
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    stepper sm_x, sm_y, sm_z;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 200, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_z, 'z', 2, 3, 4, false, 200, 7500);
+    init_stepper_ends(&sm_z, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // #1: виток радиусом 500 шагов против часовой стрелки с подъемом 200 шагов:
+    // Z отстает от доли пройденного угла не больше, чем на 2 шага
+    sput_fail_unless(prepare_helix(&sm_x, &sm_y, &sm_z, 0, 0, 200, -500, 0, false, 250),
+        "prepare_helix() == true");
+    stepper_start_cycle();
+    unsigned long tick = 0;
+    bool in_sync = true;
+    while(stepper_cycle_running() && tick < 1000000) {
+        timer_tick(1);
+        tick++;
+        double x = (double)(sm_x.current_pos / 7500) + 500;
+        double y = (double)(sm_y.current_pos / 7500);
+        double angle = atan2(y, x);
+        if(angle < 0) angle += 2 * M_PI;
+        double z = (double)(sm_z.current_pos / 7500);
+        if(z > 150 && angle < M_PI / 2) {
+            // в конце витка угол снова около 0
+            angle += 2 * M_PI;
+        }
+        double z_expected = 200 * angle / (2 * M_PI);
+        in_sync = in_sync && z - z_expected > -2 && z - z_expected < 2;
+    }
+    sput_fail_unless(in_sync, "helix: sm_z.current_pos follows the arc angle");
+    sput_fail_unless(sm_x.current_pos == 0 && sm_y.current_pos == 0, "helix: x, y back to start");
+    sput_fail_unless(sm_z.current_pos == 7500*200, "helix: sm_z.current_pos == 7500*200");
+    sput_fail_unless(sm_z.status == STEPPER_STATUS_FINISHED, "helix: sm_z.status == FINISHED");
+    // длина окружности 3142 шага по 250мкс - Z не замедляет дугу
+    sput_fail_unless(tick*timer_period_us > 785400*0.99 && tick*timer_period_us < 785400*1.01,
+        "helix: cycle time == 785ms");
+    
+    // #2: спуск по четверти окружности по часовой стрелке
+    sput_fail_unless(prepare_helix(&sm_x, &sm_y, &sm_z, 500, -500, -150, 0, -500, true),
+        "descent: prepare_helix() == true");
+    stepper_start_cycle();
+    timer_tick(1000000);
+    sput_fail_unless(sm_x.current_pos == 7500*500, "descent: sm_x.current_pos == 7500*500");
+    sput_fail_unless(sm_y.current_pos == -7500*500, "descent: sm_y.current_pos == -7500*500");
+    sput_fail_unless(sm_z.current_pos == 7500*50, "descent: sm_z.current_pos == 7500*50");
+    
+    // #2.1: задержка равна минимальной задержке моторов (у Z - самая большая):
+    // винтовая линия идет без ошибок, не чаще, чем может Z
+    sm_z.step_delay = 400;
+    sput_fail_unless(prepare_helix(&sm_x, &sm_y, &sm_z, -500, 500, 100, 0, 500, true, 400),
+        "min delay: prepare_helix() == true");
+    stepper_start_cycle();
+    tick = 0;
+    while(stepper_cycle_running() && tick < 1000000) {
+        timer_tick(1);
+        tick++;
+    }
+    sm_z.step_delay = 200;
+    sput_fail_unless(stepper_cycle_error() == CYCLE_ERROR_NONE, "min delay: stepper_cycle_error() == NONE");
+    sput_fail_unless(sm_z.error == 0, "min delay: sm_z.error == 0");
+    sput_fail_unless(sm_x.current_pos == 0 && sm_z.current_pos == 7500*150, "min delay: helix finished");
+    // четверть окружности - 785 шагов дуги, не меньше 400мкс каждый
+    sput_fail_unless(tick*timer_period_us >= 400*785*0.95, "min delay: not faster than sm_z");
+    sm_x.current_pos = 7500*500;
+    sm_y.current_pos = -7500*500;
+    sm_z.current_pos = 7500*50;
+    
+    // #3: слишком крутой подъем - линейная ось не успевает за дугой
+    sput_fail_unless(!prepare_helix(&sm_x, &sm_y, &sm_z, -500, 500, 600, 0, 500, true),
+        "too steep: prepare_helix() == false");
+    stepper_start_cycle();
+    timer_tick(1000);
+    sput_fail_unless(sm_x.current_pos == 7500*500 && sm_z.current_pos == 7500*50, "too steep: nothing prepared");
+}
+
+static void test_bezier() {
+    // кубическая кривая Безье: прямые конечные разности в целых числах
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    stepper sm_x, sm_y, sm_z;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 200, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_z, 'z', 2, 3, 4, false, 200, 7500);
+    init_stepper_ends(&sm_z, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    stepper* motors[] = {&sm_x, &sm_y, &sm_z};
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // #1: плавный поворот из (0, 0) в (1000, 1000): точка все время рядом
+    // с кривой (не дальше шага от ближайшей точки кривой), моторы приходят
+    // точно в конечную точку
+    long p1[] = {550, 0};
+    long p2[] = {1000, 450};
+    long p3[] = {1000, 1000};
+    sput_fail_unless(prepare_bezier(2, motors, p1, p2, p3, 1000), "turn: prepare_bezier() == true");
+    stepper_start_cycle();
+    unsigned long tick = 0;
+    bool on_curve = true;
+    double length = 0;
+    double prev_x = 0, prev_y = 0;
+    for(int k = 1; k <= 10000; k++) {
+        double t = k / 10000.0;
+        double u = 1 - t;
+        double bx = 3*u*u*t*p1[0] + 3*u*t*t*p2[0] + t*t*t*p3[0];
+        double by = 3*u*u*t*p1[1] + 3*u*t*t*p2[1] + t*t*t*p3[1];
+        length += sqrt((bx - prev_x)*(bx - prev_x) + (by - prev_y)*(by - prev_y));
+        prev_x = bx;
+        prev_y = by;
+    }
+    while(stepper_cycle_running() && tick < 1000000) {
+        timer_tick(1);
+        tick++;
+        double x = (double)(sm_x.current_pos / 7500);
+        double y = (double)(sm_y.current_pos / 7500);
+        double d_min = 1e9;
+        for(int k = 0; k <= 1000; k++) {
+            double t = k / 1000.0;
+            double u = 1 - t;
+            double bx = 3*u*u*t*p1[0] + 3*u*t*t*p2[0] + t*t*t*p3[0];
+            double by = 3*u*u*t*p1[1] + 3*u*t*t*p2[1] + t*t*t*p3[1];
+            double d = sqrt((bx - x)*(bx - x) + (by - y)*(by - y));
+            if(d < d_min) d_min = d;
+        }
+        on_curve = on_curve && d_min < 1.5;
+    }
+    sput_fail_unless(on_curve, "turn: point stays on the curve");
+    sput_fail_unless(sm_x.current_pos == 7500*1000, "turn: sm_x.current_pos == 7500*1000");
+    sput_fail_unless(sm_y.current_pos == 7500*1000, "turn: sm_y.current_pos == 7500*1000");
+    sput_fail_unless(sm_x.status == STEPPER_STATUS_FINISHED && sm_y.status == STEPPER_STATUS_FINISHED,
+        "turn: sm_x.status == sm_y.status == FINISHED");
+    // скорость 1000 шагов в секунду вдоль кривой (с точностью до 5%, как у дуги)
+    double expected_us = length * 1000;
+    sput_fail_unless(tick*timer_period_us > expected_us*0.95 && tick*timer_period_us < expected_us*1.05,
+        "turn: cycle time == curve length / speed");
+    
+    // #2: три мотора, S-образная кривая с разворотом по одной оси:
+    // направление меняется на ходу, конечная точка - точно
+    long q1[] = {-300, 800, 100};
+    long q2[] = {700, -600, 200};
+    long q3[] = {400, 300, -150};
+    sput_fail_unless(prepare_bezier(3, motors, q1, q2, q3), "3 motors: prepare_bezier() == true");
+    stepper_start_cycle();
+    timer_tick(1000000);
+    sput_fail_unless(!stepper_cycle_running(), "3 motors: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.current_pos == 7500*(1000 + 400), "3 motors: sm_x.current_pos == 7500*1400");
+    sput_fail_unless(sm_y.current_pos == 7500*(1000 + 300), "3 motors: sm_y.current_pos == 7500*1300");
+    sput_fail_unless(sm_z.current_pos == -7500*150, "3 motors: sm_z.current_pos == -7500*150");
+    
+    // #2.1: острый разворот по оси x: мотор шагает и сразу идет обратно
+    // (без пропуска шага кривой) - направление меняется только
+    // при опущенной ножке step
+    long r1[] = {60, -60};
+    long r2[] = {-20, 20};
+    long r3[] = {-60, -20};
+    long pos_x = sm_x.current_pos;
+    _dbg_step_pin = 8;
+    _dbg_dir_pin = 9;
+    _dbg_dir_changes = 0;
+    _dbg_dir_changes_step_high = 0;
+    dbg_pin_changed = _dbg_dir_changed;
+    sput_fail_unless(prepare_bezier(2, motors, r1, r2, r3, 250), "sharp turn: prepare_bezier() == true");
+    stepper_start_cycle();
+    timer_tick(1000000);
+    dbg_pin_changed = NULL;
+    sput_fail_unless(sm_x.current_pos == pos_x - 7500*60, "sharp turn: sm_x.current_pos == pos_x - 7500*60");
+    sput_fail_unless(_dbg_dir_changes >= 2, "sharp turn: _dbg_dir_changes >= 2");
+    sput_fail_unless(_dbg_dir_changes_step_high == 0,
+        "sharp turn: _dbg_dir_changes_step_high == 0");
+    // обратно в (1400, 1300)
+    long b1[] = {0, 0};
+    long b2[] = {60, 20};
+    prepare_bezier(2, motors, b1, b2, b2);
+    stepper_start_cycle();
+    timer_tick(1000000);
+    sput_fail_unless(sm_x.current_pos == pos_x, "sharp turn: back to sm_x.current_pos == pos_x");
+    
+    // #3: вперед и назад по одной оси: в точках разворота кривая почти стоит
+    // (шаги параметра без шагов моторов), моторы все равно приходят в конечную точку
+    long c1[] = {300, 0};
+    long c2[] = {-200, 0};
+    long c3[] = {100, 0};
+    sput_fail_unless(prepare_bezier(2, motors, c1, c2, c3, 250), "back and forth: prepare_bezier() == true");
+    stepper_start_cycle();
+    timer_tick(1000000);
+    sput_fail_unless(sm_x.current_pos == 7500*1500, "back and forth: sm_x.current_pos == 7500*1500");
+    sput_fail_unless(sm_y.current_pos == 7500*1300, "back and forth: sm_y.current_pos not changed");
+    
+    // #3.1: задержка равна минимальной задержке моторов: шаг по одной оси
+    // (243/256 задержки) не чаще, чем могут моторы, - кривая идет без ошибок
+    long m1[] = {-300, 0};
+    long m2[] = {-300, -300};
+    long m3[] = {0, -300};
+    sput_fail_unless(prepare_bezier(2, motors, m1, m2, m3, 200), "min delay: prepare_bezier() == true");
+    stepper_start_cycle();
+    tick = 0;
+    while(stepper_cycle_running() && tick < 1000000) {
+        timer_tick(1);
+        tick++;
+    }
+    sput_fail_unless(stepper_cycle_error() == CYCLE_ERROR_NONE, "min delay: stepper_cycle_error() == NONE");
+    sput_fail_unless(sm_x.error == 0 && sm_y.error == 0, "min delay: sm_x.error == sm_y.error == 0");
+    sput_fail_unless(sm_x.current_pos == 7500*1500 && sm_y.current_pos == 7500*1000, "min delay: curve finished");
+    // не меньше 300 шагов по каждой оси, по 200мкс
+    sput_fail_unless(tick*timer_period_us >= 200*300, "min delay: not faster than the motors");
+    
+    // #3.2: минимальную задержку мотора подняли после подготовки кривой,
+    // FIX исправляет и задержки шагов кривой (а не только первого шага)
+    stepper_set_error_handle_strategy(DONT_CHANGE, DONT_CHANGE, FIX, DONT_CHANGE);
+    sput_fail_unless(prepare_bezier(2, motors, c1, c2, c3, 200), "fixed delay: prepare_bezier() == true");
+    sm_x.step_delay = 1000;
+    stepper_start_cycle();
+    tick = 0;
+    while(stepper_cycle_running() && tick < 1000000) {
+        timer_tick(1);
+        tick++;
+    }
+    sm_x.step_delay = 200;
+    stepper_set_error_handle_strategy(DONT_CHANGE, DONT_CHANGE, CANCEL_CYCLE, DONT_CHANGE);
+    sput_fail_unless(sm_x.current_pos == 7500*1600, "fixed delay: sm_x.current_pos == 7500*1600");
+    // вперед и назад - всего 300 шагов, не меньше 1000мкс каждый
+    sput_fail_unless(tick*timer_period_us >= 1000*300*0.95, "fixed delay: curve steps not faster than 1000us");
+    sm_x.error = 0;
+    sm_x.current_pos = 7500*1500;
+    
+    // #4: слишком большая кривая - ничего не подготовлено
+    long big[] = {2000000, 0};
+    sput_fail_unless(!prepare_bezier(2, motors, big, big, big), "too big: prepare_bezier() == false");
+    stepper_start_cycle();
+    timer_tick(1000);
+    sput_fail_unless(sm_x.current_pos == 7500*1500, "too big: nothing prepared");
+}
+
+static void test_move_queue() {
+    // очередь движений: следующее движение запускается в обработчике
+    // прерывания сразу после последнего шага предыдущего
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    stepper sm_x, sm_y;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 200, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    sput_fail_unless(stepper_queue_count() == 0, "stepper_queue_count() == 0");
+    
+    // #1: 2 движения по 10 шагов с задержкой 1000мкс (50 тиков):
+    // второе движение - на разных моторах, без паузы между движениями
+    static stepper* line_motors[] = {&sm_x, &sm_y};
+    long line1[] = {10, 5};
+    long line2[] = {-5, 10};
+    stepper_queue_line(2, line_motors, line1, 1000);
+    stepper_queue_line(2, line_motors, line2, 1000);
+    sput_fail_unless(stepper_queue_count() == 2, "stepper_queue_count() == 2");
+    
+    stepper_start_cycle();
+    sput_fail_unless(stepper_cycle_running(), "stepper_cycle_running() == true");
+    sput_fail_unless(stepper_queue_count() == 1, "started: stepper_queue_count() == 1");
+    
+    // последний шаг первого движения
+    timer_tick(500);
+    sput_fail_unless(sm_x.current_pos == 7500*10, "line1: sm_x.current_pos == 7500*10");
+    sput_fail_unless(sm_y.current_pos == 7500*5, "line1: sm_y.current_pos == 7500*5");
+    
+    // на следующем тике загружается второе движение, цикл не завершается
+    timer_tick(1);
+    sput_fail_unless(stepper_cycle_running(), "chained: stepper_cycle_running() == true");
+    sput_fail_unless(stepper_queue_count() == 0, "chained: stepper_queue_count() == 0");
+    
+    // первый шаг второго движения - через 1000мкс после последнего шага первого
+    timer_tick(48);
+    sput_fail_unless(sm_y.current_pos == 7500*5, "line2: no step before 1000us");
+    timer_tick(1);
+    sput_fail_unless(sm_y.current_pos == 7500*6, "line2: first step after 1000us");
+    
+    timer_tick(450);
+    sput_fail_unless(sm_x.current_pos == 7500*5, "line2: sm_x.current_pos == 7500*5");
+    sput_fail_unless(sm_y.current_pos == 7500*15, "line2: sm_y.current_pos == 7500*15");
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "finished: stepper_cycle_running() == false");
+    
+    // #2: движение попало в очередь после завершения цикла -
+    // запускается stepper_start_cycle
+    stepper_queue_line(2, line_motors, line2, 1000);
+    timer_tick(100);
+    sput_fail_unless(sm_y.current_pos == 7500*15, "queued after finish: not started");
+    stepper_start_cycle();
+    timer_tick(500);
+    sput_fail_unless(sm_y.current_pos == 7500*25, "queued after finish: sm_y.current_pos == 7500*25");
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "queued after finish: stepper_cycle_running() == false");
+    
+    // #3: очередь заполнена; задержка меньше допустимой
+    int queued = 0;
+    while(stepper_queue_line(2, line_motors, line1, 1000) && queued < 100) {
+        queued++;
+    }
+    sput_fail_unless(stepper_queue_full(), "stepper_queue_full() == true");
+    sput_fail_unless(stepper_queue_count() == queued, "full: stepper_queue_count() == added moves");
+    
+    // #4: остановка цикла очищает очередь
+    stepper_start_cycle();
+    timer_tick(100);
+    stepper_finish_cycle();
+    sput_fail_unless(stepper_queue_count() == 0, "finish: stepper_queue_count() == 0");
+    sput_fail_unless(!stepper_queue_line(2, line_motors, line1, 100), "small delay: stepper_queue_line() == false");
+}
+
+static void test_cycle_programs() {
+    // следующая программа готовится, пока выполняется текущий цикл,
+    // и запускается в обработчике прерывания сразу после его завершения
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    stepper sm_x, sm_y;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 200, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    sput_fail_unless(!stepper_cycle_pending(), "stepper_cycle_pending() == false");
+    
+    // #1: 10 шагов мотором X с задержкой 1000мкс (50 тиков),
+    // следующая программа - 5 шагов мотором Y
+    prepare_steps(&sm_x, 10, 1000);
+    stepper_start_cycle();
+    timer_tick(100);
+    sput_fail_unless(sm_x.current_pos == 7500*2, "running: sm_x.current_pos == 7500*2");
+    
+    // программа не подготовлена - запускать нечего
+    sput_fail_unless(!stepper_start_cycle(), "empty: stepper_start_cycle() == false");
+    
+    prepare_steps(&sm_y, 5, 1000);
+    sput_fail_unless(sm_y.status == STEPPER_STATUS_IDLE, "prepared: sm_y.status == IDLE");
+    sput_fail_unless(stepper_start_cycle(), "pending: stepper_start_cycle() == true");
+    sput_fail_unless(stepper_cycle_pending(), "stepper_cycle_pending() == true");
+    
+    // следующая программа уже ждет запуска
+    sput_fail_unless(!stepper_start_cycle(), "pending: second stepper_start_cycle() == false");
+    
+    // последний шаг первой программы
+    timer_tick(400);
+    sput_fail_unless(sm_x.current_pos == 7500*10, "program1: sm_x.current_pos == 7500*10");
+    sput_fail_unless(sm_y.current_pos == 0, "program1: sm_y.current_pos == 0");
+    
+    // на следующем тике запускается вторая программа, цикл не завершается
+    timer_tick(1);
+    sput_fail_unless(stepper_cycle_running(), "swapped: stepper_cycle_running() == true");
+    sput_fail_unless(!stepper_cycle_pending(), "swapped: stepper_cycle_pending() == false");
+    sput_fail_unless(sm_x.status == STEPPER_STATUS_FINISHED, "swapped: sm_x.status == FINISHED");
+    sput_fail_unless(sm_y.status == STEPPER_STATUS_RUNNING, "swapped: sm_y.status == RUNNING");
+    
+    // первый шаг второй программы - через 1000мкс после последнего шага первой
+    timer_tick(48);
+    sput_fail_unless(sm_y.current_pos == 0, "program2: no step before 1000us");
+    timer_tick(1);
+    sput_fail_unless(sm_y.current_pos == 7500, "program2: first step after 1000us");
+    
+    timer_tick(200);
+    sput_fail_unless(sm_y.current_pos == 7500*5, "program2: sm_y.current_pos == 7500*5");
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "finished: stepper_cycle_running() == false");
+    
+    // #2: тот же мотор в обеих программах, со сменой направления
+    prepare_steps(&sm_x, -10, 1000);
+    stepper_start_cycle();
+    timer_tick(100);
+    prepare_steps(&sm_x, 10, 1000);
+    sput_fail_unless(sm_x.status == STEPPER_STATUS_RUNNING, "same motor: sm_x.status == RUNNING");
+    sput_fail_unless(stepper_start_cycle(), "same motor: stepper_start_cycle() == true");
+    timer_tick(400);
+    sput_fail_unless(sm_x.current_pos == 0, "same motor: sm_x.current_pos == 0");
+    timer_tick(1);
+    sput_fail_unless(stepper_cycle_running(), "same motor: stepper_cycle_running() == true");
+    timer_tick(500);
+    sput_fail_unless(sm_x.current_pos == 7500*10, "same motor: sm_x.current_pos == 7500*10");
+    timer_tick(1);
+    sput_fail_unless(!stepper_cycle_running(), "same motor: stepper_cycle_running() == false");
+    
+    // #3: программа подготовлена во время цикла, но не поставлена
+    // на запуск - цикл завершается, программу запускает stepper_start_cycle
+    prepare_steps(&sm_x, 5, 1000);
+    stepper_start_cycle();
+    timer_tick(100);
+    prepare_steps(&sm_y, -5, 1000);
+    timer_tick(200);
+    sput_fail_unless(!stepper_cycle_running(), "not scheduled: stepper_cycle_running() == false");
+    sput_fail_unless(sm_y.current_pos == 7500*5, "not scheduled: sm_y.current_pos == 7500*5");
+    stepper_start_cycle();
+    timer_tick(251);
+    sput_fail_unless(sm_y.current_pos == 0, "not scheduled: sm_y.current_pos == 0");
+    sput_fail_unless(!stepper_cycle_running(), "not scheduled: stepper_cycle_running() == false");
+    
+    // #4: остановка цикла отменяет программу, ждущую запуска
+    prepare_steps(&sm_x, 10, 1000);
+    stepper_start_cycle();
+    timer_tick(100);
+    prepare_steps(&sm_y, 10, 1000);
+    stepper_start_cycle();
+    stepper_finish_cycle();
+    sput_fail_unless(!stepper_cycle_pending(), "finish: stepper_cycle_pending() == false");
+    timer_tick(1000);
+    sput_fail_unless(sm_y.current_pos == 0, "finish: sm_y.current_pos == 0");
+    
+    // #5: программа с задержкой меньше допустимой не ставится на запуск
+    prepare_steps(&sm_x, 10, 1000);
+    stepper_start_cycle();
+    prepare_steps(&sm_y, 10, 30);
+    sput_fail_unless(!stepper_start_cycle(), "aliquant delay: stepper_start_cycle() == false");
+    sput_fail_unless(!stepper_cycle_pending(), "aliquant delay: stepper_cycle_pending() == false");
+    stepper_finish_cycle();
+}
+
+/**
+ * Выполнить все отрезки из буфера планировщика, запуская следующий
+ * отрезок сразу после завершения предыдущего (как из главного цикла loop).
+ * @return количество тиков таймера на весь путь
+ */
+static unsigned long planner_run_all() {
+    unsigned long ticks = 0;
+    while((stepper_planner_queued() > 0 || stepper_cycle_running()) && ticks < 1000000) {
+        stepper_planner_run();
+        timer_tick(1);
+        ticks++;
+    }
+    return ticks;
+}
+
+/**
+ * Пройти отрезок prepare_accel_line с места до остановки.
+ * @return количество тиков таймера на весь путь
+ */
+static unsigned long accel_line_run(int motor_count, stepper** smotors, long* step_counts) {
+    unsigned long ticks = 0;
+    prepare_accel_line(motor_count, smotors, step_counts);
+    stepper_start_cycle();
+    while(stepper_cycle_running() && ticks < 1000000) {
+        timer_tick(1);
+        ticks++;
+    }
+    return ticks;
+}
+
+static void test_planner() {
+    // планировщик движения по ломаной линии: скорость в точках стыка
+    // отрезков по углу между ними
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    // моторы - минимальная задержка между шагами 200 мкс (5000 шагов/с),
+    // ускорение 250000 шагов/с^2: разгон до максимальной скорости
+    // за 50 шагов, 20мс
+    stepper sm_x, sm_y;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper_accel(&sm_x, 250000);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 200, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper_accel(&sm_y, 250000);
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    static stepper* planner_motors[] = {&sm_x, &sm_y};
+    
+    // для сравнения: один отрезок на 600 шагов и 2 отрезка по 300 шагов
+    // с остановкой в точке стыка (разгон и торможение по 20мс)
+    long line1[] = {300, 0};
+    long line600[] = {-600, 0};
+    unsigned long line600_ticks = accel_line_run(2, planner_motors, line600);
+    unsigned long stop_ticks = accel_line_run(2, planner_motors, line1) +
+        accel_line_run(2, planner_motors, line1);
+    sput_fail_unless(sm_x.current_pos == 0, "sm_x.current_pos == 0");
+    sput_fail_unless(stop_ticks > line600_ticks + 15000/timer_period_us,
+        "stop and go: path time > 600 steps + 15ms");
+    
+    stepper_planner_init(2, planner_motors, 7500*5);
+    
+    // #1: 2 отрезка по одной прямой - без остановки в точке стыка,
+    // как один отрезок на 600 шагов
+    stepper_planner_add_line(line1);
+    stepper_planner_add_line(line1);
+    sput_fail_unless(stepper_planner_queued() == 2, "straight: stepper_planner_queued() == 2");
+    unsigned long ticks = planner_run_all();
+    sput_fail_unless(sm_x.current_pos == 7500*600, "straight: sm_x.current_pos == 7500*600");
+    sput_fail_unless(sm_y.current_pos == 0, "straight: sm_y.current_pos == 0");
+    sput_fail_unless(ticks < line600_ticks + 1000/timer_period_us,
+        "straight: path time == 600 steps path time");
+    
+    // #2: поворот на 90 градусов - в точке стыка тормозим,
+    // но не до остановки
+    long line2[] = {0, 300};
+    stepper_planner_add_line(line1);
+    stepper_planner_add_line(line2);
+    ticks = planner_run_all();
+    sput_fail_unless(sm_x.current_pos == 7500*900, "corner: sm_x.current_pos == 7500*900");
+    sput_fail_unless(sm_y.current_pos == 7500*300, "corner: sm_y.current_pos == 7500*300");
+    sput_fail_unless(ticks < stop_ticks, "corner: path time < stop and go");
+    sput_fail_unless(ticks > line600_ticks, "corner: path time > straight");
+    
+    // #3: разворот назад - полная остановка в точке стыка
+    long line3[] = {0, -300};
+    stepper_planner_add_line(line2);
+    stepper_planner_add_line(line3);
+    ticks = planner_run_all();
+    sput_fail_unless(sm_y.current_pos == 7500*300, "reverse: sm_y.current_pos == 7500*300");
+    sput_fail_unless(ticks > stop_ticks - 3 && ticks < stop_ticks + 3, "reverse: path time == stop and go");
+    
+    // #4: буфер заполнен
+    int queued = 0;
+    while(stepper_planner_add_line(line1) && queued < 100) {
+        queued++;
+    }
+    sput_fail_unless(stepper_planner_full(), "stepper_planner_full() == true");
+    sput_fail_unless(stepper_planner_queued() == queued, "full: stepper_planner_queued() == added lines");
+    sput_fail_unless(!stepper_planner_add_line(line1), "full: stepper_planner_add_line() == false");
+    stepper_planner_init(2, planner_motors, 7500*5);
+    sput_fail_unless(stepper_planner_queued() == 0, "init: stepper_planner_queued() == 0");
+}
+
+/**
+ * Выполнить G-код целиком: символы передаются интерпретатору, как только
+ * он готов их принять, главный цикл и таймер идут параллельно.
+ * @return количество тиков таймера на весь G-код
+ */
+static unsigned long gcode_run_all(const char* gcode) {
+    unsigned long ticks = 0;
+    while((*gcode != 0 || !stepper_gcode_ready() || stepper_cycle_running()) && ticks < 10000000) {
+        while(*gcode != 0 && stepper_gcode_put(*gcode)) {
+            gcode++;
+        }
+        stepper_gcode_run();
+        timer_tick(1);
+        ticks++;
+    }
+    return ticks;
+}
+
+static void test_gcode() {
+    // интерпретатор G-кода: строки превращаются в вызовы prepare_xxx
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    // distance_per_step - в нанометрах (7.5 микрометров на шаг),
+    // у X концевой датчик min на пине 11
+    stepper sm_x, sm_y, sm_z;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, 11, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 200, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_z, 'Z', 2, 3, 4, false, 200, 7500);
+    init_stepper_ends(&sm_z, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    static stepper* gcode_motors[] = {&sm_x, &sm_y, &sm_z};
+    stepper_gcode_init(3, gcode_motors, 1000000);
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // #1: G1 со скоростью подачи: 10мм = 1333.3 шага, 5мм = 666.7 шага
+    unsigned long ticks = gcode_run_all("G21 G90 (mm, absolute)\nG1 X10 Y5.0 F600\n");
+    sput_fail_unless(stepper_gcode_error() == GCODE_ERROR_NONE, "G1: stepper_gcode_error() == NONE");
+    sput_fail_unless(sm_x.current_pos == 7500*1333, "G1: sm_x.current_pos == 7500*1333");
+    sput_fail_unless(sm_y.current_pos == 7500*667, "G1: sm_y.current_pos == 7500*667");
+    // путь 11.18мм со скоростью 600мм/мин - 1.118с
+    sput_fail_unless(ticks*timer_period_us > 1118034*0.98 && ticks*timer_period_us < 1118034*1.02,
+        "G1: cycle time == path / feed");
+    
+    // #2: G91 - относительные координаты, G0 - максимальная скорость
+    gcode_run_all("G91\nG0 X-1 Z2 ; relative\nG90\n");
+    sput_fail_unless(sm_x.current_pos == 7500*(1333 - 133), "G91 G0: sm_x.current_pos == 7500*1200");
+    sput_fail_unless(sm_z.current_pos == 7500*267, "G91 G0: sm_z.current_pos == 7500*267");
+    
+    // #3: G92 - новая позиция, G3 - четверть окружности радиусом 15мм = 2000 шагов
+    gcode_run_all("G92 X0 Y0 Z0\nG3 X-15 Y15 I-15 J0 F1200\n");
+    sput_fail_unless(stepper_gcode_error() == GCODE_ERROR_NONE, "G3: stepper_gcode_error() == NONE");
+    sput_fail_unless(sm_x.current_pos == -7500*2000, "G3: sm_x.current_pos == -7500*2000");
+    sput_fail_unless(sm_y.current_pos == 7500*2000, "G3: sm_y.current_pos == 7500*2000");
+    sput_fail_unless(sm_z.current_pos == 0, "G3: sm_z.current_pos == 0");
+    
+    // #4: строка без G - в последнем режиме перемещения
+    gcode_run_all("G1 X0 Y0\nX1\n");
+    sput_fail_unless(sm_x.current_pos == 7500*133 && sm_y.current_pos == 0, "modal G1: x == 133 steps, y == 0");
+    
+    // #5: следующее движение готовится, пока идет текущее, дальше
+    // интерпретатор не принимает символы, пока строка ждет выполнения
+    const char* chain = "G1 X2\nG1 X3\nG1 X4\nG1 X5\n";
+    int accepted = stepper_gcode_puts(chain);
+    sput_fail_unless(accepted == 18, "chain: 3 lines accepted");
+    sput_fail_unless(stepper_cycle_pending(), "chain: stepper_cycle_pending() == true");
+    sput_fail_unless(!stepper_gcode_ready(), "chain: stepper_gcode_ready() == false");
+    gcode_run_all(chain + accepted);
+    sput_fail_unless(sm_x.current_pos == 7500*667, "chain: sm_x.current_pos == 7500*667");
+    
+    // #6: G4 - пауза P миллисекунд
+    dbg_micros = 0;
+    sput_fail_unless(stepper_gcode_puts("G4 P500\n") == 8, "G4: line accepted");
+    sput_fail_unless(!stepper_gcode_run(), "G4: still waiting");
+    dbg_micros += 499999;
+    sput_fail_unless(!stepper_gcode_run(), "G4: still waiting after 499.999ms");
+    dbg_micros += 1;
+    sput_fail_unless(stepper_gcode_run(), "G4: done after 500ms");
+    dbg_micros = 0;
+    
+    // #7: ошибки - строка пропускается, интерпретатор продолжает
+    unsigned long lines = stepper_gcode_line_count();
+    gcode_run_all("G1 X\n");
+    sput_fail_unless(stepper_gcode_error() == GCODE_ERROR_SYNTAX, "G1 X: stepper_gcode_error() == SYNTAX");
+    gcode_run_all("M3 S1000\n");
+    sput_fail_unless(stepper_gcode_error() == GCODE_ERROR_UNSUPPORTED, "M3: stepper_gcode_error() == UNSUPPORTED");
+    gcode_run_all("G1 A5\n");
+    sput_fail_unless(stepper_gcode_error() == GCODE_ERROR_NO_MOTOR, "G1 A5: stepper_gcode_error() == NO_MOTOR");
+    gcode_run_all("G2 X1 Y1\n");
+    sput_fail_unless(stepper_gcode_error() == GCODE_ERROR_ARC, "G2 without center: stepper_gcode_error() == ARC");
+    gcode_run_all("\n(empty)\nG1 X0\n");
+    sput_fail_unless(stepper_gcode_error() == GCODE_ERROR_NONE, "G1 X0: stepper_gcode_error() == NONE");
+    sput_fail_unless(sm_x.current_pos == 0, "G1 X0: sm_x.current_pos == 0");
+    sput_fail_unless(stepper_gcode_line_count() == lines + 5, "stepper_gcode_line_count() == lines + 5");
+    
+    // #8: G28 - к концевому датчику min, позиция - min_pos
+    gcode_run_all("G1 X3\n");
+    stepper_gcode_puts("G28 X\n");
+    timer_tick(1000);
+    sput_fail_unless(stepper_cycle_running() && !stepper_gcode_ready(), "G28: sm_x goes to min");
+    digitalWrite(11, HIGH);
+    stepper_end_changed(&sm_x);
+    gcode_run_all("");
+    digitalWrite(11, LOW);
+    stepper_end_changed(&sm_x);
+    sput_fail_unless(stepper_gcode_ready(), "G28: done");
+    sput_fail_unless(sm_x.current_pos == 0, "G28: sm_x.current_pos == min_pos");
+    gcode_run_all("G91 G1 X1\nG90\n");
+    sput_fail_unless(sm_x.current_pos == 7500*133, "G28: next move starts from min_pos");
+    
+    // #9: номер строки, комментарии и строки без движения (X и Y уже
+    // на месте) выполняются сразу, не дожидаясь таймера
+    // (скорость разбора - test/stepper_bench.cpp)
+    gcode_run_all("G1 X0 Y0\n");
+    lines = stepper_gcode_line_count();
+    for(int i = 0; i < 1000; i++) {
+        stepper_gcode_puts("N10 G1 X0.000 Y-0.0 F1200.5 (no motion) ; comment\n");
+    }
+    sput_fail_unless(stepper_gcode_line_count() == lines + 1000, "no motion: all lines executed");
+    sput_fail_unless(stepper_gcode_error() == GCODE_ERROR_NONE, "no motion: stepper_gcode_error() == NONE");
+    sput_fail_unless(!stepper_cycle_running(), "no motion: stepper_cycle_running() == false");
+    sput_fail_unless(sm_x.current_pos == 0 && sm_y.current_pos == 0, "no motion: x == y == 0");
+}
+
+// ответы устройства по протоколу stepper_proto
+static unsigned char proto_replies[256];
+static int proto_reply_size = 0;
+
+static void proto_reply(const unsigned char* data, int size, void*) {
+    for(int i = 0; i < size && proto_reply_size < (int)sizeof(proto_replies); i++) {
+        proto_replies[proto_reply_size++] = data[i];
+    }
+}
+
+/**
+ * Последний ответ устройства: тип кадра (0 - ответов нет), seq
+ * и кредит из payload.
+ */
+static unsigned char proto_last_reply(unsigned char* seq, unsigned char* credits) {
+    unsigned char type = 0;
+    int pos = 0;
+    while(pos + 5 <= proto_reply_size) {
+        int len = proto_replies[pos + 1];
+        if(proto_replies[pos] == STEPPER_PROTO_SYNC && pos + 5 + len <= proto_reply_size &&
+                stepper_proto_crc8(proto_replies + pos + 1, 3 + len) == proto_replies[pos + 4 + len]) {
+            type = proto_replies[pos + 3];
+            *seq = proto_replies[pos + 4];
+            *credits = len > 1 ? proto_replies[pos + 5] : 0;
+        }
+        pos += 5 + len;
+    }
+    proto_reply_size = 0;
+    return type;
+}
+
+static int proto_send(const unsigned char* data, int size) {
+    int sent = 0;
+    while(sent < size && stepper_proto_put(data[sent])) {
+        sent++;
+    }
+    return sent;
+}
+
+static void test_proto() {
+    // двоичный протокол: кадры с пачками отрезков в очередь движений
+    
+    // настройки частоты таймера
+    unsigned long timer_period_us = 20;
+    stepper_configure_timer(timer_period_us, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    
+    stepper sm_x, sm_y, sm_z;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 200, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_z, 'z', 2, 3, 4, false, 200, 7500);
+    init_stepper_ends(&sm_z, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    static stepper* proto_motors[] = {&sm_x, &sm_y, &sm_z};
+    stepper_proto_init(3, proto_motors, proto_reply);
+    proto_reply_size = 0;
+    unsigned char seq, credits;
+    
+    // на всякий случай: цикл не должен быть запущен
+    // (если запущен, то косяк в предыдущем тесте)
+    sput_fail_unless(!stepper_cycle_running(), "stepper_cycle_running() == false");
+    
+    // #1: 40 отрезков в одном кадре: зигзаг по X и Y, Z вверх на каждом
+    // четвертом, задержка меняется раз в 10 отрезков
+    unsigned char data[STEPPER_PROTO_FRAME_SIZE + STEPPER_PROTO_FRAME_OVERHEAD];
+    stepper_proto_frame_t frame;
+    stepper_proto_frame_begin(&frame, data, 0);
+    long x = 0, y = 0, z = 0;
+    int segments = 0;
+    for(int i = 0; i < 40; i++) {
+        long steps[] = {i % 2 == 0 ? 100 : -60, 40 + i, i % 4 == 0 ? 1 : 0};
+        if(!stepper_proto_frame_add(&frame, 3, steps, 400 + (i / 10) * 100)) {
+            break;
+        }
+        x += steps[0];
+        y += steps[1];
+        z += steps[2];
+        segments++;
+    }
+    int size = stepper_proto_frame_end(&frame);
+    sput_fail_unless(segments == 40, "40 segments fit in one frame");
+    // "G1 X0.750 Y0.300" - больше 15 байт на отрезок
+    sput_fail_unless(size < segments * 7, "frame size < 7 bytes per segment");
+    
+    sput_fail_unless(proto_send(data, size) == size, "frame accepted");
+    sput_fail_unless(proto_last_reply(&seq, &credits) == STEPPER_PROTO_ACK && seq == 0 &&
+        credits == STEPPER_PROTO_FRAMES - 1, "ACK seq=0, credits=FRAMES-1");
+    sput_fail_unless(stepper_proto_pending() == 1, "stepper_proto_pending() == 1");
+    
+    unsigned long ticks = 0;
+    while((stepper_proto_pending() > 0 || stepper_cycle_running()) && ticks < 10000000) {
+        stepper_proto_run();
+        timer_tick(1);
+        ticks++;
+    }
+    sput_fail_unless(stepper_proto_error() == PROTO_ERROR_NONE, "stepper_proto_error() == NONE");
+    sput_fail_unless(sm_x.current_pos == 7500*x, "sm_x.current_pos == sum of segments");
+    sput_fail_unless(sm_y.current_pos == 7500*y, "sm_y.current_pos == sum of segments");
+    sput_fail_unless(sm_z.current_pos == 7500*z, "sm_z.current_pos == sum of segments");
+    sput_fail_unless(proto_last_reply(&seq, &credits) == STEPPER_PROTO_ACK &&
+        credits == STEPPER_PROTO_FRAMES, "frame done: ACK with all credits");
+    // ведущий мотор - X или Y (больше шагов), задержки 400..700мкс
+    unsigned long expected_us = 0;
+    for(int i = 0; i < 40; i++) {
+        unsigned long lead = i % 2 == 0 && 40 + i < 100 ? 100 : (i % 2 == 1 && 40 + i < 60 ? 60 : 40 + i);
+        expected_us += lead * (400 + (i / 10) * 100);
+    }
+    sput_fail_unless(ticks*timer_period_us > expected_us*0.99 && ticks*timer_period_us < expected_us*1.01,
+        "segments run back to back");
+    
+    // #2: ошибка контрольной суммы - NAK с ожидаемым номером кадра,
+    // повтор кадра принимается
+    stepper_proto_frame_begin(&frame, data, 1);
+    long steps[] = {10, 0, 0};
+    stepper_proto_frame_add(&frame, 3, steps, 400);
+    size = stepper_proto_frame_end(&frame);
+    data[5] ^= 0x01;
+    proto_send(data, size);
+    sput_fail_unless(proto_last_reply(&seq, &credits) == STEPPER_PROTO_NAK && seq == 1,
+        "bad crc: NAK seq=1");
+    sput_fail_unless(stepper_proto_error() == PROTO_ERROR_CRC, "bad crc: stepper_proto_error() == CRC");
+    data[5] ^= 0x01;
+    proto_send(data, size);
+    sput_fail_unless(proto_last_reply(&seq, &credits) == STEPPER_PROTO_ACK && seq == 1, "resent: ACK seq=1");
+    
+    // #3: повтор принятого кадра (потерялся ACK) - еще один ACK, кадр не выполняется дважды
+    proto_send(data, size);
+    sput_fail_unless(proto_last_reply(&seq, &credits) == STEPPER_PROTO_ACK && seq == 1, "duplicate: ACK seq=1");
+    sput_fail_unless(stepper_proto_pending() == 1, "duplicate: stepper_proto_pending() == 1");
+    
+    // #4: пропущен кадр - NAK с ожидаемым номером
+    stepper_proto_frame_begin(&frame, data, 3);
+    stepper_proto_frame_add(&frame, 3, steps, 400);
+    size = stepper_proto_frame_end(&frame);
+    proto_send(data, size);
+    sput_fail_unless(proto_last_reply(&seq, &credits) == STEPPER_PROTO_NAK && seq == 2, "gap: NAK seq=2");
+    
+    // #5: кредит исчерпан - начало следующего кадра не принимается
+    for(int i = 0; i < STEPPER_PROTO_FRAMES - 1; i++) {
+        stepper_proto_frame_begin(&frame, data, 2 + i);
+        stepper_proto_frame_add(&frame, 3, steps, 400);
+        size = stepper_proto_frame_end(&frame);
+        proto_send(data, size);
+    }
+    sput_fail_unless(proto_last_reply(&seq, &credits) == STEPPER_PROTO_ACK && credits == 0, "window full: credits == 0");
+    sput_fail_unless(!stepper_proto_ready(), "window full: stepper_proto_ready() == false");
+    stepper_proto_frame_begin(&frame, data, 1 + STEPPER_PROTO_FRAMES);
+    stepper_proto_frame_add(&frame, 3, steps, 400);
+    size = stepper_proto_frame_end(&frame);
+    sput_fail_unless(proto_send(data, size) == 0, "window full: frame not accepted");
+    
+    long x0 = sm_x.current_pos;
+    while((stepper_proto_pending() > 0 || stepper_cycle_running()) && ticks < 20000000) {
+        stepper_proto_run();
+        timer_tick(1);
+        ticks++;
+    }
+    sput_fail_unless(sm_x.current_pos == x0 + 7500*10*STEPPER_PROTO_FRAMES, "window: all frames done");
+    sput_fail_unless(proto_send(data, size) == size, "window free: frame accepted");
+    
+    // #6: RESET - новая сессия, принятые кадры отброшены
+    size = stepper_proto_frame_control(data, STEPPER_PROTO_RESET, 200);
+    proto_send(data, size);
+    sput_fail_unless(stepper_proto_pending() == 0, "reset: stepper_proto_pending() == 0");
+    sput_fail_unless(proto_last_reply(&seq, &credits) == STEPPER_PROTO_ACK && seq == 200 &&
+        credits == STEPPER_PROTO_FRAMES, "reset: ACK seq=200, all credits");
+}
+
+/////////////////////////////////////////////////////////
+// test suites
+
+/** Stepper cycle lifecycle */
+int stepper_test_suite_lifecycle() {
+    sput_start_testing();
+
+    sput_enter_suite("Stepper cycle lifecycle");
+    sput_run_test(test_lifecycle);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Stepper cycle timer period settings */
+int stepper_test_suite_timer_period() {
+    sput_start_testing();
+
+    sput_enter_suite("Stepper cycle timer period settings");
+    sput_run_test(test_timer_period);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Stepper cycle timer period is aliquant part of motor step pulse delay */
+int stepper_test_suite_timer_period_aliquant_step_delay() {
+    sput_start_testing();
+    
+    sput_enter_suite("Stepper cycle timer period is aliquant part of motor step pulse delay");
+    sput_run_test(test_timer_period_aliquant_step_delay);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Single motor: 3 steps tick by tick on max speed */
+int stepper_test_suite_max_speed_tick_by_tick() {
+    sput_start_testing();
+    
+    sput_enter_suite("Single motor: 3 steps tick by tick on max speed");
+    sput_run_test(test_max_speed_tick_by_tick);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Single motor: 30000 steps on max speed */
+int stepper_test_suite_max_speed_30000steps() {
+    sput_start_testing();
+    
+    sput_enter_suite("Single motor: 30000 steps on max speed");
+    sput_run_test(test_max_speed_30000steps);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Single motor: 5 steps tick by tick on aliquant speed */
+int stepper_test_suite_aliquant_speed_tick_by_tick() {
+    sput_start_testing();
+    
+    sput_enter_suite("Single motor: 5 steps tick by tick on aliquant speed");
+    sput_run_test(test_aliquant_speed_tick_by_tick);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** 3 motors: draw triangle */
+int stepper_test_suite_draw_triangle() {
+    sput_start_testing();
+    
+    sput_enter_suite("3 motors: draw triangle");
+    sput_run_test(test_draw_triangle);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Small step delay error handlers */
+int stepper_test_suite_small_step_delay_handlers() {
+    sput_start_testing();
+    
+    sput_enter_suite("Small step delay error handlers");
+    sput_run_test(test_small_step_delay_handlers);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Moving with variable speed: buffered steps tick by tick */
+int stepper_test_suite_buffered_steps_tick_by_tick() {
+    sput_start_testing();
+    
+    sput_enter_suite("Moving with variable speed: buffered steps tick by tick");
+    sput_run_test(test_buffered_steps_tick_by_tick);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Moving with variable speed: buffered steps */
+int stepper_test_suite_buffered_steps() {
+    sput_start_testing();
+    
+    sput_enter_suite("Moving with variable speed: buffered steps");
+    sput_run_test(test_buffered_steps);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Step-dir driver std divider modes: 1/1, 1/18, 1/16, 1/32 */
+int stepper_test_suite_driver_std_modes() {
+    sput_start_testing();
+    
+    sput_enter_suite("Step-dir driver std divider modes: 1/1, 1/18, 1/16, 1/32");
+    sput_run_test(test_driver_std_modes);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Step-dir driver std divider modes for 2 motors at a time */
+int stepper_test_suite_driver_std_modes_2motors() {
+    sput_start_testing();
+    
+    sput_enter_suite("Step-dir driver std divider modes for 2 motors at a time");
+    sput_run_test(test_driver_std_modes_2motors);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Single motor: exit bounds (issue #1) - whirl */
+int stepper_test_suite_exit_bounds_issue1_whirl() {
+    sput_start_testing();
+    
+    sput_enter_suite("Single motor: exit bounds (issue #1) - whirl");
+    sput_run_test(test_exit_bounds_issue1_whirl);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Single motor: exit bounds (issue #1) - steps */
+int stepper_test_suite_exit_bounds_issue1_steps() {
+    sput_start_testing();
+    
+    sput_enter_suite("Single motor: exit bounds (issue #1) - steps");
+    sput_run_test(test_exit_bounds_issue1_steps);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Single motor: exit bounds (issue #9) - steps */
+int stepper_test_suite_exit_bounds_issue9_steps() {
+    sput_start_testing();
+    
+    sput_enter_suite("Single motor: exit bounds (issue #9) - steps");
+    sput_run_test(test_exit_bounds_issue9_steps);
+
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Single motor: test square signal (issue #16) */
+int stepper_test_suite_square_sig_issue16() {
+    sput_start_testing();
+    
+    sput_enter_suite("Single motor: test square signal (issue #16)");
+    sput_run_test(test_square_sig_issue16);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+
+/** Timer event-driven mode */
+int stepper_test_suite_timer_event_driven() {
+    sput_start_testing();
+    
+    sput_enter_suite("Timer event-driven mode");
+    sput_run_test(test_timer_event_driven);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+
+/** Multi-axis line: Bresenham (DDA) */
+int stepper_test_suite_line_dda() {
+    sput_start_testing();
+    
+    sput_enter_suite("Multi-axis line: Bresenham (DDA)");
+    sput_run_test(test_line_dda);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+
+/** Hard end switches: fast port reads */
+int stepper_test_suite_hard_end_fast_io() {
+    sput_start_testing();
+    
+    sput_enter_suite("Hard end switches: fast port reads");
+    sput_run_test(test_hard_end_fast_io);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+
+/** Hard end switches: pin change interrupts */
+int stepper_test_suite_hard_end_interrupts() {
+    sput_start_testing();
+    
+    sput_enter_suite("Hard end switches: pin change interrupts");
+    sput_run_test(test_hard_end_interrupts);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+
+/** Hard end switches: shift register noise filter */
+int stepper_test_suite_hard_end_filter() {
+    sput_start_testing();
+    
+    sput_enter_suite("Hard end switches: shift register noise filter");
+    sput_run_test(test_hard_end_filter);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+
+/** Batched step pulses: one port write for all motors on the port */
+int stepper_test_suite_batched_step_pulses() {
+    sput_start_testing();
+    
+    sput_enter_suite("Batched step pulses: one port write for all motors on the port");
+    sput_run_test(test_batched_step_pulses);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+
+/** Trapezoidal acceleration: prepare_accel_steps */
+int stepper_test_suite_accel_steps() {
+    sput_start_testing();
+    
+    sput_enter_suite("Trapezoidal acceleration: prepare_accel_steps");
+    sput_run_test(test_accel_steps);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Jerk-limited acceleration (S-curve): prepare_scurve_steps */
+int stepper_test_suite_scurve_steps() {
+    sput_start_testing();
+    
+    sput_enter_suite("Jerk-limited acceleration (S-curve): prepare_scurve_steps");
+    sput_run_test(test_scurve_steps);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Circular arc: integer midpoint interpolation */
+int stepper_test_suite_arc() {
+    sput_start_testing();
+    
+    sput_enter_suite("Circular arc: integer midpoint interpolation");
+    sput_run_test(test_arc);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Helix: arc with a synchronized linear axis */
+int stepper_test_suite_helix() {
+    sput_start_testing();
+    
+    sput_enter_suite("Helix: arc with a synchronized linear axis");
+    sput_run_test(test_helix);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Cubic Bezier curve: forward differencing */
+int stepper_test_suite_bezier() {
+    sput_start_testing();
+    
+    sput_enter_suite("Cubic Bezier curve: forward differencing");
+    sput_run_test(test_bezier);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Streaming buffer: refillable step series */
+int stepper_test_suite_stream_steps() {
+    sput_start_testing();
+    
+    sput_enter_suite("Streaming buffer: refillable step series");
+    sput_run_test(test_stream_steps);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Dynamic step delays: prefetched outside the ISR */
+int stepper_test_suite_dynamic_prefetch() {
+    sput_start_testing();
+    
+    sput_enter_suite("Dynamic step delays: prefetched outside the ISR");
+    sput_run_test(test_dynamic_prefetch);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Heavy step work: staggered across timer ticks */
+int stepper_test_suite_step_work_limit() {
+    sput_start_testing();
+    
+    sput_enter_suite("Heavy step work: staggered across timer ticks");
+    sput_run_test(test_step_work_limit);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** ISR profile: handler time histogram, ticks by phase, per-motor work */
+int stepper_test_suite_isr_profile() {
+    sput_start_testing();
+    
+    sput_enter_suite("ISR profile: handler time histogram, ticks by phase, per-motor work");
+    sput_run_test(test_isr_profile);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Step trace: ring buffer of step events */
+int stepper_test_suite_trace() {
+    sput_start_testing();
+    
+    sput_enter_suite("Step trace: ring buffer of step events");
+    sput_run_test(test_trace);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Move queue: chained moves without stopping the timer */
+int stepper_test_suite_move_queue() {
+    sput_start_testing();
+    
+    sput_enter_suite("Move queue: chained moves without stopping the timer");
+    sput_run_test(test_move_queue);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Double-buffered cycle programs: prepare the next cycle while running */
+int stepper_test_suite_cycle_programs() {
+    sput_start_testing();
+    
+    sput_enter_suite("Double-buffered cycle programs: prepare the next cycle while running");
+    sput_run_test(test_cycle_programs);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Look-ahead planner: junction speeds */
+int stepper_test_suite_planner() {
+    sput_start_testing();
+    
+    sput_enter_suite("Look-ahead planner: junction speeds");
+    sput_run_test(test_planner);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** G-code interpreter: streaming parser on top of prepare_xxx */
+int stepper_test_suite_gcode() {
+    sput_start_testing();
+    
+    sput_enter_suite("G-code interpreter: streaming parser on top of prepare_xxx");
+    sput_run_test(test_gcode);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+/** Binary motion protocol: batched segments with windowed ack */
+int stepper_test_suite_proto() {
+    sput_start_testing();
+    
+    sput_enter_suite("Binary motion protocol: batched segments with windowed ack");
+    sput_run_test(test_proto);
+    
+    sput_finish_testing();
+    return sput_get_return_value();
+}
+
+
+/** All tests in one bundle */
+int stepper_test_suite() {
+    sput_start_testing();
+
+    sput_enter_suite("Stepper cycle lifecycle");
+    sput_run_test(test_lifecycle);
+    
+    sput_enter_suite("Stepper cycle timer period settings");
+    sput_run_test(test_timer_period);
+    
+    sput_enter_suite("Stepper cycle timer period is aliquant part of motor step pulse delay");
+    sput_run_test(test_timer_period_aliquant_step_delay);
+    
+    sput_enter_suite("Single motor: 3 steps tick by tick on max speed");
+    sput_run_test(test_max_speed_tick_by_tick);
+    
+    sput_enter_suite("Single motor: 30000 steps on max speed");
+    sput_run_test(test_max_speed_30000steps);
+    
+    sput_enter_suite("Single motor: 5 steps tick by tick on aliquant speed");
+    sput_run_test(test_aliquant_speed_tick_by_tick);
+    
+    sput_enter_suite("3 motors: draw triangle");
+    sput_run_test(test_draw_triangle);
+    
+    sput_enter_suite("Small step delay error handlers");
+    sput_run_test(test_small_step_delay_handlers);
+    
+    sput_enter_suite("Moving with variable speed: buffered steps tick by tick");
+    sput_run_test(test_buffered_steps_tick_by_tick);
+    
+    sput_enter_suite("Moving with variable speed: buffered steps");
+    sput_run_test(test_buffered_steps);
+    
+    
+    sput_enter_suite("Step-dir driver std divider modes: 1/1, 1/18, 1/16, 1/32");
+    sput_run_test(test_driver_std_modes);
+    
+    sput_enter_suite("Step-dir driver std divider modes for 2 motors at a time");
+    sput_run_test(test_driver_std_modes_2motors);
+    
+    
+    sput_enter_suite("Single motor: exit bounds (issue #1) - whirl");
+    sput_run_test(test_exit_bounds_issue1_whirl);
+    
+    sput_enter_suite("Single motor: exit bounds (issue #1) - steps");
+    sput_run_test(test_exit_bounds_issue1_steps);
     
     sput_enter_suite("Single motor: exit bounds (issue #9) - steps");
     sput_run_test(test_exit_bounds_issue9_steps);
@@ -2132,6 +4705,69 @@ int stepper_test_suite() {
     sput_enter_suite("Single motor: test square signal (issue #16)");
     sput_run_test(test_square_sig_issue16);
     
+    sput_enter_suite("Timer event-driven mode");
+    sput_run_test(test_timer_event_driven);
+    
+    sput_enter_suite("Multi-axis line: Bresenham (DDA)");
+    sput_run_test(test_line_dda);
+    
+    sput_enter_suite("Hard end switches: fast port reads");
+    sput_run_test(test_hard_end_fast_io);
+    
+    sput_enter_suite("Hard end switches: pin change interrupts");
+    sput_run_test(test_hard_end_interrupts);
+    
+    sput_enter_suite("Hard end switches: shift register noise filter");
+    sput_run_test(test_hard_end_filter);
+    
+    sput_enter_suite("Batched step pulses: one port write for all motors on the port");
+    sput_run_test(test_batched_step_pulses);
+    
+    sput_enter_suite("Trapezoidal acceleration: prepare_accel_steps");
+    sput_run_test(test_accel_steps);
+    
+    sput_enter_suite("Jerk-limited acceleration (S-curve): prepare_scurve_steps");
+    sput_run_test(test_scurve_steps);
+    
+    sput_enter_suite("Streaming buffer: refillable step series");
+    sput_run_test(test_stream_steps);
+    
+    sput_enter_suite("Dynamic step delays: prefetched outside the ISR");
+    sput_run_test(test_dynamic_prefetch);
+    
+    sput_enter_suite("Heavy step work: staggered across timer ticks");
+    sput_run_test(test_step_work_limit);
+    
+    sput_enter_suite("ISR profile: handler time histogram, ticks by phase, per-motor work");
+    sput_run_test(test_isr_profile);
+    
+    sput_enter_suite("Step trace: ring buffer of step events");
+    sput_run_test(test_trace);
+    
+    sput_enter_suite("Circular arc: integer midpoint interpolation");
+    sput_run_test(test_arc);
+    
+    sput_enter_suite("Helix: arc with a synchronized linear axis");
+    sput_run_test(test_helix);
+    
+    sput_enter_suite("Cubic Bezier curve: forward differencing");
+    sput_run_test(test_bezier);
+    
+    sput_enter_suite("Move queue: chained moves without stopping the timer");
+    sput_run_test(test_move_queue);
+    
+    sput_enter_suite("Double-buffered cycle programs: prepare the next cycle while running");
+    sput_run_test(test_cycle_programs);
+    
+    sput_enter_suite("Look-ahead planner: junction speeds");
+    sput_run_test(test_planner);
+    
+    sput_enter_suite("G-code interpreter: streaming parser on top of prepare_xxx");
+    sput_run_test(test_gcode);
+    
+    sput_enter_suite("Binary motion protocol: batched segments with windowed ack");
+    sput_run_test(test_proto);
+    
     
     sput_finish_testing();
     return sput_get_return_value();
@@ -47,6 +47,69 @@ int stepper_test_suite_exit_bounds_issue9_steps();
 /** Single motor: test square signal (issue #16) */
 int stepper_test_suite_square_sig_issue16();
 
+/** Timer event-driven mode */
+int stepper_test_suite_timer_event_driven();
+
+/** Multi-axis line: Bresenham (DDA) */
+int stepper_test_suite_line_dda();
+
+/** Hard end switches: fast port reads */
+int stepper_test_suite_hard_end_fast_io();
+
+/** Hard end switches: pin change interrupts */
+int stepper_test_suite_hard_end_interrupts();
+
+/** Hard end switches: shift register noise filter */
+int stepper_test_suite_hard_end_filter();
+
+/** Batched step pulses: one port write for all motors on the port */
+int stepper_test_suite_batched_step_pulses();
+
+/** Trapezoidal acceleration: prepare_accel_steps */
+int stepper_test_suite_accel_steps();
+
+/** Jerk-limited acceleration (S-curve): prepare_scurve_steps */
+int stepper_test_suite_scurve_steps();
+
+/** Streaming buffer: refillable step series */
+int stepper_test_suite_stream_steps();
+
+/** Dynamic step delays: prefetched outside the ISR */
+int stepper_test_suite_dynamic_prefetch();
+
+/** Heavy step work: staggered across timer ticks */
+int stepper_test_suite_step_work_limit();
+
+/** ISR profile: handler time histogram, ticks by phase, per-motor work */
+int stepper_test_suite_isr_profile();
+
+/** Step trace: ring buffer of step events */
+int stepper_test_suite_trace();
+
+/** Circular arc: integer midpoint interpolation */
+int stepper_test_suite_arc();
+
+/** Helix: arc with a synchronized linear axis */
+int stepper_test_suite_helix();
+
+/** Cubic Bezier curve: forward differencing */
+int stepper_test_suite_bezier();
+
+/** Move queue: chained moves without stopping the timer */
+int stepper_test_suite_move_queue();
+
+/** Double-buffered cycle programs: prepare the next cycle while running */
+int stepper_test_suite_cycle_programs();
+
+/** Look-ahead planner: junction speeds */
+int stepper_test_suite_planner();
+
+/** G-code interpreter: streaming parser on top of prepare_xxx */
+int stepper_test_suite_gcode();
+
+/** Binary motion protocol: batched segments with windowed ack */
+int stepper_test_suite_proto();
+
 ///////
 
 /** All tests in one bundle */
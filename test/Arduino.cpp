@@ -1,9 +1,24 @@
+#include <stddef.h>
+
+#include "stepper_fast_io.h"
+
 // сохраненные значение пинов
 // для digitalWrite
 int dbg_pin_values[64];
 
+// текущее время для micros (тесты двигают его вручную)
+unsigned long dbg_micros = 0;
+
+// источник виртуального времени вместо dbg_micros
+// (симулятор stepper_sim.h, NULL - время двигают тесты)
+unsigned long (*dbg_micros_source)() = NULL;
+
+// вызывается перед каждым изменением значения пина
+// (симулятор stepper_sim.h, NULL - не вызывается)
+void (*dbg_pin_changed)(int pin, int val) = NULL;
+
 unsigned long micros() {
-    return 0;
+    return dbg_micros_source != NULL ? dbg_micros_source() : dbg_micros;
 }
 
 void pinMode(int pin, int mode) {
@@ -13,6 +28,7 @@ void pinMode(int pin, int mode) {
  * Сохранить значение пина
  */
 void digitalWrite(int pin, int val) {
+    if(dbg_pin_changed != NULL && dbg_pin_values[pin] != val) dbg_pin_changed(pin, val);
     dbg_pin_values[pin] = val;
 }
 
@@ -24,3 +40,51 @@ int digitalRead(int pin) {
     return dbg_pin_values[pin];
 }
 
+
+/**
+ * Прямой доступ к портам (stepper_fast_io.h): эмулируем порты
+ * по 8 пинов поверх сохраненных значений пинов.
+ */
+void fast_io_resolve_pin(int pin, fast_io_pin_t* io) {
+    if(pin < 0) {
+        // NO_PIN
+        io->port = 0;
+        io->in = 0;
+        io->mask = 0;
+    } else {
+        io->port = pin / 8;
+        io->in = pin / 8;
+        io->mask = 1 << (pin % 8);
+    }
+}
+
+// количество записей в порты через fast_io_set/fast_io_clear
+// (для отладки пакетного вывода)
+unsigned long dbg_port_writes = 0;
+
+/**
+ * Записать значение во все пины порта, отмеченные в маске
+ */
+void fast_io_write_port(fast_io_port_t port, fast_io_mask_t mask, int val) {
+    dbg_port_writes++;
+    for(int bit = 0; bit < 8; bit++) {
+        if(mask & (1 << bit)) {
+            int pin = port*8 + bit;
+            if(dbg_pin_changed != NULL && dbg_pin_values[pin] != val) dbg_pin_changed(pin, val);
+            dbg_pin_values[pin] = val;
+        }
+    }
+}
+
+/**
+ * Прочитать пины порта, отмеченные в маске
+ */
+fast_io_mask_t fast_io_read_port(fast_io_port_t port, fast_io_mask_t mask) {
+    fast_io_mask_t val = 0;
+    for(int bit = 0; bit < 8; bit++) {
+        if((mask & (1 << bit)) && dbg_pin_values[port*8 + bit]) {
+            val |= 1 << bit;
+        }
+    }
+    return val;
+}
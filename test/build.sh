@@ -1,11 +1,57 @@
 #!/bin/sh
 gcc -c timer_setup_stub.c
-g++ -std=c++11 -c \
+# профиль обработчика (STEPPER_ISR_PROFILE) и трасса шагов (STEPPER_TRACE)
+# включены, чтобы тесты их проверяли. Флаги меняют поля структуры stepper,
+# поэтому их получают все файлы, которые собираются с этими объектами
+# (см. stepper_lib_config.h)
+FEATURES="-DSTEPPER_ISR_PROFILE=1 -DSTEPPER_TRACE=1"
+g++ -std=c++11 -c $FEATURES \
     -I. -I../stepper_h/ -I../stepper_test/ -I../stepper_test/sput-1.4.0 \
     Arduino.cpp \
     ../stepper_h/stepper.cpp \
     ../stepper_h/stepper_timer.cpp \
+    ../stepper_h/stepper_planner.cpp \
+    ../stepper_h/stepper_gcode.cpp \
+    ../stepper_h/stepper_proto.cpp \
     ../stepper_test/stepper_test.cpp \
     stepper_test_main.cpp
 g++ *.o -o stepper_test
+g++ -std=c++11 $FEATURES \
+    -I. -I../stepper_h/ \
+    stepper_proto_pty.cpp Arduino.o stepper.o stepper_timer.o stepper_proto.o timer_setup_stub.o \
+    -o stepper_proto_pty
 
+g++ -std=c++11 \
+    -I. -I../stepper_h/ \
+    stepper_trace_decode.cpp \
+    -o stepper_trace_decode
+
+g++ -std=c++11 -O2 \
+    -I. -I../stepper_h/ \
+    stepper_bench.cpp Arduino.cpp \
+    ../stepper_h/stepper.cpp ../stepper_h/stepper_timer.cpp ../stepper_h/stepper_gcode.cpp timer_setup_stub.o \
+    -o stepper_bench
+g++ -std=c++11 -O2 \
+    -DSTEPPER_HARD_ENDS=0 -DSTEPPER_SOFT_ENDS=0 -DSTEPPER_CALIBRATE=0 \
+    -DSTEPPER_BUFFERED_STEPS=0 -DSTEPPER_DYNAMIC_STEPS=0 \
+    -DSTEPPER_ISR_TIMING=0 -DSTEPPER_POS_64=0 \
+    -I. -I../stepper_h/ \
+    stepper_bench.cpp Arduino.cpp \
+    ../stepper_h/stepper.cpp ../stepper_h/stepper_timer.cpp ../stepper_h/stepper_gcode.cpp timer_setup_stub.o \
+    -o stepper_bench_min
+# без одной возможности - сколько стоит каждая
+for FEATURE in HARD_ENDS SOFT_ENDS CALIBRATE BUFFERED_STEPS DYNAMIC_STEPS ISR_TIMING POS_64; do
+    g++ -std=c++11 -O2 \
+        -DSTEPPER_$FEATURE=0 \
+        -I. -I../stepper_h/ \
+        stepper_bench.cpp Arduino.cpp \
+        ../stepper_h/stepper.cpp ../stepper_h/stepper_timer.cpp ../stepper_h/stepper_gcode.cpp \
+        timer_setup_stub.o \
+        -o stepper_bench_no_$FEATURE
+done
+
+g++ -std=c++11 -O2 \
+    -I. -I../stepper_h/ \
+    stepper_sim_job.cpp stepper_sim.cpp Arduino.cpp \
+    ../stepper_h/stepper.cpp ../stepper_h/stepper_timer.cpp timer_setup_stub.o \
+    -o stepper_sim_job
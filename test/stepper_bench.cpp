@@ -0,0 +1,242 @@
+/**
+ * stepper_bench.cpp
+ *
+ * Замер времени тика обработчика прерывания таймера на хосте: 6 моторов
+ * с концевыми датчиками и виртуальными границами, (1) группа prepare_line,
+ * (2) независимые серии prepare_steps. build.sh собирает замер
+ * для нескольких наборов возможностей обработчика (stepper_lib_config.h):
+ * stepper_bench - со всеми (как по умолчанию), stepper_bench_no_XXX -
+ * без одной возможности STEPPER_XXX, stepper_bench_min - без всех:
+ * STEPPER_HARD_ENDS, STEPPER_SOFT_ENDS, STEPPER_CALIBRATE,
+ * STEPPER_BUFFERED_STEPS, STEPPER_DYNAMIC_STEPS, STEPPER_ISR_TIMING
+ * и STEPPER_POS_64. Каждый замер - лучший из BENCH_RUNS прогонов
+ * (остальные прогоны на хосте задевает вытеснение процесса системой).
+ *
+ * Время на хосте не равно времени на контроллере, но соотношение между
+ * сборками показывает, сколько стоят выключенные возможности.
+ *
+ * (3) в полной сборке: 6 моторов с "тяжелой" функцией динамической
+ * задержки шагают на одних тиках - среднее и худшее (99.9%) время вызова
+ * обработчика без ограничения и с stepper_set_step_work_limit(1).
+ * С лимитом худший тик - это один вызов функции задержки (его на тики
+ * не разделить) плюс обычная работа тика, а не 6 вызовов.
+ *
+ * (4) интерпретатор G-кода (stepper_gcode.h): строки с движением
+ * туда-обратно по X и Y, таймер идет параллельно, как в главном цикле
+ * на контроллере, - строк в секунду с учетом тиков и время разбора
+ * и подготовки строки (stepper_gcode_put и stepper_gcode_run, вместе
+ * с опросом stepper_gcode_run на каждом тике) без тиков.
+ *
+ * Сборка и запуск: см. build.sh, ./stepper_bench; ./stepper_bench_min;
+ * for b in ./stepper_bench_no_*; do $b; done
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+
+#include "stepper.h"
+#include "stepper_gcode.h"
+#include "stepper_lib_config.h"
+
+extern "C"{
+    #include "timer_setup.h"
+}
+
+#define MOTOR_COUNT 6
+#define TICKS 2000000L
+#define BENCH_RUNS 5
+#define GCODE_LINES 20000L
+
+static stepper smotors[MOTOR_COUNT];
+static stepper* psmotors[MOTOR_COUNT];
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/**
+ * Прогнать TICKS тиков таймера.
+ *
+ * @return наносекунд на тик
+ */
+static double run_ticks() {
+    stepper_start_cycle();
+    double start = now_ns();
+    for(long t = 0; t < TICKS; t++) {
+        _timer_handle_interrupts(3);
+    }
+    double ns = (now_ns() - start) / TICKS;
+    stepper_finish_cycle();
+    return ns;
+}
+
+#if STEPPER_DYNAMIC_STEPS
+// вызовов heavy_delay на текущем тике
+static int heavy_calls_tick = 0;
+
+/**
+ * Динамическая задержка с заметной ценой вычисления (как у функции
+ * с плавающей точкой на контроллере).
+ */
+static unsigned long heavy_delay(unsigned long curr_step, void* curve_context) {
+    heavy_calls_tick++;
+    volatile unsigned long x = curr_step;
+    for(int k = 0; k < 200; k++) {
+        x = x * 1103515245 + 12345;
+    }
+    return *(unsigned long*)curve_context + (x & 1) * 20;
+}
+
+/**
+ * Прогнать TICKS/10 тиков таймера, засекая каждый вызов обработчика.
+ *
+ * @param worst_ns - время вызова, которое превышает только 0.1% вызовов
+ *     (максимум на хосте - это вытеснение процесса системой, а не обработчик)
+ * @param max_calls - наибольшее количество вызовов heavy_delay на одном тике
+ * @return среднее время вызова, наносекунд
+ */
+static double run_ticks_worst(double* worst_ns, int* max_calls) {
+    static double tick_ns[TICKS / 10];
+    stepper_start_cycle();
+    double total = 0;
+    *max_calls = 0;
+    for(long t = 0; t < TICKS / 10; t++) {
+        heavy_calls_tick = 0;
+        double start = now_ns();
+        _timer_handle_interrupts(3);
+        tick_ns[t] = now_ns() - start;
+        total += tick_ns[t];
+        if(heavy_calls_tick > *max_calls) *max_calls = heavy_calls_tick;
+    }
+    stepper_finish_cycle();
+    std::nth_element(tick_ns, tick_ns + TICKS / 10 - TICKS / 10000, tick_ns + TICKS / 10);
+    *worst_ns = tick_ns[TICKS / 10 - TICKS / 10000];
+    return total / (TICKS / 10);
+}
+
+/**
+ * (3) тяжелая работа на шаге: без ограничения и по одному мотору на тик.
+ */
+static void bench_step_work() {
+    static unsigned long base_delay = 1000;
+    // отложенная работа ждет, пока до шага не останется 3 периода таймера:
+    // минимальная задержка мотора должна оставлять место для очереди
+    for(int i = 0; i < MOTOR_COUNT; i++) {
+        smotors[i].step_delay = 500;
+    }
+    for(int limit = 0; limit <= 1; limit++) {
+        stepper_set_step_work_limit(limit);
+        for(int i = 0; i < MOTOR_COUNT; i++) {
+            smotors[i].current_pos = 0;
+            prepare_dynamic_whirl(&smotors[i], 1, &base_delay, heavy_delay);
+        }
+        double worst_ns;
+        int max_calls;
+        double avg_ns = run_ticks_worst(&worst_ns, &max_calls);
+        printf("heavy steps, work limit %d: avg %.1f ns/tick, worst (99.9%%) %.1f ns/tick, "
+            "max %d heavy calls/tick\n", limit, avg_ns, worst_ns, max_calls);
+    }
+    stepper_set_step_work_limit(0);
+}
+#endif // STEPPER_DYNAMIC_STEPS
+
+/**
+ * (4) G-код: короткие движения туда-обратно (0.1мм по X, 0.05мм по Y,
+ * 13 и 7 шагов), символы передаются, как только интерпретатор готов
+ * их принять, на каждой итерации - один тик таймера.
+ */
+static void bench_gcode() {
+    stepper sm_x, sm_y;
+    init_stepper(&sm_x, 'x', 30, 31, 32, false, 100, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 33, 34, 35, false, 100, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    static stepper* gcode_motors[] = {&sm_x, &sm_y};
+    stepper_gcode_init(2, gcode_motors, 1000000);
+    
+    const char* lines[] = {"G1 X0.1 Y0.05 F6000\n", "G1 X0 Y0\n"};
+    unsigned long line_count = stepper_gcode_line_count();
+    long sent = 0;
+    const char* line = lines[0];
+    long ticks = 0;
+    double gcode_ns = 0;
+    double start = now_ns();
+    while(sent < GCODE_LINES || !stepper_gcode_ready() || stepper_cycle_running()) {
+        double gcode_start = now_ns();
+        while(sent < GCODE_LINES && stepper_gcode_put(*line)) {
+            line++;
+            if(*line == 0) {
+                sent++;
+                line = lines[sent % 2];
+            }
+        }
+        stepper_gcode_run();
+        gcode_ns += now_ns() - gcode_start;
+        
+        _timer_handle_interrupts(3);
+        ticks++;
+    }
+    double ns = now_ns() - start;
+    
+    // цена самого замера времени (now_ns) на каждой итерации
+    double clock_start = now_ns();
+    for(long t = 0; t < ticks; t++) {
+        now_ns();
+    }
+    gcode_ns -= now_ns() - clock_start;
+    
+    unsigned long done = stepper_gcode_line_count() - line_count;
+    printf("gcode: %lu moves (x %ld, y %ld), %.0f lines/s with %ld ticks, "
+        "put+run %.1f ns/line (%.0f lines/s without ticks)\n",
+        done, sm_x.current_pos / 7500, sm_y.current_pos / 7500,
+        done / (ns / 1e9), ticks, gcode_ns / done, done / (gcode_ns / 1e9));
+}
+
+int main() {
+    stepper_configure_timer(20, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    for(int i = 0; i < MOTOR_COUNT; i++) {
+        // пины шага, направления и включения; концевые датчики - отдельные пины
+        init_stepper(&smotors[i], 'a' + i, 2 + i*3, 3 + i*3, 4 + i*3, false, 100, 1000);
+        init_stepper_ends(&smotors[i], 40 + i, 50 + i, CONST, CONST,
+            -2000000000L, 2000000000L);
+        psmotors[i] = &smotors[i];
+    }
+
+    double line_ns = 0, steps_ns = 0;
+    for(int run = 0; run < BENCH_RUNS; run++) {
+        // (1) группа: ведущий мотор и 5 ведомых
+        for(int i = 0; i < MOTOR_COUNT; i++) {
+            smotors[i].current_pos = 0;
+        }
+        long steps[MOTOR_COUNT] = {1000000, 700000, -400000, 250000, -90000, 3};
+        prepare_line(MOTOR_COUNT, psmotors, steps, 100);
+        double ns = run_ticks();
+        if(run == 0 || ns < line_ns) line_ns = ns;
+        
+        // (2) независимые серии с разными скоростями
+        for(int i = 0; i < MOTOR_COUNT; i++) {
+            smotors[i].current_pos = 0;
+            prepare_steps(&smotors[i], i % 2 ? -1000000 : 1000000, 100 + i*40);
+        }
+        ns = run_ticks();
+        if(run == 0 || ns < steps_ns) steps_ns = ns;
+    }
+
+    // набор возможностей сборки
+    printf("HARD_ENDS=%d SOFT_ENDS=%d CALIBRATE=%d BUFFERED_STEPS=%d DYNAMIC_STEPS=%d "
+        "ISR_TIMING=%d POS_64=%d: line %.1f ns/tick, steps %.1f ns/tick\n",
+        STEPPER_HARD_ENDS, STEPPER_SOFT_ENDS, STEPPER_CALIBRATE, STEPPER_BUFFERED_STEPS,
+        STEPPER_DYNAMIC_STEPS, STEPPER_ISR_TIMING, STEPPER_POS_64, line_ns, steps_ns);
+#if STEPPER_DYNAMIC_STEPS
+    bench_step_work();
+#endif
+    bench_gcode();
+    return 0;
+}
@@ -0,0 +1,249 @@
+/**
+ * stepper_proto_pty.cpp
+ *
+ * Проверка протокола stepper_proto через псевдотерминал: дочерний процесс
+ * изображает устройство (библиотека + симуляция таймера), читает кадры
+ * со стороны master и отправляет туда ACK/NAK; родительский процесс - хост,
+ * открывает slave как последовательный порт, отправляет траекторию
+ * (квадрат и подъем по Z) кадрами с учетом кредита и повторяет кадры по NAK.
+ * Когда хост закрывает порт, устройство выполняет остаток очереди
+ * и сверяет положение моторов.
+ *
+ * Сборка и запуск: см. build.sh, ./stepper_proto_pty
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/wait.h>
+
+#include "stepper.h"
+#include "stepper_proto.h"
+#include "stepper_lib_config.h"
+
+extern "C"{
+    #include "timer_setup.h"
+}
+
+// отрезков на каждой стороне квадрата
+#define SIDE_SEGMENTS 500
+#define SEGMENT_COUNT (SIDE_SEGMENTS*4 + 1)
+// кадров не больше, чем отрезков
+#define FRAME_COUNT SEGMENT_COUNT
+
+/**
+ * Отрезок траектории номер i: квадрат отрезками по 4 шага со скоростью,
+ * меняющейся по ходу стороны, в конце - подъем по Z.
+ */
+static unsigned long toolpath(int i, long* steps) {
+    steps[0] = steps[1] = steps[2] = 0;
+    if(i == SIDE_SEGMENTS*4) {
+        steps[2] = 50;
+        return 1000;
+    }
+    int side = i / SIDE_SEGMENTS;
+    long d = side < 2 ? 4 : -4;
+    steps[side % 2] = d;
+    // одна ось - наискосок на первой стороне
+    if(side == 0 && i % 3 == 0) steps[1] = 1;
+    return 300 + (i % SIDE_SEGMENTS) * 2;
+}
+
+static void device_reply(const unsigned char* data, int size, void* context) {
+    int fd = *(int*)context;
+    while(size > 0) {
+        int n = write(fd, data, size);
+        if(n > 0) {
+            data += n;
+            size -= n;
+        } else if(n < 0 && errno != EAGAIN) {
+            return;
+        }
+    }
+}
+
+/**
+ * Устройство: принимать кадры, пока хост не закроет порт.
+ */
+static int device(int fd) {
+    stepper_configure_timer(20, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+
+    stepper sm_x, sm_y, sm_z;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, 200, 7500);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, 200, 7500);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_z, 'z', 2, 3, 4, false, 200, 7500);
+    init_stepper_ends(&sm_z, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    stepper* smotors[] = {&sm_x, &sm_y, &sm_z};
+    stepper_proto_init(3, smotors, device_reply, &fd);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    unsigned char buf[64];
+    int buf_pos = 0, buf_size = 0;
+    bool connected = true;
+    while(connected || stepper_proto_pending() > 0 || stepper_cycle_running()) {
+        if(connected && buf_pos == buf_size) {
+            buf_pos = 0;
+            buf_size = read(fd, buf, sizeof(buf));
+            if(buf_size < 0 && errno == EAGAIN) {
+                buf_size = 0;
+            } else if(buf_size <= 0) {
+                // хост закрыл порт
+                buf_size = 0;
+                connected = false;
+            }
+        }
+        while(buf_pos < buf_size && stepper_proto_put(buf[buf_pos])) {
+            buf_pos++;
+        }
+        stepper_proto_run();
+        // такт таймера
+        _timer_handle_interrupts(3);
+    }
+
+    long x = 0, y = 0, z = 0;
+    for(int i = 0; i < SEGMENT_COUNT; i++) {
+        long steps[3];
+        toolpath(i, steps);
+        x += steps[0];
+        y += steps[1];
+        z += steps[2];
+    }
+    printf("device: error=%d x=%ld/%ld y=%ld/%ld z=%ld/%ld\n", stepper_proto_error(),
+        (long)(sm_x.current_pos / 7500), x, (long)(sm_y.current_pos / 7500), y, (long)(sm_z.current_pos / 7500), z);
+    return stepper_proto_error() == PROTO_ERROR_NONE &&
+        sm_x.current_pos == 7500*x && sm_y.current_pos == 7500*y && sm_z.current_pos == 7500*z ? 0 : 1;
+}
+
+/**
+ * Прочитать ответы устройства: кредит с учетом кадров, отправленных после
+ * подтвержденного, номер кадра для повтора по NAK.
+ *
+ * @return false - ответов нет
+ */
+static bool host_replies(int fd, unsigned char next_seq, int* credits, unsigned char* resend_seq, bool* resend) {
+    static unsigned char reply[STEPPER_PROTO_FRAME_OVERHEAD + 2];
+    static int reply_size = 0;
+    unsigned char b;
+    bool got = false;
+    while(read(fd, &b, 1) == 1) {
+        if(reply_size == 0 && b != STEPPER_PROTO_SYNC) continue;
+        reply[reply_size++] = b;
+        if(reply_size == 2 && reply[1] > 2) {
+            reply_size = 0;
+        } else if(reply_size > 2 && reply_size == STEPPER_PROTO_FRAME_OVERHEAD + reply[1]) {
+            reply_size = 0;
+            if(stepper_proto_crc8(reply + 1, 3 + reply[1]) != reply[4 + reply[1]]) continue;
+            got = true;
+            if(reply[3] == STEPPER_PROTO_ACK) {
+                // кадры после подтвержденного еще занимают буферы устройства
+                *credits = reply[5] - (unsigned char)(next_seq - reply[4] - 1);
+            } else if(reply[3] == STEPPER_PROTO_NAK) {
+                *resend_seq = reply[4];
+                *resend = true;
+            }
+        }
+    }
+    return got;
+}
+
+/**
+ * Хост: отправить траекторию и закрыть порт.
+ */
+static int host(int fd) {
+    static unsigned char frames[FRAME_COUNT][STEPPER_PROTO_FRAME_SIZE + STEPPER_PROTO_FRAME_OVERHEAD];
+    static int frame_sizes[FRAME_COUNT];
+
+    // траектория кадрами: номер кадра i - seq (i % 256)
+    int frame_count = 0;
+    int segment = 0;
+    while(segment < SEGMENT_COUNT) {
+        stepper_proto_frame_t frame;
+        stepper_proto_frame_begin(&frame, frames[frame_count], frame_count);
+        long steps[3];
+        while(segment < SEGMENT_COUNT &&
+                stepper_proto_frame_add(&frame, 3, steps, toolpath(segment, steps))) {
+            segment++;
+        }
+        frame_sizes[frame_count++] = stepper_proto_frame_end(&frame);
+    }
+
+    // начать сессию
+    unsigned char data[STEPPER_PROTO_FRAME_OVERHEAD];
+    write(fd, data, stepper_proto_frame_control(data, STEPPER_PROTO_RESET, 255));
+    int credits = 0;
+    unsigned char resend_seq;
+    bool resend = false;
+    while(!host_replies(fd, 0, &credits, &resend_seq, &resend)) {
+        usleep(1000);
+    }
+
+    int next = 0, resent = 0;
+    long bytes = 0;
+    while(next < frame_count) {
+        if(credits > 0) {
+            write(fd, frames[next], frame_sizes[next]);
+            bytes += frame_sizes[next];
+            next++;
+            credits--;
+        } else {
+            usleep(100);
+        }
+        host_replies(fd, next, &credits, &resend_seq, &resend);
+        if(resend) {
+            // NAK: отправить снова начиная с ожидаемого кадра
+            next -= (unsigned char)(next - resend_seq);
+            resend = false;
+            resent++;
+        }
+    }
+    printf("host: %d segments in %d frames, %ld bytes, %d resent\n",
+        SEGMENT_COUNT, frame_count, bytes, resent);
+    // дождаться последних подтверждений, чтобы не потерять кадры при закрытии
+    while(credits < STEPPER_PROTO_FRAMES) {
+        if(!host_replies(fd, next, &credits, &resend_seq, &resend)) usleep(1000);
+    }
+    return 0;
+}
+
+int main() {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if(slave < 0) {
+        perror("open slave");
+        return 1;
+    }
+    // последовательный порт без обработки символов
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        close(slave);
+        exit(device(master));
+    }
+    close(master);
+    fcntl(slave, F_SETFL, fcntl(slave, F_GETFL) | O_NONBLOCK);
+    int res = host(slave);
+    close(slave);
+
+    int status;
+    waitpid(pid, &status, 0);
+    res = res == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+    printf(res == 0 ? "[SUCCESS]\n" : "[FAIL]\n");
+    return res;
+}
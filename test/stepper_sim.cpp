@@ -0,0 +1,295 @@
+/**
+ * stepper_sim.cpp
+ *
+ * Симулятор движка шагов в виртуальном времени, см. stepper_sim.h
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "stepper.h"
+#include "stepper_sim.h"
+
+extern "C"{
+    #include "timer_setup.h"
+}
+
+// из Arduino.cpp
+extern int dbg_pin_values[64];
+extern unsigned long (*dbg_micros_source)();
+extern void (*dbg_pin_changed)(int pin, int val);
+
+#define SIM_PIN_COUNT 64
+
+/**
+ * Отслеживаемый пин: статистика собирается на лету по изменениям.
+ */
+typedef struct {
+    const char* name;
+    bool watched;
+    /** Ножка step: собирать статистику шагов */
+    bool step;
+    /** Идентификатор сигнала в VCD */
+    char vcd_id;
+
+    stepper_sim_pin_stats_t stats;
+
+    /** Время последнего фронта LOW>HIGH, нс */
+    unsigned long long rise_ns;
+    bool rise_seen;
+    bool pulse_seen;
+
+    /** Предыдущий интервал между шагами, нс */
+    unsigned long long prev_interval_ns;
+
+    /** Сумма квадратов отклонений интервала от среднего (метод Уэлфорда) */
+    double interval_m2;
+} sim_pin_t;
+
+static sim_pin_t _sim_pins[SIM_PIN_COUNT];
+// номера отслеживаемых пинов в порядке stepper_sim_watch
+static int _sim_watch_pins[SIM_PIN_COUNT];
+static int _sim_watch_count = 0;
+
+static stepper_sim_cost_t _sim_cost;
+static unsigned long long _sim_period_ns = 0;
+
+// виртуальное время
+static unsigned long long _sim_time_ns = 0;
+// время следующего вызова обработчика по таймеру
+static unsigned long long _sim_next_isr_ns = 0;
+// цикл шагов работал на предыдущем вызове обработчика
+static bool _sim_cycle_running = false;
+
+static unsigned long long _sim_isr_calls = 0;
+static unsigned long _sim_overruns = 0;
+
+static FILE* _sim_vcd = NULL;
+static unsigned long long _sim_vcd_until_ns = 0;
+static unsigned long long _sim_vcd_time_ns = 0;
+
+/**
+ * micros() в виртуальном времени: каждый вызов стоит micros_ns.
+ */
+static unsigned long _sim_micros() {
+    unsigned long us = (unsigned long)(_sim_time_ns / 1000);
+    _sim_time_ns += _sim_cost.micros_ns;
+    return us;
+}
+
+static void _sim_vcd_write(sim_pin_t* pin, int val) {
+    if(_sim_vcd == NULL || (_sim_vcd_until_ns != 0 && _sim_time_ns > _sim_vcd_until_ns)) return;
+    if(_sim_time_ns != _sim_vcd_time_ns) {
+        _sim_vcd_time_ns = _sim_time_ns;
+        fprintf(_sim_vcd, "#%llu\n", _sim_time_ns);
+    }
+    fprintf(_sim_vcd, "%d%c\n", val ? 1 : 0, pin->vcd_id);
+}
+
+/**
+ * Изменение значения пина (из digitalWrite и fast_io_write_port).
+ */
+static void _sim_pin_changed(int pin_num, int val) {
+    if(pin_num >= 0 && pin_num < SIM_PIN_COUNT && _sim_pins[pin_num].watched) {
+        sim_pin_t* pin = &_sim_pins[pin_num];
+        stepper_sim_pin_stats_t* stats = &pin->stats;
+        stats->transitions++;
+        _sim_vcd_write(pin, val);
+
+        if(!pin->step) {
+            // направление, включение и т.п.: только переключения
+        } else if(val) {
+            pin->rise_ns = _sim_time_ns;
+            pin->rise_seen = true;
+        } else {
+            // импульс
+            if(pin->rise_seen) {
+                unsigned long long pulse = _sim_time_ns - pin->rise_ns;
+                if(!pin->pulse_seen || pulse < stats->pulse_min_ns) stats->pulse_min_ns = pulse;
+                if(!pin->pulse_seen || pulse > stats->pulse_max_ns) stats->pulse_max_ns = pulse;
+                pin->pulse_seen = true;
+            }
+
+            // шаг
+            stats->steps++;
+            if(stats->steps == 1) {
+                stats->first_step_ns = _sim_time_ns;
+            } else {
+                unsigned long long interval = _sim_time_ns - stats->last_step_ns;
+                unsigned long n = stats->steps - 1;
+                if(n == 1 || interval < stats->interval_min_ns) stats->interval_min_ns = interval;
+                if(n == 1 || interval > stats->interval_max_ns) stats->interval_max_ns = interval;
+
+                double delta = interval - stats->interval_mean_ns;
+                stats->interval_mean_ns += delta / n;
+                pin->interval_m2 += delta * (interval - stats->interval_mean_ns);
+
+                if(n > 1) {
+                    unsigned long long jitter = interval > pin->prev_interval_ns ?
+                        interval - pin->prev_interval_ns : pin->prev_interval_ns - interval;
+                    if(jitter > stats->jitter_max_ns) stats->jitter_max_ns = jitter;
+                }
+                pin->prev_interval_ns = interval;
+            }
+            stats->last_step_ns = _sim_time_ns;
+        }
+    }
+    _sim_time_ns += _sim_cost.pin_ns;
+}
+
+void stepper_sim_init(unsigned long period_us, const stepper_sim_cost_t* cost) {
+    stepper_sim_finish();
+
+    memset(_sim_pins, 0, sizeof(_sim_pins));
+    _sim_watch_count = 0;
+    if(cost != NULL) {
+        _sim_cost = *cost;
+    } else {
+        memset(&_sim_cost, 0, sizeof(_sim_cost));
+    }
+    _sim_period_ns = (unsigned long long)period_us * 1000;
+
+    _sim_time_ns = 0;
+    _sim_next_isr_ns = 0;
+    _sim_cycle_running = false;
+    _sim_isr_calls = 0;
+    _sim_overruns = 0;
+
+    dbg_micros_source = _sim_micros;
+    dbg_pin_changed = _sim_pin_changed;
+}
+
+bool stepper_sim_watch(int pin, const char* name, bool step) {
+    if(pin < 0 || pin >= SIM_PIN_COUNT) return false;
+    if(!_sim_pins[pin].watched) {
+        _sim_pins[pin].watched = true;
+        // печатные символы VCD с '!' - на 64 пина хватает
+        _sim_pins[pin].vcd_id = '!' + _sim_watch_count;
+        _sim_watch_pins[_sim_watch_count++] = pin;
+    }
+    _sim_pins[pin].name = name;
+    _sim_pins[pin].step = step;
+    return true;
+}
+
+bool stepper_sim_vcd_open(const char* file_name, unsigned long long until_us) {
+    if(_sim_vcd != NULL) fclose(_sim_vcd);
+    _sim_vcd = fopen(file_name, "w");
+    if(_sim_vcd == NULL) return false;
+    _sim_vcd_until_ns = until_us != 0 ? _sim_time_ns + until_us * 1000 : 0;
+    _sim_vcd_time_ns = _sim_time_ns;
+
+    fprintf(_sim_vcd, "$timescale 1ns $end\n");
+    fprintf(_sim_vcd, "$scope module stepper $end\n");
+    for(int i = 0; i < _sim_watch_count; i++) {
+        sim_pin_t* pin = &_sim_pins[_sim_watch_pins[i]];
+        fprintf(_sim_vcd, "$var wire 1 %c %s $end\n", pin->vcd_id, pin->name);
+    }
+    fprintf(_sim_vcd, "$upscope $end\n");
+    fprintf(_sim_vcd, "$enddefinitions $end\n");
+
+    // начальные значения
+    fprintf(_sim_vcd, "#%llu\n$dumpvars\n", _sim_time_ns);
+    for(int i = 0; i < _sim_watch_count; i++) {
+        int pin = _sim_watch_pins[i];
+        fprintf(_sim_vcd, "%d%c\n", dbg_pin_values[pin] ? 1 : 0, _sim_pins[pin].vcd_id);
+    }
+    fprintf(_sim_vcd, "$end\n");
+    return true;
+}
+
+bool stepper_sim_run(unsigned long long duration_us) {
+    unsigned long long end_ns = _sim_time_ns + duration_us * 1000;
+    while(stepper_cycle_running()) {
+        if(!_sim_cycle_running) {
+            // цикл только что запущен: таймер отсчитывает периоды от запуска
+            _sim_cycle_running = true;
+            _sim_next_isr_ns = _sim_time_ns + stepper_timer_event_ticks() * _sim_period_ns;
+        }
+        if(_sim_next_isr_ns > end_ns) break;
+
+        if(_sim_time_ns > _sim_next_isr_ns) {
+            // предыдущий вызов не успел закончиться к своему периоду:
+            // прерывание ждало и сработает сразу
+            _sim_overruns++;
+        } else {
+            _sim_time_ns = _sim_next_isr_ns;
+        }
+        _sim_time_ns += _sim_cost.isr_ns;
+        _timer_handle_interrupts(3);
+        _sim_isr_calls++;
+
+        // в режиме "по событию" таймер перезапускается на несколько периодов
+        _sim_next_isr_ns += stepper_timer_event_ticks() * _sim_period_ns;
+    }
+    if(!stepper_cycle_running()) {
+        _sim_cycle_running = false;
+    }
+    if(_sim_time_ns < end_ns) {
+        _sim_time_ns = end_ns;
+    }
+    return stepper_cycle_running();
+}
+
+unsigned long long stepper_sim_time_ns() {
+    return _sim_time_ns;
+}
+
+unsigned long long stepper_sim_isr_calls() {
+    return _sim_isr_calls;
+}
+
+unsigned long stepper_sim_overruns() {
+    return _sim_overruns;
+}
+
+void stepper_sim_pin_stats(int pin, stepper_sim_pin_stats_t* stats) {
+    if(pin < 0 || pin >= SIM_PIN_COUNT) {
+        memset(stats, 0, sizeof(stepper_sim_pin_stats_t));
+        return;
+    }
+    *stats = _sim_pins[pin].stats;
+    unsigned long n = stats->steps > 1 ? stats->steps - 1 : 0;
+    stats->step_rate = n > 0 && stats->last_step_ns > stats->first_step_ns ?
+        n * 1e9 / (stats->last_step_ns - stats->first_step_ns) : 0;
+    stats->interval_stddev_ns = n > 0 ? sqrt(_sim_pins[pin].interval_m2 / n) : 0;
+}
+
+void stepper_sim_print_stats(FILE* out) {
+    fprintf(out, "virtual time %.3f s, %llu isr calls, %lu overruns\n",
+        _sim_time_ns / 1e9, _sim_isr_calls, _sim_overruns);
+    for(int i = 0; i < _sim_watch_count; i++) {
+        int pin = _sim_watch_pins[i];
+        stepper_sim_pin_stats_t stats;
+        stepper_sim_pin_stats(pin, &stats);
+        if(!_sim_pins[pin].step) {
+            fprintf(out, "%s: %lu transitions\n", _sim_pins[pin].name, stats.transitions);
+            continue;
+        }
+        fprintf(out, "%s: %lu transitions, %lu steps, %.1f steps/s, "
+            "interval %.3f/%.3f/%.3f us (min/mean/max), stddev %.3f us, jitter %.3f us, "
+            "pulse %.3f-%.3f us\n",
+            _sim_pins[pin].name, stats.transitions, stats.steps, stats.step_rate,
+            stats.interval_min_ns / 1e3, stats.interval_mean_ns / 1e3, stats.interval_max_ns / 1e3,
+            stats.interval_stddev_ns / 1e3, stats.jitter_max_ns / 1e3,
+            stats.pulse_min_ns / 1e3, stats.pulse_max_ns / 1e3);
+    }
+}
+
+void stepper_sim_finish() {
+    if(_sim_vcd != NULL) {
+        // конец записи - чтобы последние значения было видно
+        unsigned long long end_ns = _sim_vcd_until_ns != 0 && _sim_time_ns > _sim_vcd_until_ns ?
+            _sim_vcd_until_ns : _sim_time_ns;
+        if(end_ns > _sim_vcd_time_ns) fprintf(_sim_vcd, "#%llu\n", end_ns);
+        fclose(_sim_vcd);
+        _sim_vcd = NULL;
+    }
+    dbg_micros_source = NULL;
+    dbg_pin_changed = NULL;
+}
+
@@ -0,0 +1,171 @@
+/**
+ * stepper_sim.h
+ *
+ * Симулятор движка шагов на хосте в виртуальном времени: вызывает
+ * обработчик прерывания таймера _timer_handle_interrupts на тех моментах
+ * виртуального времени, на которых его вызвал бы аппаратный таймер
+ * (с учетом режима "по событию"), micros() возвращает виртуальное время,
+ * у вызовов есть настраиваемая цена. Каждое изменение значения
+ * отслеживаемых пинов получает метку времени: изменения пишутся в VCD
+ * (GTKWave и т.п.) и сразу сворачиваются в статистику (частота шагов,
+ * разброс интервалов между шагами, ширина импульсов), поэтому память
+ * не растет с длиной задания - часы работы станка прогоняются за секунды.
+ *
+ * Симулятор подменяет micros() и перехватывает запись пинов в Arduino.cpp
+ * (dbg_micros_source, dbg_pin_changed) только между stepper_sim_init
+ * и stepper_sim_finish, остальные тесты его не замечают.
+ *
+ * Пример:
+ *   stepper_configure_timer(20, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+ *   stepper_set_timer_enabled(false);
+ *   stepper_set_timer_event_driven(true);
+ *   stepper_sim_init(20);
+ *   stepper_sim_watch(8, "step_x", true);
+ *   stepper_sim_vcd_open("job.vcd", 100000);
+ *   prepare_steps(&sm_x, 100000, 1000);
+ *   stepper_start_cycle();
+ *   while(stepper_sim_run(1000)) {
+ *       // главный цикл: пополнить очередь движений и т.п.
+ *   }
+ *   stepper_sim_pin_stats_t stats;
+ *   stepper_sim_pin_stats(8, &stats);
+ *   stepper_sim_finish();
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#ifndef STEPPER_SIM_H
+#define STEPPER_SIM_H
+
+#include <stdio.h>
+
+/**
+ * Цена операций в виртуальном времени, наносекунд.
+ */
+typedef struct {
+    /** Вызов micros(): время, которое видит STEPPER_ISR_TIMING, растет с каждым вызовом */
+    unsigned long micros_ns;
+
+    /** Вход в обработчик прерывания (до первой записи пинов) */
+    unsigned long isr_ns;
+
+    /** Изменение значения пина */
+    unsigned long pin_ns;
+} stepper_sim_cost_t;
+
+/**
+ * Статистика отслеживаемого пина. Для ножек step: шаг - фронт HIGH>LOW
+ * (как у драйверов шаговых моторов), импульс - время в HIGH.
+ */
+typedef struct {
+    /** Изменений значения пина */
+    unsigned long transitions;
+
+    /** Шагов (фронтов HIGH>LOW) */
+    unsigned long steps;
+
+    /** Время первого и последнего шага, нс */
+    unsigned long long first_step_ns;
+    unsigned long long last_step_ns;
+
+    /** Средняя частота шагов между первым и последним шагом, шагов в секунду */
+    double step_rate;
+
+    /** Интервал между соседними шагами: наименьший, наибольший, средний, нс */
+    unsigned long long interval_min_ns;
+    unsigned long long interval_max_ns;
+    double interval_mean_ns;
+
+    /** Стандартное отклонение интервала между шагами, нс */
+    double interval_stddev_ns;
+
+    /**
+     * Наибольшая разница соседних интервалов, нс (разброс от шага к шагу:
+     * на постоянной скорости - дрожание, на разгоне - еще и изменение скорости)
+     */
+    unsigned long long jitter_max_ns;
+
+    /** Ширина импульса: наименьшая и наибольшая, нс */
+    unsigned long long pulse_min_ns;
+    unsigned long long pulse_max_ns;
+} stepper_sim_pin_stats_t;
+
+/**
+ * Начать симуляцию: виртуальное время - 0, отслеживаемых пинов нет,
+ * micros() и запись пинов переключаются на симулятор.
+ *
+ * Аппаратный таймер в симуляции не нужен: stepper_set_timer_enabled(false).
+ *
+ * @param period_us - период таймера, как в stepper_configure_timer
+ * @param cost - цена операций (NULL - все бесплатно)
+ */
+void stepper_sim_init(unsigned long period_us, const stepper_sim_cost_t* cost=NULL);
+
+/**
+ * Отслеживать изменения пина: метки времени, статистика, сигнал в VCD.
+ * Задать до stepper_sim_vcd_open.
+ *
+ * @param pin - номер пина (0-63, как в Arduino.cpp)
+ * @param name - имя сигнала в VCD
+ * @param step - ножка step: собирать статистику шагов и импульсов
+ *     (у остальных пинов - только количество переключений)
+ * @return false - пин вне диапазона
+ */
+bool stepper_sim_watch(int pin, const char* name, bool step=false);
+
+/**
+ * Писать изменения отслеживаемых пинов в файл VCD (шкала - 1нс).
+ *
+ * @param file_name - имя файла
+ * @param until_us - писать только первые until_us микросекунд
+ *     виртуального времени (0 - до stepper_sim_finish)
+ * @return false - файл не открылся
+ */
+bool stepper_sim_vcd_open(const char* file_name, unsigned long long until_us=0);
+
+/**
+ * Выполнять цикл шагов в виртуальном времени: вызывать обработчик
+ * прерывания, пока не пройдет duration_us микросекунд или цикл
+ * не завершится. Если цикл не запущен, время просто идет вперед
+ * (главный цикл может запустить цикл между вызовами).
+ *
+ * @return true - цикл шагов еще работает
+ */
+bool stepper_sim_run(unsigned long long duration_us);
+
+/**
+ * Виртуальное время с начала симуляции, нс.
+ */
+unsigned long long stepper_sim_time_ns();
+
+/**
+ * Вызовов обработчика прерывания с начала симуляции.
+ */
+unsigned long long stepper_sim_isr_calls();
+
+/**
+ * Вызовов обработчика, которые начались позже своего периода таймера:
+ * предыдущий вызов (вместе с ценой операций) не успел закончиться.
+ */
+unsigned long stepper_sim_overruns();
+
+/**
+ * Статистика отслеживаемого пина.
+ */
+void stepper_sim_pin_stats(int pin, stepper_sim_pin_stats_t* stats);
+
+/**
+ * Напечатать статистику всех отслеживаемых пинов.
+ */
+void stepper_sim_print_stats(FILE* out);
+
+/**
+ * Закончить симуляцию: закрыть VCD, вернуть micros() и запись пинов
+ * в обычный режим тестов (dbg_micros).
+ */
+void stepper_sim_finish();
+
+#endif // STEPPER_SIM_H
+
@@ -0,0 +1,162 @@
+/**
+ * stepper_sim_job.cpp
+ *
+ * Долгое задание в симуляторе (stepper_sim.h): 3 мотора ходят по квадратам
+ * разного размера отрезками из очереди движений с разными скоростями,
+ * главный цикл пополняет очередь раз в миллисекунду виртуального времени.
+ * Таймер - в режиме "по событию", как на медленных шагах на контроллере.
+ * После задания сверяются положение моторов, количество импульсов
+ * на ножках step, минимальный интервал между шагами и ширина импульсов,
+ * печатается статистика ножек.
+ *
+ * Запуск:
+ *   ./stepper_sim_job [-h часы] [-vcd файл [-vcd_ms мс]] [-cost micros_ns isr_ns pin_ns]
+ * по умолчанию - 1 час машинного времени, VCD - первые 100мс.
+ *
+ * Сборка: см. build.sh
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stepper.h"
+#include "stepper_sim.h"
+
+extern "C"{
+    #include "timer_setup.h"
+}
+
+#define PERIOD_US 20
+#define MIN_STEP_DELAY 200
+#define DISTANCE_PER_STEP 7500
+
+/**
+ * Отрезок задания номер i: стороны квадратов по очереди (+x, +y, -x, -y),
+ * на первой стороне y идет наискосок, на каждом квадрате подъем
+ * и опускание z. Задержка кратна периоду таймера.
+ */
+static unsigned long job_segment(long i, long* steps) {
+    long square = i / 6;
+    long side = 200 + (square * 37) % 1800;
+    steps[0] = steps[1] = steps[2] = 0;
+    switch(i % 6) {
+        case 0: steps[0] = side; steps[1] = side / 3; break;
+        case 1: steps[1] = side - side / 3; break;
+        case 2: steps[0] = -side; break;
+        case 3: steps[1] = -side; break;
+        case 4: steps[2] = 50; break;
+        case 5: steps[2] = -50; break;
+    }
+    return 500 + ((i * 53) % 75) * PERIOD_US;
+}
+
+int main(int argc, char** argv) {
+    double hours = 1;
+    const char* vcd_file = NULL;
+    unsigned long vcd_ms = 100;
+    stepper_sim_cost_t cost = {0, 0, 0};
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            hours = atof(argv[++i]);
+        } else if(strcmp(argv[i], "-vcd") == 0 && i + 1 < argc) {
+            vcd_file = argv[++i];
+        } else if(strcmp(argv[i], "-vcd_ms") == 0 && i + 1 < argc) {
+            vcd_ms = strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "-cost") == 0 && i + 3 < argc) {
+            cost.micros_ns = strtoul(argv[++i], NULL, 10);
+            cost.isr_ns = strtoul(argv[++i], NULL, 10);
+            cost.pin_ns = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-h hours] [-vcd file [-vcd_ms ms]] [-cost micros_ns isr_ns pin_ns]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    stepper_configure_timer(PERIOD_US, TIMER_DEFAULT, TIMER_PRESCALER_1_8, 200);
+    stepper_set_timer_enabled(false);
+    stepper_set_timer_event_driven(true);
+    stepper_sim_init(PERIOD_US, &cost);
+
+    stepper sm_x, sm_y, sm_z;
+    init_stepper(&sm_x, 'x', 8, 9, 10, false, MIN_STEP_DELAY, DISTANCE_PER_STEP);
+    init_stepper_ends(&sm_x, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_y, 'y', 5, 6, 7, false, MIN_STEP_DELAY, DISTANCE_PER_STEP);
+    init_stepper_ends(&sm_y, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    init_stepper(&sm_z, 'z', 2, 3, 4, false, MIN_STEP_DELAY, DISTANCE_PER_STEP);
+    init_stepper_ends(&sm_z, NO_PIN, NO_PIN, INF, INF, 0, 0);
+    stepper* smotors[] = {&sm_x, &sm_y, &sm_z};
+
+    stepper_sim_watch(8, "step_x", true);
+    stepper_sim_watch(9, "dir_x");
+    stepper_sim_watch(10, "en_x");
+    stepper_sim_watch(5, "step_y", true);
+    stepper_sim_watch(6, "dir_y");
+    stepper_sim_watch(2, "step_z", true);
+    stepper_sim_watch(3, "dir_z");
+    if(vcd_file != NULL && !stepper_sim_vcd_open(vcd_file, vcd_ms * 1000)) {
+        perror(vcd_file);
+        return 1;
+    }
+
+    // задание: пополнять очередь, пока не выйдет время
+    clock_t start = clock();
+    unsigned long long job_ns = (unsigned long long)(hours * 3600e9);
+    long segment = 0;
+    long pos[3] = {0, 0, 0};
+    unsigned long total_steps[3] = {0, 0, 0};
+    bool running = true;
+    while(running || stepper_queue_count() > 0) {
+        while(stepper_sim_time_ns() < job_ns && !stepper_queue_full()) {
+            long steps[3];
+            unsigned long step_delay = job_segment(segment, steps);
+            if(!stepper_queue_line(3, smotors, steps, step_delay)) break;
+            segment++;
+            for(int m = 0; m < 3; m++) {
+                pos[m] += steps[m];
+                total_steps[m] += labs(steps[m]);
+            }
+        }
+        if(!stepper_cycle_running() && stepper_queue_count() > 0) {
+            stepper_start_cycle();
+        }
+        running = stepper_sim_run(1000);
+    }
+    double cpu_s = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    stepper_sim_print_stats(stdout);
+    printf("%ld segments, %.3f s virtual in %.3f s cpu\n",
+        segment, stepper_sim_time_ns() / 1e9, cpu_s);
+
+    // проверки
+    bool ok = stepper_cycle_error() == CYCLE_ERROR_NONE && stepper_sim_overruns() == 0;
+    if(!ok) {
+        printf("cycle error=%d, overruns=%lu\n", stepper_cycle_error(), stepper_sim_overruns());
+    }
+    int step_pins[3] = {8, 5, 2};
+    for(int m = 0; m < 3; m++) {
+        stepper_sim_pin_stats_t stats;
+        stepper_sim_pin_stats(step_pins[m], &stats);
+        bool motor_ok = smotors[m]->current_pos == (long)DISTANCE_PER_STEP * pos[m] &&
+            stats.steps == total_steps[m] &&
+            // цена операций сдвигает отдельные шаги меньше, чем на период
+            stats.interval_min_ns + PERIOD_US * 1000 > MIN_STEP_DELAY * 1000ULL &&
+            stats.pulse_min_ns > 0;
+        if(!motor_ok) {
+            printf("motor %c: pos=%ld/%ld steps=%lu/%lu\n", smotors[m]->name,
+                (long)(smotors[m]->current_pos / DISTANCE_PER_STEP), pos[m],
+                stats.steps, total_steps[m]);
+        }
+        ok = ok && motor_ok;
+    }
+    stepper_sim_finish();
+
+    printf(ok ? "[SUCCESS]\n" : "[FAIL]\n");
+    return ok ? 0 : 1;
+}
+
@@ -0,0 +1,183 @@
+/**
+ * stepper_trace_decode.cpp
+ *
+ * Разбор трассы шагов на компьютере: поток событий stepper_trace_encode
+ * (по STEPPER_TRACE_EVENT_BYTES байт: тик, имя мотора, флаги), снятый
+ * с последовательного порта в файл, - в CSV или VCD (GTKWave и т.п.).
+ *
+ * CSV: tick,time_us,motor,dir,stop,errors
+ * VCD: для каждого мотора - ножка step (HIGH за один период таймера
+ * до шага, как на контроллере), направление, остановка, флаги ошибок.
+ *
+ * Запуск:
+ *   ./stepper_trace_decode [-vcd] [-p период_таймера_мкс] [файл] > trace.csv
+ * без файла - читает стандартный ввод, период по умолчанию - 1 (время в тиках).
+ *
+ * Сборка: см. build.sh
+ *
+ * LGPLv3, 2014-2017
+ *
+ * @author Антон Моисеев 1i7.livejournal.com
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+
+// флаги событий - из stepper.h (библиотека с разборщиком не собирается,
+// поэтому флаг здесь не меняет раскладку структур, см. stepper_lib_config.h)
+#define STEPPER_TRACE 1
+#include "stepper.h"
+
+/** Изменение сигнала VCD */
+typedef struct {
+    unsigned long long time;
+    int order;
+    char id;
+    const char* value;
+} vcd_change_t;
+
+static void vcd_change(std::vector<vcd_change_t>& changes, unsigned long long time, char id, const char* value) {
+    vcd_change_t change = {time, (int)changes.size(), id, value};
+    changes.push_back(change);
+}
+
+static bool vcd_change_less(const vcd_change_t& a, const vcd_change_t& b) {
+    return a.time < b.time || (a.time == b.time && a.order < b.order);
+}
+
+/** Значение флагов ошибок для VCD: b и 6 бит */
+static const char* vcd_error_bits(unsigned char errors) {
+    static char bits[256][9];
+    char* s = bits[errors];
+    if(s[0] == 0) {
+        s[0] = 'b';
+        for(int b = 0; b < 6; b++) {
+            s[1 + b] = errors & (0x20 >> b) ? '1' : '0';
+        }
+        s[7] = 0;
+    }
+    return s;
+}
+
+static int write_csv(const std::vector<stepper_trace_event_t>& events, unsigned long period_us) {
+    printf("tick,time_us,motor,dir,stop,errors\n");
+    for(size_t i = 0; i < events.size(); i++) {
+        const stepper_trace_event_t& e = events[i];
+        printf("%lu,%llu,%c,%d,%d,0x%02x\n", e.tick, (unsigned long long)e.tick * period_us, e.motor,
+            e.flags & STEPPER_TRACE_DIR ? 1 : -1, e.flags & STEPPER_TRACE_STOP ? 1 : 0,
+            e.flags & STEPPER_TRACE_ERROR_MASK);
+    }
+    return 0;
+}
+
+static int write_vcd(const std::vector<stepper_trace_event_t>& events, unsigned long period_us) {
+    // моторы в порядке появления, на каждый - 4 сигнала
+    std::vector<char> motors;
+    for(size_t i = 0; i < events.size(); i++) {
+        if(std::find(motors.begin(), motors.end(), events[i].motor) == motors.end()) {
+            motors.push_back(events[i].motor);
+        }
+    }
+    if(motors.size() > 20) {
+        fprintf(stderr, "too many motors: %d\n", (int)motors.size());
+        return 1;
+    }
+
+    printf("$timescale 1us $end\n");
+    printf("$scope module stepper $end\n");
+    for(size_t m = 0; m < motors.size(); m++) {
+        char id = '!' + m*4;
+        printf("$var wire 1 %c step_%c $end\n", id, motors[m]);
+        printf("$var wire 1 %c dir_%c $end\n", id + 1, motors[m]);
+        printf("$var wire 1 %c stop_%c $end\n", id + 2, motors[m]);
+        printf("$var wire 6 %c errors_%c $end\n", id + 3, motors[m]);
+    }
+    printf("$upscope $end\n");
+    printf("$enddefinitions $end\n");
+
+    std::vector<vcd_change_t> changes;
+    for(size_t m = 0; m < motors.size(); m++) {
+        char id = '!' + m*4;
+        vcd_change(changes, 0, id, "0");
+        vcd_change(changes, 0, id + 1, "x");
+        vcd_change(changes, 0, id + 2, "0");
+        vcd_change(changes, 0, id + 3, "b000000");
+    }
+    for(size_t i = 0; i < events.size(); i++) {
+        const stepper_trace_event_t& e = events[i];
+        char id = '!' + (std::find(motors.begin(), motors.end(), e.motor) - motors.begin())*4;
+        unsigned long long time = (unsigned long long)e.tick * period_us;
+        unsigned long long high = time >= period_us ? time - period_us : 0;
+        vcd_change(changes, high, id + 1, e.flags & STEPPER_TRACE_DIR ? "1" : "0");
+        vcd_change(changes, time, id + 3, vcd_error_bits(e.flags & STEPPER_TRACE_ERROR_MASK));
+        if(e.flags & STEPPER_TRACE_STOP) {
+            vcd_change(changes, time, id + 2, "1");
+        } else {
+            // шаг по фронту HIGH>LOW
+            vcd_change(changes, high, id, "1");
+            vcd_change(changes, time, id, "0");
+        }
+    }
+    std::stable_sort(changes.begin(), changes.end(), vcd_change_less);
+
+    // повторные значения сигналов не выводим
+    const char* last_values[128] = {NULL};
+    unsigned long long time = 0;
+    printf("#0\n");
+    for(size_t i = 0; i < changes.size(); i++) {
+        const char*& last_value = last_values[(int)changes[i].id];
+        if(last_value != NULL && strcmp(last_value, changes[i].value) == 0) {
+            continue;
+        }
+        last_value = changes[i].value;
+        if(changes[i].time != time) {
+            time = changes[i].time;
+            printf("#%llu\n", time);
+        }
+        if(changes[i].value[0] == 'b') {
+            printf("%s %c\n", changes[i].value, changes[i].id);
+        } else {
+            printf("%s%c\n", changes[i].value, changes[i].id);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    bool vcd = false;
+    unsigned long period_us = 1;
+    const char* file_name = NULL;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-vcd") == 0) {
+            vcd = true;
+        } else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            period_us = strtoul(argv[++i], NULL, 10);
+        } else {
+            file_name = argv[i];
+        }
+    }
+
+    FILE* in = file_name != NULL ? fopen(file_name, "rb") : stdin;
+    if(in == NULL) {
+        perror(file_name);
+        return 1;
+    }
+
+    std::vector<stepper_trace_event_t> events;
+    unsigned char data[STEPPER_TRACE_EVENT_BYTES];
+    while(fread(data, 1, STEPPER_TRACE_EVENT_BYTES, in) == STEPPER_TRACE_EVENT_BYTES) {
+        stepper_trace_event_t e;
+        e.tick = (unsigned long)data[0] | (unsigned long)data[1] << 8 |
+            (unsigned long)data[2] << 16 | (unsigned long)data[3] << 24;
+        e.motor = data[4];
+        e.flags = data[5];
+        events.push_back(e);
+    }
+    if(in != stdin) fclose(in);
+
+    return vcd ? write_vcd(events, period_us) : write_csv(events, period_us);
+}
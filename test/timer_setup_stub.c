@@ -64,6 +64,18 @@ const int TIMER_PRESCALER_1_1024 = 1024;
 void _timer_init_ISR(int timer, int prescaler, int period) {
 }
 
+/**
+ * Update compare match value for already started timer: next interrupt
+ * would be fired after adjustment+1 timer clocks.
+ * 
+ * @param timer
+ *     system timer id for started ISR
+ * @param adjustment
+ *   adjustment divider after timer prescaled - timer compare match value.
+ */
+void _timer_update_ISR(int timer, unsigned int adjustment) {
+}
+
 /**
  * Stop ISR (Interrupt service routine) for the timer.
  * 